@@ -301,6 +301,867 @@ check_table(t, "S", 1, 5, 1)
 check_table(t.subs[1], "A", 2, 5, 1)
 
 
+heading("Native predicates")
+
+subheading("Built-in predicates")
+check(type(lpeg.predicates())=="table")
+digits = lpeg.R("09")^1
+octet = lpeg.rcap(lpeg.rpred(digits, "octet"), "octet")
+ipv4 = lpeg.rcap(octet * ("." * octet)^-3 * -1, "ipv4")
+s = ipv4:rmatch("10.0.255.1")
+check(type(s)=="userdata")
+check_table(lpeg.decode(s), "ipv4", 1, 11, 4)
+s = ipv4:rmatch("10.0.256.1")
+check(s==false)
+card = lpeg.rcap(lpeg.rpred((lpeg.R("09") + lpeg.S" -")^1, "luhn"), "card")
+check(type(card:rmatch("4111 1111 1111 1111"))=="userdata")
+check(card:rmatch("4111 1111 1111 1112")==false)
+-- fixed-length body
+month = lpeg.rcap(lpeg.rpred(lpeg.R("09") * lpeg.R("09"), "month"), "month")
+check(type(month:rmatch("12"))=="userdata")
+check(month:rmatch("13")==false)
+-- predicate failure backtracks into the next alternative
+p = lpeg.rcap(lpeg.rpred(digits, "hour") * ":", "hour") + lpeg.rcap(digits * ":", "other")
+check_table(lpeg.decode(p:rmatch("99:")), "other", 1, 4)
+
+subheading("Errors")
+ok, msg = pcall(lpeg.rpred, digits, "no such predicate")
+check(not ok)
+check(msg:find("unknown predicate"))
+
+heading("Native code")
+
+subheading("Same results as the interpreter")
+word = lpeg.R("az","AZ")^1
+p = (lpeg.C(word) + 1)^0
+q = (lpeg.C(word) + 1)^0
+jitted = lpeg.jit(q)
+check(type(jitted)=="boolean")
+subject = string.rep("hello, world 123 foo!! ", 50)
+a = {p:match(subject)}
+b = {q:match(subject)}
+check(#a==#b and a[1]==b[1] and a[#a]==b[#b])
+g = lpeg.P{ "S", S = "(" * lpeg.V"S" * ")" + lpeg.R"09"^1 }
+lpeg.jit(g)
+check(g:match("((((12))))")==11)
+check(g:match("((1)")==nil)
+r = lpeg.rcap(lpeg.rcap(digits, "d") * (lpeg.S" -" * lpeg.rcap(digits, "d"))^0, "nums")
+lpeg.jit(r)
+check_table(lpeg.decode(r:rmatch("12-34 5")), "nums", 1, 8, 3)
+check(r:rmatch("x")==false)
+lpeg.jit(ipv4)
+check_table(lpeg.decode(ipv4:rmatch("10.0.255.1")), "ipv4", 1, 11, 4)
+check(ipv4:rmatch("10.0.256.1")==false)
+
+subheading("Native and interpreted results on random inputs")
+local function results (...)
+  local t = {select("#", ...)}
+  for i = 1, t[1] do
+    local v = select(i, ...)
+    if type(v) == "table" then v = "{" .. results((table.unpack or unpack)(v)) .. "}"
+    elseif type(v) == "userdata" then v = lpeg.getdata(v)
+    end
+    t[i + 1] = tostring(v)
+  end
+  return table.concat(t, "|")
+end
+local seed = 7
+local function rand (n)
+  seed = (seed * 1103515245 + 12345) % 2147483648
+  return seed % n
+end
+local subjects = {"", "hello, world 123 foo!! ", "((12))", "10.0.255.1",
+                  "12-34 5", "ab=12 x"}
+for i = 1, 60 do
+  local c = {}
+  for j = 1, rand(40) do
+    c[j] = string.char(string.byte("ab1( )-.=x\n", rand(11) + 1))
+  end
+  subjects[#subjects + 1] = table.concat(c)
+end
+local makers = {
+  function () return (lpeg.C(word) + 1)^0 end,
+  function () return lpeg.P{"S", S = "(" * lpeg.V"S" * ")" + lpeg.R"09"^1} end,
+  function () return lpeg.Ct((lpeg.C(lpeg.S"ab"^1) * lpeg.Cp() + 1)^0) end,
+  function () return (1 - lpeg.S"=\n")^1 * "=" * lpeg.C((1 - lpeg.P"\n")^0) end,
+  function () return (lpeg.C"ab" / string.upper + #lpeg.P"1" * lpeg.Cp() * 1 + 1)^0 end,
+  function () return (lpeg.P"a"^-2 * -lpeg.P"b" * lpeg.S"1x") ^ 1 end,
+  -- (rosie captures, matched with rmatch)
+  function () return lpeg.rcap(lpeg.rcap(lpeg.S"ab"^1, "w") * lpeg.B"b" + lpeg.rconstcap("x", "c"), "t") end,
+  function () return lpeg.rcap(lpeg.rcap(digits, "d") * (lpeg.S" -" * lpeg.rcap(digits, "d"))^0, "nums") end,
+  function () return ipv4 * lpeg.P(true) end,
+}
+for i, make in ipairs(makers) do
+  local interp, native = make(), make()
+  local run = interp.match
+  if i > 6 then  -- (leaving out the times rmatch returns)
+    run = function (p, ...)
+      local m, left, abend = p:rmatch(...)
+      return m, left, abend
+    end
+  end
+  local differ = 0
+  lpeg.jit(interp, false)
+  lpeg.jit(native)
+  for _, subject in ipairs(subjects) do
+    for _, init in ipairs{1, 3, -2} do
+      if results(run(interp, subject, init))
+         ~=results(run(native, subject, init)) then
+        differ = differ + 1
+      end
+    end
+  end
+  check(differ==0)
+end
+
+subheading("Fallback to the interpreter")
+rt = lpeg.Cmt(lpeg.P(1), function() return true end)
+check(lpeg.jit(rt)==false)
+check(rt:match("a")==2)
+check(lpeg.jit(q, false)==false)
+check(q:match("abc")=="abc")
+
+subheading("Ahead-of-time compilation to C")
+src = lpeg.aotsource(ipv4, "ipv4")
+check(type(src)=="string")
+check(src:find("r_aotpattern ipv4 = {", 1, true))
+check(src:find("static const char *ipv4_match (JitState *js, const char *s)", 1, true))
+check(src:find("int ipv4_lua (lua_State *L)", 1, true))
+check(src:find('"octet"', 1, true))
+check(src==lpeg.aotsource(ipv4, "ipv4"))
+ok, msg = pcall(lpeg.aotsource, rt, "rt")
+check(not ok and msg:find("run%-time captures"))
+ok, msg = pcall(lpeg.aotsource, ipv4, "not an identifier")
+check(not ok and msg:find("not a valid C identifier"))
+
+subheading("Generated C, compiled and run")
+-- needs a C compiler and the Lua headers (in LUA_INCDIR, if not found)
+local function shell (cmd)
+  local ok = os.execute(cmd .. " >/dev/null 2>&1")
+  return ok == true or ok == 0
+end
+local cc = "cc -O1 -fPIC -shared -I. -Isrc"
+if os.getenv("LUA_INCDIR") then cc = cc .. " -I" .. os.getenv("LUA_INCDIR") end
+local probe = os.tmpname()
+local f = io.open(probe .. ".c", "w")
+f:write('#include "raot.h"\nint probe (void) { return R_AOT_VERSION; }\n')
+f:close()
+if not (package.loadlib and shell(cc .. " " .. probe .. ".c -o " .. probe .. ".so")) then
+  print("(no C compiler, or no Lua headers: skipped)")
+else
+  local names = {}
+  for i = 1, #makers do names[i] = "pat" .. i end
+  names[1] = string.rep("long_name_", 30)  -- (longer than any line buffer)
+  for i, make in ipairs(makers) do
+    local interp, compiled = make(), make()
+    local src = lpeg.aotsource(compiled, names[i])
+    local name = probe .. "_" .. i
+    f = io.open(name .. ".c", "w")
+    f:write(src)
+    f:close()
+    check(src:find("int " .. names[i] .. "_lua (lua_State *L)", 1, true))
+    check(shell(cc .. " " .. name .. ".c -o " .. name .. ".so"))
+    lpeg.aot(compiled, package.loadlib(name .. ".so", names[i] .. "_lua")())
+    local run = interp.match
+    if i > 6 then
+      run = function (p, ...)
+        local m, left, abend = p:rmatch(...)
+        return m, left, abend
+      end
+    end
+    local differ = 0
+    lpeg.jit(interp, false)
+    for _, subject in ipairs(subjects) do
+      for _, init in ipairs{1, 3, -2} do
+        if results(run(interp, subject, init))
+           ~=results(run(compiled, subject, init)) then
+          differ = differ + 1
+        end
+      end
+    end
+    check(differ==0)
+    os.remove(name .. ".c")
+    os.remove(name .. ".so")
+  end
+  -- code generated for an earlier version is refused
+  src = lpeg.aotsource(ipv4, "old")
+  src = src:gsub("R_AOT_VERSION,", "1,", 1)
+  f = io.open(probe .. ".c", "w")
+  f:write(src)
+  f:close()
+  check(shell(cc .. " " .. probe .. ".c -o " .. probe .. ".so"))
+  ok, msg = pcall(lpeg.aot, ipv4 * lpeg.P(true), package.loadlib(probe .. ".so", "old_lua")())
+  check(not ok and msg:find("compiled for a different version"))
+end
+os.remove(probe .. ".c")
+os.remove(probe .. ".so")
+os.remove(probe)
+
+heading("DFA regions")
+
+subheading("Ordered choice and greedy repetition")
+p = (lpeg.P"a" + lpeg.P"ab" + lpeg.P"abc") * lpeg.P"c" * lpeg.P"x"^0
+check(p:match("abc")==nil)
+check(p:match("acxx")==5)
+p = (lpeg.P"ab" + lpeg.P"a")^0 * (lpeg.P"b" + lpeg.P"c")
+check(p:match("ababac")==7)
+check(p:match("ababb")==6)
+check(p:match("ababx")==nil)
+p = lpeg.P"a"^0 * lpeg.P"a" + lpeg.P"a"^1 * lpeg.P"b"
+check(p:match("aaab")==5)
+check(p:match("aaa")==nil)
+p = ((lpeg.R"az"^1 * lpeg.P"1" + lpeg.R"az"^1 * lpeg.P"2" + lpeg.R"az"^1) * lpeg.P" ")^0
+subject = string.rep("abc1 defg2 hij ", 1000)
+check(p:match(subject)==#subject+1)
+check(p:match(subject .. "k3 ")==#subject+1)
+
+subheading("Inside captures")
+word = (lpeg.R"az" + lpeg.P"-")^1 * (lpeg.P"'s" + lpeg.P"s'")^-1
+p = lpeg.Ct((lpeg.C(word) + 1)^0)
+t = p:match("the cat's toys, well-worn")
+check(#t==4 and t[2]=="cat's" and t[4]=="well-worn")
+r = lpeg.rcap((lpeg.P"x" + lpeg.R"09"^1 * lpeg.P"."^-1)^1, "num")
+check_table(lpeg.decode(r:rmatch("12.x3")), "num", 1, 6, 0)
+check(r:rmatch("-1")==false)
+
+subheading("Deep trees")
+-- finding the regions walks the tree without recursion
+s = string.rep("ab", 10000)
+p = lpeg.P(s) * (lpeg.P"x" + "y")^0
+check(p:match(s .. "xyxz")==#s+4 and not p:match("ab" .. s:sub(4)))
+
+heading("Capture-free twins")
+
+subheading("Rejecting before capturing")
+num = lpeg.rcap(lpeg.R"09"^1, "d")
+r = lpeg.rcap(num * (lpeg.P"." * num)^0 * lpeg.P";", "nums")
+for i = 1, 200 do check(r:rmatch("1.22.333" .. i)==false) end
+check_table(lpeg.decode(r:rmatch("1.22.333;x")), "nums", 1, 10, 3)
+p = lpeg.Ct((lpeg.C(lpeg.R"az"^1) * lpeg.P" "^-1)^1 * -1)
+for i = 1, 200 do check(p:match("abc de" .. i)==nil) end
+t = p:match("abc de f")
+check(#t==3 and t[3]=="f")
+lpeg.jit(r)
+check(r:rmatch("1.2")==false)
+check_table(lpeg.decode(r:rmatch("1.2;")), "nums", 1, 5, 2)
+lpeg.jit(r, false)
+g = lpeg.P{"S", S = lpeg.rcap(lpeg.P"(" * lpeg.V"S" * lpeg.P")" + lpeg.R"09"^1, "s")}
+check(g:rmatch("((1)")==false)
+check_table(lpeg.decode(g:rmatch("((1))")), "s", 1, 6, 1)
+
+subheading("Boolean encoding")
+m, leftover, abend = r:rmatch("12.3;xyz", 1, 4)
+check(m==true and leftover==3 and abend==false)
+m, leftover = r:rmatch("12.3xyz", 1, 4)
+check(m==false and leftover==7)
+m, leftover = r:rmatch("ab 12;", 4, 4)
+check(m==true and leftover==0)
+m, leftover = lpeg.P"ab":rmatch("abc", 1, 4)
+check(m==true and leftover==1)
+h = lpeg.rcap(lpeg.P"a"^1 * lpeg.Halt(), "h")
+m, leftover, abend = h:rmatch("aab", 1, 4)
+check(m==true and leftover==1 and abend==true)
+rt = lpeg.rcap(lpeg.Cmt(lpeg.P(1), function(s, i) return i == 2 end), "rt")
+check(rt:rmatch("x", 1, 4)==true)
+check(rt:rmatch("", 1, 4)==false)
+
+heading("Prefilters")
+
+subheading("Required literals and lengths")
+sshd = lpeg.rcap(lpeg.P"sshd[" * lpeg.R"09"^1 * lpeg.P"]: " * lpeg.rcap(lpeg.P"Accepted" + lpeg.P"Failed", "what") * lpeg.P" password", "sshd")
+check(sshd:rmatch("sshd[12]: Accepted key")==false)
+check(sshd:rmatch("sshd[12]: Failed passwor")==false)
+check(sshd:rmatch("cron[12]: Failed password")==false)
+check_table(lpeg.decode(sshd:rmatch("sshd[12]: Failed password x")), "sshd", 1, 26, 1)
+check(sshd:rmatch("sshd[12]: Failed password x", 1, 4)==true)
+http = (1 - lpeg.P"HTTP/1.")^0 * lpeg.P"HTTP/1." * lpeg.S"01"
+check(http:match("GET / HTTP/2")==nil)
+check(http:match("GET / HTTP/1.1")==15)
+check(http:match("GET / HTTP/1.1", 7)==15)
+check(http:match("GET / HTTP/1.1", 8)==nil)
+check(http:match("HTTP/1.1 GET", 2)==nil)
+p = lpeg.P"ab" * lpeg.P"c"^-1 * #lpeg.P"xyz"
+check(p:match("abcxyz")==4)
+check(p:match("abcxy")==nil)
+p = (lpeg.P"xabcy" + lpeg.P"zabcw") * -1
+check(p:match("zabcw")==6)
+check(p:match("zabcwz")==nil)
+check((lpeg.P"needle" * lpeg.Halt() + lpeg.P"n"):match("n")==2)
+check((lpeg.B"x" * lpeg.P"yz"):match("xyz", 2)==4)
+
+heading("Unanchored search")
+
+subheading("Start and end of the first match")
+id = lpeg.rcap(lpeg.P"id=" * lpeg.rcap(lpeg.R"09"^1, "d"), "id")
+m, leftover, abend, t1, t2, start = id:rsearch("xx id=12 y")
+check(start==4 and leftover==2)
+check_table(lpeg.decode(m), "id", 4, 9, 1)
+m, leftover, abend, t1, t2, start = id:rsearch("xx id= y id=7")
+check(start==10 and leftover==0)
+m, leftover, abend, t1, t2, start = id:rsearch("xx id= y")
+check(m==false and leftover==8 and start==false)
+m, leftover, abend, t1, t2, start = id:rsearch("id=1 id=2", 2, 4)
+check(m==true and start==6 and leftover==0)
+num = lpeg.rcap(lpeg.R"09"^1 * lpeg.P"." * lpeg.R"09"^1, "num")
+m, leftover, abend, t1, t2, start = num:rsearch("v 1 2.5 3", 1, 4)
+check(m==true and start==5 and leftover==2)
+check(num:rsearch("v 1 2.5 3", 6, 4)==false)
+lpeg.jit(num)
+m, leftover, abend, t1, t2, start = num:rsearch("v 1 2.5 3", 1, 4)
+check(m==true and start==5 and leftover==2)
+lpeg.jit(num, false)
+e = lpeg.rcap(lpeg.P"x"^0, "e")
+m, leftover, abend, t1, t2, start = e:rsearch("abc", 2)
+check(start==2 and leftover==2)
+-- a required literal that comes late is looked for once, not per start
+far = lpeg.rcap(lpeg.P"q" * lpeg.P"a"^0 * "XYZ", "far")
+check(far:rsearch(("q"):rep(100000) .. ("b"):rep(10) .. "XYZ")==false)
+subject = "qXYZ" .. ("q"):rep(100000) .. "qaaXYZ"
+m, leftover, abend, t1, t2, start = far:rsearch(subject, 5, 4)
+check(m==true and start==100005 and leftover==0)
+check(select(2, lpeg.rfindall(far, subject))==2)
+check(select(2, far:rsubst(subject, "replace", "-"))==2)
+
+heading("Find all")
+
+subheading("Framed matches")
+kv = lpeg.rcap(lpeg.rcap(lpeg.R"az"^1, "k") * "=" * lpeg.rcap(lpeg.R"09"^1, "d"), "kv")
+buf, n, abend = kv:rfindall("a=1 bb=22 x= c=333")
+check(n==3 and abend==false)
+t = lpeg.decodeall(buf)
+check(#t==3)
+check_table(t[1], "kv", 1, 4, 2)
+check_table(t[2], "kv", 5, 10, 2)
+check_table(t[3], "kv", 14, 19, 2)
+check(t[3].subs[2].s==16)
+buf, n = kv:rfindall("a=1 bb=22 x= c=333", 1, 1)
+json = lpeg.getdata(buf)
+check(n==3 and select(2, json:gsub("\n", ""))==3)
+check(json:find('"data":"bb=22"}\n', 1, true))
+buf, n = kv:rfindall("a=1 bb=22", 3)
+check(n==1 and lpeg.decodeall(buf)[1].s==5)
+buf, n = kv:rfindall("none here")
+check(n==0 and #lpeg.decodeall(buf)==0)
+ok, msg = pcall(kv.rfindall, kv, "a=1", 1, 2)
+check(not ok and msg:find("invalid encoding"))
+
+subheading("Counting only")
+buf, n, abend = kv:rfindall("a=1 bb=22 x= c=333", 1, 4)
+check(buf==nil and n==3 and abend==false)
+check(select(2, lpeg.rcap(lpeg.R"09"^0, "n"):rfindall("a1b", 1, 4))==4)
+h = lpeg.rcap(lpeg.P"x" * lpeg.Halt() + lpeg.P"y", "h")
+buf, n, abend = h:rfindall("yyxyy", 1, 4)
+check(n==3 and abend==true)
+
+heading("Substitution")
+
+subheading("Whole matches")
+digits = lpeg.R"09"^1
+buf, n = digits:rsubst("call 555 1234 now", "replace", "#")
+check(lpeg.getdata(buf)=="call # # now" and n==2)
+buf, n = digits:rsubst("call 555 1234 now", "mask")
+check(lpeg.getdata(buf)=="call *** **** now" and n==2)
+buf = digits:rsubst("555", "mask", "X")
+check(lpeg.getdata(buf)=="XXX")
+buf = digits:rsubst("no digits", "replace")
+check(lpeg.getdata(buf)=="no digits")
+check(lpeg.getdata((lpeg.R"09"^0):rsubst("a1b", "replace", "-"))=="a-b")
+key = "0123456789abcdef"
+h1 = lpeg.getdata(digits:rsubst("12 34 12", "hash", key))
+check(#h1==50 and h1:sub(1,16)==h1:sub(35,50) and h1:sub(1,16)~=h1:sub(18,33))
+check(lpeg.getdata(digits:rsubst("12", "hash", "fedcba9876543210"))~=h1:sub(1,16))
+-- SipHash-2-4 of bytes 0..14, keyed by bytes 0..15 (from its paper)
+bytes = ""
+for i = 0, 15 do bytes = bytes .. string.char(i) end
+check(lpeg.getdata(lpeg.P(15):rsubst(bytes:sub(1, 15), "hash", bytes))=="a129ca6149be45e5")
+ok, msg = pcall(digits.rsubst, digits, "12", "hash")
+check(not ok and msg:find("hash needs a key of 16 bytes"))
+ok, msg = pcall(digits.rsubst, digits, "12", "hash", "short")
+check(not ok and msg:find("hash needs a key of 16 bytes"))
+ok, msg = pcall(digits.rsubst, digits, "1", "erase")
+check(not ok and msg:find("invalid option"))
+
+subheading("Named captures")
+kv = lpeg.rcap(lpeg.rcap(lpeg.R"az"^1, "k") * "=" * lpeg.rcap(lpeg.R"09"^1, "d"), "kv")
+buf, n = kv:rsubst("a=1 bb=22 x= c=333", "mask", "*", {"d"})
+check(lpeg.getdata(buf)=="a=* bb=** x= c=***" and n==3)
+buf, n = kv:rsubst("a=1 bb=22", "replace", "?", {"k", "kv"})
+check(lpeg.getdata(buf)=="? ?" and n==2)
+buf, n = kv:rsubst("a=1 bb=22", "replace", "?", {"other"})
+check(lpeg.getdata(buf)=="a=1 bb=22" and n==0)
+
+subheading("Buffers")
+out = lpeg.newbuffer()
+lpeg.add(out, ">")
+buf = digits:rsubst("x1y", "replace", "0", nil, out)
+check(buf==out and lpeg.getdata(out)==">x0y")
+inbuf = digits:rsubst("a1", "replace", "22")
+buf = digits:rsubst(inbuf, "mask")
+check(lpeg.getdata(buf)=="a**")
+ok, msg = pcall(digits.rsubst, digits, out, "mask", "*", nil, out)
+check(not ok and msg:find("output buffer is the input"))
+
+heading("Pattern sets")
+
+subheading("First match and all matches")
+num = lpeg.rcap(lpeg.R"09"^1, "num")
+word = lpeg.rcap(lpeg.R"az"^1, "word")
+ip = lpeg.rcap(lpeg.R"09"^1 * ("." * lpeg.R"09"^1)^3, "ip")
+any = lpeg.rcap(lpeg.P(1)^1, "any")
+set = lpeg.rset{ip, num, word, any}
+id, buf, leftover, abend = lpeg.rsetmatch(set, "10.0.0.1 up")
+check(id==1 and leftover==3 and abend==false)
+check_table(lpeg.decode(buf), "ip", 1, 9, 0)
+id, buf, leftover = lpeg.rsetmatch(set, "42 up")
+check(id==2 and leftover==3 and lpeg.decode(buf).type=="num")
+ids, buf = lpeg.rsetmatch(set, "42 up", 1, 3, true)
+check(#ids==2 and ids[1]==2 and ids[2]==4 and lpeg.decode(buf).type=="num")
+ids = lpeg.rsetmatch(set, "up 42", 1, 4, true)
+check(#ids==2 and ids[1]==3 and ids[2]==4)
+id, ok, leftover = lpeg.rsetmatch(set, "up 42", 4, 4)
+check(id==2 and ok==true and leftover==0)
+id, ok, leftover = lpeg.rsetmatch(lpeg.rset{num, word}, "-")
+check(id==false and ok==false and leftover==1)
+ids, ok = lpeg.rsetmatch(lpeg.rset{num, word}, "-", 1, 4, true)
+check(#ids==0 and ok==false)
+check(lpeg.rsetmatch(lpeg.rset{num, lpeg.P(-1)}, "", 1, 4)==2)
+check(lpeg.rsetmatch(lpeg.rset{"up", num}, "up")==1)
+ok, msg = pcall(lpeg.rset, {})
+check(not ok and msg:find("empty pattern set"))
+ok, msg = pcall(lpeg.rsetmatch, num, "1")
+check(not ok)
+
+heading("Matching lines")
+
+subheading("Records per line")
+kv = lpeg.rcap(lpeg.rcap(lpeg.R"az"^1, "k") * "=" * lpeg.rcap(lpeg.R"09"^1, "d"), "kv")
+buf, n, lines = lpeg.rmatchlines(kv, "a=1\nnone\nbb=22\n")
+check(n==2 and lines==3)
+t = lpeg.decodeall(buf)
+check(#t==3 and t[2]==false)
+check_table(t[1], "kv", 1, 4, 2)
+check_table(t[3], "kv", 1, 6, 2)
+buf, n, lines = lpeg.rmatchlines(kv, "a=1\n\nc=3", 1)
+json = lpeg.getdata(buf)
+check(n==2 and lines==3 and select(2, json:gsub("\n", ""))==3)
+check(json:find('\n\n{', 1, true))
+buf, n, lines = lpeg.rmatchlines(kv, "a=1\nb", 4)
+check(buf==nil and n==1 and lines==2)
+check(select(3, lpeg.rmatchlines(kv, ""))==0)
+-- a match that captures nothing is not a line that did not match
+buf, n, lines = lpeg.rmatchlines(lpeg.R"09"^1, "12\nx\n3")
+t = lpeg.decodeall(buf)
+check(n==2 and lines==3 and #t==3 and t[1]==true and t[2]==false and t[3]==true)
+buf, n = lpeg.rfindall(lpeg.R"09"^1, "1 22 333")
+t = lpeg.decodeall(buf)
+check(n==3 and #t==3 and t[1]==true and t[3]==true)
+ok, msg = pcall(lpeg.rmatchlines, kv, "a=1", 2)
+check(not ok and msg:find("invalid encoding"))
+
+subheading("Resuming on shared prefixes")
+w = lpeg.rcap(lpeg.R"az"^1, "w")
+words = lpeg.rcap((w * lpeg.P" "^-1)^0, "words")
+buf, n, lines, skipped = lpeg.rmatchlines(words, "abc def ghi\nabc def ghj\nabc xyz\n")
+check(n==3 and lines==3 and skipped>0)
+t = lpeg.decodeall(buf)
+check(t[2].subs[3].s==9 and t[2].subs[3].e==12)
+check(#t[3].subs==2 and t[3].subs[2].s==5)
+buf, n, lines, skipped = lpeg.rmatchlines(words, "abcdefgh\nabc\n")
+t = lpeg.decodeall(buf)
+check(t[2].e==4 and #t[2].subs==1)
+
+heading("Result cache")
+
+subheading("Hits, misses and eviction")
+kv = lpeg.rcap(lpeg.rcap(lpeg.R"az"^1, "k") * "=" * lpeg.rcap(lpeg.R"09"^1, "d"), "kv")
+check(select(3, lpeg.rcache(kv))==0)
+hits, misses, used = lpeg.rcache(kv, 2)
+check(hits==0 and misses==0 and used==0)
+buf, leftover, abend = kv:rmatch("ab=12 x")
+check_table(lpeg.decode(buf), "kv", 1, 6, 2)
+buf, leftover, abend = kv:rmatch("ab=12 x")
+check(leftover==2 and abend==false)
+check_table(lpeg.decode(buf), "kv", 1, 6, 2)
+check(lpeg.getdata(kv:rmatch("ab=12 x", 1, 1)):find('"data":"ab=12"', 1, true))
+check(kv:rmatch("ab=12 x", 1, 4)==true)
+check(kv:rmatch("ab=12 x", 2, 4)==true)
+ok, leftover = kv:rmatch("-", 1, 4)
+check(ok==false and leftover==1)
+ok, leftover = kv:rmatch("-", 1, 4)
+check(ok==false and leftover==1)
+hits, misses, used = lpeg.rcache(kv)
+check(hits==2 and misses==5 and used==2)
+_, _, _, _, _, start = kv:rsearch("-- ab=1", 1, 4)
+check(start==4)
+_, _, _, _, _, start = kv:rsearch("-- ab=1", 1, 4)
+check(start==4 and lpeg.rcache(kv)==3)
+check(select(3, lpeg.rcache(kv, 0))==0)
+ok, msg = pcall(lpeg.rcache, kv, -1)
+check(not ok and msg:find("out of range"))
+ok, msg = pcall(lpeg.rcache, lpeg.Cmt(lpeg.P"a", function() return true end), 10)
+check(not ok and msg:find("match%-time"))
+
+heading("Wide positions")
+
+subheading("The byte64 encoding")
+kv = lpeg.rcap(lpeg.rcap(lpeg.R"az"^1, "k") * "=" * lpeg.rcap(lpeg.R"09"^1, "d"), "kv")
+buf = kv:rmatch("ab=12 x", 1, 5)
+data = lpeg.getdata(buf)
+check(data:byte(1)==2 and data:byte(2)==0)
+t = lpeg.decode(buf)
+check_table(t, "kv", 1, 6, 2)
+check(t.subs[1].type=="k" and t.subs[2].s==4 and t.subs[2].e==6)
+cc = lpeg.rcap(lpeg.rconstcap("hi", "c") * lpeg.P"x", "cc")
+t = lpeg.decode(cc:rmatch("x", 1, 5))
+check(t.type=="cc" and t.subs[1].data=="hi")
+buf, n = kv:rfindall("a=1 bb=22", 1, 5)
+t = lpeg.decodeall(buf)
+check(n==2 and #t==2 and t[2].s==5 and t[2].subs[2].e==10)
+buf, n = lpeg.rmatchlines(kv, "a=1\n-\nb=2\n", 5)
+t = lpeg.decodeall(buf)
+check(n==2 and t[2]==false and t[3].subs[2].s==3)
+check(kv:rmatch("-", 1, 5)==false)
+ok, msg = pcall(lpeg.decode, (function () local b = lpeg.newbuffer(); lpeg.add(b, "\7\0\0\0"); return b end)())
+check(not ok and msg:find("unsupported match data version 7"))
+
+heading("Chunked records")
+
+subheading("Speculation, validation and stitching")
+num = lpeg.rcap(lpeg.R"09"^1, "num")
+v = lpeg.rcap((1 - lpeg.P"}\n")^0, "v")
+rec = lpeg.rcap('{"id":' * num * ',"v":' * v * "}\n", "rec")
+bnd = #lpeg.P'{"id":'
+input = '{"id":1,"v":a}\n{"id":2,"v":{"id":0}\n{"id":3,"v":}\n'
+t = lpeg.rspeculate(bnd, input, 3)
+check(#t==3 and t[1]==1 and t[2]==28 and t[3]==37)
+buf, n, pos, abend = lpeg.rrecords(rec, input)
+check(n==3 and pos==#input+1 and abend==false)
+t = lpeg.decodeall(buf)
+check(#t==3 and t[2].s==16 and t[3].subs[1].s==43)
+data = lpeg.getdata(buf)
+for _, k in ipairs{1, 2, 3, 8} do
+  buf, n, pos, abend, redone = lpeg.rchunked(rec, input, bnd, k)
+  check(n==3 and pos==#input+1 and abend==false and lpeg.getdata(buf)==data)
+end
+check(select(5, lpeg.rchunked(rec, input, bnd, 3))==0)
+check(select(5, lpeg.rchunked(rec, input, bnd, 2))==1)
+buf, n, pos = lpeg.rrecords(rec, input, 16, 17, 4)
+check(buf==nil and n==1 and pos==37)
+buf, n, pos, abend, redone = lpeg.rchunked(rec, input .. "x" .. input, bnd, 4)
+check(n==3 and pos==#input+1 and #lpeg.decodeall(buf)==3)
+check(select(2, lpeg.rchunked(rec, "", bnd, 4))==0)
+ok, msg = pcall(lpeg.rchunked, rec, input, bnd, 0)
+check(not ok and msg:find("invalid number of chunks"))
+
+subheading("Chunks matched by threads")
+big = {}
+for i = 1, 500 do
+  big[i] = '{"id":' .. i .. ',"v":' .. string.rep(i % 3 == 0 and '{"id":0' or "x", i % 7) .. "}\n"
+end
+big = table.concat(big) .. '{"id":x}\n' .. input
+for _, enc in ipairs{1, 3, 5} do
+  data, n, pos, abend = lpeg.rrecords(rec, big, 1, nil, enc)
+  data = lpeg.getdata(data)
+  for _, k in ipairs{1, 5, 64} do
+    for _, th in ipairs{1, 2, 4} do
+      buf, n2, pos2, abend2 = lpeg.rchunked(rec, big, bnd, k, enc, th)
+      check(lpeg.getdata(buf)==data and n2==n and pos2==pos and abend2==abend)
+    end
+  end
+end
+buf, n, pos = lpeg.rrecords(rec, big, 1, nil, 4)
+check(buf==nil and n==500)
+buf, n2, pos2 = lpeg.rchunked(rec, big, bnd, 16, 4, 3)
+check(buf==nil and n2==n and pos2==pos)
+-- a runtime capture runs in the state of the pattern: no threads
+rt = lpeg.Cmt(lpeg.P'{"id":', function(s, i) return i end)
+rt = lpeg.rcap(rt * (1 - lpeg.P"\n")^0 * "\n", "rt")
+data = lpeg.getdata(lpeg.rrecords(rt, big))
+check(lpeg.getdata(lpeg.rchunked(rt, big, bnd, 8, 3, 4))==data)
+-- the error of a thread is raised here
+deep = lpeg.P{"r", r = "{" * lpeg.V"r" * "}" + "{"} * (1 - lpeg.P"\n")^0 * "\n"
+ok, msg = pcall(lpeg.rchunked, deep, big .. string.rep("{", 12000) .. big, bnd, 8, 3, 4)
+check(not ok and msg:find("backtrack stack overflow"))
+ok, msg = pcall(lpeg.rchunked, rec, input, bnd, 2, 3, 0)
+check(not ok and msg:find("invalid number of threads"))
+ok, msg = pcall(lpeg.rrecords, rec, input, 1, nil, -1)
+check(not ok and msg:find("invalid encoding"))
+
+heading("Compiling")
+
+subheading("Remembered analyses")
+-- a rule reached again through a predicate (hascaptures used to loop)
+g = lpeg.P{"r1", r1 = lpeg.P"s" + "t",
+           r2 = "u" * #lpeg.V"r2" + lpeg.C(lpeg.S"xyz")}
+check(g:match("s")==2)
+g = lpeg.P{"r", r = "u" * #lpeg.V"r" * lpeg.P(1) + lpeg.C(lpeg.S"xyz")}
+check(g:match("uux")==3 and g:match("x")=="x")
+-- nested choices with nullable heads (compiled in cubic time before)
+p = lpeg.P"a"
+for i = 1, 1000 do
+  p = lpeg.rcap(lpeg.P(string.char(98 + i % 20))^-1 * p * lpeg.P"x"^-1
+                + "y" * lpeg.P"w", "n")
+end
+check(select(2, p:rmatch("a"))==0)
+-- each node analyzed a bounded number of times (millions if not)
+ok, n = pcall(lpeg.panalyses, p)
+if ok then
+  check(n < 50 * 1000)
+  check((lpeg.P"b" * "c"):match("bc")==3 and lpeg.panalyses(p)==n)
+  check(lpeg.panalyses(lpeg.P"b" * "c") < 10)
+else
+  check(n:find("only implemented in debug mode"))
+end
+
+subheading("Left factoring")
+-- the same code as the choice written with its prefixes factored
+p = lpeg.P"abcxz" + lpeg.P"abcyz" + lpeg.P"abd"
+q = lpeg.P"ab" * (lpeg.P"c" * (lpeg.P"xz" + "yz") + "d")
+check(p:match("abcyz")==6 and p:match("abd")==4 and not p:match("abcz"))
+q:match("")
+check(lpeg.psize(p) - lpeg.usize(p) == lpeg.psize(q) - lpeg.usize(q))
+-- the order of the alternatives is kept
+p = lpeg.P"a" + lpeg.P"ab" + lpeg.P"b" + lpeg.P"ac"
+check(p:match("ab")==2 and p:match("ac")==2 and p:match("b")==2)
+p = lpeg.P"ab" + lpeg.P"a" * lpeg.S"bc" * "d" + lpeg.P"acd"
+check(p:match("abd")==3 and p:match("acd")==4)
+-- and so are the captures of the alternatives
+p = lpeg.C(lpeg.P"ab" * lpeg.C"c" + lpeg.P"ab" * lpeg.C"d" + lpeg.C"a")
+a, b = p:match("abd")
+check(a=="abd" and b=="d")
+a, b = p:match("ax")
+check(a=="a" and b=="a")
+p = lpeg.P"if" * lpeg.rcap(lpeg.R"az"^1, "id") + lpeg.P"in" * lpeg.rcap("t", "t")
+check(select(2, p:rmatch("int"))==0)
+-- inside the rules of a grammar
+g = lpeg.P{"s", s = lpeg.P"if" * lpeg.V"t" + lpeg.P"in" * lpeg.V"s" + lpeg.C"x",
+           t = lpeg.C"y" + lpeg.P"yy"}
+check(g:match("inify")=="y" and g:match("inx")=="x" and not g:match("iz"))
+
+subheading("Inlining rules")
+g = lpeg.P{"s", s = lpeg.V"a" * lpeg.V"b" + lpeg.V"b",
+           a = lpeg.P"x" + "y", b = lpeg.C(lpeg.R"09"^1),
+           r = "(" * lpeg.V"r"^-1 * ")"}
+check(g:match("x12")=="12" and g:match("34")=="34" and not g:match("z1"))
+-- recursive rules are still called
+g = lpeg.P{"s", s = lpeg.V"r" * -1, r = "(" * lpeg.V"r"^-1 * ")"}
+check(g:match("((()))")==7 and not g:match("(()"))
+g = lpeg.P{"a", a = "x" * lpeg.V"b" + "y", b = "z" * lpeg.V"a"}
+check(g:match("xzxzy")==6 and not g:match("xzx"))
+-- a small rule called many times is inlined only up to a budget
+p = lpeg.P(true)
+for i = 1, 300 do p = p * lpeg.V"d" end
+g = lpeg.P{"s", s = p, d = lpeg.R"09" + lpeg.S"abcdef"}
+check(g:match(string.rep("7a", 150))==301 and not g:match(string.rep("7", 299)))
+check(lpeg.psize(g) < 20000)
+
+subheading("Follow sets of rules")
+-- what follows the calls of a (recursive, so not inlined) rule
+g = lpeg.P{"s", s = lpeg.V"r" * "x" + lpeg.V"r" * "y",
+           r = lpeg.P"ab" * lpeg.V"r" + lpeg.P"a"^-1}
+check(g:match("ababx")==6 and g:match("abay")==5 and g:match("y")==2)
+check(not g:match("abz") and not g:match("abab"))
+g = lpeg.P{"s", s = lpeg.C(lpeg.V"r") * -1 + lpeg.C(lpeg.V"r") * "a",
+           r = lpeg.P"b" * lpeg.V"r" + lpeg.P"a" * lpeg.V"t" + "",
+           t = lpeg.V"r"^-1 * "c"}
+check(g:match("bb")=="bb" and g:match("bac")=="bac")
+check(g:match("bba")=="bb" and g:match("baca")=="bac" and not g:match("bacc"))
+-- a halt ends the match whatever the follow sets say
+p = lpeg.rcap(lpeg.P"ab"^0 * lpeg.Halt() * "x", "h")
+check(select(3, lpeg.rmatch(p, "ac"))==true)
+g = lpeg.P{"s", s = lpeg.P"a" * #lpeg.V"h" * "a" + lpeg.P"ab" + "b",
+           h = lpeg.Halt()^0}
+p = lpeg.rcap(g, "top")
+a, b, c = lpeg.rmatch(p, "acc", 1, 1)
+check(lpeg.getdata(a)=='{"type":"top","s":1,"e":2,"data":"a"}' and c==true)
+g = lpeg.P{"s", s = lpeg.P"a" * lpeg.V"h" * "x" + lpeg.P"ab",
+           h = lpeg.P"a"^-1 * lpeg.Halt() + "a" * lpeg.V"h"}
+check(select(3, lpeg.rmatch(lpeg.rcap(g, "g"), "ab"))==true)
+
+subheading("Right recursion as loops")
+-- a list longer than the backtrack stack allows for its recursion
+g = lpeg.P{"list", list = lpeg.V"item" * ("," * lpeg.V"list")^-1,
+           item = lpeg.C(lpeg.R"az"^1)}
+t = {g:match(string.rep("ab,", 20000) .. "z")}
+check(#t==20001 and t[1]=="ab" and t[20001]=="z")
+t = {g:match("a,b,")}
+check(#t==2 and t[2]=="b")
+-- several recursive alternatives, and one to end the list
+g = lpeg.P{"l", l = lpeg.C(lpeg.R"az"^1) * ("," * lpeg.V"l" + ";" * lpeg.V"l"
+                                            + lpeg.P"." * "x" + "")}
+t = {g:match("a,b;c.x")}
+check(#t==3 and t[3]=="c" and g:match("a,b;c.x")=="a")
+check(lpeg.match(lpeg.Ct(g) * lpeg.Cp(), "a,b;c.y")[3]=="c")
+check(select(2, lpeg.match(lpeg.Ct(g) * lpeg.Cp(), "a,b;c.y"))==6)
+-- rules whose last choice can fail are still called
+g = lpeg.P{"r", r = "a" * lpeg.V"r" + lpeg.P"ab"}
+check(g:match("aab")==4 and not g:match("aaa"))
+-- the captures nest as they do with the calls
+p = lpeg.P{"r", r = lpeg.rcap(lpeg.P"x" * (lpeg.P"," * lpeg.V"r")^-1, "r")}
+a = lpeg.rmatch(p, "x,x,x", 1, 1)
+check(lpeg.getdata(a):find('"type":"r","s":5'))
+
+subheading("Profile-guided layout")
+function build() return lpeg.C(lpeg.P"xyz" * lpeg.R"09"^1 + lpeg.R"az"^1) * -1 end
+p = build()
+check(lpeg.rprofile(p)==nil and lpeg.rprofile(p, true)==true)
+for i = 1, 500 do p:match("hello") end
+check(p:match("xyz12")=="xyz12")
+prof = lpeg.rprofile(p)
+check(type(prof)=="string")
+-- the rare ways are moved after the common ones; the matches are the same
+check(lpeg.rlayout(p) > 0 and lpeg.rprofile(p)==nil)
+check(p:match("hello")=="hello" and p:match("xyz12")=="xyz12")
+check(p:match("xyz")=="xyz" and not p:match("x1") and not p:match("abc1"))
+-- a saved profile lays out the same code again, natively too
+q = build()
+check(lpeg.rlayout(q, prof) > 0 and q:match("xyz7")=="xyz7" and q:match("ab")=="ab")
+q = build()
+lpeg.jit(q)
+check(lpeg.rlayout(q, prof) > 0 and q:match("xyz7")=="xyz7" and not q:match("x1"))
+-- but not other code
+ok, msg = pcall(lpeg.rlayout, lpeg.P"a" * "b", prof)
+check(not ok and msg:find("not for this code"))
+ok, msg = pcall(lpeg.rlayout, build(), "short")
+check(not ok and msg:find("not for this code"))
+ok, msg = pcall(lpeg.rlayout, build())
+check(not ok and msg:find("not being profiled"))
+-- a profiled pattern counts without its cache, and stops when asked
+p = lpeg.rcap(lpeg.P"a"^1 + lpeg.P"b", "x")
+lpeg.rcache(p, 10)
+check(lpeg.rprofile(p, true) and lpeg.rmatch(p, "aa") and lpeg.rmatch(p, "aa"))
+check(lpeg.rcache(p)==0 and lpeg.rprofile(p, false)==false)
+check(lpeg.rprofile(p)==nil)
+
+subheading("Profile-guided order of alternatives")
+function build()
+  local d = lpeg.R"09"
+  return (lpeg.C(lpeg.P"<" * d^1 * ">") + lpeg.C(lpeg.P"[" * d^1 * "]")
+          + lpeg.C(lpeg.R"az"^1 * ":" * d^1) + lpeg.P(1)) * -1
+end
+p = build()
+lpeg.rprofile(p, true)
+for i = 1, 100 do p:match("abc:12") end
+check(p:match("[1]")=="[1]")
+prof = lpeg.rprofile(p)
+-- the common format is tried first; the last alternative stays last
+check(lpeg.rorder(p)==1 and lpeg.rprofile(p)==nil)
+check(p:match("abc:12")=="abc:12" and p:match("[1]")=="[1]" and p:match("<1>")=="<1>")
+check(p:match("x")==2 and p:match("abc")==nil and p:match("<1")==nil)
+q = build()
+check(lpeg.rorder(q, prof)==1 and q:match("ab:1")=="ab:1" and q:match("[2]")=="[2]")
+-- the profile is for the code the pattern compiles to, not the reordered code
+check(lpeg.rorder(q, prof)==1)
+lpeg.rprofile(q, true)
+ok, msg = pcall(lpeg.rorder, q)
+check(not ok and msg:find("not for this code"))
+-- alternatives that could both match keep their order
+p = lpeg.C(lpeg.P"ab") + lpeg.C(lpeg.P"a")
+lpeg.rprofile(p, true)
+for i = 1, 10 do p:match("a") end
+check(lpeg.rorder(p)==0 and p:match("ab")=="ab")
+
+subheading("Pool of charsets")
+function codesize(p) p:match("") return lpeg.psize(p) - lpeg.usize(p) end
+-- a charset used many times is kept in the code once
+q = lpeg.C(lpeg.S"xyz")
+p = q
+for i = 2, 10 do p = p * q end
+check(codesize(p) - codesize(q) < 9 * 32)
+check(p:match("xyzzyxxyzz")=="x" and not p:match("xyzzyxxyz"))
+-- many charsets share tables of byte classes
+g = lpeg.P(false)
+for i = 1, 12 do g = g + lpeg.C(lpeg.S(string.char(96 + i, 64 + i))) end
+g = g^1 * -1
+a, b, c = g:match("aBl")
+check(a=="a" and b=="B" and c=="l" and not g:match("aBm"))
+src = lpeg.aotsource(g, "classes")
+check(src:find("R_INCLASS", 1, true) and src:find("R_TESTCHAR", 1, true))
+lpeg.jit(g)
+a, b, c = g:match("Lba")
+check(a=="L" and b=="b" and c=="a" and not g:match("M"))
+
+subheading("Compact code")
+-- an instruction takes a word, and so does a short jump
+p = lpeg.C(lpeg.P"ab" + "cd")
+check(codesize(p) <= 12 * 4)
+check(p:match("ab")=="ab" and p:match("cd")=="cd" and not p:match("ad"))
+-- jumps too long to fit in their instructions
+q = lpeg.P(string.rep("ab", 20000))
+p = lpeg.C(q * "!" + "x" + q * "?") * lpeg.C(lpeg.S"yz"^0)
+check(codesize(p) > 40000 * 4)
+a, b = p:match(string.rep("ab", 20000) .. "?zy")
+check(#a==40001 and b=="zy" and p:match("xy")=="x")
+check(not p:match(string.rep("ab", 20000)))
+lpeg.jit(p)
+a, b = p:match(string.rep("ab", 20000) .. "!y")
+check(#a==40001 and b=="y" and not p:match(string.rep("ab", 19999) .. "?"))
+
+subheading("Large pattern libraries")
+-- rule numbers past a byte, and more rules than there were room for
+g = {"S"}
+for i = 1, 2000 do
+  g["r" .. i] = lpeg.P("<" .. i .. ">") * lpeg.V("r" .. i)^-1
+end
+g.S = lpeg.V"r299" * lpeg.V"r257" * lpeg.V"r1999" * lpeg.V"r3" * -1
+p = lpeg.P(g)
+check(p:match("<299><299><257><1999><3>")==25)
+check(not p:match("<299><43><1999><3>") and not p:match("<3><257><1999><3>"))
+g = {"S", S = "x" * lpeg.V"S"^-1}
+for i = 1, 700 do g["r" .. i] = "a" * lpeg.V("r" .. (i % 700 + 1)) end
+ok, msg = pcall(lpeg.P, g)
+check(ok)
+-- keys into the ktable past a short
+function balanced (n, f)
+  local function build (i, j)
+    if i == j then return f(i) end
+    local m = (i + j) // 2
+    return build(i, m) * build(m + 1, j)
+  end
+  return build(1, n)
+end
+p = balanced(40000, function (i) return lpeg.rcap(lpeg.P"a", "n" .. i) end)
+s = string.rep("a", 40000)
+buf, n = p:rsubst(s, "replace", "?", {"n39999"})
+check(n==1 and lpeg.getdata(buf)==string.rep("a", 39998) .. "?a")
+lpeg.jit(p)
+buf, n = p:rsubst(s, "replace", "?", {"n40000", "n2"})
+check(n==2 and lpeg.getdata(buf)=="a?" .. string.rep("a", 39997) .. "?")
+
+subheading("Patterns as shared nodes")
+-- built one part at a time, in linear time
+p = lpeg.P""
+for i = 1, 20000 do p = p * lpeg.R"az" end
+check(p:match(string.rep("x", 20000))==20001)
+check(not p:match(string.rep("x", 19999)))
+q = lpeg.P(false)
+for i = 1, 5000 do q = q + lpeg.P("k" .. i) * -lpeg.R"09" end
+check(q:match("k4999")==6 and q:match("k17x")==4 and not q:match("k5001"))
+-- equal nodes are one
+a, b = lpeg.P"a", lpeg.P"b"
+check(rawequal(a * b, a * b) and rawequal(lpeg.C(a), lpeg.C(a)))
+check(rawequal(lpeg.Cg(a, "x"), lpeg.Cg(a, "x")))
+check(not rawequal(lpeg.Cg(a, "x"), lpeg.Cg(a, "y")))
+check(not rawequal(lpeg.Cg(a, ""), lpeg.Cg(a)))
+p = a^0
+check(rawequal(p + b, p) and not rawequal(b + p, p))
+-- a shared part keeps its captures, also after it is compiled
+d = lpeg.C(lpeg.R"09"^1) / tonumber
+check(d:match("7")==7)
+w = lpeg.Cg(lpeg.C(lpeg.R"az"^1), "w")
+r = lpeg.Ct(d * " " * w * " " * d):match("12 ab 34")
+check(r[1]==12 and r[2]==34 and r.w=="ab")
+p = lpeg.rcap(lpeg.rcap(d, "n") * ("," * lpeg.rcap(d, "n"))^0, "list")
+buf, n = p:rsubst("1,22,3", "replace", "#", {"n"})
+check(n==3 and lpeg.getdata(buf)=="#,#,#")
+-- repetitions
+p = lpeg.P"ab"^2
+check(p:match("abab")==5 and p:match("ababab")==7 and not p:match("ab"))
+p = lpeg.P"ab"^-2
+check(p:match("ababab")==5 and p:match("x")==1)
+ok, msg = pcall(function () return (lpeg.P"a"^0 * lpeg.P"b"^-1)^1 end)
+check(not ok and msg:find("empty string"))
+
 test.finish()
 
 
@@ -613,13 +613,18 @@ int getcaptures (lua_State *L, const char *s, const char *r, int ptop) {
 
 /* Rosie extensions */
 /* See byte encoder in rcap.c */
-void r_pushmatch(lua_State *L, const char **s, const char **e, int depth);
-void r_pushmatch(lua_State *L, const char **s, const char **e, int depth) {
+
+/* positions are ints, or 64-bit ints when 'wide' (byte64) */
+#define readpos(s, wide)	((wide) ? r_readint64(s) : r_readint(s))
+#define peekpos(s, wide)	((wide) ? r_peekint64(s) : r_peekint(s))
+
+static void pushmatch(lua_State *L, const char **s, const char **e, int depth,
+                      int wide) {
   int top;
   short shortlen;
-  int pos;
+  lua_Integer pos;
   int n = 0;
-  pos = r_readint(s);
+  pos = readpos(s, wide);
   check_bounds(s, e);
   
   if ((pos) > 0) luaL_error(L, "corrupt match data (expected start marker)");
@@ -651,8 +656,8 @@ void r_pushmatch(lua_State *L, const char **s, const char **e, int depth) {
 
   /* process subs, if any */
   top = lua_gettop(L);
-  while (r_peekint(s) < 0) {
-    r_pushmatch(L, s, e, depth++);
+  while (*s < *e && peekpos(s, wide) < 0) {  /* rosie: not past the end */
+    pushmatch(L, s, e, depth++, wide);
     n++;
   } 
   
@@ -667,7 +672,7 @@ void r_pushmatch(lua_State *L, const char **s, const char **e, int depth) {
     lua_rawset(L, -3);		/* match["subs"] = subs table */    
   }    
 
-  pos = r_readint(s);  
+  pos = readpos(s, wide);  
   check_bounds(s, e);
   lua_pushliteral(L, "e");  
   lua_pushinteger(L, pos);  
@@ -676,6 +681,19 @@ void r_pushmatch(lua_State *L, const char **s, const char **e, int depth) {
 
   /* leave match table on the stack */
 }
+
+/* rosie: decode a match in the byte encoding, or in byte64 (see rcap.h) */
+void r_pushmatch(lua_State *L, const char **s, const char **e, int depth);
+void r_pushmatch(lua_State *L, const char **s, const char **e, int depth) {
+  int wide = 0;
+  if (*e - *s >= 4 && r_peekint(s) > 0) {  /* a version, not a start marker? */
+    int version = r_readint(s);
+    if (version != R_BYTE64_VERSION)
+      luaL_error(L, "unsupported match data version %d", version);
+    wide = 1;
+  }
+  pushmatch(L, s, e, depth, wide);
+}
   
 int r_lua_decode (lua_State *L) {
   rBuffer *buf = (rBuffer *)luaL_checkudata(L, 1, ROSIE_BUFFER); 
@@ -689,8 +707,39 @@ int r_lua_decode (lua_State *L) {
   return 2;
 }
 
+/*
+** rosie: decodeall(buf) decodes the byte-encoded matches written by
+** rfindall and rmatchlines, each preceded by its length, into a list of
+** match tables: true for an empty record (a match with no captures), and
+** false for a record of length R_NOMATCH (a line that did not match)
+*/
+int r_lua_decodeall (lua_State *L) {
+  rBuffer *buf = (rBuffer *)luaL_checkudata(L, 1, ROSIE_BUFFER);
+  const char *s = buf->data;
+  const char *e = buf->data + buf->n;
+  lua_Integer i = 0;
+  lua_newtable(L);
+  while (e - s >= 4) {
+    int len = r_readint(&s);
+    const char *recend = s + len;
+    if (len == R_NOMATCH) {  /* see rmatchlines */
+      lua_pushboolean(L, 0);
+      recend = s;
+    }
+    else if (len < 0 || len > e - s)
+      luaL_error(L, "corrupt match data (bad record length)");
+    else if (len == 0) lua_pushboolean(L, 1);  /* nothing was captured */
+    else r_pushmatch(L, &s, &recend, 0);
+    if (s != recend) luaL_error(L, "corrupt match data (bad record length)");
+    lua_rawseti(L, -2, ++i);
+  }
+  if (s != e) luaL_error(L, "corrupt match data (buffer overrun)");
+  return 1;
+}
+
 encoder_functions debug_encoder = { debug_Open, debug_Fullcapture, debug_Close };
 encoder_functions byte_encoder = { byte_Open, byte_Fullcapture, byte_Close };
+encoder_functions byte64_encoder = { byte64_Open, byte64_Fullcapture, byte64_Close };
 encoder_functions json_encoder = { json_Open, json_Fullcapture, json_Close };
 
 #define push(start, count) \
@@ -739,18 +788,22 @@ static int caploop(CapState *cs, encoder_functions *encode, rBuffer *buf) {
      * Close that didn't exist due to the non-local exit from the vm.
      */
     if (isfinalcap(cs->cap)) {
-      Capture synthetic;
-      synthetic.s = cs->cap->s;
-      synthetic.idx = 0;
-      synthetic.kind = Cclose;
-      synthetic.siz = 1;	/* 1 means closed */
-      cs->cap = &synthetic;
+      /* rosie: the synthetic close follows the last capture, as encoders
+	 look at the capture before a close */
+      Capture synthetic[2];
+      synthetic[0] = *(cs->cap - 1);
+      synthetic[1].s = cs->cap->s;
+      synthetic[1].idx = 0;
+      synthetic[1].kind = Cclose;
+      synthetic[1].siz = 1;	/* 1 means closed */
+      cs->cap = &synthetic[1];
       while (1) {
 	err = encode->Close(cs, buf, count, start); if (err) return err;
 	if (top==0) break;
-	pop;
+	synthetic[0] = synthetic[1];  /* the capture just closed */
 	count = counts[top];
 	start = starts[top];
+	pop;
       }
       return ROSIE_HALT;
     }
@@ -773,7 +826,7 @@ static const char *r_status_messages[] = {
 static int dummy[1];
 static void *output_buffer_key = (void *)&dummy[0];
 
-static rBuffer *getbuffer(lua_State *L) {
+rBuffer *r_getbuffer(lua_State *L) {
   rBuffer *buf;
   int t;
   /* TODO: IF we are reusing the buffer, AND there is one already, then */
@@ -795,27 +848,27 @@ static rBuffer *getbuffer(lua_State *L) {
 }
      
 
-int r_getcaptures(lua_State *L, const char *s, const char *r, int ptop, int etype, size_t len) {
+/*
+** rosie: encode the captures of a match of subject 's' at the end of
+** 'buf'.  Returns 1 when the match halted (abend), else 0.
+*/
+int r_encodecaptures(lua_State *L, rBuffer *buf, const char *s, int ptop, int etype) {
   int err;
   encoder_functions encode;
   Capture *capture = (Capture *)lua_touserdata(L, caplistidx(ptop));
-  rBuffer *buf = getbuffer(L);
-  int abend = 0;		/* 0 => normal completion; 1 => halt */
   switch (etype) {
   case ENCODE_DEBUG: { encode = debug_encoder; break; } /* Debug output */
   case ENCODE_BYTE: { encode = byte_encoder; break; }   /* Byte array (compact) */
+  case ENCODE_BYTE64: { encode = byte64_encoder; break; } /* rosie: wide positions */
   case ENCODE_JSON: { encode = json_encoder; break; }   /* JSON string */
-  case ENCODE_LINE: { r_addlstring(L, buf, s, len); goto done; } /* Put the entire input into buf, and we are done */
   default: { return luaL_error(L, "invalid encoding value: %d", etype); }
   }
-  if (isfinalcap(capture)) {
-    abend = 1;
-    goto done;
-  }
+  if (isfinalcap(capture)) return 1;
   if (!isclosecap(capture)) {  /* is there a capture? */
     CapState cs;
     cs.ocap = cs.cap = capture; cs.L = L;
     cs.s = s; cs.valuecached = 0; cs.ptop = ptop;
+    if (etype == ENCODE_BYTE64) r_addint(L, buf, R_BYTE64_VERSION);  /* rosie */
     /* Rosie's rcap ensures that the pattern has an outer capture.  So
      * if we see a full capture, it is because the outermost
      * open/close was converted to a full capture.  And it must be the
@@ -834,19 +887,24 @@ int r_getcaptures(lua_State *L, const char *s, const char *r, int ptop, int etyp
       {
 	err = caploop(&cs, &encode, buf);
       }
-    if (err == ROSIE_HALT)
-      {
-	abend = 1;
-	goto done;
-      }
+    if (err == ROSIE_HALT) return 1;
     else
       if (err) {
 	if ((err < 0) || (err > n_messages)) return luaL_error(L, "in rosie match, unspecified error");
 	else return luaL_error(L, r_status_messages[err]);
       }
   }
-done:
-  lua_pushinteger(L, (int) len - (r - s)); /* leftover chars */
+  return 0;
+}
+
+int r_getcaptures(lua_State *L, const char *s, const char *r, int ptop, int etype, size_t len) {
+  rBuffer *buf = r_getbuffer(L);
+  int abend = 0;		/* 0 => normal completion; 1 => halt */
+  if (etype == ENCODE_LINE)	/* Put the entire input into buf, and we are done */
+    r_addlstring(L, buf, s, len);
+  else
+    abend = r_encodecaptures(L, buf, s, ptop, etype);
+  lua_pushinteger(L, (lua_Integer) len - (r - s)); /* leftover chars */
   lua_pushboolean(L, abend);
   return 3;			 /* N.B. an rBuffer is on the stack */
 }
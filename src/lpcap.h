@@ -50,6 +50,7 @@ capidx_t finddyncap (Capture *cap, Capture *last);
 #include "rbuf.h"
 
 #define R_MAXDEPTH USHRT_MAX	/* max nesting depth for patterns (was 200) */
+#define R_NOMATCH (-1)	/* length of the record of a line that did not match */
 
 typedef struct {  
   int (*Open)(CapState *cs, rBuffer *buf, int count);
@@ -64,7 +65,10 @@ typedef enum r_status {
 
 int r_match (lua_State *L);
 int r_getcaptures(lua_State *L, const char *s, const char *r, int ptop, int etype, size_t len);
+rBuffer *r_getbuffer(lua_State *L);
+int r_encodecaptures(lua_State *L, rBuffer *buf, const char *s, int ptop, int etype);
 int r_lua_decode (lua_State *L);
+int r_lua_decodeall (lua_State *L);
 
 #endif
 
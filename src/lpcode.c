@@ -4,6 +4,7 @@
 */
 
 #include <limits.h>
+#include <string.h>
 
 
 #include "lua.h"
@@ -11,6 +12,7 @@
 
 #include "lptypes.h"
 #include "lpcode.h"
+#include "rdfa.h"
 
 
 /* signals a "no-instruction */
@@ -125,29 +127,166 @@ int tocharset (TTree *tree, Charset *cs) {
 }
 
 
+/*
+** rosie: the code generators ask the analyses below about the same
+** subtrees at every level of a pattern, so a compilation remembers
+** their results in a table with an entry per node of the tree being
+** compiled ('memo', indexed from its root).  The boolean results go in
+** 'val', with a bit per analysis.  A node met again while its analysis
+** is under way is a recursive rule: it has no fixed length, adds no
+** captures to those found where it started (which then are not
+** remembered if there are none, see 'memo1'), and is otherwise
+** analyzed as lpeg always did.  So is any node beyond MEMODEPTH
+** nested analyses, so that the recursion stays shallow.  Outside a
+** compilation 'memo' is NULL and nothing is remembered.  'runs' counts
+** the analyses a compilation ran rather than found remembered (see
+** 'r_compileanalyses').
+*/
+
+#define MEMODEPTH	4000
+
+/* the analyses remembered */
+#define MCAPTURES	1
+#define MNULLABLE	2
+#define MNOFAIL		4
+#define MHEADFAIL	8
+#define MFIXEDLEN	16
+#define MFIRST		32
+
+typedef struct MemoEntry {
+  byte known;  /* analyses done */
+  byte busy;  /* analyses under way */
+  byte val;  /* boolean results */
+  int len;  /* fixed length */
+  int e;  /* 'getfirst' result, for the full follow set */
+  Charset first;
+} MemoEntry;
+
+typedef struct Memo {
+  TTree *root;
+  int n;  /* number of entries */
+  int depth;  /* nested analyses under way */
+  int cuts;  /* rules not looked at again by 'captures' */
+  lua_Integer runs;  /* analyses run, not remembered */
+  MemoEntry *entry;
+} Memo;
+
+static int captures (Memo *memo, TTree *tree);
+static int checks (Memo *memo, TTree *tree, int pred);
+static int lenof (Memo *memo, TTree *tree, int count, int len);
+static int headfailof (Memo *memo, TTree *tree);
+static int firstof (Memo *memo, TTree *tree, const Charset *follow,
+                    Charset *firstset);
+static int getfirst (Memo *memo, TTree *tree, const Charset *follow,
+                     Charset *firstset);
+
+
+/* the entry of 'tree', or NULL if results cannot be remembered now */
+static MemoEntry *memoentry (Memo *memo, TTree *tree) {
+  ptrdiff_t i;
+  if (memo == NULL || memo->depth >= MEMODEPTH) return NULL;
+  i = tree - memo->root;
+  return (i >= 0 && i < memo->n) ? &memo->entry[i] : NULL;
+}
+
+
+static int analysis (Memo *memo, TTree *tree, int a) {
+  switch (a) {
+    case MCAPTURES: return captures(memo, tree);
+    case MNULLABLE: return checks(memo, tree, PEnullable);
+    case MNOFAIL: return checks(memo, tree, PEnofail);
+    case MHEADFAIL: return headfailof(memo, tree);
+    default: return lenof(memo, tree, 0, 0);
+  }
+}
+
+
+/* analysis 'a' (other than MFIRST) of 'tree', remembered */
+static int memo1 (Memo *memo, TTree *tree, int a) {
+  MemoEntry *me = memoentry(memo, tree);
+  int r, cuts;
+  if (memo != NULL) memo->runs++;
+  if (me == NULL) {
+    r = analysis(NULL, tree, a);
+    if (a == MCAPTURES && !r && memo != NULL)
+      memo->cuts++;  /* it may have met a call under way */
+    return r;
+  }
+  if (me->busy & a) {  /* a recursive rule */
+    if (a == MFIXEDLEN) return -1;  /* has no fixed length */
+    if (a == MCAPTURES) {  /* its captures are seen where it started */
+      memo->cuts++;
+      return 0;
+    }
+    return analysis(NULL, tree, a);
+  }
+  if (me->known & a)
+    memo->runs--;  /* remembered */
+  else {
+    cuts = memo->cuts;
+    me->busy |= a;  memo->depth++;
+    r = analysis(memo, tree, a);
+    me->busy &= ~a;  memo->depth--;
+    if (a == MCAPTURES && !r && memo->cuts != cuts)
+      return 0;  /* only so far: not remembered */
+    me->known |= a;
+    if (a == MFIXEDLEN) me->len = r;
+    else if (r) me->val |= a;
+  }
+  return (a == MFIXEDLEN) ? me->len : ((me->val & a) != 0);
+}
+
+#define mcaptures(m,t)		memo1(m, t, MCAPTURES)
+#define mchecks(m,t,pred)	memo1(m, t, ((pred) == PEnullable) \
+                                              ? MNULLABLE : MNOFAIL)
+#define mnullable(m,t)		mchecks(m, t, PEnullable)
+#define mnofail(m,t)		mchecks(m, t, PEnofail)
+#define mheadfail(m,t)		memo1(m, t, MHEADFAIL)
+#define mfixedlen(m,t)		memo1(m, t, MFIXEDLEN)
+
+
 /*
 ** Check whether a pattern tree has captures
+** (rosie: a call goes to the body of its rule, not to the rules after
+** it, and only once: as in lpeg 1.0, the call has key 0 meanwhile)
 */
-int hascaptures (TTree *tree) {
+static int captures (Memo *memo, TTree *tree) {
  tailcall:
   switch (tree->tag) {
     case TCapture: case TRunTime:
       return 1;
-    case TCall:
-      tree = sib2(tree); goto tailcall;  /* return hascaptures(sib2(tree)); */
+    case TCall: {
+      int key = tree->key;
+      int r;
+      if (key == 0) {  /* rule already being looked at? */
+        if (memo != NULL) memo->cuts++;
+        return 0;
+      }
+      tree->key = 0;
+      r = mcaptures(memo, sib1(sib2(tree)));
+      tree->key = key;
+      return r;
+    }
     case TOpenCall: assert(0);
     default: {
       switch (numsiblings[tree->tag]) {
         case 1:  /* return hascaptures(sib1(tree)); */
-          tree = sib1(tree); goto tailcall;
+          tree = sib1(tree); break;
         case 2:
-          if (hascaptures(sib1(tree))) return 1;
+          if (mcaptures(memo, sib1(tree))) return 1;
           /* else return hascaptures(sib2(tree)); */
-          tree = sib2(tree); goto tailcall;
+          tree = sib2(tree); break;
         default: assert(numsiblings[tree->tag] == 0); return 0;
       }
     }
   }
+  if (memo != NULL) return mcaptures(memo, tree);  /* rosie */
+  goto tailcall;
+}
+
+
+int hascaptures (TTree *tree) {
+  return captures(NULL, tree);
 }
 
 
@@ -169,13 +308,14 @@ int hascaptures (TTree *tree) {
 ** Run-time captures can do whatever they want, so the result
 ** is conservative.
 */
-int checkaux (TTree *tree, int pred) {
+static int checks (Memo *memo, TTree *tree, int pred) {
  tailcall:
   switch (tree->tag) {
     case TChar: case TSet: case TAny:
     case TFalse: case TOpenCall: 
+    case THalt:  /* rosie: nothing after it runs (as in 'verifyrule') */
       return 0;  /* not nullable */
-    case TRep: case TTrue: case THalt: /* rosie adds THalt */
+    case TRep: case TTrue:
       return 1;  /* no fail */
     case TNot: case TBehind:  /* can match empty, but can fail */
       if (pred == PEnofail) return 0;
@@ -183,69 +323,358 @@ int checkaux (TTree *tree, int pred) {
     case TAnd:  /* can match empty; fail iff body does */
       if (pred == PEnullable) return 1;
       /* else return checkaux(sib1(tree), pred); */
-      tree = sib1(tree); goto tailcall;
-    case TRunTime:  /* can fail; match empty iff body does */
+      tree = sib1(tree); break;
+    case TRunTime: case TPredicate:  /* can fail; match empty iff body does */
       if (pred == PEnofail) return 0;
       /* else return checkaux(sib1(tree), pred); */
-      tree = sib1(tree); goto tailcall;
+      tree = sib1(tree); break;
     case TSeq:
-      if (!checkaux(sib1(tree), pred)) return 0;
+      if (!mchecks(memo, sib1(tree), pred)) return 0;
       /* else return checkaux(sib2(tree), pred); */
-      tree = sib2(tree); goto tailcall;
+      tree = sib2(tree); break;
     case TChoice:
-      if (checkaux(sib2(tree), pred)) return 1;
+      if (mchecks(memo, sib2(tree), pred)) return 1;
       /* else return checkaux(sib1(tree), pred); */
-      tree = sib1(tree); goto tailcall;
+      tree = sib1(tree); break;
     case TCapture: case TGrammar: case TRule:
       /* return checkaux(sib1(tree), pred); */
-      tree = sib1(tree); goto tailcall;
+      tree = sib1(tree); break;
     case TCall:  /* return checkaux(sib2(tree), pred); */
-      tree = sib2(tree); goto tailcall;
+      tree = sib2(tree); break;
     default: assert(0); return 0;
   }
+  if (memo != NULL) return mchecks(memo, tree, pred);  /* rosie */
+  goto tailcall;
+}
+
+
+int checkaux (TTree *tree, int pred) {
+  return checks(NULL, tree, pred);
 }
 
 
 /*
 ** number of characters to match a pattern (or -1 if variable)
-** ('count' avoids infinite loops for grammars)
+** ('count' avoids infinite loops for grammars; with a 'memo', a rule
+** seen again has no fixed length, see 'memo1')
 */
-int fixedlenx (TTree *tree, int count, int len) {
+
+/* rosie: calls followed without a memo (was MAXRULES) */
+#define MAXLENCALLS	1000
+
+static int lenof (Memo *memo, TTree *tree, int count, int len) {
+  int n;
  tailcall:
   switch (tree->tag) {
     case TChar: case TSet: case TAny:
       return len + 1;
-    case TFalse: case TTrue: case TNot: case TAnd: case TBehind: case THalt: /* rosie adds THalt */
+    case TFalse: case TTrue: case TNot: case TAnd: case TBehind:
       return len;
     case TRep: case TRunTime: case TOpenCall:
+    case TPredicate:  /* rosie: a predicate may advance */
+    case THalt:  /* rosie: and a halt ends the match where it is */
       return -1;
     case TCapture: case TRule: case TGrammar:
       /* return fixedlenx(sib1(tree), count); */
-      tree = sib1(tree); goto tailcall;
+      tree = sib1(tree); break;
     case TCall:
-      if (count++ >= MAXRULES)
+      if (memo == NULL && count++ >= MAXLENCALLS)
         return -1;  /* may be a loop */
       /* else return fixedlenx(sib2(tree), count); */
-      tree = sib2(tree); goto tailcall;
+      tree = sib2(tree); break;
     case TSeq: {
-      len = fixedlenx(sib1(tree), count, len);
+      if (memo != NULL)
+        len = ((n = mfixedlen(memo, sib1(tree))) < 0) ? -1 : len + n;
+      else len = lenof(NULL, sib1(tree), count, len);
       if (len < 0) return -1;
       /* else return fixedlenx(sib2(tree), count, len); */
-      tree = sib2(tree); goto tailcall;
+      tree = sib2(tree); break;
     }
     case TChoice: {
       int n1, n2;
-      n1 = fixedlenx(sib1(tree), count, len);
+      if (memo != NULL) {  /* rosie */
+        n1 = mfixedlen(memo, sib1(tree));
+        n2 = (n1 < 0) ? -1 : mfixedlen(memo, sib2(tree));
+        return (n1 >= 0 && n1 == n2) ? len + n1 : -1;
+      }
+      n1 = lenof(NULL, sib1(tree), count, len);
       if (n1 < 0) return -1;
-      n2 = fixedlenx(sib2(tree), count, len);
+      n2 = lenof(NULL, sib2(tree), count, len);
       if (n1 == n2) return n1;
       else return -1;
     }
     default: assert(0); return 0;
   };
+  if (memo != NULL)  /* rosie */
+    return ((n = mfixedlen(memo, tree)) < 0) ? -1 : len + n;
+  goto tailcall;
+}
+
+
+int fixedlenx (TTree *tree, int count, int len) {
+  return lenof(NULL, tree, count, len);
+}
+
+
+/*
+** {======================================================
+** rosie: prefilters (see rFilter in lptree.h)
+** =======================================================
+*/
+
+/* limits on the analysis: nesting of subtrees and nodes visited */
+#define LITDEPTH	200
+#define LITBUDGET	20000
+
+typedef struct Lit {
+  int len;
+  char s[R_LITMAX];
+} Lit;
+
+/*
+** What is known about the matches of a subtree: how many bytes they
+** consume, and literals they all start with, end with, and contain.
+** 'exact' means that the subtree only matches the literal 'pre' (and
+** then 'suf' and 'in' are the same literal).
+*/
+typedef struct Lits {
+  int min, max;  /* max < 0: unbounded */
+  int never;  /* never matches */
+  int exact;
+  Lit pre, suf, in;
+} Lits;
+
+
+static int addlen (int a, int b) {
+  if (a < 0 || b < 0) return -1;
+  return (a > INT_MAX / 2 - b) ? INT_MAX / 2 : a + b;
+}
+
+
+static void unknown (Lits *l) {
+  memset(l, 0, sizeof(Lits));
+  l->max = -1;
+}
+
+
+/* concatenation of 'a' and 'b', keeping its first (or last) bytes */
+static void litcat (Lit *res, const Lit *a, const Lit *b, int front) {
+  char buff[2 * R_LITMAX];
+  int n = a->len + b->len;
+  memcpy(buff, a->s, a->len);
+  memcpy(buff + a->len, b->s, b->len);
+  res->len = (n > R_LITMAX) ? R_LITMAX : n;
+  memcpy(res->s, front ? buff : buff + n - res->len, res->len);
+}
+
+
+static int littakes (const Lit *big, const Lit *small) {  /* contains? */
+  int i;
+  for (i = 0; i + small->len <= big->len; i++)
+    if (memcmp(big->s + i, small->s, small->len) == 0) return 1;
+  return 0;
+}
+
+
+static void litbest (Lit *res, const Lit *l) {
+  if (l->len > res->len) *res = *l;
+}
+
+
+static void analyze (TTree *tree, Lits *l, int depth, int *budget);
+
+static void analyzeseq (TTree *tree, Lits *l, int depth, int *budget) {
+  Lits b;
+  Lit j;
+  analyze(sib1(tree), l, depth, budget);
+  analyze(sib2(tree), &b, depth, budget);
+  l->never |= b.never;
+  l->min = addlen(l->min, b.min);
+  l->max = addlen(l->max, b.max);
+  litcat(&j, &l->suf, &b.pre, 1);  /* across the two parts */
+  if (l->exact) litcat(&l->pre, &l->pre, &b.pre, 1);
+  if (b.exact) litcat(&l->suf, &l->suf, &b.suf, 0);
+  else l->suf = b.suf;
+  if (l->exact && b.exact && l->pre.len == l->min) {  /* nothing lost? */
+    l->in = l->pre;
+    return;
+  }
+  l->exact = 0;
+  litbest(&l->in, &b.in);
+  litbest(&l->in, &j);
+  litbest(&l->in, &l->pre);
+  litbest(&l->in, &l->suf);
+}
+
+
+static void analyzechoice (TTree *tree, Lits *l, int depth, int *budget) {
+  Lits b;
+  int i, n;
+  analyze(sib1(tree), l, depth, budget);
+  analyze(sib2(tree), &b, depth, budget);
+  if (b.never) return;
+  if (l->never) { *l = b; return; }
+  l->min = (l->min < b.min) ? l->min : b.min;
+  l->max = (l->max < 0 || b.max < 0) ? -1 : (l->max > b.max) ? l->max : b.max;
+  if (l->exact && b.exact && l->pre.len == b.pre.len
+      && memcmp(l->pre.s, b.pre.s, b.pre.len) == 0)
+    return;  /* both alternatives match the same literal */
+  l->exact = 0;
+  n = (l->pre.len < b.pre.len) ? l->pre.len : b.pre.len;
+  for (i = 0; i < n && l->pre.s[i] == b.pre.s[i]; i++) ;
+  l->pre.len = i;  /* common prefix */
+  n = (l->suf.len < b.suf.len) ? l->suf.len : b.suf.len;
+  for (i = 0; i < n; i++)
+    if (l->suf.s[l->suf.len - 1 - i] != b.suf.s[b.suf.len - 1 - i]) break;
+  memmove(l->suf.s, l->suf.s + l->suf.len - i, i);  /* common suffix */
+  l->suf.len = i;
+  if (littakes(&l->in, &b.in))  /* 'b.in' is required by both? */
+    l->in = b.in;
+  else if (!littakes(&b.in, &l->in))  /* nor is 'l->in'? */
+    l->in.len = 0;
+  litbest(&l->in, &l->pre);
+  litbest(&l->in, &l->suf);
+}
+
+
+static void analyze (TTree *tree, Lits *l, int depth, int *budget) {
+  if (depth > LITDEPTH || --*budget < 0) {
+    unknown(l);
+    return;
+  }
+  switch (tree->tag) {
+    case TChar: case TSet: case TAny: {
+      Charset cs;
+      int c;
+      unknown(l);
+      l->min = l->max = 1;
+      if (tree->tag == TChar) c = tree->u.n;
+      else if (tree->tag != TSet || !tocharset(tree, &cs)
+               || charsettype(cs.cs, &c) != IChar)
+        break;
+      l->exact = 1;
+      l->pre.len = l->suf.len = l->in.len = 1;
+      l->pre.s[0] = l->suf.s[0] = l->in.s[0] = (char)c;
+      break;
+    }
+    case TTrue:
+      unknown(l);
+      l->max = 0;  l->exact = 1;
+      break;
+    case TFalse:
+      unknown(l);
+      l->max = 0;  l->never = 1;
+      break;
+    case TRep:
+      analyze(sib1(tree), l, depth + 1, budget);
+      l->max = (l->max == 0) ? 0 : -1;
+      l->min = 0;  l->never = 0;  l->exact = 0;
+      l->pre.len = l->suf.len = l->in.len = 0;
+      break;
+    case TNot: case TAnd: case TBehind: case THalt: case TOpenCall:
+      unknown(l);  /* (THalt is handled in 'r_prefilter') */
+      l->max = 0;
+      if (tree->tag == TOpenCall) l->max = -1;
+      break;
+    case TRunTime: case TPredicate:  /* may move past the body's match */
+      analyze(sib1(tree), l, depth + 1, budget);
+      l->max = -1;  l->exact = 0;  l->suf.len = 0;
+      break;
+    case TSeq:
+      analyzeseq(tree, l, depth + 1, budget);
+      break;
+    case TChoice:
+      analyzechoice(tree, l, depth + 1, budget);
+      break;
+    case TCapture: case TGrammar: case TRule:
+      analyze(sib1(tree), l, depth + 1, budget);
+      break;
+    case TCall:
+      analyze(sib2(tree), l, depth + 1, budget);
+      break;
+    default: assert(0); unknown(l);
+  }
+}
+
+
+static int hashalt (TTree *tree) {
+ tailcall:
+  if (tree->tag == THalt) return 1;
+  switch (numsiblings[tree->tag]) {
+    case 1: tree = sib1(tree); goto tailcall;
+    case 2: if (hashalt(sib1(tree))) return 1;
+      tree = sib2(tree); goto tailcall;
+    default: return 0;  /* rules of calls are seen in their grammar */
+  }
+}
+
+
+/*
+** Compute the prefilter of a pattern.  The literal that starts every
+** match is tested in place; the longest literal found anywhere in the
+** matches is searched for, unless the first one already contains it.
+** A halt ends a match anywhere, so with one only 'max' is kept.
+*/
+void r_prefilter (TTree *tree, rFilter *f) {
+  Lits l;
+  int budget = LITBUDGET;
+  analyze(tree, &l, 0, &budget);
+  f->max = l.max;
+  f->min = l.min;
+  f->prelen = f->len = 0;
+  if (l.never || hashalt(tree)) {
+    f->min = 0;
+    return;
+  }
+  f->prelen = l.pre.len;
+  memcpy(f->pre, l.pre.s, l.pre.len);
+  if (!littakes(&l.pre, &l.in)) {
+    f->len = l.in.len;
+    memcpy(f->lit, l.in.s, l.in.len);
+  }
+}
+
+
+/*
+** First occurrence of literal 'lit' (of 'len' > 0 bytes) in 's'..'e',
+** or NULL.  (It leaves the hard work to 'memchr'.)
+*/
+const char *r_findlit (const char *lit, int len, const char *s,
+                       const char *e) {
+  const char *last;
+  for (last = e - len; s <= last; s++) {
+    s = (const char *)memchr(s, (byte)lit[0], last - s + 1);
+    if (s == NULL) return NULL;
+    if (memcmp(s + 1, lit + 1, len - 1) == 0) return s;
+  }
+  return NULL;
 }
 
 
+/*
+** Does the prefilter 'f' rule out a match of subject 's'..'e' by its
+** length or its prefix (leaving out the literal)?
+*/
+int r_prefixrejects (const rFilter *f, const char *s, const char *e) {
+  if (e - s < f->min) return 1;
+  return (f->prelen > 0
+          && (e - s < f->prelen || memcmp(s, f->pre, f->prelen) != 0));
+}
+
+
+/*
+** Does the prefilter 'f' rule out a match of subject 's'..'e'?
+*/
+int r_filterrejects (const rFilter *f, const char *s, const char *e) {
+  if (r_prefixrejects(f, s, e)) return 1;
+  if (f->len == 0) return 0;
+  if (f->max >= 0 && f->max < e - s) e = s + f->max;
+  return (r_findlit(f->lit, f->len, s, e) == NULL);
+}
+
+/* }====================================================== */
+
+
 /*
 ** Computes the 'first set' of a pattern.
 ** The result is a conservative aproximation:
@@ -263,8 +692,11 @@ int fixedlenx (TTree *tree, int count, int len) {
 ** (tests cannot be used because they would always fail for an empty input);
 ** 2) there is a match-time capture ==> return has bit 2 set
 ** (optimizations should not bypass match-time captures).
+** rosie: a halt also sets bit 2, with a full set, as it ends the match
+** whatever follows it; predicates and repetitions keep such a set.
 */
-static int getfirst (TTree *tree, const Charset *follow, Charset *firstset) {
+static int firstof (Memo *memo, TTree *tree, const Charset *follow,
+                    Charset *firstset) {
  tailcall:
   switch (tree->tag) {
     case TChar: case TSet: case TAny: {
@@ -279,27 +711,27 @@ static int getfirst (TTree *tree, const Charset *follow, Charset *firstset) {
       loopset(i, firstset->cs[i] = 0);
       return 0;
     }
-    case THalt: {		/* rosie */
-      loopset(i, firstset->cs[i] = follow->cs[i]); 
-      return 1;
+    case THalt: {  /* rosie: a halt ends the match, whatever follows */
+      loopset(i, firstset->cs[i] = 0xFF);
+      return 2;  /* like a match-time capture */
     }
     case TChoice: {
       Charset csaux;
-      int e1 = getfirst(sib1(tree), follow, firstset);
-      int e2 = getfirst(sib2(tree), follow, &csaux);
+      int e1 = getfirst(memo, sib1(tree), follow, firstset);
+      int e2 = getfirst(memo, sib2(tree), follow, &csaux);
       loopset(i, firstset->cs[i] |= csaux.cs[i]);
       return e1 | e2;
     }
     case TSeq: {
-      if (!nullable(sib1(tree))) {
+      if (!mnullable(memo, sib1(tree))) {
         /* when p1 is not nullable, p2 has nothing to contribute;
            return getfirst(sib1(tree), fullset, firstset); */
-        tree = sib1(tree); follow = fullset; goto tailcall;
+        tree = sib1(tree); follow = fullset; break;
       }
       else {  /* FIRST(p1 p2, fl) = FIRST(p1, FIRST(p2, fl)) */
         Charset csaux;
-        int e2 = getfirst(sib2(tree), follow, &csaux);
-        int e1 = getfirst(sib1(tree), &csaux, firstset);
+        int e2 = getfirst(memo, sib2(tree), follow, &csaux);
+        int e1 = getfirst(memo, sib1(tree), &csaux, firstset);
         if (e1 == 0) return 0;  /* 'e1' ensures that first can be used */
         else if ((e1 | e2) & 2)  /* one of the children has a matchtime? */
           return 2;  /* pattern has a matchtime capture */
@@ -307,26 +739,31 @@ static int getfirst (TTree *tree, const Charset *follow, Charset *firstset) {
       }
     }
     case TRep: {
-      getfirst(sib1(tree), follow, firstset);
+      int e = getfirst(memo, sib1(tree), follow, firstset);
       loopset(i, firstset->cs[i] |= follow->cs[i]);
-      return 1;  /* accept the empty string */
+      return (e & 2) | 1;  /* accept the empty string (rosie: keep bit 2) */
     }
     case TCapture: case TGrammar: case TRule: {
       /* return getfirst(sib1(tree), follow, firstset); */
-      tree = sib1(tree); goto tailcall;
+      tree = sib1(tree); break;
     }
     case TRunTime: {  /* function invalidates any follow info. */
-      int e = getfirst(sib1(tree), fullset, firstset);
+      int e = getfirst(memo, sib1(tree), fullset, firstset);
       if (e) return 2;  /* function is not "protected"? */
       else return 0;  /* pattern inside capture ensures first can be used */
     }
+    case TPredicate: {  /* rosie: predicate may advance past any follow */
+      /* predicates have no side effects, so they can be bypassed */
+      return getfirst(memo, sib1(tree), fullset, firstset);
+    }
     case TCall: {
       /* return getfirst(sib2(tree), follow, firstset); */
-      tree = sib2(tree); goto tailcall;
+      tree = sib2(tree); break;
     }
     case TAnd: {
-      int e = getfirst(sib1(tree), follow, firstset);
-      loopset(i, firstset->cs[i] &= follow->cs[i]);
+      int e = getfirst(memo, sib1(tree), follow, firstset);
+      if (!(e & 2))  /* rosie */
+        loopset(i, firstset->cs[i] &= follow->cs[i]);
       return e;
     }
     case TNot: {
@@ -338,12 +775,52 @@ static int getfirst (TTree *tree, const Charset *follow, Charset *firstset) {
     }
     case TBehind: {  /* instruction gives no new information */
       /* call 'getfirst' only to check for math-time captures */
-      int e = getfirst(sib1(tree), follow, firstset);
-      loopset(i, firstset->cs[i] = follow->cs[i]);  /* uses follow */
+      int e = getfirst(memo, sib1(tree), follow, firstset);
+      if (!(e & 2))  /* rosie */
+        loopset(i, firstset->cs[i] = follow->cs[i]);  /* uses follow */
       return e | 1;  /* always can accept the empty string */
     }
     default: assert(0); return 0;
   }
+  if (memo != NULL)  /* rosie */
+    return getfirst(memo, tree, follow, firstset);
+  goto tailcall;
+}
+
+
+/* 'firstof', remembered for the full follow set */
+static int getfirst (Memo *memo, TTree *tree, const Charset *follow,
+                     Charset *firstset) {
+  MemoEntry *me = memoentry(memo, tree);
+  int e;
+  if (memo != NULL) memo->runs++;
+  if (me == NULL || (me->busy & MFIRST))
+    return firstof(NULL, tree, follow, firstset);
+  if (follow != fullset) {
+    memo->depth++;
+    e = firstof(memo, tree, follow, firstset);
+    memo->depth--;
+    return e;
+  }
+  if (me->known & MFIRST)
+    memo->runs--;  /* remembered */
+  else {
+    me->busy |= MFIRST;  memo->depth++;
+    me->e = firstof(memo, tree, fullset, &me->first);
+    me->busy &= ~MFIRST;  memo->depth--;
+    me->known |= MFIRST;
+  }
+  *firstset = me->first;
+  return me->e;
+}
+
+
+/*
+** rosie: the first set of a whole pattern; returns 0 when no match can
+** start with a character outside it (nor at the end of the subject)
+*/
+int r_firstset (TTree *tree, Charset *firstset) {
+  return getfirst(NULL, tree, fullset, firstset);
 }
 
 
@@ -351,28 +828,31 @@ static int getfirst (TTree *tree, const Charset *follow, Charset *firstset) {
 ** If 'headfail(tree)' true, then 'tree' can fail only depending on the
 ** next character of the subject.
 */
-static int headfail (TTree *tree) {
+static int headfailof (Memo *memo, TTree *tree) {
  tailcall:
   switch (tree->tag) {
     case TChar: case TSet: case TAny: case TFalse:
       return 1;
     case TTrue: case TRep: case TRunTime: case TNot:
     case TBehind:  case THalt:	/* rosie adds THalt */
+    case TPredicate:		/* rosie */
       return 0;
     case TCapture: case TGrammar: case TRule: case TAnd:
-      tree = sib1(tree); goto tailcall;  /* return headfail(sib1(tree)); */
+      tree = sib1(tree); break;  /* return headfail(sib1(tree)); */
     case TCall:
-      tree = sib2(tree); goto tailcall;  /* return headfail(sib2(tree)); */
+      tree = sib2(tree); break;  /* return headfail(sib2(tree)); */
     case TSeq:
-      if (!nofail(sib2(tree))) return 0;
+      if (!mnofail(memo, sib2(tree))) return 0;
       /* else return headfail(sib1(tree)); */
-      tree = sib1(tree); goto tailcall;
+      tree = sib1(tree); break;
     case TChoice:
-      if (!headfail(sib1(tree))) return 0;
+      if (!mheadfail(memo, sib1(tree))) return 0;
       /* else return headfail(sib2(tree)); */
-      tree = sib2(tree); goto tailcall;
+      tree = sib2(tree); break;
     default: assert(0); return 0;
   }
+  if (memo != NULL) return mheadfail(memo, tree);  /* rosie */
+  goto tailcall;
 }
 
 
@@ -386,9 +866,11 @@ static int needfollow (TTree *tree) {
   switch (tree->tag) {
     case TChar: case TSet: case TAny:
     case TFalse: case TTrue: case TAnd: case TNot: case THalt: /* rosie adds THalt */
-    case TRunTime: case TGrammar: case TCall: case TBehind:
+    case TRunTime: case TGrammar: case TBehind:
+    case TPredicate:		/* rosie */
       return 0;
     case TChoice: case TRep:
+    case TCall:  /* rosie: its rule may be inlined (see 'codecall') */
       return 1;
     case TCapture:
       tree = sib1(tree); goto tailcall;
@@ -414,16 +896,38 @@ static int needfollow (TTree *tree) {
 */
 int sizei (const Instruction *i) {
   switch((Opcode)i->i.code) {
-    case ISet: case ISpan: return CHARSETINSTSIZE;
-    case ITestSet: return CHARSETINSTSIZE + 1;
+    case ISet: case ISpan: return 2;		/* rosie: see lpvm.h */
+    case ITestSet: return 2 + longjump(i);	/* rosie */
+    case ICharset: return CHARSETINSTSIZE;	/* rosie */
+    case IClasses: return CLASSINSTSIZE;	/* rosie */
+    case IDfa: return DFAINSTSIZE;		/* rosie */
+    case IPredicate: return 3;			/* rosie: offset and length */
     case ITestChar: case ITestAny: case IChoice: case IJmp: case ICall:
-    case IOpenCall: case ICommit: case IPartialCommit: case IBackCommit:
+    case ICommit: case IPartialCommit: case IBackCommit:
+      return 1 + longjump(i);			/* rosie */
+    case IOpenCall:
       return 2;
+    case IFullCapture: case IOpenCapture:
+      return 1 + widekey(i);			/* rosie */
     default: return 1;
   }
 }
 
 
+/*
+** rosie: with 'count', the counts of the code of a profiled pattern (see
+** rprof.h), to be added to the 'weight' of the alternatives that code
+** is for; without it, the weights to order alternatives by (see
+** 'orderalts').  Both are by place in the tree compiled.
+*/
+typedef struct rOrder {
+  const uint64_t *count;
+  int ncount;
+  uint64_t *weight;
+  int reordered;  /* choices whose alternatives were reordered */
+} rOrder;
+
+
 /*
 ** state for the compiler
 */
@@ -431,6 +935,19 @@ typedef struct CompileState {
   Pattern *p;  /* pattern being compiled */
   int ncode;  /* next position in p->code to be filled */
   lua_State *L;
+  TTree *root;  /* rosie: tree being compiled */
+  byte *dfamark;  /* rosie: which subtrees of 'root' get a DFA */
+  int nodfa;  /* rosie: inside a DFA region (or its stand-alone code)? */
+  int nocap;  /* rosie: leave captures out? */
+  Memo *memo;  /* rosie: results of the analyses of 'root' */
+  const byte *inlinable;  /* rosie: rules of the grammar being coded */
+  int inlinebudget;  /* rosie: tree nodes that may still be inlined */
+  rOrder *order;  /* rosie: counting the runs of alternatives? */
+  const int *origin;  /* rosie: see 'leftfactor' */
+  struct SetEntry *sets;  /* rosie: pool of charsets (see 'addsetref') */
+  int nsets;  /* rosie: number of charsets in the pool */
+  int maxsets;  /* rosie: room in the pool */
+  int setsidx;  /* rosie: stack index of the pool */
 } CompileState;
 
 
@@ -444,6 +961,8 @@ typedef struct CompileState {
 static void codegen (CompileState *compst, TTree *tree, int opt, int tt,
                      const Charset *fl);
 
+static void peephole (CompileState *compst);
+
 
 void realloccode (lua_State *L, Pattern *p, int nsize) {
   void *ud;
@@ -459,8 +978,11 @@ void realloccode (lua_State *L, Pattern *p, int nsize) {
 
 static int nextinstruction (CompileState *compst) {
   int size = compst->p->codesize;
-  if (compst->ncode >= size)
+  if (compst->ncode >= size) {
+    if (size >= MAXPATTSIZE)  /* rosie */
+      luaL_error(compst->L, "pattern code too large");
     realloccode(compst->L, compst->p, size * 2);
+  }
   return compst->ncode++;
 }
 
@@ -472,6 +994,7 @@ static int addinstruction (CompileState *compst, Opcode op, int aux) {
   int i = nextinstruction(compst);
   getinstr(compst, i).i.code = op;
   getinstr(compst, i).i.aux = aux;
+  getinstr(compst, i).i.key = 0;  /* rosie: part of the code's fingerprint */
   return i;
 }
 
@@ -482,7 +1005,7 @@ static int addinstruction (CompileState *compst, Opcode op, int aux) {
 static int addoffsetinst (CompileState *compst, Opcode op) {
   int i = addinstruction(compst, op, 0);  /* instruction */
   addinstruction(compst, (Opcode)0, 0);  /* open space for offset */
-  assert(op == ITestSet || sizei(&getinstr(compst, i)) == 2);
+  assert(op == ITestSet || op == IPredicate || sizei(&getinstr(compst, i)) == 2);
   return i;
 }
 
@@ -504,14 +1027,19 @@ static void setoffset (CompileState *compst, int instruction, int offset) {
 static int addinstcap (CompileState *compst, Opcode op, int cap, int key,
                        int aux) {
   int i = addinstruction(compst, op, joinkindoff(cap, aux));
-  getinstr(compst, i).i.key = key;
+  if (key > SHRT_MAX) {  /* rosie: a wide key (see lpvm.h) */
+    int k = addinstruction(compst, (Opcode)0, 0);
+    getinstr(compst, i).i.key = -1;
+    getinstr(compst, k).offset = key;
+  }
+  else getinstr(compst, i).i.key = key;
   return i;
 }
 
 
 #define gethere(compst) 	((compst)->ncode)
 
-#define target(code,i)		((i) + code[i + 1].offset)
+#define target(code,i)		((i) + getoffset(&(code)[i]))
 
 
 /*
@@ -545,18 +1073,122 @@ static void codechar (CompileState *compst, int c, int tt) {
 
 
 /*
-** Add a charset posfix to an instruction
+** {======================================================
+** rosie: pool of charsets
+** =======================================================
 */
-static void addcharset (CompileState *compst, const byte *cs) {
-  int p = gethere(compst);
-  int i;
-  for (i = 0; i < (int)CHARSETINSTSIZE - 1; i++)
-    nextinstruction(compst);  /* space for buffer */
-  /* fill buffer with charset */
-  loopset(j, getinstr(compst, p).buff[j] = cs[j]);
+
+/*
+** Each distinct charset of the code is kept once, in a pool at the end
+** of the code (see lpvm.h).  While the code is generated, a set
+** instruction refers to its charset by its index in the pool, which is
+** a userdata on the stack (at 'setsidx') until 'addsetpool' puts it in
+** the code.
+*/
+typedef struct SetEntry {
+  Charset cs;
+  unsigned int hash;  /* to compare charsets quickly */
+  int place;  /* of its entry in the code */
+  int mask;  /* its bit in an IClasses table, or 0 */
+} SetEntry;
+
+
+static void newsetpool (CompileState *compst) {
+  compst->nsets = 0;  compst->maxsets = 8;
+  compst->sets = (SetEntry *)lua_newuserdata(compst->L,
+                                             8 * sizeof(SetEntry));
+  compst->setsidx = lua_gettop(compst->L);
+}
+
+
+/*
+** Add the reference to charset 'cs' to the instruction being coded,
+** adding 'cs' to the pool if it is not there yet
+*/
+static void addsetref (CompileState *compst, const byte *cs) {
+  unsigned int h = 0;
+  int i, k;
+  loopset(j, h = h * 31 + cs[j]);
+  for (k = 0; k < compst->nsets; k++)
+    if (compst->sets[k].hash == h && cs_equal(compst->sets[k].cs.cs, cs))
+      break;
+  if (k == compst->nsets) {  /* a new charset? */
+    if (k == compst->maxsets) {  /* pool is full? */
+      SetEntry *ns = (SetEntry *)lua_newuserdata(compst->L,
+                                                 2 * k * sizeof(SetEntry));
+      memcpy(ns, compst->sets, k * sizeof(SetEntry));
+      lua_replace(compst->L, compst->setsidx);
+      compst->sets = ns;  compst->maxsets = 2 * k;
+    }
+    loopset(j, compst->sets[k].cs.cs[j] = cs[j]);
+    compst->sets[k].hash = h;
+    compst->nsets++;
+  }
+  i = addinstruction(compst, (Opcode)0, 0);
+  getinstr(compst, i).offset = k;
 }
 
 
+/*
+** Put the pool after the code (which ends with its IEnd), and turn the
+** index in each reference into the offset to its entry.  The charsets
+** go 8 to an IClasses table of 256 bytes, which takes the room of 8
+** bitmaps, so that the sets of a large grammar share a few lines of
+** cache; the last ones, short of 8, get an ICharset each.  (Defining
+** R_NOCLASSES keeps all of them as bitmaps.)
+*/
+static void addsetpool (CompileState *compst) {
+  Instruction *code;
+  int ntables = 0;
+  int first = compst->ncode;
+  int k, i;
+#if !defined(R_NOCLASSES)
+  ntables = compst->nsets / 8;
+#endif
+  for (k = 0; k < compst->nsets; k++) {
+    SetEntry *se = &compst->sets[k];
+    if (k < 8 * ntables) {
+      int c;
+      if (k % 8 == 0) {  /* starts a new table? */
+        int t = addinstruction(compst, IClasses, 0);
+        for (i = 1; i < (int)CLASSINSTSIZE; i++)
+          addinstruction(compst, (Opcode)0, 0);
+        memset(&getinstr(compst, t + 1), 0,
+               (CLASSINSTSIZE - 1) * sizeof(Instruction));
+      }
+      se->place = compst->ncode - CLASSINSTSIZE;
+      se->mask = 1 << (k % 8);
+      for (c = 0; c <= UCHAR_MAX; c++)
+        if (testchar(se->cs.cs, c))
+          getinstr(compst, se->place + 1).buff[c] |= (byte)se->mask;
+    }
+    else {
+      se->place = addinstruction(compst, ICharset, 0);
+      se->mask = 0;
+      for (i = 1; i < (int)CHARSETINSTSIZE; i++)
+        addinstruction(compst, (Opcode)0, 0);
+      loopset(j, getinstr(compst, se->place + 1).buff[j] = se->cs.cs[j]);
+    }
+  }
+  code = compst->p->code;
+  for (i = 0; i < first; i += sizei(&code[i])) {
+    switch ((Opcode)code[i].i.code) {
+      case ISet: case ITestSet: case ISpan: {
+        int r = setslot(&code[i]);
+        SetEntry *se = &compst->sets[code[i + r].offset];
+        code[i].i.aux = se->mask;
+        code[i + r].offset = se->place - i;
+        break;
+      }
+      default: break;
+    }
+  }
+}
+
+/* }====================================================== */
+
+
+
 /*
 ** code a char set, optimizing unit sets for IChar, "complete"
 ** sets for IAny, and empty sets for IFail; also use an IAny
@@ -569,11 +1201,11 @@ static void codecharset (CompileState *compst, const byte *cs, int tt) {
     case IChar: codechar(compst, c, tt); break;
     case ISet: {  /* non-trivial set? */
       if (tt >= 0 && getinstr(compst, tt).i.code == ITestSet &&
-          cs_equal(cs, getinstr(compst, tt + 2).buff))
+          cs_equal(cs, compst->sets[getinstr(compst, tt + 2).offset].cs.cs))
         addinstruction(compst, IAny, 0);
       else {
         addinstruction(compst, ISet, 0);
-        addcharset(compst, cs);
+        addsetref(compst, cs);
       }
       break;
     }
@@ -603,7 +1235,7 @@ static int codetestset (CompileState *compst, Charset *cs, int e) {
       }
       case ISet: {
         int i = addoffsetinst(compst, ITestSet);
-        addcharset(compst, cs->cs);
+        addsetref(compst, cs->cs);
         return i;
       }
       default: assert(0); return 0;
@@ -634,8 +1266,10 @@ static int finallabel (Instruction *code, int i) {
 ** <behind(p)> == behind n; <p>   (where n = fixedlen(p))
 */
 static void codebehind (CompileState *compst, TTree *tree) {
-  if (tree->u.n > 0)
-    addinstruction(compst, IBehind, tree->u.n);
+  if (tree->u.n > 0) {
+    int i = addinstruction(compst, IBehind, 0);
+    getinstr(compst, i).i.key = tree->u.n;  /* rosie */
+  }
   codegen(compst, sib1(tree), 0, NOINST, fullset);
 }
 
@@ -656,9 +1290,10 @@ static void codechoice (CompileState *compst, TTree *p1, TTree *p2, int opt,
   int haltp2 = (p2->tag == THalt);
   int emptyp2 = (p2->tag == TTrue);
   Charset cs1, cs2;
-  int e1 = getfirst(p1, fullset, &cs1);
-  if (!haltp2 && (headfail(p1) ||
-		  (!e1 && (getfirst(p2, fl, &cs2), cs_disjoint(&cs1, &cs2))))) {
+  Memo *memo = compst->memo;
+  int e1 = getfirst(memo, p1, fullset, &cs1);
+  if (!haltp2 && (mheadfail(memo, p1) ||
+		  (!e1 && (getfirst(memo, p2, fl, &cs2), cs_disjoint(&cs1, &cs2))))) {
     /* <p1 / p2> == test (fail(p1)) -> L1 ; p1 ; jmp L2; L1: p2; L2: */
     int test = codetestset(compst, &cs1, 0);
     int jmp = NOINST;
@@ -696,11 +1331,13 @@ static void codechoice (CompileState *compst, TTree *p1, TTree *p2, int opt,
 ** (valid only when 'p' has no captures)
 */
 static void codeand (CompileState *compst, TTree *tree, int tt) {
-  int n = fixedlen(tree);
-  if (n >= 0 && n <= MAXBEHIND && !hascaptures(tree)) {
+  int n = mfixedlen(compst->memo, tree);
+  if (n >= 0 && n <= MAXBEHIND && !mcaptures(compst->memo, tree)) {
     codegen(compst, tree, 0, tt, fullset);
-    if (n > 0)
-      addinstruction(compst, IBehind, n);
+    if (n > 0) {
+      int i = addinstruction(compst, IBehind, 0);
+      getinstr(compst, i).i.key = n;  /* rosie */
+    }
   }
   else {  /* default: Choice L1; p1; BackCommit L2; L1: Fail; L2: */
     int pcommit;
@@ -721,8 +1358,8 @@ static void codeand (CompileState *compst, TTree *tree, int tt) {
 */
 static void codecapture (CompileState *compst, TTree *tree, int tt,
                          const Charset *fl) {
-  int len = fixedlen(sib1(tree));
-  if (len >= 0 && len <= MAXOFF && !hascaptures(sib1(tree))) {
+  int len = mfixedlen(compst->memo, sib1(tree));
+  if (len >= 0 && len <= MAXOFF && !mcaptures(compst->memo, sib1(tree))) {
     codegen(compst, sib1(tree), 0, tt, fl);
     addinstcap(compst, IFullCapture, tree->cap, tree->key, len);
   }
@@ -741,6 +1378,45 @@ static void coderuntime (CompileState *compst, TTree *tree, int tt) {
 }
 
 
+/*
+** rosie: add predicate 'id' with the length 'len' of its body (or -1)
+*/
+static int addpredicate (CompileState *compst, int id, int len) {
+  int pred = addoffsetinst(compst, IPredicate);
+  int i = addinstruction(compst, (Opcode)0, 0);
+  getinstr(compst, pred).i.aux = id;
+  getinstr(compst, i).offset = len;
+  return pred;
+}
+
+
+/*
+** Native predicate (rosie): the predicate needs the position where
+** its body started. When the body has a fixed length 'n', that is
+** just 'n' characters behind the current position:
+**   <p>; predicate(n) L1; L1:
+** otherwise the body runs inside a choice, whose entry saves it:
+**   choice L1; <p>; predicate L2; L1: fail; L2:
+*/
+static void codepredicate (CompileState *compst, TTree *tree, int tt) {
+  int n = mfixedlen(compst->memo, sib1(tree));
+  int pred;
+  if (n >= 0 && n <= MAXBEHIND) {
+    codegen(compst, sib1(tree), 0, tt, fullset);
+    pred = addpredicate(compst, tree->u.n, n);
+    jumptohere(compst, pred);
+  }
+  else {
+    int pchoice = addoffsetinst(compst, IChoice);
+    codegen(compst, sib1(tree), 0, tt, fullset);
+    pred = addpredicate(compst, tree->u.n, -1);  /* start is in the stack */
+    jumptohere(compst, pchoice);
+    addinstruction(compst, IFail, 0);
+    jumptohere(compst, pred);
+  }
+}
+
+
 /*
 ** Repetion; optimizations:
 ** When pattern is a charset, can use special instruction ISpan.
@@ -756,11 +1432,11 @@ static void coderep (CompileState *compst, TTree *tree, int opt,
   Charset st;
   if (tocharset(tree, &st)) {
     addinstruction(compst, ISpan, 0);
-    addcharset(compst, st.cs);
+    addsetref(compst, st.cs);
   }
   else {
-    int e1 = getfirst(tree, fullset, &st);
-    if (headfail(tree) || (!e1 && cs_disjoint(&st, fl))) {
+    int e1 = getfirst(compst->memo, tree, fullset, &st);
+    if (mheadfail(compst->memo, tree) || (!e1 && cs_disjoint(&st, fl))) {
       /* L1: test (fail(p1)) -> L2; <p>; jmp L1; L2: */
       int jmp;
       int test = codetestset(compst, &st, 0);
@@ -799,9 +1475,9 @@ static void coderep (CompileState *compst, TTree *tree, int opt,
 */
 static void codenot (CompileState *compst, TTree *tree) {
   Charset st;
-  int e = getfirst(tree, fullset, &st);
+  int e = getfirst(compst->memo, tree, fullset, &st);
   int test = codetestset(compst, &st, e);
-  if (headfail(tree))  /* test (fail(p1)) -> L1; fail; L1:  */
+  if (mheadfail(compst->memo, tree))  /* test (fail(p1)) -> L1; fail; L1:  */
     addinstruction(compst, IFail, 0);
   else {
     /* test(fail(p))-> L1; choice L1; <p>; failtwice; L1:  */
@@ -824,13 +1500,14 @@ static void correctcalls (CompileState *compst, int *positions,
   Instruction *code = compst->p->code;
   for (i = from; i < to; i += sizei(&code[i])) {
     if (code[i].i.code == IOpenCall) {
-      int n = code[i].i.key;  /* rule number */
+      int n = code[i + 1].offset;  /* rule number (rosie: in a word) */
       int rule = positions[n];  /* rule position */
       assert(rule == from || code[rule - 1].i.code == IRet);
       if (code[finaltarget(code, i + 2)].i.code == IRet)  /* call; ret ? */
         code[i].i.code = IJmp;  /* tail call */
       else
         code[i].i.code = ICall;
+      code[i].i.key = 0;  /* rosie: its offset is in the next word */
       jumptothere(compst, i, rule);  /* call jumps to respective rule */
     }
   }
@@ -838,33 +1515,180 @@ static void correctcalls (CompileState *compst, int *positions,
 }
 
 
+/*
+** rosie: whether 'rule' can be reached through the calls in 't';
+** 'seen' marks the rules of its grammar already looked at
+*/
+static int reaches (TTree *t, TTree *rule, byte *seen) {
+ tailcall:
+  switch (t->tag) {
+    case TGrammar: return 0;  /* its calls stay inside it */
+    case TCall: {
+      TTree *r = sib2(t);
+      if (r == rule) return 1;
+      if (seen[r->cap]) return 0;
+      seen[r->cap] = 1;
+      t = sib1(r); goto tailcall;
+    }
+    default: break;
+  }
+  switch (numsiblings[t->tag]) {
+    case 1:
+      t = sib1(t); goto tailcall;
+    case 2:
+      if (reaches(sib1(t), rule, seen)) return 1;
+      t = sib2(t); goto tailcall;
+    default: return 0;
+  }
+}
+
+
+/*
+** rosie: mark in 'inlinable' the rules of 'grammar' whose body is
+** small and cannot reach the rule again, so that their calls can be
+** replaced by their bodies ('seen' has room for a mark for each rule)
+*/
+static void markinlinable (TTree *grammar, byte *inlinable, byte *seen) {
+  TTree *rule;
+  for (rule = sib1(grammar); rule->tag == TRule; rule = sib2(rule)) {
+    inlinable[rule->cap] = 0;
+    if (rule->u.ps - 1 <= R_INLINESIZE) {
+      memset(seen, 0, grammar->u.n);
+      inlinable[rule->cap] = !reaches(sib1(rule), rule, seen);
+    }
+  }
+}
+
+
+/*
+** rosie: add to the follow sets of the rules called in 't' what may
+** follow their calls, given that 'fl' may follow 't'.  Sets '*changed'
+** when a set grows.
+*/
+static void followcalls (Memo *memo, TTree *t, const Charset *fl,
+                         Charset *follow, int *changed) {
+ tailcall:
+  switch (t->tag) {
+    case TSeq: {
+      Charset fl1;
+      getfirst(memo, sib2(t), fl, &fl1);
+      followcalls(memo, sib1(t), &fl1, follow, changed);
+      t = sib2(t); goto tailcall;
+    }
+    case TChoice:
+      followcalls(memo, sib1(t), fl, follow, changed);
+      t = sib2(t); goto tailcall;
+    case TRep: {  /* another round, or what follows the repetition */
+      Charset fl1;
+      getfirst(memo, t, fl, &fl1);
+      followcalls(memo, sib1(t), &fl1, follow, changed);
+      return;
+    }
+    case TCapture:
+      t = sib1(t); goto tailcall;
+    case TNot: case TAnd: case TBehind: case TRunTime: case TPredicate:
+      fl = fullset;  /* the match goes on from elsewhere */
+      t = sib1(t); goto tailcall;
+    case TCall: {
+      Charset *f = &follow[sib2(t)->cap];
+      loopset(i, if (fl->cs[i] & ~f->cs[i]) {
+        f->cs[i] |= fl->cs[i];  *changed = 1;
+      });
+      return;
+    }
+    default: return;  /* a nested grammar has its own follow sets */
+  }
+}
+
+
+/*
+** rosie: fill 'follow' with the follow sets of the rules of 'grammar',
+** indexed by rule number.  What may follow a rule is what may
+** follow any of its calls, so the sets are found by a fixpoint over the
+** rule bodies; the initial rule may be followed by anything.  When
+** there is no fixpoint after FOLLOWPASSES passes, all sets are full.
+*/
+
+#define FOLLOWPASSES	100
+
+static void rulefollows (CompileState *compst, TTree *grammar,
+                         Charset *follow) {
+  int n = grammar->u.n;
+  TTree *rule;
+  int changed, passes = 0;
+  memset(follow, 0, n * sizeof(Charset));
+  follow[sib1(grammar)->cap] = *fullset;
+  do {
+    changed = 0;
+    for (rule = sib1(grammar); rule->tag == TRule; rule = sib2(rule))
+      followcalls(compst->memo, sib1(rule), &follow[rule->cap], follow,
+                  &changed);
+  } while (changed && ++passes < FOLLOWPASSES);
+  if (changed) {
+    int i;
+    for (i = 0; i < n; i++) follow[i] = *fullset;
+  }
+}
+
+
 /*
 ** Code for a grammar:
 ** call L1; jmp L2; L1: rule 1; ret; rule 2; ret; ...; L2:
+** rosie: each rule is coded with its follow set (see 'rulefollows');
+** the tables by rule number are in a userdata, sized for the grammar
 */
 static void codegrammar (CompileState *compst, TTree *grammar) {
-  int positions[MAXRULES];
+  int n = grammar->u.n;
+  int *positions;
+  byte *inlinable;
+  const byte *outer = compst->inlinable;
+  Charset *follow;
   int rulenumber = 0;
   TTree *rule;
   int firstcall = addoffsetinst(compst, ICall);  /* call initial rule */
   int jumptoend = addoffsetinst(compst, IJmp);  /* jump to the end */
   int start = gethere(compst);  /* here starts the initial rule */
   jumptohere(compst, firstcall);
+  luaL_checkstack(compst->L, 1, "grammars nested too deeply");
+  follow = (Charset *)lua_newuserdata(compst->L,
+                         n * (sizeof(Charset) + sizeof(int) + 2));
+  positions = (int *)(follow + n);
+  inlinable = (byte *)(positions + n);
+  rulefollows(compst, grammar, follow);  /* rosie */
+  markinlinable(grammar, inlinable, inlinable + n);  /* rosie */
+  compst->inlinable = inlinable;
   for (rule = sib1(grammar); rule->tag == TRule; rule = sib2(rule)) {
     positions[rulenumber++] = gethere(compst);  /* save rule position */
-    codegen(compst, sib1(rule), 0, NOINST, fullset);  /* code rule */
+    codegen(compst, sib1(rule), 0, NOINST, &follow[rule->cap]);
     addinstruction(compst, IRet, 0);
   }
   assert(rule->tag == TTrue);
+  compst->inlinable = outer;
   jumptohere(compst, jumptoend);
   correctcalls(compst, positions, start, gethere(compst));
+  lua_pop(compst->L, 1);  /* tables by rule number */
 }
 
 
-static void codecall (CompileState *compst, TTree *call) {
-  int c = addoffsetinst(compst, IOpenCall);  /* to be corrected later */
-  getinstr(compst, c).i.key = sib2(call)->cap;  /* rule number */
-  assert(sib2(call)->tag == TRule);
+/*
+** rosie: a call to a rule marked by 'markinlinable' is coded as the
+** body of the rule, in place, while the budget for code growth lasts;
+** the code after it can then use its tests and follow sets
+*/
+static void codecall (CompileState *compst, TTree *call, int opt, int tt,
+                      const Charset *fl) {
+  TTree *rule = sib2(call);
+  int size = rule->u.ps - 1;  /* of its body */
+  assert(rule->tag == TRule);
+  if (compst->inlinable != NULL && compst->inlinable[rule->cap] &&
+      size <= compst->inlinebudget) {
+    compst->inlinebudget -= size;
+    codegen(compst, sib1(rule), opt, tt, fl);
+  }
+  else {
+    int c = addoffsetinst(compst, IOpenCall);  /* to be corrected later */
+    getinstr(compst, c + 1).offset = rule->cap;  /* rosie: rule number */
+  }
 }
 
 
@@ -877,17 +1701,185 @@ static int codeseq1 (CompileState *compst, TTree *p1, TTree *p2,
                      int tt, const Charset *fl) {
   if (needfollow(p1)) {
     Charset fl1;
-    getfirst(p2, fl, &fl1);  /* p1 follow is p2 first */
+    getfirst(compst->memo, p2, fl, &fl1);  /* p1 follow is p2 first */
     codegen(compst, p1, 0, tt, &fl1);
   }
   else  /* use 'fullset' as follow */
     codegen(compst, p1, 0, tt, fullset);
-  if (fixedlen(p1) != 0)  /* can 'p1' consume anything? */
+  if (mfixedlen(compst->memo, p1) != 0)  /* can 'p1' consume anything? */
     return  NOINST;  /* invalidate test */
   else return tt;  /* else 'tt' still protects sib2 */
 }
 
 
+/*
+** rosie: the walks below go over trees as deep as a user makes them, so
+** they keep the subtrees still to be seen in a stack of their own.  It
+** starts in 'local'; when that is full, it moves to a userdata at the
+** top of the Lua stack, which 'walkend' removes.
+*/
+typedef struct Walk {
+  lua_State *L;
+  TTree **s;
+  int n, size;
+  TTree *local[32];
+} Walk;
+
+
+static void walkinit (Walk *w, lua_State *L) {
+  w->L = L;
+  w->s = w->local;
+  w->n = 0;
+  w->size = sizeof(w->local) / sizeof(w->local[0]);
+}
+
+
+static void walkpush (Walk *w, TTree *t) {
+  if (w->n == w->size) {
+    TTree **ns = (TTree **)lua_newuserdata(w->L,
+                                           2 * w->size * sizeof(TTree *));
+    memcpy(ns, w->s, w->n * sizeof(TTree *));
+    if (w->s != w->local) lua_replace(w->L, -2);  /* free the old one */
+    w->s = ns;
+    w->size *= 2;
+  }
+  w->s[w->n++] = t;
+}
+
+
+static void walkend (Walk *w) {
+  if (w->s != w->local) lua_pop(w->L, 1);
+}
+
+
+/*
+** rosie: a subtree made only of characters, sets, sequences, choices
+** and repetitions can run as a DFA (see rdfa.h).  Mark in 'mark' the
+** ones worth it: large enough, and with a choice or a repetition that
+** is not a simple span.  For each node seen (from the 'n' nodes of the
+** tree array at 'root'), 'size' gets its size in nodes, or -1 if it
+** cannot run as a DFA, and 'worth' whether it has such a choice or
+** repetition; a node is seen again, to set these, after its siblings.
+** When 'nocap', captures are left out of the code, so they do not keep
+** a subtree from running as a DFA.
+*/
+static void markdfa (lua_State *L, TTree *root, int n, byte *mark,
+                     int nocap) {
+  int *size = (int *)lua_newuserdata(L, n * (sizeof(int) + 2));
+  byte *worth = (byte *)(size + n);
+  byte *seen = worth + n;
+  Walk w;
+  memset(seen, 0, n);
+  walkinit(&w, L);
+  walkpush(&w, root);
+  while (w.n > 0) {
+    TTree *t = w.s[w.n - 1];
+    int i = (int)(t - root);
+    int ns = (t->tag == TCall) ? 0 : numsiblings[t->tag];
+    int sz, wt;
+    if (!seen[i]) {  /* first see its siblings */
+      seen[i] = 1;
+      if (ns == 2) walkpush(&w, sib2(t));
+      if (ns >= 1) walkpush(&w, sib1(t));
+      continue;
+    }
+    w.n--;
+    switch (t->tag) {
+      case TChar: case TSet: case TAny: case TTrue: case TFalse:
+        sz = 1;  wt = 0;
+        break;
+      case TCapture:
+        if (!nocap) goto other;
+        sz = size[i + 1];  wt = worth[i + 1];
+        if (sz >= 0) sz++;
+        break;
+      case TRep:
+        sz = size[i + 1];
+        wt = worth[i + 1] || (sib1(t)->tag != TSet && sib1(t)->tag != TChar &&
+                              sib1(t)->tag != TAny);
+        if (sz >= 0) sz++;
+        break;
+      case TSeq: case TChoice: {
+        int i2 = (int)(sib2(t) - root);
+        wt = worth[i + 1] || worth[i2] || t->tag == TChoice;
+        sz = (size[i + 1] < 0 || size[i2] < 0) ? -1
+             : size[i + 1] + size[i2] + 1;
+        break;
+      }
+      default: other:  /* (a call's rule is marked as part of its grammar) */
+        sz = -1;  wt = 0;
+        break;
+    }
+    size[i] = sz;  worth[i] = wt;
+    if (sz >= R_DFAMINSIZE && wt) mark[i] = 1;
+  }
+  walkend(&w);
+  lua_pop(L, 1);  /* sizes */
+}
+
+
+/* rosie: number of nodes in the tree array holding 'tree' */
+static int treeextent (lua_State *L, TTree *tree, TTree *root) {
+  int n = 0;
+  Walk w;
+  walkinit(&w, L);
+  walkpush(&w, tree);
+  while (w.n > 0) {
+    TTree *t = w.s[--w.n];
+    for (;;) {  /* down its first siblings */
+      if ((int)(t - root) + 1 > n) n = (int)(t - root) + 1;
+      if (t->tag == TCall || numsiblings[t->tag] == 0) break;
+      if (numsiblings[t->tag] == 2) walkpush(&w, sib2(t));
+      t = sib1(t);
+    }
+  }
+  walkend(&w);
+  return n;
+}
+
+
+/*
+** rosie: code for a region that runs as a DFA:
+**   dfa L; <code for the region>; L:
+** The DFA is built from the region compiled alone, with no context.
+** Without memory for the DFA, only the ordinary code is generated.
+*/
+static void codedfa (CompileState *compst, TTree *tree, int opt, int tt,
+                     const Charset *fl) {
+  Pattern sub;
+  CompileState subst;
+  rDfa *dfa;
+  int idfa = NOINST;
+  sub.code = NULL;  sub.codesize = 0;  sub.jit = NULL;
+  subst.p = &sub;  subst.ncode = 0;  subst.L = compst->L;
+  subst.root = compst->root;  subst.dfamark = NULL;
+  subst.nodfa = 1;  subst.nocap = compst->nocap;  subst.memo = compst->memo;
+  subst.inlinable = NULL;  subst.inlinebudget = 0;  /* no calls in a DFA */
+  subst.order = NULL;  subst.origin = NULL;
+  newsetpool(&subst);
+  realloccode(compst->L, &sub, 2);
+  codegen(&subst, tree, 0, NOINST, fullset);
+  addinstruction(&subst, IEnd, 0);
+  peephole(&subst);
+  addsetpool(&subst);
+  dfa = r_dfanew(sub.code, subst.ncode);
+  realloccode(compst->L, &sub, 0);
+  lua_pop(compst->L, 1);  /* pool */
+  if (dfa != NULL) {
+    int k;
+    idfa = addinstruction(compst, IDfa, 0);
+    addinstruction(compst, (Opcode)0, 0);  /* offset */
+    for (k = 2; k < DFAINSTSIZE; k++)
+      addinstruction(compst, (Opcode)0, 0);  /* the DFA */
+    r_setdfa(&getinstr(compst, idfa), dfa);
+  }
+  compst->nodfa++;
+  codegen(compst, tree, opt, tt, fl);
+  compst->nodfa--;
+  if (dfa != NULL) jumptohere(compst, idfa);
+}
+
+
 /*
 ** Main code-generation function: dispatch to auxiliar functions
 ** according to kind of tree. ('needfollow' should return true
@@ -896,6 +1888,17 @@ static int codeseq1 (CompileState *compst, TTree *p1, TTree *p2,
 static void codegen (CompileState *compst, TTree *tree, int opt, int tt,
                      const Charset *fl) {
  tailcall:
+  if (compst->order != NULL) {  /* rosie: count the runs of this code */
+    rOrder *o = compst->order;
+    int i = (int)(tree - compst->root);
+    if (compst->origin != NULL) i = compst->origin[i] - 1;
+    if (i >= 0 && compst->ncode < o->ncount)
+      o->weight[i] += o->count[compst->ncode];
+  }
+  if (!compst->nodfa && compst->dfamark[tree - compst->root]) {  /* rosie */
+    codedfa(compst, tree, opt, tt, fl);
+    return;
+  }
   switch (tree->tag) {
     case TChar: codechar(compst, tree->u.n, tt); break;
     case TAny: addinstruction(compst, IAny, 0); break;
@@ -908,10 +1911,17 @@ static void codegen (CompileState *compst, TTree *tree, int opt, int tt,
     case TBehind: codebehind(compst, tree); break;
     case TNot: codenot(compst, sib1(tree)); break;
     case TAnd: codeand(compst, sib1(tree), tt); break;
-    case TCapture: codecapture(compst, tree, tt, fl); break;
+    case TCapture: {
+      if (compst->nocap) {  /* rosie */
+        tree = sib1(tree); goto tailcall;
+      }
+      codecapture(compst, tree, tt, fl);
+      break;
+    }
     case TRunTime: coderuntime(compst, tree, tt); break;
+    case TPredicate: codepredicate(compst, tree, tt); break; /* rosie */
     case TGrammar: codegrammar(compst, tree); break;
-    case TCall: codecall(compst, tree); break;
+    case TCall: codecall(compst, tree, opt, tt, fl); break;
     case TSeq: {
       tt = codeseq1(compst, sib1(tree), sib2(tree), tt, fl);  /* code 'p1' */
       /* codegen(compst, p2, opt, tt, fl); */
@@ -939,7 +1949,7 @@ static void peephole (CompileState *compst) {
     switch (code[i].i.code) {
       case IChoice: case ICall: case ICommit: case IPartialCommit:
       case IBackCommit: case ITestChar: case ITestSet:
-      case ITestAny: {  /* instructions with labels */
+      case ITestAny: case IPredicate: case IDfa: {  /* instructions with labels */
         jumptothere(compst, i, finallabel(code, i));  /* optimize label */
         break;
       }
@@ -974,20 +1984,686 @@ static void peephole (CompileState *compst) {
 }
 
 
+/*
+** {======================================================
+** rosie: short jumps
+** =======================================================
+*/
+
+/* can instruction 'p' keep its offset in its 'key'? (see lpvm.h) */
+static int shortens (const Instruction *p) {
+  switch ((Opcode)p->i.code) {
+    case ITestAny: case ITestChar: case ITestSet: case IChoice: case IJmp:
+    case ICall: case ICommit: case IPartialCommit: case IBackCommit:
+      return 1;
+    default: return 0;
+  }
+}
+
+
+/* does 'p' get a word for its offset, with or without 'shortjumps'? */
+static int needsword (const Instruction *p, int shortjumps) {
+  int off = getoffset(p);
+  return !(shortjumps && off != 0 && off >= SHRT_MIN && off <= SHRT_MAX);
+}
+
+
+/* size of instruction 'p' when recoded */
+static int recodedsize (const Instruction *p, int shortjumps) {
+  if (shortens(p))
+    return sizei(p) - longjump(p) + needsword(p, shortjumps);
+  else
+    return sizei(p);
+}
+
+
+/*
+** Recode the code of 'p' with the offset of each jump that fits in the
+** 'key' of its instruction put there, if 'shortjumps', or else with
+** every offset in a word of its own (as the code is generated).  Every
+** label and charset reference is moved with its target.  Moving the
+** offsets of some jumps into their instructions only makes the other
+** jumps shorter, so an offset that fits before still fits after.
+*/
+void r_recode (lua_State *L, Pattern *p, int shortjumps) {
+  Instruction *code = p->code;
+  int n = p->codesize;
+  int *newpos = (int *)lua_newuserdata(L, (n + 1) * sizeof(int));
+  Instruction *nc;
+  int i, j = 0;
+  for (i = 0; i < n; i += sizei(&code[i])) {
+    newpos[i] = j;
+    j += recodedsize(&code[i], shortjumps);
+  }
+  newpos[n] = j;
+  nc = (Instruction *)lua_newuserdata(L, j * sizeof(Instruction));
+  for (i = 0; i < n; i += sizei(&code[i])) {
+    const Instruction *op = &code[i];
+    Instruction *np = &nc[newpos[i]];
+    Opcode c = (Opcode)op->i.code;
+    if (shortens(op)) {
+      int off = newpos[i + getoffset(op)] - newpos[i];
+      int word = needsword(op, shortjumps);
+      *np = *op;
+      np->i.key = word ? 0 : (short)off;
+      if (word) (np + 1)->offset = off;
+      memcpy(np + 1 + word, op + 1 + longjump(op),
+             (sizei(op) - 1 - longjump(op)) * sizeof(Instruction));
+    }
+    else {
+      memcpy(np, op, sizei(op) * sizeof(Instruction));
+      if (c == IDfa || c == IPredicate)
+        (np + 1)->offset = newpos[i + getoffset(op)] - newpos[i];
+    }
+    if (c == ISet || c == ITestSet || c == ISpan) {
+      int entry = i + (op + setslot(op))->offset;
+      (np + setslot(np))->offset = newpos[entry] - newpos[i];
+    }
+  }
+  realloccode(L, p, j);
+  memcpy(p->code, nc, j * sizeof(Instruction));
+  lua_pop(L, 2);
+}
+
+
+/*
+** Put in 'place' the place that each instruction of 'code' (of 'n'
+** words) has in it with every offset in a word of its own; return the
+** size of that code.  (The counts of a profile of the code, by those
+** places, are those of the code as generated.)
+*/
+int r_longplaces (const Instruction *code, int n, int *place) {
+  int i, j = 0;
+  for (i = 0; i < n; i += sizei(&code[i])) {
+    place[i] = j;
+    j += recodedsize(&code[i], 0);
+  }
+  return j;
+}
+
+/* }====================================================== */
+
+
+/*
+** {======================================================
+** rosie: left factoring of choices
+** =======================================================
+*/
+
+/*
+** Before it is compiled, a tree is copied with the first steps that
+** consecutive alternatives have in common factored out: 'c p1 / c p2 / q'
+** becomes 'c (p1 / p2) / q', where 'c' is a character, a set, or any
+** character.  Such a 'c' has no captures and matches in one way only,
+** so the copy matches as the tree does, but the prefix is matched once
+** instead of once per alternative (and the inner choice may need no
+** backtracking at all).  Longer prefixes are factored one step at a
+** time.  Only consecutive alternatives are grouped, to keep the order
+** of the choice; alternatives after one that always succeeds once 'c'
+** has matched cannot be reached, and are left out.
+*/
+
+typedef struct Factor {
+  TTree *dst;  /* the copy */
+  int n;  /* its size */
+  TTree **alt;  /* stack of the alternatives being factored */
+  int nalt, maxalt;
+  int changed;  /* factored anything? */
+  TTree *src;  /* rosie: the tree copied */
+  const uint64_t *weight;  /* rosie: see 'orderalts' (or NULL) */
+  int *origin;  /* rosie: see 'leftfactor' (or NULL) */
+  int reordered;
+  lua_State *L;  /* rosie: for the tables of 'factorgrammar' */
+} Factor;
+
+/* the tail of an alternative that is only its first step */
+static TTree truetree = {TTrue, 0, 0, {0}};
+
+static int factorcopy (Factor *f, TTree *t, int d);
+static int rulecopy (Factor *f, TTree *rule, int d);
+
+
+static int leafsize (TTree *t) {
+  return (t->tag == TSet) ? bytes2slots(CHARSETSIZE) + 1 : 1;
+}
+
+
+/* the first step of an alternative, if it can be factored out */
+static TTree *headof (TTree *t) {
+  if (t->tag == TSeq) t = sib1(t);
+  switch (t->tag) {
+    case TChar: case TSet: case TAny: return t;
+    default: return NULL;
+  }
+}
+
+
+/* what an alternative matches after its first step */
+static TTree *tailof (TTree *t) {
+  return (t->tag == TSeq) ? sib2(t) : &truetree;
+}
+
+
+static int samehead (TTree *h1, TTree *h2) {
+  if (h1 == NULL || h2 == NULL || h1->tag != h2->tag) return 0;
+  switch (h1->tag) {
+    case TChar: return (h1->u.n == h2->u.n);
+    case TSet: return cs_equal(treebuffer(h1), treebuffer(h2));
+    default: return 1;  /* TAny */
+  }
+}
+
+
+/* rosie: the place of alternative 't' in the tree copied, or -1 */
+static int altplace (Factor *f, TTree *t) {
+  return (t == &truetree) ? -1 : (int)(t - f->src);
+}
+
+
+/* rosie: the weight of alternative 't' (see 'orderalts') */
+static uint64_t altweight (Factor *f, TTree *t) {
+  int i = altplace(f, t);
+  return (i >= 0) ? f->weight[i] : 0;
+}
+
+
+/*
+** rosie: order the alternatives 'alt[i..e)' by their weights, heaviest
+** first, within each run of them that cannot match the empty string
+** and whose first sets are disjoint: at most one alternative of such a
+** run can match where the choice is tried, so they may be tried in any
+** order.  (First sets are only looked at when the weights are not in
+** order already.)
+*/
+static void orderalts (Factor *f, int i, int e) {
+  int j, k, end;
+  if (f->weight == NULL) return;
+  for (j = i + 1; j < e; j++)
+    if (altweight(f, f->alt[j - 1]) < altweight(f, f->alt[j])) break;
+  if (j == e) return;  /* in order already */
+  for (; i < e; i = end) {
+    Charset seen, cs;
+    int moved = 0;
+    loopset(c, seen.cs[c] = 0);
+    for (end = i; end < e; end++) {
+      TTree *t = f->alt[end];
+      if (altplace(f, t) < 0
+          || getfirst(NULL, t, fullset, &cs) != 0 || !cs_disjoint(&cs, &seen))
+        break;
+      loopset(c, seen.cs[c] |= cs.cs[c]);
+    }
+    if (end == i) {  /* 'alt[i]' cannot be moved */
+      end++;
+      continue;
+    }
+    for (j = i + 1; j < end; j++) {  /* stable insertion sort */
+      TTree *t = f->alt[j];
+      uint64_t w = altweight(f, t);
+      for (k = j; k > i && altweight(f, f->alt[k - 1]) < w; k--)
+        f->alt[k] = f->alt[k - 1];
+      f->alt[k] = t;
+      moved |= (k != j);
+    }
+    if (moved) {
+      f->changed = 1;
+      f->reordered++;
+    }
+  }
+}
+
+
+/* push the alternatives of 't' */
+static void pushalts (Factor *f, TTree *t) {
+  while (t->tag == TChoice) {
+    pushalts(f, sib1(t));
+    t = sib2(t);
+  }
+  assert(f->nalt < f->maxalt);
+  f->alt[f->nalt++] = t;
+}
+
+
+/*
+** Rule calls are copied with their rule numbers; once the rules of
+** their grammar are copied, they get their offsets back.
+*/
+static void fixcalls (TTree *dst, TTree *t, const int *positions) {
+ tailcall:
+  switch (t->tag) {
+    case TGrammar: return;  /* its calls were fixed already */
+    case TCall:
+      t->u.ps = (int)(&dst[positions[t->u.ps]] - t);
+      return;
+    default: break;
+  }
+  switch (numsiblings[t->tag]) {
+    case 1:
+      t = sib1(t); goto tailcall;
+    case 2:
+      fixcalls(dst, sib1(t), positions);
+      t = sib2(t); goto tailcall;
+    default: return;
+  }
+}
+
+
+static int factorgrammar (Factor *f, TTree *g, int d) {
+  int *positions;  /* rosie: by rule number */
+  TTree *rule;
+  int n = d + 1;
+  luaL_checkstack(f->L, 1, "grammars nested too deeply");
+  positions = (int *)lua_newuserdata(f->L, g->u.n * sizeof(int));
+  f->dst[d] = *g;
+  for (rule = sib1(g); rule->tag == TRule; rule = sib2(rule)) {
+    int r = n;
+    f->dst[r] = *rule;
+    positions[rule->cap] = r;
+    n += 1 + rulecopy(f, rule, r + 1);
+    f->dst[r].u.ps = n - r;
+  }
+  assert(rule->tag == TTrue);
+  f->dst[n++] = *rule;
+  for (rule = sib1(&f->dst[d]); rule->tag == TRule; rule = sib2(rule))
+    fixcalls(f->dst, sib1(rule), positions);
+  lua_pop(f->L, 1);
+  return n - d;
+}
+
+
+static int factoralts (Factor *f, int i, int e, int d);
+
+/*
+** Copy into 'd' the choice of alternatives 'alt[i..e)', which all
+** have the same first step.  Returns the size of the copy.
+*/
+static int factorrun (Factor *f, int i, int e, int d) {
+  TTree *h = headof(f->alt[i]);
+  int base = f->nalt;
+  int nh, n;
+  if (e - i == 1) {
+    if (f->origin != NULL)
+      f->origin[d] = altplace(f, f->alt[i]) + 1;
+    return factorcopy(f, f->alt[i], d);
+  }
+  f->changed = 1;
+  for (; i < e; i++) {
+    pushalts(f, tailof(f->alt[i]));
+    if (f->alt[f->nalt - 1]->tag == TTrue)
+      break;  /* the rest cannot be reached */
+  }
+  orderalts(f, base, f->nalt);
+  nh = leafsize(h);
+  if (f->nalt - base == 1 && f->alt[base]->tag == TTrue) {  /* only 'c' */
+    memcpy(&f->dst[d], h, nh * sizeof(TTree));
+    n = nh;
+  }
+  else {  /* c (tail1 / tail2 / ...) */
+    f->dst[d].tag = TSeq;  f->dst[d].cap = 0;  f->dst[d].key = 0;
+    f->dst[d].u.ps = nh + 1;
+    memcpy(&f->dst[d + 1], h, nh * sizeof(TTree));
+    n = 1 + nh + factoralts(f, base, f->nalt, d + 1 + nh);
+  }
+  f->nalt = base;
+  return n;
+}
+
+
+/*
+** Copy into 'd' the choice of alternatives 'alt[i..e)', factoring each
+** run of them with the same first step.  Returns the size of the copy.
+*/
+static int factoralts (Factor *f, int i, int e, int d) {
+  TTree *h = headof(f->alt[i]);
+  int j = i + 1;
+  int n1;
+  while (j < e && samehead(h, headof(f->alt[j])))
+    j++;
+  if (j == e)  /* only one run? */
+    return factorrun(f, i, j, d);
+  f->dst[d].tag = TChoice;  f->dst[d].cap = 0;  f->dst[d].key = 0;
+  n1 = factorrun(f, i, j, d + 1);
+  f->dst[d].u.ps = n1 + 1;
+  return 1 + n1 + factoralts(f, j, e, d + 1 + n1);
+}
+
+
+/* copy 't' into position 'd' of the copy; returns the size of the copy */
+static int factorcopy (Factor *f, TTree *t, int d) {
+  TTree *c = &f->dst[d];
+  int n;
+  switch (t->tag) {
+    case TChoice: {
+      int base = f->nalt;
+      pushalts(f, t);
+      orderalts(f, base, f->nalt);
+      n = factoralts(f, base, f->nalt, d);
+      f->nalt = base;
+      return n;
+    }
+    case TGrammar:
+      return factorgrammar(f, t, d);
+    case TCall:  /* see 'fixcalls' */
+      *c = *t;
+      c->u.ps = sib2(t)->cap;
+      return 1;
+    default: break;
+  }
+  switch (numsiblings[t->tag]) {
+    case 0:
+      n = leafsize(t);
+      assert(d + n <= f->n);
+      memcpy(c, t, n * sizeof(TTree));
+      return n;
+    case 1:
+      *c = *t;
+      return 1 + factorcopy(f, sib1(t), d + 1);
+    default:
+      *c = *t;
+      n = 1 + factorcopy(f, sib1(t), d + 1);
+      c->u.ps = n;
+      return n + factorcopy(f, sib2(t), d + n);
+  }
+}
+
+
+/*
+** rosie: rules that recur only at their right ends are copied as
+** loops.  A rule 'r <- A (X1 r / ... / Xk r / E)', where 'E' cannot
+** fail, matches as 'r <- A (X1 A / ... / Xk A)* E': the call of 'r' in
+** an 'Xi' can fail only where its 'A' does, and then the next
+** alternative is tried where 'Xi' started, as it is when the loop
+** ends.  So a list like 'r <- item ("," r)?' is matched with no stack
+** for its elements.  'A' is copied for each 'Xi', so it must be small
+** (R_INLINESIZE); an 'E' that is only 'true' is left out.
+*/
+
+static TTree *laststep (TTree *t) {
+  while (t->tag == TSeq) t = sib2(t);
+  return t;
+}
+
+
+/* does alternative 't' end with a call of 'rule'? */
+static int callsrule (TTree *t, TTree *rule) {
+  t = laststep(t);
+  return (t->tag == TCall && sib2(t) == rule);
+}
+
+
+/* size of the steps of sequence 't' before its step 'stop' */
+static int stepsize (lua_State *L, TTree *t, TTree *stop) {
+  int n = 0;
+  for (; t != stop; t = sib2(t))
+    n += 1 + treeextent(L, sib1(t), sib1(t));
+  return n;
+}
+
+
+/* can all the steps of sequence 't' before 'stop' match the empty string? */
+static int stepsnullable (TTree *t, TTree *stop) {
+  for (; t != stop; t = sib2(t))
+    if (!nullable(sib1(t))) return 0;
+  return 1;
+}
+
+
+/*
+** When 'rule' is copied as a loop, push the alternatives of 'last', the
+** last step of its body, and return how many of them recur.  Otherwise
+** push nothing and return 0.  (A loop must not match the empty string.)
+*/
+static int loopalts (Factor *f, TTree *rule, TTree *last) {
+  TTree *body = sib1(rule);
+  int base = f->nalt;
+  int k = 0;
+  if (last->tag != TChoice || stepsize(f->L, body, last) > R_INLINESIZE)
+    return 0;
+  pushalts(f, last);
+  while (base + k < f->nalt && callsrule(f->alt[base + k], rule)) {
+    TTree *x = f->alt[base + k];
+    if (stepsnullable(x, laststep(x)) && stepsnullable(body, last))
+      break;
+    k++;
+  }
+  if (base + k == f->nalt || !nofail(f->alt[f->nalt - 1]))
+    k = 0;
+  if (k == 0) f->nalt = base;
+  return k;
+}
+
+
+/*
+** Copy into 'd' the steps of sequence 't' before its step 'stop'.
+** With 'open', something follows them, so the last one is a sequence
+** too.  Returns the size of the copy.
+*/
+static int seqcopy (Factor *f, TTree *t, TTree *stop, int open, int d) {
+  int n = 0;
+  while (t != stop) {
+    TTree *s = sib1(t);
+    t = sib2(t);
+    if (t != stop || open) {  /* s p */
+      TTree *c = &f->dst[d + n];
+      c->tag = TSeq;  c->cap = 0;  c->key = 0;
+      c->u.ps = 1 + factorcopy(f, s, d + n + 1);
+      n += c->u.ps;
+    }
+    else
+      n += factorcopy(f, s, d + n);
+  }
+  return n;
+}
+
+
+/*
+** Copy into 'd' the body of 'rule', as a loop when it can be (see
+** above).  Returns the size of the copy.
+*/
+static int rulecopy (Factor *f, TTree *rule, int d) {
+  TTree *body = sib1(rule);
+  TTree *last = laststep(body);
+  int base = f->nalt;
+  int k = loopalts(f, rule, last);
+  int n, seq, i;  /* 'seq' is where '(...)* E' is, or -1 */
+  if (k == 0)
+    return factorcopy(f, body, d);
+  f->changed = 1;
+  n = seqcopy(f, body, last, 1, d);  /* A */
+  seq = -1;
+  if (f->nalt - base - k > 1 || f->alt[f->nalt - 1]->tag != TTrue) {
+    seq = d + n;
+    f->dst[seq].tag = TSeq;  f->dst[seq].cap = 0;  f->dst[seq].key = 0;
+    n++;
+  }
+  f->dst[d + n].tag = TRep;  f->dst[d + n].cap = 0;  f->dst[d + n].key = 0;
+  n++;
+  for (i = base; i < base + k; i++) {  /* X1 A / ... / Xk A */
+    TTree *x = f->alt[i];
+    int c = d + n;
+    int nx;
+    if (i < base + k - 1) {
+      f->dst[c].tag = TChoice;  f->dst[c].cap = 0;  f->dst[c].key = 0;
+      n++;
+    }
+    nx = seqcopy(f, x, laststep(x), (body != last), d + n);
+    nx += seqcopy(f, body, last, 0, d + n + nx);
+    if (i < base + k - 1) f->dst[c].u.ps = 1 + nx;
+    n += nx;
+  }
+  if (seq >= 0) {
+    f->dst[seq].u.ps = d + n - seq;
+    orderalts(f, base + k, f->nalt);
+    n += factoralts(f, base + k, f->nalt, d + n);
+  }
+  f->nalt = base;
+  return n;
+}
+
+
+/* how much larger than 't' its copy may be, for its loops */
+static int loopgrowth (Factor *f, TTree *t) {
+  int n = 0;
+ tailcall:
+  switch (t->tag) {
+    case TCall: return n;
+    case TRule: {
+      TTree *last = laststep(sib1(t));
+      int base = f->nalt;
+      int k = loopalts(f, t, last);
+      f->nalt = base;
+      if (k > 0) {  /* 'A' copied 'k' more times, with its own loops */
+        TTree *s;
+        n += 2 + k * (1 + bytes2slots(CHARSETSIZE)) * stepsize(f->L, sib1(t), last);
+        for (s = sib1(t); s != last; s = sib2(s))
+          n += k * loopgrowth(f, sib1(s));
+      }
+      break;
+    }
+    default: break;
+  }
+  switch (numsiblings[t->tag]) {
+    case 1:
+      t = sib1(t); goto tailcall;
+    case 2:
+      n += loopgrowth(f, sib1(t));
+      t = sib2(t); goto tailcall;
+    default: return n;
+  }
+}
+
+
+/*
+** Push a copy of 'tree' with its choices factored and its loops made,
+** and return it.  The copy is never larger than the tree, but for the
+** loops.  When there is nothing to change, push nil and return 'tree'
+** itself.  rosie: with 'order', the alternatives are ordered by its
+** weights, or, while counting, '*origin' gets where in 'tree' each node
+** of the copy that is an alternative comes from (plus 1; 0 for the other
+** nodes); it is NULL when 'tree' itself is returned.
+*/
+static TTree *leftfactor (lua_State *L, TTree *tree, rOrder *order,
+                          int **origin) {
+  Factor f;
+  size_t size;
+  f.n = treeextent(L, tree, tree) + bytes2slots(CHARSETSIZE);  /* last a set? */
+  f.maxalt = 2 * f.n;  /* each node once, plus a 'truetree' for each leaf */
+  f.alt = (TTree **)lua_newuserdata(L, f.maxalt * sizeof(TTree *));
+  f.nalt = 0;  f.changed = 0;
+  f.src = tree;  f.reordered = 0;  f.L = L;
+  f.weight = (order != NULL && order->count == NULL) ? order->weight : NULL;
+  f.n += loopgrowth(&f, tree);
+  size = f.n * sizeof(TTree);
+  if (order != NULL) size += f.n * sizeof(int);
+  f.dst = (TTree *)lua_newuserdata(L, size);
+  f.origin = (order != NULL) ? (int *)(f.dst + f.n) : NULL;
+  if (f.origin != NULL) memset(f.origin, 0, f.n * sizeof(int));
+  factorcopy(&f, tree, 0);
+  lua_remove(L, -2);  /* alternatives */
+  if (order != NULL) order->reordered = f.reordered;
+  if (origin != NULL) *origin = f.changed ? f.origin : NULL;
+  if (f.changed)
+    return f.dst;
+  lua_pop(L, 1);
+  lua_pushnil(L);
+  return tree;
+}
+
+/* }====================================================== */
+
+
 /*
 ** Compile a pattern
 */
-Instruction *compile (lua_State *L, Pattern *p) {
+/*
+** rosie: compile 'tree' into the code of 'p'; 'nocap' leaves its
+** captures out.  The tree compiled is its factored copy (see
+** 'leftfactor').  With 'order', see 'r_compileorder'.  Returns the
+** number of analyses run (see 'Memo').
+*/
+static lua_Integer compiletree (lua_State *L, Pattern *p, TTree *tree,
+                                int nocap, rOrder *order) {
   CompileState compst;
+  Memo memo;
+  int n;
+  int *origin;
+  tree = leftfactor(L, tree, order, &origin);
+  compst.order = (order != NULL && order->count != NULL) ? order : NULL;
+  compst.origin = origin;
   compst.p = p;  compst.ncode = 0;  compst.L = L;
+  compst.root = tree;  compst.nocap = nocap;
+  n = treeextent(L, tree, tree);
+  compst.dfamark = (byte *)lua_newuserdata(L, n);
+  memset(compst.dfamark, 0, n);
+  memo.root = tree;  memo.n = n;  memo.depth = memo.cuts = 0;
+  memo.runs = 0;
+  memo.entry = (MemoEntry *)lua_newuserdata(L, n * sizeof(MemoEntry));
+  memset(memo.entry, 0, n * sizeof(MemoEntry));
+  compst.memo = &memo;
+  compst.inlinable = NULL;  compst.inlinebudget = n;  /* rosie */
+  compst.nodfa = 0;
+  markdfa(L, tree, n, compst.dfamark, nocap);
+  newsetpool(&compst);
   realloccode(L, p, 2);  /* minimum initial size */
-  codegen(&compst, p->tree, 0, NOINST, fullset);
+  codegen(&compst, tree, 0, NOINST, fullset);
   addinstruction(&compst, IEnd, 0);
-  realloccode(L, p, compst.ncode);  /* set final size */
   peephole(&compst);  
+  addsetpool(&compst);
+  realloccode(L, p, compst.ncode);  /* set final size */
+  r_recode(L, p, 1);  /* rosie */
+  lua_pop(L, 4);  /* factored tree, dfamark, memo, and pool */
+  return memo.runs;
+}
+
+
+Instruction *compile (lua_State *L, Pattern *p) {
+  compiletree(L, p, p->tree, 0, NULL);
+  r_prefilter(p->tree, &p->filter);  /* rosie */
   return p->code;
 }
 
 
+/*
+** rosie: compile into 'twin' (whose code must be empty) the code of
+** 'p' without its captures.  The two programs accept the same subjects
+** and end their matches at the same place, except when a match-time
+** capture could change that, so 'p' must not have one.
+*/
+void compiletwin (lua_State *L, Pattern *p, Pattern *twin) {
+  compiletree(L, twin, p->tree, 1, NULL);
+}
+
+
+/*
+** rosie: compile into 'q' (whose code must be empty) the code of 'p'
+** with the alternatives of its choices ordered by 'weight', and return
+** how many choices were reordered (see 'orderalts'); or, with 'count',
+** compile the code of 'p' as usual, adding to 'weight' the runs counted
+** of the code of each alternative, which are those of its first
+** instruction.  'weight' is by place in the tree of 'p'.
+*/
+int r_compileorder (lua_State *L, Pattern *p, Pattern *q,
+                    const uint64_t *count, int ncount, uint64_t *weight) {
+  rOrder o;
+  o.count = count;  o.ncount = ncount;
+  o.weight = weight;  o.reordered = 0;
+  compiletree(L, q, p->tree, 0, &o);
+  return o.reordered;
+}
+
+
+#if defined(LPEG_DEBUG)
+
+/*
+** rosie: compile into 'q' (whose code must be empty) the code of 'p',
+** as 'compile' does, and return how many analyses of tree nodes that
+** compilation ran rather than found remembered (for the tests)
+*/
+lua_Integer r_compileanalyses (lua_State *L, Pattern *p, Pattern *q) {
+  return compiletree(L, q, p->tree, 0, NULL);
+}
+
+#endif
+
+
 /* }====================================================== */
 
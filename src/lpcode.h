@@ -5,6 +5,8 @@
 #if !defined(lpcode_h)
 #define lpcode_h
 
+#include <stdint.h>
+
 #include "lua.h"
 
 #include "lptypes.h"
@@ -15,9 +17,23 @@ int tocharset (TTree *tree, Charset *cs);
 int checkaux (TTree *tree, int pred);
 int fixedlenx (TTree *tree, int count, int len);
 int hascaptures (TTree *tree);
+void r_prefilter (TTree *tree, rFilter *f);
+int r_prefixrejects (const rFilter *f, const char *s, const char *e);
+int r_filterrejects (const rFilter *f, const char *s, const char *e);
+const char *r_findlit (const char *lit, int len, const char *s,
+                       const char *e);
+int r_firstset (TTree *tree, Charset *firstset);
 int lp_gc (lua_State *L);
 Instruction *compile (lua_State *L, Pattern *p);
+void compiletwin (lua_State *L, Pattern *p, Pattern *twin);
+int r_compileorder (lua_State *L, Pattern *p, Pattern *q,
+                    const uint64_t *count, int ncount, uint64_t *weight);
+#if defined(LPEG_DEBUG)
+lua_Integer r_compileanalyses (lua_State *L, Pattern *p, Pattern *q);
+#endif
 void realloccode (lua_State *L, Pattern *p, int nsize);
+void r_recode (lua_State *L, Pattern *p, int shortjumps);
+int r_longplaces (const Instruction *code, int n, int *place);
 int sizei (const Instruction *i);
 
 
@@ -11,6 +11,7 @@
 #include "lptypes.h"
 #include "lpprint.h"
 #include "lpcode.h"
+#include "rpred.h"
 
 
 #if defined(LPEG_DEBUG)
@@ -48,7 +49,7 @@ static void printcapkind (int kind) {
 
 
 static void printjmp (const Instruction *op, const Instruction *p) {
-  printf("-> %d", (int)(p + (p + 1)->offset - op));
+  printf("-> %d", (int)(p + getoffset(p) - op));
 }
 
 
@@ -60,7 +61,8 @@ void printinst (const Instruction *op, const Instruction *p) {
     "ret", "end",
     "choice", "jmp", "call", "open_call",
     "commit", "partial_commit", "back_commit", "failtwice", "fail", "giveup",
-    "fullcapture", "opencapture", "closecapture", "closeruntime", "halt"
+    "fullcapture", "opencapture", "closecapture", "closeruntime", "halt",
+    "predicate", "dfa", "charset", "classes"
   };
   printf("%02ld: %s ", (long)(p - op), names[p->i.code]);
   switch ((Opcode)p->i.code) {
@@ -74,23 +76,27 @@ void printinst (const Instruction *op, const Instruction *p) {
     }
     case IFullCapture: {
       printcapkind(getkind(p));
-      printf(" (size = %d)  (idx = %d)", getoff(p), p->i.key);
+      printf(" (size = %d)  (idx = %d)", getoff(p), getkey(p));
       break;
     }
     case IOpenCapture: {
       printcapkind(getkind(p));
-      printf(" (idx = %d)", p->i.key);
+      printf(" (idx = %d)", getkey(p));
       break;
     }
-    case ISet: {
-      printcharset((p+1)->buff);
+    case ISet: case ISpan: {	/* rosie: charset is in the pool */
+      byte cs[CHARSETSIZE];
+      r_getcharset(p, cs);
+      printcharset(cs);
       break;
     }
     case ITestSet: {
-      printcharset((p+2)->buff); printjmp(op, p);
+      byte cs[CHARSETSIZE];
+      r_getcharset(p, cs);
+      printcharset(cs); printjmp(op, p);
       break;
     }
-    case ISpan: {
+    case ICharset: {		/* rosie */
       printcharset((p+1)->buff);
       break;
     }
@@ -99,11 +105,17 @@ void printinst (const Instruction *op, const Instruction *p) {
       break;
     }
     case IBehind: {
-      printf("%d", p->i.aux);
+      printf("%d", p->i.key);
+      break;
+    }
+    case IPredicate: {
+      printf("%s (len = %d) ", r_predicates[p->i.aux].name, (p + 2)->offset);
+      printjmp(op, p);
       break;
     }
     case IJmp: case ICall: case ICommit: case IChoice:
-    case IPartialCommit: case IBackCommit: case ITestAny: {
+    case IPartialCommit: case IBackCommit: case ITestAny:
+    case IDfa: {		/* rosie */
       printjmp(op, p);
       break;
     }
@@ -122,6 +134,35 @@ void printpatt (Instruction *p, int n) {
 }
 
 
+/* rosie */
+static void printlit (const char *s, int len) {
+  int i;
+  printf("'");
+  for (i = 0; i < len; i++) {
+    byte c = (byte)s[i];
+    if (isprint(c)) printf("%c", c);
+    else printf("\\x%02x", c);
+  }
+  printf("'");
+}
+
+
+void printfilter (const rFilter *f) {
+  printf("prefilter: length %d..", f->min);
+  if (f->max < 0) printf("*");
+  else printf("%d", f->max);
+  if (f->prelen > 0) {
+    printf(", starts with ");
+    printlit(f->pre, f->prelen);
+  }
+  if (f->len > 0) {
+    printf(", contains ");
+    printlit(f->lit, f->len);
+  }
+  printf("\n");
+}
+
+
 #if defined(LPEG_DEBUG)
 static void printcap (Capture *cap) {
   printcapkind(cap->kind);
@@ -155,7 +196,8 @@ static const char *tagnames[] = {
   "not", "and",
   "call", "opencall", "rule", "grammar",
   "behind",
-  "capture", "run-time"
+  "capture", "run-time",
+  "halt", "predicate"
 };
 
 
@@ -181,6 +223,11 @@ void printtree (TTree *tree, int ident) {
       printf(" key: %d\n", tree->key);
       break;
     }
+    case TPredicate: {
+      printf(" %s\n", r_predicates[tree->u.n].name);
+      printtree(sib1(tree), ident + 2);
+      break;
+    }
     case TBehind: {
       printf(" %d\n", tree->u.n);
         printtree(sib1(tree), ident + 2);
@@ -14,6 +14,7 @@
 #if defined(LPEG_DEBUG)
 
 void printpatt (Instruction *p, int n);
+void printfilter (const rFilter *f);
 void printtree (TTree *tree, int ident);
 void printktable (lua_State *L, int idx);
 void printcharset (const byte *st);
@@ -28,6 +29,7 @@ void printinst (const Instruction *op, const Instruction *p);
 	luaL_error(L, "function only implemented in debug mode")
 #define printpatt(p,n)  \
 	luaL_error(L, "function only implemented in debug mode")
+#define printfilter(f)  ((void)0)
 
 #endif
 
@@ -5,9 +5,12 @@
 
 #include <ctype.h>
 #include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
 #include <string.h>
 
 #include <time.h>
+#include <unistd.h>
 
 #include "lua.h"
 #include "lauxlib.h"
@@ -19,6 +22,14 @@
 #include "lptree.h"
 
 #include "rpeg.h"
+#include "rpred.h"
+#include "rjit.h"
+#include "raot.h"
+#include "rdfa.h"
+#include "rsubst.h"
+#include "rcache.h"
+#include "rhash.h"
+#include "rprof.h"
 
 /* number of siblings for each tree */
 const byte numsiblings[] = {
@@ -30,11 +41,13 @@ const byte numsiblings[] = {
   0, 0, 2, 1,  /* call, opencall, rule, grammar */
   1,	       /* behind */
   1, 1,	       /* capture, runtime capture */
-  0	       /* halt (rosie) */
+  0,	       /* halt (rosie) */
+  1	       /* predicate (rosie) */
 };
 
 
 static TTree *newgrammar (lua_State *L, int arg);
+static Pattern *newpattern (lua_State *L, int len);  /* rosie */
 
 
 /*
@@ -244,47 +257,6 @@ static void correctkeys (TTree *tree, int n) {
 }
 
 
-/*
-** Join the ktables from p1 and p2 the ktable for the new pattern at the
-** top of the stack, reusing them when possible.
-*/
-static void joinktables (lua_State *L, int p1, TTree *t2, int p2) {
-  int n1, n2;
-  lua_getuservalue(L, p1);  /* get ktables */
-  lua_getuservalue(L, p2);
-  n1 = ktablelen(L, -2);
-  n2 = ktablelen(L, -1);
-  if (n1 == 0 && n2 == 0)  /* are both tables empty? */
-    lua_pop(L, 2);  /* nothing to be done; pop tables */
-  else if (n2 == 0 || lp_equal(L, -2, -1)) {  /* 2nd table empty or equal? */
-    lua_pop(L, 1);  /* pop 2nd table */
-    lua_setuservalue(L, -2);  /* set 1st ktable into new pattern */
-  }
-  else if (n1 == 0) {  /* first table is empty? */
-    lua_setuservalue(L, -3);  /* set 2nd table into new pattern */
-    lua_pop(L, 1);  /* pop 1st table */
-  }
-  else {
-    lua_createtable(L, n1 + n2, 0);  /* create ktable for new pattern */
-    /* stack: new p; ktable p1; ktable p2; new ktable */
-    concattable(L, -3, -1);  /* from p1 into new ktable */
-    concattable(L, -2, -1);  /* from p2 into new ktable */
-    lua_setuservalue(L, -4);  /* new ktable becomes 'p' environment */
-    lua_pop(L, 2);  /* pop other ktables */
-    correctkeys(t2, n1);  /* correction for indices from p2 */
-  }
-}
-
-
-/*
-** copy 'ktable' of element 'idx' to new tree (on top of stack)
-*/
-static void copyktable (lua_State *L, int idx) {
-  lua_getuservalue(L, idx);
-  lua_setuservalue(L, -2);
-}
-
-
 /*
 ** merge 'ktable' from 'stree' at stack index 'idx' into 'ktable'
 ** from tree at the top of the stack, and correct corresponding
@@ -315,6 +287,342 @@ static int addtonewktable (lua_State *L, int p, int idx) {
 /* }====================================================== */
 
 
+/*
+** {======================================================
+** Pattern nodes (rosie)
+** =======================================================
+*/
+
+/*
+** A combinator does not copy the trees of its operands into the
+** pattern it makes: it makes a node, whose 'node' holds only the root
+** of its tree and whose uservalue holds its operands (at 1 and 2) and
+** its own Lua value, if it has one (at 3).  Nodes with equal roots,
+** operands and values are one: the registry table R_NODES, with weak
+** values, maps a hash of them to the node.  So building a pattern takes
+** time and memory in proportion to the combinators used, and a
+** subpattern used in many places is kept once.
+** The tree of a node is made when it is first needed (to compile it, to
+** put it in a grammar, to print it), by 'flatten'.  The node then is a
+** pattern like the others, with its tree in 'tree' and its 'ktable' as
+** uservalue, and leaves R_NODES, as it no longer keeps its operands.
+** Whether a node is nullable or nofail, which combinators ask, is known
+** from its root and its operands when it is made.
+*/
+
+#define PNODE		1	/* tree not made yet */
+#define PKNOWN		2	/* PNULLABLE and PNOFAIL are set */
+#define PNULLABLE	4
+#define PNOFAIL		8
+
+#define isnode(p)	((p)->props & PNODE)
+
+
+static int getprops (Pattern *p) {
+  if (!(p->props & PKNOWN)) {
+    p->props |= PKNOWN;
+    if (nullable(p->tree)) p->props |= PNULLABLE;
+    if (nofail(p->tree)) p->props |= PNOFAIL;
+  }
+  return p->props;
+}
+
+
+/* a leaf with the properties 'props' (see 'checkaux') */
+static int stubtag (int props) {
+  if (props & PNOFAIL) return TTrue;
+  else if (props & PNULLABLE) return TNot;
+  else return TFalse;
+}
+
+
+/*
+** Properties of a node with root 'root' and operands 'p1' and 'p2'
+** (NULL if the root has one sibling): those of the root over leaves
+** with the properties of the operands
+*/
+static int nodeprops (const TTree *root, Pattern *p1, Pattern *p2) {
+  TTree t[3];
+  int props = PNODE | PKNOWN;
+  memset(t, 0, sizeof(t));
+  t[0] = *root;
+  t[1].tag = stubtag(getprops(p1));
+  if (p2 != NULL) {
+    t[0].u.ps = 2;
+    t[2].tag = stubtag(getprops(p2));
+  }
+  if (nullable(t)) props |= PNULLABLE;
+  if (nofail(t)) props |= PNOFAIL;
+  return props;
+}
+
+
+/*
+** Hash of a node with root 'root', operands at 'i1' and 'i2' (0 if
+** none) and own value at 'k' (0 if none), its key in R_NODES.  (Nodes
+** with the same hash are told apart by 'samenode'.)
+*/
+static lua_Integer nodehash (lua_State *L, const TTree *root, int i1,
+                             int i2, int k) {
+  const void *ops[3];
+  int data[3];
+  uint64_t h = R_FNV_OFFSET;
+  ops[0] = lua_touserdata(L, i1);
+  ops[1] = (i2 == 0) ? NULL : lua_touserdata(L, i2);
+  ops[2] = (k == 0) ? NULL : lua_topointer(L, k);  /* NULL for strings */
+  data[0] = root->tag;  data[1] = root->cap;
+  data[2] = (root->tag == TCapture) ? root->key : root->u.n;
+  h = r_fnv(h, ops, sizeof(ops));
+  h = r_fnv(h, data, sizeof(data));
+  if (k != 0 && lua_type(L, k) == LUA_TSTRING) {
+    size_t len;
+    const char *s = lua_tolstring(L, k, &len);
+    h = r_fnv(h, s, len);
+  }
+  return (lua_Integer)h;
+}
+
+
+/*
+** Is the value at the top of the stack the node with root 'root',
+** operands at 'i1' and 'i2' and own value at 'k' (as in 'nodehash')?
+*/
+static int samenode (lua_State *L, const TTree *root, int i1, int i2,
+                     int k) {
+  Pattern *p = (Pattern *)lua_touserdata(L, -1);
+  int same;
+  if (p == NULL || !isnode(p) || p->node->tag != root->tag ||
+      p->node->cap != root->cap || p->node->key != root->key ||
+      p->node->u.n != root->u.n)
+    return 0;
+  lua_getuservalue(L, -1);
+  lua_rawgeti(L, -1, 1);
+  lua_rawgeti(L, -2, 2);
+  lua_rawgeti(L, -3, 3);
+  same = lua_rawequal(L, -3, i1) &&
+         ((i2 == 0) ? lua_isnil(L, -2) : lua_rawequal(L, -2, i2)) &&
+         ((k == 0) ? lua_isnil(L, -1) : lua_rawequal(L, -1, k));
+  lua_pop(L, 4);
+  return same;
+}
+
+
+/*
+** Push a node with root 'root', operands at 'i1' and 'i2' (0 if the
+** root has one sibling), which must be patterns, and own value at 'k'
+** (0 if none): a node equal to it, if there is one, or a new node.
+** Indices must be absolute.
+*/
+static Pattern *newnode (lua_State *L, const TTree *root, int i1, int i2,
+                         int k) {
+  Pattern *p1 = (Pattern *)lua_touserdata(L, i1);
+  Pattern *p2 = (i2 == 0) ? NULL : (Pattern *)lua_touserdata(L, i2);
+  int size = 1 + p1->treesize + ((p2 == NULL) ? 0 : p2->treesize);
+  Pattern *p;
+  if (size > MAXPATTSIZE)
+    luaL_error(L, "pattern too large");
+  lua_getfield(L, LUA_REGISTRYINDEX, R_NODES);
+  lua_pushinteger(L, nodehash(L, root, i1, i2, k));
+  lua_pushvalue(L, -1);
+  lua_rawget(L, -3);
+  if (samenode(L, root, i1, i2, k)) {  /* there is one already? */
+    lua_replace(L, -3);
+    lua_pop(L, 1);  /* remove hash */
+    return (Pattern *)lua_touserdata(L, -1);
+  }
+  lua_pop(L, 1);  /* (a node with the same hash is replaced) */
+  p = newpattern(L, 1);
+  p->node[0] = *root;
+  p->tree = NULL;
+  p->treesize = size;
+  p->props = nodeprops(root, p1, p2);
+  lua_createtable(L, 3, 0);
+  lua_pushvalue(L, i1);
+  lua_rawseti(L, -2, 1);
+  if (i2 != 0) {
+    lua_pushvalue(L, i2);
+    lua_rawseti(L, -2, 2);
+  }
+  if (k != 0) {
+    lua_pushvalue(L, k);
+    lua_rawseti(L, -2, 3);
+  }
+  lua_setuservalue(L, -2);
+  lua_pushvalue(L, -2);  /* stack: R_NODES, hash, node, hash, node */
+  lua_pushvalue(L, -2);
+  lua_rawset(L, -5);
+  lua_replace(L, -3);
+  lua_pop(L, 1);
+  return p;
+}
+
+
+/* where 'flatten' puts the values the keys of the new tree refer to */
+typedef struct Flat {
+  int kt;  /* stack index of the new 'ktable' */
+  int seen;  /* of a table with the offset in it of each ktable added */
+} Flat;
+
+
+/*
+** Add to the new ktable that of the pattern at the top of the stack,
+** unless it is there already; return its offset in it
+*/
+static int addktable (lua_State *L, const Flat *fl) {
+  int n, i, len;
+  lua_getuservalue(L, -1);
+  if ((len = ktablelen(L, -1)) == 0) {
+    lua_pop(L, 1);
+    return 0;
+  }
+  lua_pushvalue(L, -1);
+  lua_rawget(L, fl->seen);
+  if (!lua_isnil(L, -1))
+    n = lua_tointeger(L, -1);
+  else {
+    n = ktablelen(L, fl->kt);
+    if (n + len > MAXCAPIDX)
+      luaL_error(L, "too many Lua values in pattern");
+    for (i = 1; i <= len; i++) {
+      lua_rawgeti(L, -2, i);
+      lua_rawseti(L, fl->kt, n + i);
+    }
+    lua_pushvalue(L, -2);
+    lua_pushinteger(L, n);
+    lua_rawset(L, fl->seen);
+  }
+  lua_pop(L, 2);
+  return n;
+}
+
+
+static void fillchain (lua_State *L, const Flat *fl, TTree *d);
+
+/*
+** Make in 'd' the tree of the pattern at the top of the stack
+*/
+static void fillpatt (lua_State *L, const Flat *fl, TTree *d) {
+  Pattern *p = (Pattern *)lua_touserdata(L, -1);
+  luaL_checkstack(L, LUA_MINSTACK, "pattern too complex");
+  if (!isnode(p)) {
+    memcpy(d, p->tree, p->treesize * sizeof(TTree));
+    correctkeys(d, addktable(L, fl));
+  }
+  else if (p->node->tag == TSeq || p->node->tag == TChoice)
+    fillchain(L, fl, d);
+  else {
+    *d = p->node[0];
+    lua_getuservalue(L, -1);
+    lua_rawgeti(L, -1, 3);  /* own value */
+    if (lua_isnil(L, -1))
+      lua_pop(L, 1);
+    else {
+      int n = ktablelen(L, fl->kt);
+      if (n >= MAXCAPIDX)
+        luaL_error(L, "too many Lua values in pattern");
+      lua_rawseti(L, fl->kt, ++n);
+      d->key = n;
+    }
+    lua_rawgeti(L, -1, 1);
+    fillpatt(L, fl, sib1(d));
+    lua_pop(L, 2);
+  }
+}
+
+
+/*
+** Make in 'd' the tree of the node at the top of the stack, a sequence
+** or a choice: the operands of the nodes of that kind below it, in
+** order, joined by a list of those nodes (as 'correctassociativity'
+** would leave them).  A long pattern is usually built by joining its
+** parts one at a time, so this goes without recursion.
+*/
+static void fillchain (lua_State *L, const Flat *fl, TTree *d) {
+  TTree root = ((Pattern *)lua_touserdata(L, -1))->node[0];
+  int top = lua_gettop(L);
+  int n = 0, todo = 1;
+  int i;
+  lua_newtable(L);  /* operands, in order */
+  lua_newtable(L);  /* patterns still to be seen, last first */
+  lua_pushvalue(L, top);
+  lua_rawseti(L, top + 2, 1);
+  while (todo > 0) {
+    Pattern *q;
+    lua_rawgeti(L, top + 2, todo--);
+    q = (Pattern *)lua_touserdata(L, -1);
+    if (isnode(q) && q->node->tag == root.tag) {
+      lua_getuservalue(L, -1);
+      lua_rawgeti(L, -1, 2);
+      lua_rawseti(L, top + 2, ++todo);
+      lua_rawgeti(L, -1, 1);
+      lua_rawseti(L, top + 2, ++todo);
+      lua_pop(L, 2);
+    }
+    else
+      lua_rawseti(L, top + 1, ++n);
+  }
+  for (i = 1; i <= n; i++) {
+    lua_rawgeti(L, top + 1, i);
+    if (i < n) {
+      *d = root;
+      d->u.ps = 1 + ((Pattern *)lua_touserdata(L, -1))->treesize;
+      fillpatt(L, fl, sib1(d));
+      d = sib2(d);
+    }
+    else
+      fillpatt(L, fl, d);
+    lua_pop(L, 1);
+  }
+  lua_pop(L, 2);
+}
+
+
+/*
+** Make the tree of the node at 'idx', with a new ktable
+*/
+static void flatten (lua_State *L, int idx) {
+  Pattern *p = (Pattern *)lua_touserdata(L, idx);
+  Flat fl;
+  int top;
+  if (idx < 0) idx += lua_gettop(L) + 1;
+  if (p->tree == NULL) {  /* (else one left by an error) */
+    void *ud;
+    lua_Alloc f = lua_getallocf(L, &ud);
+    p->tree = (TTree *)f(ud, NULL, 0, p->treesize * sizeof(TTree));
+    if (p->tree == NULL) luaL_error(L, "not enough memory");
+  }
+  luaL_checkstack(L, LUA_MINSTACK, "pattern too complex");
+  lua_newtable(L);  /* new ktable */
+  lua_newtable(L);
+  fl.kt = lua_gettop(L) - 1;  fl.seen = fl.kt + 1;
+  lua_pushvalue(L, idx);
+  fillpatt(L, &fl, p->tree);
+  lua_pop(L, 2);  /* node and 'seen' */
+  lua_getfield(L, LUA_REGISTRYINDEX, R_NODES);
+  lua_getuservalue(L, idx);
+  lua_rawgeti(L, -1, 1);
+  lua_rawgeti(L, -2, 2);
+  lua_rawgeti(L, -3, 3);
+  top = lua_gettop(L);
+  lua_pushinteger(L, nodehash(L, p->node, top - 2,
+                              lua_isnil(L, top - 1) ? 0 : top - 1, top));
+  lua_pushvalue(L, -1);
+  lua_rawget(L, top - 4);
+  if (lua_touserdata(L, -1) == (void *)p) {  /* this node? */
+    lua_pop(L, 1);
+    lua_pushnil(L);
+    lua_rawset(L, top - 4);  /* remove it */
+  }
+  else
+    lua_pop(L, 2);
+  lua_pop(L, 5);  /* R_NODES, uservalue and its values */
+  p->props &= ~PNODE;
+  lua_setuservalue(L, idx);  /* new ktable */
+}
+
+/* }====================================================== */
+
+
 /*
 ** {======================================================
 ** Tree generation
@@ -343,32 +651,51 @@ static Pattern *getpattern (lua_State *L, int idx) {
 }
 
 
-static int getsize (lua_State *L, int idx) {
-  return (lua_rawlen(L, idx) - sizeof(Pattern)) / sizeof(TTree) + 1;
-}
-
-
-static TTree *gettree (lua_State *L, int idx, int *len) {
-  Pattern *p = getpattern(L, idx);
-  if (len)
-    *len = getsize(L, idx);
-  return p->tree;
-}
-
-
 /*
 ** create a pattern. Set its uservalue (the 'ktable') equal to its
 ** metatable. (It could be any empty sequence; the metatable is at
 ** hand here, so we use it.)
 */
-static TTree *newtree (lua_State *L, int len) {
+static Pattern *newpattern (lua_State *L, int len) {
   size_t size = (len - 1) * sizeof(TTree) + sizeof(Pattern);
-  Pattern *p = (Pattern *)lua_newuserdata(L, size);
+  Pattern *p;
+  if (len > MAXPATTSIZE)  /* rosie */
+    luaL_error(L, "pattern too large");
+  p = (Pattern *)lua_newuserdata(L, size);
   luaL_getmetatable(L, PATTERN_T);
   lua_pushvalue(L, -1);
   lua_setuservalue(L, -3);
   lua_setmetatable(L, -2);
   p->code = NULL;  p->codesize = 0;
+  p->jit = NULL;
+  p->twin = NULL;
+  p->search = NULL;
+  p->cache = NULL;
+  p->profile = NULL;
+  p->filter.min = 0;  p->filter.max = -1;
+  p->filter.prelen = p->filter.len = 0;
+  p->tree = p->node;  p->treesize = len;  /* rosie */
+  p->props = 0;
+  return p;
+}
+
+
+static TTree *newtree (lua_State *L, int len) {
+  return newpattern(L, len)->tree;
+}
+
+
+static int getsize (lua_State *L, int idx) {
+  return getpattern(L, idx)->treesize;  /* rosie */
+}
+
+
+static TTree *gettree (lua_State *L, int idx, int *len) {
+  Pattern *p = getpattern(L, idx);
+  if (isnode(p))  /* rosie */
+    flatten(L, idx);
+  if (len)
+    *len = p->treesize;
   return p->tree;
 }
 
@@ -388,17 +715,6 @@ static TTree *newcharset (lua_State *L) {
 }
 
 
-/*
-** add to tree a sequence where first sibling is 'sib' (with size
-** 'sibsize'); returns position for second sibling
-*/
-static TTree *seqaux (TTree *tree, TTree *sib, int sibsize) {
-  tree->tag = TSeq; tree->u.ps = sibsize + 1;
-  memcpy(sib1(tree), sib, sibsize * sizeof(TTree));
-  return sib2(tree);
-}
-
-
 /*
 ** Build a sequence of 'n' nodes, each with tag 'tag' and 'u.n' got
 ** from the array 's' (or 0 if array is NULL). (TSeq is binary, so it
@@ -443,88 +759,98 @@ static TTree *numtree (lua_State *L, int n) {
 
 /*
 ** Convert value at index 'idx' to a pattern
+** (rosie: which may be a node, see 'getpatt')
 */
-static TTree *getpatt (lua_State *L, int idx, int *len) {
-  TTree *tree;
+static Pattern *topattern (lua_State *L, int idx) {
   switch (lua_type(L, idx)) {
     case LUA_TSTRING: {
       size_t slen;
       const char *s = lua_tolstring(L, idx, &slen);  /* get string */
       if (slen == 0)  /* empty? */
-        tree = newleaf(L, TTrue);  /* always match */
+        newleaf(L, TTrue);  /* always match */
       else {
-        tree = newtree(L, 2 * (slen - 1) + 1);
+        TTree *tree = newtree(L, 2 * (slen - 1) + 1);
         fillseq(tree, TChar, slen, s);  /* sequence of 'slen' chars */
       }
       break;
     }
     case LUA_TNUMBER: {
       int n = lua_tointeger(L, idx);
-      tree = numtree(L, n);
+      numtree(L, n);
       break;
     }
     case LUA_TBOOLEAN: {
-      tree = (lua_toboolean(L, idx) ? newleaf(L, TTrue) : newleaf(L, TFalse));
+      newleaf(L, lua_toboolean(L, idx) ? TTrue : TFalse);
       break;
     }
     case LUA_TTABLE: {
-      tree = newgrammar(L, idx);
+      newgrammar(L, idx);
       break;
     }
     case LUA_TFUNCTION: {
-      tree = newtree(L, 2);
+      TTree *tree = newtree(L, 2);
       tree->tag = TRunTime;
       tree->key = addtonewktable(L, 0, idx);
       sib1(tree)->tag = TTrue;
       break;
     }
     default: {
-      return gettree(L, idx, len);
+      return getpattern(L, idx);
     }
   }
   lua_replace(L, idx);  /* put new tree into 'idx' slot */
+  return (Pattern *)lua_touserdata(L, idx);
+}
+
+
+/*
+** Convert value at index 'idx' to a pattern with its tree made
+*/
+static TTree *getpatt (lua_State *L, int idx, int *len) {
+  Pattern *p = topattern(L, idx);
+  if (isnode(p))  /* rosie */
+    flatten(L, idx);
   if (len)
-    *len = getsize(L, idx);
-  return tree;
+    *len = p->treesize;
+  return p->tree;
+}
+
+
+/* rosie: a root with tag 'tag' (and no data yet) */
+static TTree *mkroot (TTree *root, int tag) {
+  memset(root, 0, sizeof(TTree));
+  root->tag = tag;
+  return root;
 }
 
 
 /*
 ** create a new tree, whith a new root and one sibling.
 ** Sibling must be on the Lua stack, at index 1.
+** (rosie: a node, see 'newnode', with own value at 'k' if not 0)
 */
-static TTree *newroot1sib (lua_State *L, int tag) {
-  int s1;
-  TTree *tree1 = getpatt(L, 1, &s1);
-  TTree *tree = newtree(L, 1 + s1);  /* create new tree */
-  tree->tag = tag;
-  memcpy(sib1(tree), tree1, s1 * sizeof(TTree));
-  copyktable(L, 1);
-  return tree;
+static void newroot1sib (lua_State *L, const TTree *root, int k) {
+  topattern(L, 1);
+  newnode(L, root, 1, 0, k);
 }
 
 
 /*
 ** create a new tree, whith a new root and 2 siblings.
 ** Siblings must be on the Lua stack, first one at index 1.
+** (rosie: a node, see 'newnode')
 */
-static TTree *newroot2sib (lua_State *L, int tag) {
-  int s1, s2;
-  TTree *tree1 = getpatt(L, 1, &s1);
-  TTree *tree2 = getpatt(L, 2, &s2);
-  TTree *tree = newtree(L, 1 + s1 + s2);  /* create new tree */
-  tree->tag = tag;
-  tree->u.ps =  1 + s1;
-  memcpy(sib1(tree), tree1, s1 * sizeof(TTree));
-  memcpy(sib2(tree), tree2, s2 * sizeof(TTree));
-  joinktables(L, 1, sib2(tree), 2);
-  return tree;
+static void newroot2sib (lua_State *L, int tag) {
+  TTree root;
+  topattern(L, 1);
+  topattern(L, 2);
+  newnode(L, mkroot(&root, tag), 1, 2, 0);
 }
 
 
 static int lp_P (lua_State *L) {
   luaL_checkany(L, 1);
-  getpatt(L, 1, NULL);
+  topattern(L, 1);
   lua_settop(L, 1);
   return 1;
 }
@@ -542,8 +868,8 @@ static int lp_halt (lua_State *L) {
 ** (cannot do x . false => false because x may have runtime captures)
 */
 static int lp_seq (lua_State *L) {
-  TTree *tree1 = getpatt(L, 1, NULL);
-  TTree *tree2 = getpatt(L, 2, NULL);
+  TTree *tree1 = topattern(L, 1)->node;  /* rosie: the roots */
+  TTree *tree2 = topattern(L, 2)->node;
   /* rosie adds THalt, which behaves like TFalse in this case */
 /*   if (tree1->tag == THalt || tree1->tag == TFalse || tree2->tag == TTrue) */
   if (tree1->tag == TFalse || tree2->tag == TTrue)
@@ -565,13 +891,14 @@ static int lp_seq (lua_State *L) {
 /* for rosie's THalt, we could in future do this optimization: THalt / x => THalt */
 static int lp_choice (lua_State *L) {
   Charset st1, st2;
-  TTree *t1 = getpatt(L, 1, NULL);
-  TTree *t2 = getpatt(L, 2, NULL);
+  Pattern *p1 = topattern(L, 1);
+  TTree *t1 = p1->node;  /* rosie: the roots (charsets are not nodes) */
+  TTree *t2 = topattern(L, 2)->node;
   if (tocharset(t1, &st1) && tocharset(t2, &st2)) {
     TTree *t = newcharset(L);
     loopset(i, treebuffer(t)[i] = st1.cs[i] | st2.cs[i]);
   }
-  else if (nofail(t1) || t2->tag == TFalse)
+  else if ((getprops(p1) & PNOFAIL) || t2->tag == TFalse)
     lua_pushvalue(L, 1);  /* true / x => true, x / false => x */
   else if (t1->tag == TFalse)
     lua_pushvalue(L, 2);  /* false / x => x */
@@ -583,36 +910,32 @@ static int lp_choice (lua_State *L) {
 
 /*
 ** p^n
+** (rosie: the nodes of p^n and p^-n all have 'p' as an operand)
 */
 static int lp_star (lua_State *L) {
-  int size1;
+  TTree root;
   int n = (int)luaL_checkinteger(L, 2);
-  TTree *tree1 = getpatt(L, 1, &size1);
+  Pattern *p1 = topattern(L, 1);
+  lua_settop(L, 1);
   if (n >= 0) {  /* seq tree1 (seq tree1 ... (seq tree1 (rep tree1))) */
-    TTree *tree = newtree(L, (n + 1) * (size1 + 1));
-    if (nullable(tree1))
+    if (getprops(p1) & PNULLABLE)
       luaL_error(L, "loop body may accept empty string");
-    while (n--)  /* repeat 'n' times */
-      tree = seqaux(tree, tree1, size1);
-    tree->tag = TRep;
-    memcpy(sib1(tree), tree1, size1 * sizeof(TTree));
+    newroot1sib(L, mkroot(&root, TRep), 0);
+    while (n--) {  /* repeat 'n' times */
+      newnode(L, mkroot(&root, TSeq), 1, 2, 0);
+      lua_remove(L, 2);
+    }
   }
   else {  /* choice (seq tree1 ... choice tree1 true ...) true */
-    TTree *tree;
-    n = -n;
-    /* size = (choice + seq + tree1 + true) * n, but the last has no seq */
-    tree = newtree(L, n * (size1 + 3) - 1);
-    for (; n > 1; n--) {  /* repeat (n - 1) times */
-      tree->tag = TChoice; tree->u.ps = n * (size1 + 3) - 2;
-      sib2(tree)->tag = TTrue;
-      tree = sib1(tree);
-      tree = seqaux(tree, tree1, size1);
+    newleaf(L, TTrue);  /* at index 2 */
+    newnode(L, mkroot(&root, TChoice), 1, 2, 0);
+    for (n = -n; n > 1; n--) {  /* repeat (n - 1) times */
+      newnode(L, mkroot(&root, TSeq), 1, 3, 0);
+      newnode(L, mkroot(&root, TChoice), 4, 2, 0);
+      lua_replace(L, 3);
+      lua_pop(L, 1);
     }
-    tree->tag = TChoice; tree->u.ps = size1 + 1;
-    sib2(tree)->tag = TTrue;
-    memcpy(sib1(tree), tree1, size1 * sizeof(TTree));
   }
-  copyktable(L, 1);
   return 1;
 }
 
@@ -621,7 +944,8 @@ static int lp_star (lua_State *L) {
 ** #p == &p
 */
 static int lp_and (lua_State *L) {
-  newroot1sib(L, TAnd);
+  TTree root;
+  newroot1sib(L, mkroot(&root, TAnd), 0);
   return 1;
 }
 
@@ -630,7 +954,8 @@ static int lp_and (lua_State *L) {
 ** -p == !p
 */
 static int lp_not (lua_State *L) {
-  newroot1sib(L, TNot);
+  TTree root;
+  newroot1sib(L, mkroot(&root, TNot), 0);
   return 1;
 }
 
@@ -641,21 +966,17 @@ static int lp_not (lua_State *L) {
 */
 static int lp_sub (lua_State *L) {
   Charset st1, st2;
-  int s1, s2;
-  TTree *t1 = getpatt(L, 1, &s1);
-  TTree *t2 = getpatt(L, 2, &s2);
+  TTree *t1 = topattern(L, 1)->node;  /* rosie: the roots */
+  TTree *t2 = topattern(L, 2)->node;
   if (tocharset(t1, &st1) && tocharset(t2, &st2)) {
     TTree *t = newcharset(L);
     loopset(i, treebuffer(t)[i] = st1.cs[i] & ~st2.cs[i]);
   }
   else {
-    TTree *tree = newtree(L, 2 + s1 + s2);
-    tree->tag = TSeq;  /* sequence of... */
-    tree->u.ps =  2 + s2;
-    sib1(tree)->tag = TNot;  /* ...not... */
-    memcpy(sib1(sib1(tree)), t2, s2 * sizeof(TTree));  /* ...t2 */
-    memcpy(sib2(tree), t1, s1 * sizeof(TTree));  /* ... and t1 */
-    joinktables(L, 1, sib1(tree), 2);
+    TTree root;
+    lua_settop(L, 2);
+    newnode(L, mkroot(&root, TNot), 2, 0, 0);  /* not t2... */
+    newnode(L, mkroot(&root, TSeq), 3, 1, 0);  /* ...and t1 */
   }
   return 1;
 }
@@ -693,14 +1014,14 @@ static int lp_range (lua_State *L) {
 ** Look-behind predicate
 */
 static int lp_behind (lua_State *L) {
-  TTree *tree;
+  TTree root;
   TTree *tree1 = getpatt(L, 1, NULL);
   int n = fixedlen(tree1);
   luaL_argcheck(L, n >= 0, 1, "pattern may not have fixed length");
   luaL_argcheck(L, !hascaptures(tree1), 1, "pattern have captures");
   luaL_argcheck(L, n <= MAXBEHIND, 1, "pattern too long to look behind");
-  tree = newroot1sib(L, TBehind);
-  tree->u.n = n;
+  mkroot(&root, TBehind)->u.n = n;
+  newroot1sib(L, &root, 0);
   return 1;
 }
 
@@ -722,9 +1043,9 @@ static int lp_V (lua_State *L) {
 ** stack)
 */
 static int capture_aux (lua_State *L, int cap, int labelidx) {
-  TTree *tree = newroot1sib(L, TCapture);
-  tree->cap = cap;
-  tree->key = (labelidx == 0) ? 0 : addtonewktable(L, 1, labelidx);
+  TTree root;
+  mkroot(&root, TCapture)->cap = cap;
+  newroot1sib(L, &root, labelidx);  /* rosie: key set by 'fillpatt' */
   return 1;
 }
 
@@ -735,6 +1056,7 @@ static int capture_aux (lua_State *L, int cap, int labelidx) {
 static TTree *auxemptycap (TTree *tree, int cap) {
   tree->tag = TCapture;
   tree->cap = cap;
+  tree->key = 0;  /* rosie: a key may be wide, so it must be set */
   sib1(tree)->tag = TTrue;
   return tree;
 }
@@ -769,10 +1091,11 @@ static int lp_divcapture (lua_State *L) {
     /* case LUA_TSTRING: return capture_aux(L, Cstring, 2); */
     case LUA_TNUMBER: {
       int n = lua_tointeger(L, 2);
-      TTree *tree = newroot1sib(L, TCapture);
+      TTree root;
       luaL_argcheck(L, 0 <= n && n <= SHRT_MAX, 1, "invalid number");
-      tree->cap = Cnum;
-      tree->key = n;
+      mkroot(&root, TCapture)->cap = Cnum;
+      root.key = n;
+      newroot1sib(L, &root, 0);
       return 1;
     }
     default: return luaL_argerror(L, 2, "invalid replacement value");
@@ -863,10 +1186,9 @@ static int lp_backref (lua_State *L) {
 
 
 static int lp_matchtime (lua_State *L) {
-  TTree *tree;
+  TTree root;
   luaL_checktype(L, 2, LUA_TFUNCTION);
-  tree = newroot1sib(L, TRunTime);
-  tree->key = addtonewktable(L, 1, 2);
+  newroot1sib(L, mkroot(&root, TRunTime), 2);
   return 1;
 }
 
@@ -875,6 +1197,7 @@ static int r_pattern_size (lua_State *L) {
   Pattern *p = getpattern(L, 1);
   size_t without_code = lua_rawlen(L, 1);
   size_t codesize = p->codesize * sizeof(Instruction);
+  if (p->jit) codesize += p->jit->size;
   lua_pushinteger(L, without_code + codesize);
   return 1;
 }
@@ -909,6 +1232,19 @@ static int r_constcapture (lua_State *L) {
 }  
   
 
+/* rosie native predicate: body pattern plus the name of a registered
+   C predicate that checks (and may extend) what the body matched */
+static int r_predicate_capture (lua_State *L) {
+  TTree root;
+  const char *name = luaL_checkstring(L, 2);
+  int id = r_find_predicate(name);
+  if (id < 0) return luaL_error(L, "unknown predicate '%s'", name);
+  mkroot(&root, TPredicate)->u.n = id;
+  newroot1sib(L, &root, 0);
+  return 1;
+}
+  
+
 /* }====================================================== */
 
 
@@ -1045,9 +1381,10 @@ static int verifyerror (lua_State *L, int *passed, int npassed) {
 ** Parameter 'nb' works as an accumulator, to allow tail calls in
 ** choices. ('nb' true makes function returns true.)
 ** Assume ktable at the top of the stack.
+** rosie: 'passed' has room for 'maxpassed' rules.
 */
 static int verifyrule (lua_State *L, TTree *tree, int *passed, int npassed,
-                       int nb) {
+                       int maxpassed, int nb) {
  tailcall:
   switch (tree->tag) {
     case TChar: case TSet: case TAny:
@@ -1057,29 +1394,30 @@ static int verifyrule (lua_State *L, TTree *tree, int *passed, int npassed,
     case TBehind:  /* look-behind cannot have calls */
       return 1;
     case TNot: case TAnd: case TRep:
-      /* return verifyrule(L, sib1(tree), passed, npassed, 1); */
+      /* return verifyrule(L, sib1(tree), passed, npassed, maxpassed, 1); */
       tree = sib1(tree); nb = 1; goto tailcall;
-    case TCapture: case TRunTime:
-      /* return verifyrule(L, sib1(tree), passed, npassed, nb); */
+    case TCapture: case TRunTime: case TPredicate:
+      /* return verifyrule(L, sib1(tree), passed, npassed, maxpassed, nb); */
       tree = sib1(tree); goto tailcall;
     case TCall:
-      /* return verifyrule(L, sib2(tree), passed, npassed, nb); */
+      /* return verifyrule(L, sib2(tree), passed, npassed, maxpassed, nb); */
       tree = sib2(tree); goto tailcall;
     case TSeq:  /* only check 2nd child if first is nb */
-      if (!verifyrule(L, sib1(tree), passed, npassed, 0))
+      if (!verifyrule(L, sib1(tree), passed, npassed, maxpassed, 0))
         return nb;
-      /* else return verifyrule(L, sib2(tree), passed, npassed, nb); */
+      /* else return verifyrule(L, sib2(tree), passed, npassed, maxpassed,
+                                   nb); */
       tree = sib2(tree); goto tailcall;
     case TChoice:  /* must check both children */
-      nb = verifyrule(L, sib1(tree), passed, npassed, nb);
-      /* return verifyrule(L, sib2(tree), passed, npassed, nb); */
+      nb = verifyrule(L, sib1(tree), passed, npassed, maxpassed, nb);
+      /* return verifyrule(L, sib2(tree), passed, npassed, maxpassed, nb); */
       tree = sib2(tree); goto tailcall;
     case TRule:
-      if (npassed >= MAXRULES)
+      if (npassed >= maxpassed)
         return verifyerror(L, passed, npassed);
       else {
         passed[npassed++] = tree->key;
-        /* return verifyrule(L, sib1(tree), passed, npassed); */
+        /* return verifyrule(L, sib1(tree), passed, npassed, maxpassed); */
         tree = sib1(tree); goto tailcall;
       }
     case TGrammar:
@@ -1089,13 +1427,19 @@ static int verifyrule (lua_State *L, TTree *tree, int *passed, int npassed,
 }
 
 
+/*
+** rosie: a chain of left calls longer than the number of rules of the
+** grammar repeats a rule, so 'passed' needs no more room than that
+*/
 static void verifygrammar (lua_State *L, TTree *grammar) {
-  int passed[MAXRULES];
+  int maxpassed = grammar->u.n + 1;
+  int *passed = (int *)lua_newuserdata(L, maxpassed * sizeof(int));
   TTree *rule;
+  lua_pushvalue(L, -2);  /* ktable back at the top */
   /* check left-recursive rules */
   for (rule = sib1(grammar); rule->tag == TRule; rule = sib2(rule)) {
     if (rule->key == 0) continue;  /* unused rule */
-    verifyrule(L, sib1(rule), passed, 0, 0);
+    verifyrule(L, sib1(rule), passed, 0, maxpassed, 0);
   }
   assert(rule->tag == TTrue);
   /* check infinite loops inside rules */
@@ -1107,6 +1451,7 @@ static void verifygrammar (lua_State *L, TTree *grammar) {
     }
   }
   assert(rule->tag == TTrue);
+  lua_pop(L, 2);  /* ktable copy and 'passed' */
 }
 
 
@@ -1147,10 +1492,15 @@ static TTree *newgrammar (lua_State *L, int arg) {
 
 
 static Instruction *prepcompile (lua_State *L, Pattern *p, int idx) {
+  Instruction *code;
+  if (isnode(p)) flatten(L, idx);  /* rosie */
   lua_getuservalue(L, idx);  /* push 'ktable' (may be used by 'finalfix') */
   finalfix(L, 0, NULL, p->tree);
   lua_pop(L, 1);  /* remove 'ktable' */
-  return compile(L, p);
+  code = compile(L, p);
+  if (p->jit)  /* rosie: native code requested? */
+    r_jitcode(p->jit, code, p->codesize);
+  return code;
 }
 
 
@@ -1164,16 +1514,22 @@ static int lp_printtree (lua_State *L) {
   }
   printktable(L, 1);
   printtree(tree, 0);
+  {  /* rosie */
+    rFilter f;
+    r_prefilter(tree, &f);
+    printfilter(&f);
+  }
   return 0;
 }
 
 
 static int lp_printcode (lua_State *L) {
-  Pattern *p = getpattern(L, 1);
+  Pattern *p = (getpatt(L, 1, NULL), getpattern(L, 1));  /* rosie */
   printktable(L, 1);
   if (p->code == NULL)  /* not compiled yet? */
     prepcompile(L, p, 1);
   printpatt(p->code, p->codesize);
+  printfilter(&p->filter);  /* rosie */
   return 0;
 }
 
@@ -1198,114 +1554,1679 @@ static size_t initposition (lua_State *L, size_t len, int idx) {
 
 
 /*
-** Main match function
+** rosie: run the native code for 'p' when it has some, else interpret
+** (counting, while 'p' is profiled)
 */
-static int lp_match (lua_State *L) {
-  Capture capture[INITCAPSIZE];
-  const char *r;
-  size_t l;
-  Pattern *p = (getpatt(L, 1, NULL), getpattern(L, 1));
-  Instruction *code = (p->code != NULL) ? p->code : prepcompile(L, p, 1);
-  const char *s = luaL_checklstring(L, SUBJIDX, &l);
-  size_t i = initposition(L, l, SUBJIDX+1);
-  int ptop = lua_gettop(L);
-  lua_pushnil(L);  /* initialize subscache */
-  lua_pushlightuserdata(L, capture);  /* initialize caplistidx */
-  lua_getuservalue(L, 1);  /* initialize penvidx */
-  r = match(L, s, s + i, s + l, code, capture, ptop);
-  if (r == NULL) {
-    lua_pushnil(L);
-    return 1;
-  }
-  return getcaptures(L, s, r, ptop);
-}
+#define runmatch(L,p,o,s,e,code,capture,ptop)				\
+  ((p)->profile != NULL							\
+   ? r_profilematch(L, o, s, e, code, capture, ptop, (p)->profile)	\
+   : r_jitted((p)->jit) ? r_jitmatch(L, (p)->jit, o, s, e, capture, ptop) \
+                        : match(L, o, s, e, code, capture, ptop))
 
-/* required args: peg, input
- * optional args: start position, encoding type, total time accumulator, lpeg time accumulator
- * encoding types: debug (-1), byte array (0), json (1), input (2)
- * RESTRICTION: only a limited set of capture types are supported
+
+/*
+** {======================================================
+** rosie: capture-free twins (see lptree.h)
+** =======================================================
 */
 
-/* inline? */
-static int do_r_match (lua_State *L, int from_lua) {
-  Capture capture[INITCAPSIZE];
-  int n, encoding, input_type;
-  lua_Integer t0, tmatch, tfinal, duration0, duration1;
-  const char *r;
-  size_t l;
-  Pattern *p;
-  Instruction *code;
-  const char *s;
-  size_t i;
-  int ptop;
-  void *buf;
-  
-  t0 = (lua_Integer) clock();
-  p = (getpatt(L, 1, NULL), getpattern(L, 1));
-  code = (p->code != NULL) ? p->code : prepcompile(L, p, 1);
+/* always try a twin for this many calls, and then one call in this many
+   when most subjects match anyway */
+#define TWINSAMPLE	64
 
-  /* From lua code, accept Lua string or ROSIE_BUFFER for input */
-  /* Only C code, like librosie, can call here with a rosie_string. */
-  input_type = lua_type(L, SUBJIDX);
-  switch (input_type) {
-  case LUA_TLIGHTUSERDATA: {
-    if (from_lua) return luaL_argerror(L, SUBJIDX, "lightuserdata prohibited");
-    buf = lua_touserdata(L, SUBJIDX);
-    if (!buf) return 0;		/* TODO: how to signal a fatal error? */
-    s = (char *) ((rstr *)buf)->ptr;
-    l = ((rstr *)buf)->len;
-    break;
-  }
-  case LUA_TUSERDATA: {
-    buf = luaL_testudata(L, SUBJIDX, ROSIE_BUFFER);
-    if (!buf) return 0;		/* TODO: how to signal a fatal error? */
-    s = ((rBuffer *)buf)->data;
-    l = ((rBuffer *)buf)->n;
-    break;
+/* marks patterns that have no twin */
+static rTwin notwin;
+
+
+/* ('hascaptures' would loop on recursive rules) */
+static int hastag (TTree *tree, int tag) {
+ tailcall:
+  if (tree->tag == tag) return 1;
+  switch (numsiblings[tree->tag]) {
+    case 1: tree = sib1(tree); goto tailcall;
+    case 2: if (hastag(sib1(tree), tag)) return 1;
+      tree = sib2(tree); goto tailcall;
+    default: return 0;  /* rules of calls are seen in their grammar */
   }
-  case LUA_TSTRING: { 
-    s = luaL_checklstring(L, SUBJIDX, &l);
-    break;
+}
+
+
+static void twinjit (rTwin *t, rJit *jit) {
+  if (jit != NULL && !jit->aot) {
+    if (t->p.jit == NULL && (t->p.jit = r_newjit()) != NULL)
+      r_jitcode(t->p.jit, t->p.code, t->p.codesize);
   }
-  default: 
-    return luaL_argerror(L, SUBJIDX, from_lua ? "not rbuffer or lua string" : "not rbuffer, rstr, or lua string");
+  else {
+    r_jitfree(t->p.jit);
+    t->p.jit = NULL;
   }
-      
-  if (l > INT_MAX) luaL_error(L, "input string too long");
-  i = initposition(L, l, SUBJIDX+1);
-  encoding = luaL_optinteger(L, SUBJIDX+2, ENCODE_BYTE);
-  duration0 = luaL_optinteger(L, SUBJIDX+3, 0);	/* total time accumulator */
-  duration1 = luaL_optinteger(L, SUBJIDX+4, 0); /* total time without post-processing */
-  /* prepare for matching */
-  ptop = lua_gettop(L);
-  lua_pushnil(L);  /* initialize subscache */
-  lua_pushlightuserdata(L, capture);  /* initialize caplistidx */
-  lua_getuservalue(L, 1);  /* initialize penvidx */
-  r = match(L, s, s + i, s + l, code, capture, ptop);
-  tmatch = (lua_Integer) clock();
-  if (r == NULL) {
-    lua_pushboolean(L, 0);	/* false, i.e. no match */
-    lua_pushinteger(L, l);	/* leftover value is len */
-    lua_pushboolean(L, 0);	/* dummy, so that there are always 5 return values */
-    lua_pushinteger(L, (tmatch-t0)+duration0); /* total time (no capture processing) */
-    lua_pushinteger(L, (tmatch-t0)+duration1); /* match time (includes lpeg overhead) */
-    return 5;
+}
+
+
+static void freetwin (lua_State *L, Pattern *p) {
+  rTwin *t = p->twin;
+  if (t != NULL && t != &notwin) {
+    void *ud;
+    lua_Alloc f = lua_getallocf(L, &ud);
+    if (t->p.code != NULL) r_dfafreecode(t->p.code, t->p.codesize);
+    realloccode(L, &t->p, 0);
+    r_jitfree(t->p.jit);
+    f(ud, t, sizeof(rTwin), 0);
   }
-  n = r_getcaptures(L, s, r, ptop, encoding, l);
-  assert(n==3);
+  p->twin = NULL;
+}
+
+
+/*
+** Get the twin of a compiled pattern 'p', building it on first use.
+** Patterns without captures are their own twin, and patterns with
+** match-time captures have none, as those captures can change the
+** match.  (A pattern being profiled runs without its twin.)
+*/
+static rTwin *gettwin (lua_State *L, Pattern *p) {
+  if (p->profile != NULL) return NULL;
+  if (p->twin == NULL) {
+    if (!hastag(p->tree, TCapture) || hastag(p->tree, TRunTime))
+      p->twin = &notwin;
+    else {
+      void *ud;
+      lua_Alloc f = lua_getallocf(L, &ud);
+      rTwin *t = (rTwin *)f(ud, NULL, 0, sizeof(rTwin));
+      if (t == NULL) luaL_error(L, "not enough memory");
+      memset(t, 0, sizeof(rTwin));
+      p->twin = t;  /* so that it is freed if 'compiletwin' fails */
+      compiletwin(L, p, &t->p);
+      twinjit(t, p->jit);
+    }
+  }
+  return (p->twin == &notwin) ? NULL : p->twin;
+}
+
+
+/*
+** Before another match in the same call: remove the backtrack stack of
+** the previous one, and give the next one the initial capture list.
+*/
+static void resetmatch (lua_State *L, Capture *capture, int ptop) {
+  lua_settop(L, ptop + 3);
+  lua_pushlightuserdata(L, capture);
+  lua_replace(L, caplistidx(ptop));
+}
+
+
+/*
+** Run the twin of 'p' on a subject, when that is likely to pay.
+** Returns 1 when the subject does not match.
+*/
+static int twinrejects (lua_State *L, Pattern *p, const char *o,
+                        const char *s, const char *e, Capture *capture,
+                        int ptop) {
+  rTwin *t;
+  const char *r;
+  if (p->jit != NULL && p->jit->aot) return 0;  /* nothing to gain */
+  if ((t = gettwin(L, p)) == NULL) return 0;
+  if (t->tries >= TWINSAMPLE && 2 * t->hits > t->tries
+      && ++t->skips % TWINSAMPLE != 0)
+    return 0;  /* most subjects match: run the full code only */
+  r = runmatch(L, &t->p, o, s, e, t->p.code, capture, ptop);
+  resetmatch(L, capture, ptop);
+  if (++t->tries > 1024 * TWINSAMPLE) {  /* favor recent calls */
+    t->tries /= 2;  t->hits /= 2;
+  }
+  if (r != NULL) t->hits++;
+  return (r == NULL);
+}
+
+
+/*
+** Did a match stop at a halt? (Its capture list then ends with
+** a Cfinal instead of the closing entry put by IEnd.)
+*/
+static int halted (Capture *cap) {
+  while (cap->kind != Cfinal && !(cap->kind == Cclose && cap->s == NULL))
+    cap++;
+  return (cap->kind == Cfinal);
+}
+
+/* }====================================================== */
+
+
+/*
+** {======================================================
+** rosie: unanchored search
+** =======================================================
+*/
+
+/* how candidate positions are found */
+#define SKIPNONE	0  /* every position is a candidate */
+#define SKIPCHAR	1  /* matches start with 'c' */
+#define SKIPSET		2  /* matches start with a character in 'first' */
+#define SKIPPREFIX	3  /* matches start with the prefilter's 'pre' */
+
+typedef struct rSearch {
+  int how;
+  int c;
+  Charset first;
+  byte shift[UCHAR_MAX + 1];  /* Horspool shifts for 'pre' */
+} rSearch;
+
+
+static void freesearch (lua_State *L, Pattern *p) {
+  if (p->search != NULL) {
+    void *ud;
+    lua_Alloc f = lua_getallocf(L, &ud);
+    f(ud, p->search, sizeof(rSearch), 0);
+    p->search = NULL;
+  }
+}
+
+
+/*
+** Get the search plan of a compiled pattern 'p', building it on first
+** use.  A prefix of two or more bytes is found with Horspool's
+** algorithm; a single starting character with 'memchr'.
+*/
+static rSearch *getsearch (lua_State *L, Pattern *p) {
+  if (p->search == NULL) {
+    void *ud;
+    lua_Alloc f = lua_getallocf(L, &ud);
+    rSearch *sk = (rSearch *)f(ud, NULL, 0, sizeof(rSearch));
+    const rFilter *ft = &p->filter;
+    int i;
+    if (sk == NULL) luaL_error(L, "not enough memory");
+    sk->how = SKIPNONE;
+    if (ft->prelen >= 2) {
+      sk->how = SKIPPREFIX;
+      for (i = 0; i <= UCHAR_MAX; i++) sk->shift[i] = (byte)ft->prelen;
+      for (i = 0; i < ft->prelen - 1; i++)
+        sk->shift[(byte)ft->pre[i]] = (byte)(ft->prelen - 1 - i);
+    }
+    else if (ft->prelen == 1) {
+      sk->how = SKIPCHAR;  sk->c = (byte)ft->pre[0];
+    }
+    else if (r_firstset(p->tree, &sk->first) == 0) {
+      int n = 0;
+      for (i = 0; i <= UCHAR_MAX; i++)
+        if (testchar(sk->first.cs, i)) { n++; sk->c = i; }
+      sk->how = (n == 1) ? SKIPCHAR : (n <= UCHAR_MAX) ? SKIPSET : SKIPNONE;
+    }
+    p->search = sk;
+  }
+  return p->search;
+}
+
+
+/* first candidate position at or after 's', or NULL if none */
+static const char *nextcandidate (const rSearch *sk, const rFilter *f,
+                                  const char *s, const char *e) {
+  switch (sk->how) {
+    case SKIPPREFIX: {
+      int n = f->prelen;
+      byte last = (byte)f->pre[n - 1];
+      while (e - s >= n) {
+        byte c = (byte)s[n - 1];
+        if (c == last && memcmp(s, f->pre, n - 1) == 0) return s;
+        s += sk->shift[c];
+      }
+      return NULL;
+    }
+    case SKIPCHAR:
+      return (const char *)memchr(s, sk->c, e - s);
+    case SKIPSET:
+      for (; s < e; s++)
+        if (testchar(sk->first.cs, (byte)*s)) return s;
+      return NULL;
+    default:
+      return s;
+  }
+}
+
+
+/*
+** Find the first position at or after 's' where 'p' matches, and match
+** there; returns the end of that match (or NULL) and its start in
+** '*start'.  The capture-free twin, when there is one, screens the
+** candidates, so the full code runs once; when 'nocap' it is the only
+** one to run.
+*/
+static const char *searchmatch (lua_State *L, Pattern *p, const char *o,
+                                const char *s, const char *e, int nocap,
+                                Capture *capture, int ptop,
+                                const char **start) {
+  const rFilter *f = &p->filter;
+  rSearch *sk = getsearch(L, p);
+  rTwin *t = (p->jit != NULL && p->jit->aot) ? NULL : gettwin(L, p);
+  Pattern *q = (t != NULL) ? &t->p : p;
+  int far = (f->len > 0 && f->max < 0);  /* literal anywhere after 's'? */
+  const char *lit = NULL;  /* then, its first occurrence not before 's' */
+  if (far && (lit = r_findlit(f->lit, f->len, s, e)) == NULL)
+    return NULL;  /* no match can be anywhere */
+  for (; e - s >= f->min; s++) {
+    const char *r;
+    if ((s = nextcandidate(sk, f, s, e)) == NULL) break;
+    if (far) {  /* look for the literal again only once past it */
+      if (s > lit && (lit = r_findlit(f->lit, f->len, s, e)) == NULL)
+        break;
+      if (r_prefixrejects(f, s, e)) continue;
+    }
+    else if (r_filterrejects(f, s, e)) continue;
+    r = runmatch(L, q, o, s, e, q->code, capture, ptop);
+    if (r != NULL && q != p && !nocap) {
+      resetmatch(L, capture, ptop);
+      r = runmatch(L, p, o, s, e, p->code, capture, ptop);
+    }
+    if (r != NULL) {
+      *start = s;
+      return r;
+    }
+    resetmatch(L, capture, ptop);
+  }
+  return NULL;
+}
+
+/* }====================================================== */
+
+
+/*
+** Main match function
+*/
+static int lp_match (lua_State *L) {
+  Capture capture[INITCAPSIZE];
+  const char *r;
+  size_t l;
+  Pattern *p = (getpatt(L, 1, NULL), getpattern(L, 1));
+  Instruction *code = (p->code != NULL) ? p->code : prepcompile(L, p, 1);
+  const char *s = luaL_checklstring(L, SUBJIDX, &l);
+  size_t i = initposition(L, l, SUBJIDX+1);
+  int ptop = lua_gettop(L);
+  lua_pushnil(L);  /* initialize subscache */
+  lua_pushlightuserdata(L, capture);  /* initialize caplistidx */
+  lua_getuservalue(L, 1);  /* initialize penvidx */
+  if (r_filterrejects(&p->filter, s + i, s + l)  /* rosie */
+      || twinrejects(L, p, s, s + i, s + l, capture, ptop))
+    r = NULL;
+  else
+    r = runmatch(L, p, s, s + i, s + l, code, capture, ptop);
+  if (r == NULL) {
+    lua_pushnil(L);
+    return 1;
+  }
+  return getcaptures(L, s, r, ptop);
+}
+
+/* required args: peg, input
+ * optional args: start position, encoding type, total time accumulator, lpeg time accumulator
+ * encoding types: debug (-1), byte array (0), json (1), input (2), bool (4),
+ * byte array with 64-bit positions (5)
+ * RESTRICTION: only a limited set of capture types are supported
+ * rosie: when 'search', the match may start anywhere at or after the
+ * start position, and its start is returned as an extra value
+*/
+
+/* rosie: positions in the byte encoding are ints; byte64 lifts that */
+#define checklength(L, l, encoding) \
+  { if ((l) > INT_MAX && (encoding) == ENCODE_BYTE) \
+      luaL_error(L, "input too long for the byte encoding (use byte64)"); }
+
+/* rosie: encodings whose matches are framed by their lengths */
+#define framed(encoding) \
+  ((encoding) == ENCODE_BYTE || (encoding) == ENCODE_BYTE64)
+
+/* rosie: the subject of rmatch and friends, or NULL (see do_r_match) */
+static const char *getsubject (lua_State *L, int from_lua, size_t *l) {
+  void *buf;
+  /* From lua code, accept Lua string or ROSIE_BUFFER for input */
+  /* Only C code, like librosie, can call here with a rosie_string. */
+  switch (lua_type(L, SUBJIDX)) {
+  case LUA_TLIGHTUSERDATA: {
+    if (from_lua) luaL_argerror(L, SUBJIDX, "lightuserdata prohibited");
+    buf = lua_touserdata(L, SUBJIDX);
+    if (!buf) return NULL;	/* TODO: how to signal a fatal error? */
+    *l = ((rstr *)buf)->len;
+    return (char *) ((rstr *)buf)->ptr;
+  }
+  case LUA_TUSERDATA: {
+    buf = luaL_testudata(L, SUBJIDX, ROSIE_BUFFER);
+    if (!buf) return NULL;	/* TODO: how to signal a fatal error? */
+    *l = ((rBuffer *)buf)->n;
+    return ((rBuffer *)buf)->data;
+  }
+  case LUA_TSTRING: { 
+    return luaL_checklstring(L, SUBJIDX, l);
+  }
+  default: 
+    luaL_argerror(L, SUBJIDX, from_lua ? "not rbuffer or lua string" : "not rbuffer, rstr, or lua string");
+    return NULL;
+  }
+}
+
+/*
+** rosie: return the results of an rmatch (or rsearch) from its cache
+** entry
+*/
+static int pushcached (lua_State *L, const rCacheEntry *ce, int encoding,
+                       int search, lua_Integer t0, lua_Integer duration0,
+                       lua_Integer duration1) {
+  lua_Integer tmatch = (lua_Integer) clock();
+  if (!ce->matched)
+    lua_pushboolean(L, 0);
+  else if (encoding == ENCODE_BOOL)
+    lua_pushboolean(L, 1);
+  else {
+    rBuffer *buf = r_getbuffer(L);
+    r_addlstring(L, buf, ce->data + ce->len, ce->outlen);
+  }
+  lua_pushinteger(L, ce->leftover);
+  lua_pushboolean(L, ce->abend);
+  lua_pushinteger(L, (tmatch-t0)+duration0); /* total time */
+  lua_pushinteger(L, (tmatch-t0)+duration1); /* match time */
+  if (search) {
+    if (ce->matched) lua_pushinteger(L, ce->matchstart + 1);
+    else lua_pushboolean(L, 0);
+  }
+  return 5 + search;
+}
+
+/* rosie: cache the results of an rmatch (see pushcached) */
+static void cacheresult (lua_State *L, Pattern *p, uint64_t key,
+                         const char *s, size_t l, size_t i, int encoding,
+                         int search, const rBuffer *out, int matched,
+                         size_t leftover, int abend, size_t matchstart) {
+  rCacheEntry *ce = r_cacheput(L, p->cache, key, s, l, i, encoding, search,
+                               out ? out->data : NULL, out ? out->n : 0);
+  if (ce != NULL) {
+    ce->matched = matched;
+    ce->leftover = leftover;
+    ce->abend = abend;
+    ce->matchstart = matchstart;
+  }
+}
+
+/* inline? */
+static int do_r_match (lua_State *L, int from_lua, int search) {
+  Capture capture[INITCAPSIZE];
+  int n, encoding;
+  int cached = 0;  /* rosie: to be cached? */
+  uint64_t key = 0;
+  lua_Integer t0, tmatch, tfinal, duration0, duration1;
+  const char *r;
+  const char *start;
+  size_t l;
+  Pattern *p;
+  Instruction *code;
+  const char *s;
+  size_t i;
+  int ptop;
+  
+  t0 = (lua_Integer) clock();
+  p = (getpatt(L, 1, NULL), getpattern(L, 1));
+  code = (p->code != NULL) ? p->code : prepcompile(L, p, 1);
+
+  s = getsubject(L, from_lua, &l);
+  if (s == NULL) return 0;
+  i = initposition(L, l, SUBJIDX+1);
+  encoding = luaL_optinteger(L, SUBJIDX+2, ENCODE_BYTE);
+  checklength(L, l, encoding);
+  duration0 = luaL_optinteger(L, SUBJIDX+3, 0);	/* total time accumulator */
+  duration1 = luaL_optinteger(L, SUBJIDX+4, 0); /* total time without post-processing */
+  if (p->cache != NULL && p->profile == NULL && encoding != ENCODE_DEBUG
+      && l <= R_CACHEMAXLEN) {  /* rosie */
+    rCacheEntry *ce;
+    key = r_cachekey(s, l, i, encoding, search);
+    ce = r_cachefind(p->cache, key, s, l, i, encoding, search);
+    if (ce != NULL)
+      return pushcached(L, ce, encoding, search, t0, duration0, duration1);
+    cached = 1;
+  }
+  /* prepare for matching */
+  ptop = lua_gettop(L);
+  lua_pushnil(L);  /* initialize subscache */
+  lua_pushlightuserdata(L, capture);  /* initialize caplistidx */
+  lua_getuservalue(L, 1);  /* initialize penvidx */
+  start = s + i;
+  if (search)  /* rosie */
+    r = searchmatch(L, p, s, s + i, s + l, encoding == ENCODE_BOOL,
+                    capture, ptop, &start);
+  else if (r_filterrejects(&p->filter, s + i, s + l))  /* rosie */
+    r = NULL;
+  else if (encoding == ENCODE_BOOL) {  /* rosie: no captures needed */
+    rTwin *t = gettwin(L, p);
+    Pattern *q = (t != NULL) ? &t->p : p;
+    r = runmatch(L, q, s, s + i, s + l, q->code, capture, ptop);
+  }
+  else if (twinrejects(L, p, s, s + i, s + l, capture, ptop))  /* rosie */
+    r = NULL;
+  else
+    r = runmatch(L, p, s, s + i, s + l, code, capture, ptop);
+  tmatch = (lua_Integer) clock();
+  if (r == NULL) {
+    if (cached)  /* rosie */
+      cacheresult(L, p, key, s, l, i, encoding, search, NULL, 0, l, 0, 0);
+    lua_pushboolean(L, 0);	/* false, i.e. no match */
+    lua_pushinteger(L, l);	/* leftover value is len */
+    lua_pushboolean(L, 0);	/* dummy, so that there are always 5 return values */
+    lua_pushinteger(L, (tmatch-t0)+duration0); /* total time (no capture processing) */
+    lua_pushinteger(L, (tmatch-t0)+duration1); /* match time (includes lpeg overhead) */
+    if (search) lua_pushboolean(L, 0);  /* no start (rosie) */
+    return 5 + search;
+  }
+  if (encoding == ENCODE_BOOL) {  /* rosie */
+    int abend = halted((Capture *)lua_touserdata(L, caplistidx(ptop)));
+    if (cached)
+      cacheresult(L, p, key, s, l, i, encoding, search, NULL, 1,
+                  l - (r - s), abend, start - s);
+    lua_pushboolean(L, 1);	/* match */
+    lua_pushinteger(L, l - (r - s));	/* leftover */
+    lua_pushboolean(L, abend);
+    lua_pushinteger(L, (tmatch-t0)+duration0); /* total time */
+    lua_pushinteger(L, (tmatch-t0)+duration1); /* match time */
+    if (search) lua_pushinteger(L, start - s + 1);  /* rosie */
+    return 5 + search;
+  }
+  n = r_getcaptures(L, s, r, ptop, encoding, l);
+  assert(n==3);
+  if (cached)  /* rosie */
+    cacheresult(L, p, key, s, l, i, encoding, search,
+                (rBuffer *)lua_touserdata(L, -3), 1, l - (r - s),
+                lua_toboolean(L, -1), start - s);
   tfinal = (lua_Integer) clock();
   lua_pushinteger(L, (tfinal-t0)+duration0); /* total time (includes capture processing) */
   lua_pushinteger(L, (tmatch-t0)+duration1); /* match time (includes lpeg overhead) */
-  return n+2;				     /* success => 3 values on the stack */
+  if (search) lua_pushinteger(L, start - s + 1);  /* rosie */
+  return n+2+search;			     /* success => 3 values on the stack */
+}
+
+/*
+** rosie: rcache(p [, size]) gives 'p' a new cache of the results of
+** rmatch and rsearch with room for 'size' of them, or removes its cache
+** when 'size' is 0 (see rcache.h).  Returns the number of hits and of
+** misses in the cache, and the number of results in it.
+*/
+static int r_cache (lua_State *L) {
+  Pattern *p = (getpatt(L, 1, NULL), getpattern(L, 1));
+  if (!lua_isnoneornil(L, 2)) {
+    lua_Integer size = luaL_checkinteger(L, 2);
+    luaL_argcheck(L, 0 <= size && size <= R_CACHEMAXSIZE, 2, "out of range");
+    if (size > 0 && hastag(p->tree, TRunTime))
+      return luaL_error(L, "pattern has match-time captures");
+    r_freecache(L, p->cache);
+    p->cache = (size > 0) ? r_newcache(L, (int)size) : NULL;
+  }
+  lua_pushinteger(L, p->cache ? (lua_Integer)p->cache->hits : 0);
+  lua_pushinteger(L, p->cache ? (lua_Integer)p->cache->misses : 0);
+  lua_pushinteger(L, p->cache ? p->cache->used : 0);
+  return 3;
+}
+
+/*
+** rosie: jit(p [, on]) turns native code for pattern 'p' on (the
+** default) or off.  Returns true when 'p' will run natively; false
+** when the interpreter will be used, e.g. because the platform is not
+** supported or the pattern has run-time captures.  Native code is
+** listed for 'perf' only when LPEG_PERFMAP is set (see rjit.c).
+*/
+static int r_jit (lua_State *L) {
+  Pattern *p = (getpatt(L, 1, NULL), getpattern(L, 1));
+  int on = lua_isnoneornil(L, 2) || lua_toboolean(L, 2);
+  if (!on) {
+    r_jitfree(p->jit);
+    p->jit = NULL;
+  }
+  else if (p->jit == NULL) {
+    p->jit = r_newjit();
+    if (p->jit == NULL) return luaL_error(L, "not enough memory");
+    if (p->code == NULL) prepcompile(L, p, 1);
+    else r_jitcode(p->jit, p->code, p->codesize);
+  }
+  if (p->twin != NULL && p->twin != &notwin)
+    twinjit(p->twin, p->jit);
+  lua_pushboolean(L, r_jitted(p->jit));
+  return 1;
+}
+
+/*
+** rosie: aotsource(p, name) returns C source for pattern 'p' (see raot.h)
+*/
+static int r_aot_source (lua_State *L) {
+  Pattern *p = (getpatt(L, 1, NULL), getpattern(L, 1));
+  const char *name = luaL_checkstring(L, 2);
+  uint64_t fp;
+  if (p->code == NULL) prepcompile(L, p, 1);
+  lua_getuservalue(L, 1);
+  fp = r_aotfingerprint(L, lua_gettop(L), p->code, p->codesize);
+  lua_pop(L, 1);
+  return r_aotsource(L, name, p->code, p->codesize, fp);
+}
+
+
+/*
+** rosie: aot(p, aotpattern) makes 'p' run code generated by aotsource,
+** given as a lightuserdata pointing to its r_aotpattern
+*/
+static int r_aot (lua_State *L) {
+  Pattern *p = (getpatt(L, 1, NULL), getpattern(L, 1));
+  const r_aotpattern *aot;
+  const char *msg;
+  uint64_t fp;
+  luaL_checktype(L, 2, LUA_TLIGHTUSERDATA);
+  aot = (const r_aotpattern *)lua_touserdata(L, 2);
+  if (p->code == NULL) prepcompile(L, p, 1);
+  if (p->jit == NULL && (p->jit = r_newjit()) == NULL)
+    return luaL_error(L, "not enough memory");
+  lua_getuservalue(L, 1);
+  fp = r_aotfingerprint(L, lua_gettop(L), p->code, p->codesize);
+  msg = r_aotattach(p->jit, aot, p->codesize, fp);
+  if (msg) return luaL_error(L, "cannot use compiled pattern: %s", msg);
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+/*
+** rosie: rprofile(p, on) starts or stops counting the instructions run
+** by 'p', and returns true while they are counted; rprofile(p) returns
+** the counts so far as a string, or nil (see rprof.h)
+*/
+static int r_profile (lua_State *L) {
+  Pattern *p = (getpatt(L, 1, NULL), getpattern(L, 1));
+  if (lua_isnone(L, 2)) {
+    rProfile *pf = p->profile;
+    if (pf == NULL) lua_pushnil(L);
+    else lua_pushlstring(L, (const char *)pf, r_profilebytes(pf->codesize));
+    return 1;
+  }
+  r_freeprofile(L, p->profile);
+  p->profile = NULL;
+  if (lua_toboolean(L, 2)) {
+    uint64_t fp;
+    if (p->code == NULL) prepcompile(L, p, 1);
+    lua_getuservalue(L, 1);
+    fp = r_aotfingerprint(L, lua_gettop(L), p->code, p->codesize);
+    lua_pop(L, 1);
+    p->profile = r_newprofile(L, p->codesize, fp);
+  }
+  lua_pushboolean(L, p->profile != NULL);
+  return 1;
+}
+
+
+/* rosie: the fingerprint of code for pattern 1 (see raot.h) */
+static uint64_t codefingerprint (lua_State *L, const Instruction *code,
+                                 int codesize) {
+  uint64_t fp;
+  lua_getuservalue(L, 1);
+  fp = r_aotfingerprint(L, lua_gettop(L), code, codesize);
+  lua_pop(L, 1);
+  return fp;
+}
+
+
+/*
+** rosie: the profile for 'rlayout' and 'rorder' on pattern 1, compiled:
+** the one given as argument 2 (copied, so that its counts are aligned),
+** or else the one being collected
+*/
+static const rProfile *getprofile (lua_State *L, Pattern *p) {
+  if (p->jit != NULL && p->jit->aot)
+    luaL_error(L, "pattern runs ahead-of-time code");
+  if (!lua_isnoneornil(L, 2)) {
+    size_t len;
+    const char *s = luaL_checklstring(L, 2, &len);
+    rProfile *copy = (rProfile *)lua_newuserdata(L, len > 0 ? len : 1);
+    if (len > 0) memcpy(copy, s, len);
+    if (len < sizeof(rProfile) || len != r_profilebytes(copy->codesize))
+      luaL_error(L, "profile is not for this code");
+    return copy;
+  }
+  if (p->profile == NULL)
+    luaL_error(L, "pattern is not being profiled");
+  return p->profile;
+}
+
+
+/* rosie: after the code of 'p' changed, by profile 'pf' */
+static void newcode (lua_State *L, Pattern *p, const rProfile *pf,
+                     int changed) {
+  if (pf == p->profile || changed) {  /* counts for the old code */
+    r_freeprofile(L, p->profile);
+    p->profile = NULL;
+  }
+  if (changed && p->jit != NULL)
+    r_jitcode(p->jit, p->code, p->codesize);
+}
+
+
+/*
+** rosie: rlayout(p [, profile]) moves the code of 'p' that ran rarely,
+** by 'profile' or else by the counts being taken, out of the way of the
+** rest (see rprof.h).  Returns the number of blocks moved.
+*/
+static int r_layout (lua_State *L) {
+  Pattern *p = (getpatt(L, 1, NULL), getpattern(L, 1));
+  const rProfile *pf;
+  int moved;
+  if (p->code == NULL) prepcompile(L, p, 1);
+  pf = getprofile(L, p);
+  if (pf->codesize != p->codesize
+      || pf->fingerprint != codefingerprint(L, p->code, p->codesize))
+    return luaL_error(L, "profile is not for this code");
+  moved = r_relayout(L, p, pf);
+  newcode(L, p, pf, moved > 0);
+  lua_pushinteger(L, moved);
+  return 1;
+}
+
+
+static void freecode (lua_State *L, Pattern *p) {
+  if (p->code != NULL) r_dfafreecode(p->code, p->codesize);
+  realloccode(L, p, 0);
+}
+
+
+/*
+** rosie: rorder(p [, profile]) compiles 'p' again, trying first the
+** alternatives of its choices that ran more often, by 'profile' or
+** else by the counts being taken, where that cannot change the matches
+** (see rprof.h).  Returns the number of choices reordered.
+*/
+static int r_order (lua_State *L) {
+  Pattern *p = (getpatt(L, 1, NULL), getpattern(L, 1));
+  const rProfile *pf;
+  Pattern q;
+  uint64_t *weight, *count;
+  int n = getsize(L, 1);
+  int same;
+  if (p->code == NULL) prepcompile(L, p, 1);
+  pf = getprofile(L, p);
+  weight = (uint64_t *)lua_newuserdata(L, n * sizeof(uint64_t));
+  memset(weight, 0, n * sizeof(uint64_t));
+  memset(&q, 0, sizeof(Pattern));
+  r_compileorder(L, p, &q, pf->count, 0, weight);  /* counting nothing */
+  same = (q.codesize == pf->codesize
+          && codefingerprint(L, q.code, q.codesize) == pf->fingerprint);
+  if (same) {  /* count by the places of the code as it is generated */
+    int *place = (int *)lua_newuserdata(L, q.codesize * sizeof(int));
+    int i, nlong = r_longplaces(q.code, q.codesize, place);
+    count = (uint64_t *)lua_newuserdata(L, nlong * sizeof(uint64_t));
+    memset(count, 0, nlong * sizeof(uint64_t));
+    for (i = 0; i < q.codesize; i += sizei(&q.code[i]))
+      count[place[i]] = pf->count[i];
+    freecode(L, &q);
+    r_compileorder(L, p, &q, count, nlong, weight);
+  }
+  freecode(L, &q);
+  if (!same)  /* the counts are not for the code compiled */
+    return luaL_error(L, "profile is not for this code");
+  n = r_compileorder(L, p, &q, NULL, 0, weight);
+  if (n > 0) {
+    freecode(L, p);
+    p->code = q.code;  p->codesize = q.codesize;
+  }
+  else freecode(L, &q);
+  newcode(L, p, pf, n > 0);
+  lua_pushinteger(L, n);
+  return 1;
+}
+
+/*
+** rosie: panalyses(p) compiles 'p' again, on the side, and returns how
+** many analyses of its tree nodes that compilation ran rather than
+** found remembered (see lpcode.c); only in debug mode
+*/
+static int lp_analyses (lua_State *L) {
+#if defined(LPEG_DEBUG)
+  Pattern *p = (getpatt(L, 1, NULL), getpattern(L, 1));
+  Pattern q;
+  lua_Integer n;
+  if (p->code == NULL) prepcompile(L, p, 1);
+  memset(&q, 0, sizeof(Pattern));
+  n = r_compileanalyses(L, p, &q);
+  freecode(L, &q);
+  lua_pushinteger(L, n);
+  return 1;
+#else
+  return luaL_error(L, "function only implemented in debug mode");
+#endif
 }
 
 int r_match_lua (lua_State *L);
 int r_match_lua (lua_State *L) {
-  return do_r_match(L, 1);
+  return do_r_match(L, 1, 0);
 }
 
 int r_match_C (lua_State *L) {
-  return do_r_match(L, 0);
+  return do_r_match(L, 0, 0);
+}
+
+
+/*
+** rosie: rfindall(p, input [, start [, encoding [, t0 [, t1]]]]) finds
+** every match of 'p' in the input, left to right and not overlapping,
+** and encodes them all into the output buffer: each byte-encoded match
+** is preceded by its length (see decodeall), and JSON matches are
+** followed by a newline.  Returns the buffer, the number of matches,
+** whether the last one halted, and the times, as rmatch does.  With the
+** "bool" encoding nothing is encoded, so only the capture-free twin
+** runs, and the buffer is nil.  An empty match moves the search on by
+** one byte.
+*/
+static int r_findall (lua_State *L) {
+  Capture capture[INITCAPSIZE];
+  lua_Integer t0, tmatch, duration0, duration1;
+  Pattern *p;
+  rBuffer *buf = NULL;
+  const char *s, *e, *from, *start, *r;
+  size_t l;
+  int encoding, ptop, count = 0, abend = 0;
+  t0 = (lua_Integer) clock();
+  p = (getpatt(L, 1, NULL), getpattern(L, 1));
+  if (p->code == NULL) prepcompile(L, p, 1);
+  s = getsubject(L, 1, &l);
+  if (s == NULL) return 0;
+  from = s + initposition(L, l, SUBJIDX+1);
+  e = s + l;
+  encoding = luaL_optinteger(L, SUBJIDX+2, ENCODE_BYTE);
+  checklength(L, l, encoding);
+  duration0 = luaL_optinteger(L, SUBJIDX+3, 0);
+  duration1 = luaL_optinteger(L, SUBJIDX+4, 0);
+  if (encoding != ENCODE_BOOL) {
+    if (!framed(encoding) && encoding != ENCODE_JSON
+        && encoding != ENCODE_DEBUG)
+      return luaL_error(L, "invalid encoding value for findall: %d", encoding);
+    buf = r_getbuffer(L);  /* stays below the match state */
+  }
+  else lua_pushnil(L);
+  ptop = lua_gettop(L);
+  lua_pushnil(L);  /* initialize subscache */
+  lua_pushlightuserdata(L, capture);  /* initialize caplistidx */
+  lua_getuservalue(L, 1);  /* initialize penvidx */
+  while (!abend && from <= e) {
+    r = searchmatch(L, p, s, from, e, buf == NULL, capture, ptop, &start);
+    if (r == NULL) break;
+    count++;
+    if (buf != NULL) {
+      size_t n0 = buf->n;
+      if (framed(encoding)) r_addint(L, buf, 0);  /* its length */
+      abend = r_encodecaptures(L, buf, s, ptop, encoding);
+      if (framed(encoding)) r_setint(buf, n0, (int)(buf->n - n0 - 4));
+      else if (encoding == ENCODE_JSON) r_addlstring(L, buf, "\n", 1);
+    }
+    else abend = halted((Capture *)lua_touserdata(L, caplistidx(ptop)));
+    resetmatch(L, capture, ptop);
+    from = (r > start) ? r : r + 1;
+  }
+  tmatch = (lua_Integer) clock();
+  lua_pushvalue(L, ptop);  /* the buffer (or nil) */
+  lua_pushinteger(L, count);
+  lua_pushboolean(L, abend);
+  lua_pushinteger(L, (tmatch-t0)+duration0); /* total time */
+  lua_pushinteger(L, (tmatch-t0)+duration1); /* match time */
+  return 5;
+}
+
+/*
+** rosie: the names in the list at 'arg' as a byte array indexed like
+** the ktable of 'p' (at 'kidx'), left on the stack; its size goes in
+** '*n'.
+*/
+static const byte *selectnames (lua_State *L, int arg, int kidx, size_t *n) {
+  byte *sel;
+  size_t i, nk = lua_isnil(L, kidx) ? 0 : lua_rawlen(L, kidx);
+  int set;
+  luaL_checktype(L, arg, LUA_TTABLE);
+  lua_newtable(L);  /* set of names */
+  set = lua_gettop(L);
+  for (i = 1; lua_rawgeti(L, arg, i) != LUA_TNIL; i++) {
+    luaL_argcheck(L, lua_type(L, -1) == LUA_TSTRING, arg, "names must be strings");
+    lua_pushboolean(L, 1);
+    lua_rawset(L, set);
+  }
+  lua_pop(L, 1);
+  sel = (byte *)lua_newuserdata(L, nk + 1);
+  sel[0] = 0;
+  for (i = 1; i <= nk; i++) {
+    lua_rawgeti(L, kidx, i);
+    sel[i] = (lua_type(L, -1) == LUA_TSTRING && lua_rawget(L, set) != LUA_TNIL);
+    lua_pop(L, 1);
+  }
+  lua_remove(L, set);
+  *n = nk + 1;
+  return sel;
+}
+
+
+/*
+** rosie: rsubst(p, input, how [, with [, names [, out]]]) copies the
+** input into a buffer, replacing each match of 'p' (or only the named
+** Rosie captures within it) as 'how' says (see rsubst.h).  A buffer
+** given as the input is never also the output.
+*/
+static int r_subst (lua_State *L) {
+  static const char *const hows[] = {"replace", "mask", "hash", NULL};
+  Capture capture[INITCAPSIZE];
+  rSubst sb;
+  Pattern *p;
+  rBuffer *out;
+  const char *s, *e, *from, *pos, *start, *r;
+  size_t l;
+  int ptop, count = 0, abend = 0;
+  p = (getpatt(L, 1, NULL), getpattern(L, 1));
+  if (p->code == NULL) prepcompile(L, p, 1);
+  s = getsubject(L, 1, &l);
+  if (s == NULL) return 0;
+  sb.how = luaL_checkoption(L, SUBJIDX+1, NULL, hows);
+  sb.with = luaL_optlstring(L, SUBJIDX+2, "", &sb.withlen);
+  if (sb.how == R_SUBST_HASH && sb.withlen != R_SIPKEYLEN)
+    return luaL_error(L, "hash needs a key of %d bytes", R_SIPKEYLEN);
+  sb.selected = NULL;
+  sb.nselected = 0;
+  lua_settop(L, SUBJIDX+4);
+  if (!lua_isnoneornil(L, SUBJIDX+3)) {
+    lua_getuservalue(L, 1);
+    sb.selected = selectnames(L, SUBJIDX+3, lua_gettop(L), &sb.nselected);
+  }
+  if (!lua_isnoneornil(L, SUBJIDX+4)) {
+    out = (rBuffer *)luaL_checkudata(L, SUBJIDX+4, ROSIE_BUFFER);
+    luaL_argcheck(L, !lua_rawequal(L, SUBJIDX, SUBJIDX+4), SUBJIDX+4,
+                  "output buffer is the input");
+    lua_pushvalue(L, SUBJIDX+4);
+  }
+  else if (lua_type(L, SUBJIDX) == LUA_TUSERDATA)
+    out = r_newbuffer(L);  /* the input may be the shared output buffer */
+  else out = r_getbuffer(L);
+  ptop = lua_gettop(L);
+  lua_pushnil(L);  /* initialize subscache */
+  lua_pushlightuserdata(L, capture);  /* initialize caplistidx */
+  lua_getuservalue(L, 1);  /* initialize penvidx */
+  e = s + l;
+  from = pos = s;
+  while (!abend && from <= e) {
+    r = searchmatch(L, p, s, from, e, sb.selected == NULL, capture, ptop,
+                    &start);
+    if (r == NULL) break;
+    if (sb.selected != NULL) {
+      Capture *cap = (Capture *)lua_touserdata(L, caplistidx(ptop));
+      count += r_substcaptures(L, out, &sb, &pos, cap);
+      abend = halted(cap);
+    }
+    else {
+      if (r > start) {
+        r_substspan(L, out, &sb, &pos, start, r);
+        count++;
+      }
+      abend = halted((Capture *)lua_touserdata(L, caplistidx(ptop)));
+    }
+    resetmatch(L, capture, ptop);
+    from = (r > start) ? r : r + 1;
+  }
+  r_addlstring(L, out, pos, e - pos);
+  lua_pushvalue(L, ptop);  /* the buffer */
+  lua_pushinteger(L, count);
+  return 2;
+}
+
+/*
+** rosie: rmatchlines(p, input [, encoding]) matches 'p' against each
+** line of the input (without its newline) as rmatch would, and encodes
+** a record for every line into the output buffer, framed as rfindall
+** frames them; a line that does not match gets just the length
+** R_NOMATCH (false in decodeall), or an empty line in JSON.  A line that shares a prefix
+** with the lines before it resumes matching from a checkpoint taken on
+** those (see lpvm.h), so the interpreter runs rather than native code.
+** Returns the buffer (nil for "bool"), the number of lines that matched,
+** the number of lines, and the number of bytes that resuming skipped.
+*/
+static int r_matchlines (lua_State *L) {
+  Capture capture[INITCAPSIZE];
+  rResume *rs;
+  Pattern *p;
+  rBuffer *buf = NULL;
+  const char *s, *e, *line, *eol, *r;
+  size_t l;
+  int encoding, ptop, count = 0, lines = 0;
+  p = (getpatt(L, 1, NULL), getpattern(L, 1));
+  if (p->code == NULL) prepcompile(L, p, 1);
+  s = getsubject(L, 1, &l);
+  if (s == NULL) return 0;
+  e = s + l;
+  encoding = luaL_optinteger(L, SUBJIDX+1, ENCODE_BYTE);
+  checklength(L, l, encoding);
+  lua_settop(L, SUBJIDX+1);
+  rs = (rResume *)lua_newuserdata(L, sizeof(rResume));
+  r_resumeinit(rs);
+  if (encoding != ENCODE_BOOL) {
+    if (!framed(encoding) && encoding != ENCODE_JSON
+        && encoding != ENCODE_DEBUG)
+      return luaL_error(L, "invalid encoding value for matchlines: %d",
+                        encoding);
+    if (lua_type(L, SUBJIDX) == LUA_TUSERDATA)
+      buf = r_newbuffer(L);  /* the input may be the shared output buffer */
+    else buf = r_getbuffer(L);
+  }
+  else lua_pushnil(L);
+  ptop = lua_gettop(L);
+  lua_pushnil(L);  /* initialize subscache */
+  lua_pushlightuserdata(L, capture);  /* initialize caplistidx */
+  lua_getuservalue(L, 1);  /* initialize penvidx */
+  for (line = s; line < e; line = eol + 1) {
+    size_t n0 = (buf != NULL) ? buf->n : 0;
+    if ((eol = (const char *)memchr(line, '\n', e - line)) == NULL) eol = e;
+    lines++;
+    if (r_filterrejects(&p->filter, line, eol))
+      r = NULL;
+    else if (p->profile != NULL)
+      r = r_profilematch(L, line, line, eol, p->code, capture, ptop,
+                         p->profile);
+    else
+      r = r_resumematch(L, line, eol, p->code, capture, ptop, rs);
+    if (r != NULL) count++;
+    if (framed(encoding)) r_addint(L, buf, (r != NULL) ? 0 : R_NOMATCH);
+    if (r != NULL && buf != NULL) {
+      r_encodecaptures(L, buf, line, ptop, encoding);
+      if (framed(encoding)) r_setint(buf, n0, (int)(buf->n - n0 - 4));
+    }
+    if (encoding == ENCODE_JSON) r_addlstring(L, buf, "\n", 1);
+    resetmatch(L, capture, ptop);
+  }
+  lua_pushvalue(L, ptop);  /* the buffer (or nil) */
+  lua_pushinteger(L, count);
+  lua_pushinteger(L, lines);
+  lua_pushinteger(L, (lua_Integer)rs->resumed);
+  return 4;
+}
+
+
+/*
+** {======================================================
+** rosie: speculative chunked matching of records
+** =======================================================
+*/
+
+/* most chunks in one call */
+#define R_MAXCHUNKS	4096
+
+/* most threads matching the chunks of one call */
+#if !defined(R_MAXTHREADS)
+#define R_MAXTHREADS	64
+#endif
+
+/*
+** Match records of 'p' one after another from 's', encoding each one
+** into 'buf' (framed as rfindall frames them) unless it is NULL, until
+** one ends at or after 'stop', none matches, one matches the empty
+** string, or one halts.  Returns where the last record ended; adds the
+** number of records to '*count' and sets '*abend' if the last halted.
+** Positions are encoded relative to 'o'.
+*/
+static const char *matchrecords (lua_State *L, Pattern *p, const char *o,
+                                 const char *s, const char *stop,
+                                 const char *e, rBuffer *buf, int encoding,
+                                 Capture *capture, int ptop, int *count,
+                                 int *abend) {
+  rTwin *t = (buf != NULL || (p->jit != NULL && p->jit->aot))
+             ? NULL : gettwin(L, p);
+  Pattern *q = (t != NULL) ? &t->p : p;
+  *abend = 0;
+  while (s < stop && !*abend) {
+    const char *r = NULL;
+    if (!r_filterrejects(&p->filter, s, e))
+      r = runmatch(L, q, o, s, e, q->code, capture, ptop);
+    if (r == NULL || r == s) {  /* no more records */
+      resetmatch(L, capture, ptop);
+      break;
+    }
+    (*count)++;
+    if (buf != NULL) {
+      size_t n0 = buf->n;
+      if (framed(encoding)) r_addint(L, buf, 0);  /* its length */
+      *abend = r_encodecaptures(L, buf, o, ptop, encoding);
+      if (framed(encoding)) r_setint(buf, n0, (int)(buf->n - n0 - 4));
+      else if (encoding == ENCODE_JSON) r_addlstring(L, buf, "\n", 1);
+    }
+    else *abend = halted((Capture *)lua_touserdata(L, caplistidx(ptop)));
+    resetmatch(L, capture, ptop);
+    s = r;
+  }
+  return s;
+}
+
+
+/*
+** Speculative starts of at most 'n' chunks of 's'..'e' into 'starts':
+** the first chunk starts at 's', and chunk k at the first match of the
+** boundary pattern 'b' (at 'bidx') at or after k/n of the way through
+** the subject, and after the start of chunk k - 1.  Chunks with no
+** boundary are dropped.  Returns the number of chunks.
+*/
+static int speculate (lua_State *L, Pattern *b, int bidx, const char *s,
+                      const char *e, int n, const char **starts) {
+  Capture capture[INITCAPSIZE];
+  const char *from, *start;
+  size_t step = (size_t)(e - s) / n;
+  int top = lua_gettop(L);
+  int ptop = top, k, m = 1;
+  if (b->code == NULL) prepcompile(L, b, bidx);
+  lua_pushnil(L);  /* initialize subscache */
+  lua_pushlightuserdata(L, capture);  /* initialize caplistidx */
+  lua_getuservalue(L, bidx);  /* initialize penvidx */
+  starts[0] = s;
+  for (k = 1; k < n; k++) {
+    from = s + step * k;
+    if (from <= starts[m - 1]) from = starts[m - 1] + 1;
+    if (from >= e || searchmatch(L, b, s, from, e, 1, capture, ptop,
+                                 &start) == NULL || start >= e)
+      break;
+    resetmatch(L, capture, ptop);
+    starts[m++] = start;
+  }
+  lua_settop(L, top);
+  return m;
+}
+
+
+/* the output buffer of a call on the subject at SUBJIDX, pushed */
+static rBuffer *outbuffer (lua_State *L, int encoding, const char *fname) {
+  if (encoding == ENCODE_BOOL) {
+    lua_pushnil(L);
+    return NULL;
+  }
+  if (!framed(encoding) && encoding != ENCODE_JSON)
+    luaL_error(L, "invalid encoding value for %s: %d", fname, encoding);
+  if (lua_type(L, SUBJIDX) == LUA_TUSERDATA)
+    return r_newbuffer(L);  /* the input may be the shared output buffer */
+  return r_getbuffer(L);
+}
+
+
+/*
+** rosie: rspeculate(boundary, input, n) returns a list of the positions
+** where at most 'n' chunks of the input would start: 1, then the first
+** match of 'boundary' at or after each n-th of the way through it.  A
+** chunk is meant to start at a record, so the boundary pattern should
+** match where records start (a predicate like #"{\"id\"" does).
+*/
+static int r_speculate (lua_State *L) {
+  const char **starts;
+  const char *s;
+  size_t l;
+  int n, m, k;
+  Pattern *b = (getpatt(L, 1, NULL), getpattern(L, 1));
+  s = getsubject(L, 1, &l);
+  if (s == NULL) return 0;
+  n = (int)luaL_checkinteger(L, SUBJIDX+1);
+  luaL_argcheck(L, n >= 1 && n <= R_MAXCHUNKS, SUBJIDX+1,
+                "invalid number of chunks");
+  lua_settop(L, SUBJIDX+1);
+  starts = (const char **)lua_newuserdata(L, n * sizeof(const char *));
+  m = speculate(L, b, 1, s, s + l, n, starts);
+  lua_createtable(L, m, 0);
+  for (k = 0; k < m; k++) {
+    lua_pushinteger(L, (lua_Integer)(starts[k] - s) + 1);
+    lua_rawseti(L, -2, k + 1);
+  }
+  return 1;
+}
+
+
+/*
+** rosie: rrecords(p, input [, start [, stop [, encoding]]]) matches
+** records of 'p' one after another, anchored, from 'start', until one
+** ends at or after 'stop' (default: the end of the input), none
+** matches, or one matches the empty string or halts.  The records are
+** encoded as rfindall encodes matches, with positions in the whole
+** input.  Returns the buffer (nil for "bool"), the number of records,
+** the position after the last one, and whether it halted.  This is the
+** work of one chunk in rchunked.
+*/
+static int r_records (lua_State *L) {
+  Capture capture[INITCAPSIZE];
+  Pattern *p;
+  rBuffer *buf;
+  const char *s, *e, *from, *stop, *r;
+  size_t l;
+  int encoding, ptop, count = 0, abend;
+  p = (getpatt(L, 1, NULL), getpattern(L, 1));
+  if (p->code == NULL) prepcompile(L, p, 1);
+  s = getsubject(L, 1, &l);
+  if (s == NULL) return 0;
+  e = s + l;
+  from = s + initposition(L, l, SUBJIDX+1);
+  stop = lua_isnoneornil(L, SUBJIDX+2) ? e
+         : s + initposition(L, l, SUBJIDX+2);
+  encoding = luaL_optinteger(L, SUBJIDX+3, ENCODE_BYTE);
+  checklength(L, l, encoding);
+  lua_settop(L, SUBJIDX+3);
+  buf = outbuffer(L, encoding, "records");
+  ptop = lua_gettop(L);
+  lua_pushnil(L);  /* initialize subscache */
+  lua_pushlightuserdata(L, capture);  /* initialize caplistidx */
+  lua_getuservalue(L, 1);  /* initialize penvidx */
+  r = matchrecords(L, p, s, from, stop, e, buf, encoding, capture, ptop,
+                   &count, &abend);
+  lua_pushvalue(L, ptop);  /* the buffer (or nil) */
+  lua_pushinteger(L, count);
+  lua_pushinteger(L, (lua_Integer)(r - s) + 1);
+  lua_pushboolean(L, abend);
+  return 4;
+}
+
+
+/* the outcome of matching one chunk */
+typedef struct rChunk {
+  const char *start;  /* speculative start */
+  const char *end;  /* where its last record ended */
+  rBuffer *buf;
+  int count, abend;
+} rChunk;
+
+
+/* number of processors online, to match chunks with */
+static int onlinecpus (void) {
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  return (n < 1) ? 1 : (n > R_MAXTHREADS) ? R_MAXTHREADS : (int)n;
+}
+
+
+/* the chunks of one call, matched by threads (see 'matchchunks') */
+typedef struct rChunks {
+  Pattern *p;
+  const char *s, *e;  /* the subject */
+  rChunk *ch;
+  int m;  /* number of chunks */
+  int encoding;
+  int next;  /* the next chunk to match */
+  pthread_mutex_t lock;  /* for 'next' */
+} rChunks;
+
+/* a thread matching chunks, with a Lua state of its own */
+typedef struct rWorker {
+  rChunks *cs;
+  lua_State *L;  /* buffers of its chunks at 1, copy of the ktable at 2 */
+  pthread_t thread;
+  int started;
+  char error[200];  /* its error, or "" */
+} rWorker;
+
+
+/*
+** Copy into the state 'to' (at its top) the ktable of 'p' (at 'idx' in
+** 'L'); return 0 when a value in it cannot be copied, as a capture
+** that runs Lua code needs the state of the pattern
+*/
+static int copyktable (lua_State *L, int idx, lua_State *to) {
+  int i, n;
+  lua_getuservalue(L, idx);
+  n = ktablelen(L, -1);
+  lua_createtable(to, n, 0);
+  for (i = 1; i <= n; i++) {
+    lua_rawgeti(L, -1, i);
+    switch (lua_type(L, -1)) {
+      case LUA_TNIL: break;
+      case LUA_TBOOLEAN: lua_pushboolean(to, lua_toboolean(L, -1)); break;
+      case LUA_TNUMBER:
+#if LUA_VERSION_NUM >= 503
+        if (lua_isinteger(L, -1)) {
+          lua_pushinteger(to, lua_tointeger(L, -1));
+          break;
+        }
+#endif
+        lua_pushnumber(to, lua_tonumber(L, -1));
+        break;
+      case LUA_TSTRING: {
+        size_t l;
+        const char *v = lua_tolstring(L, -1, &l);
+        lua_pushlstring(to, v, l);
+        break;
+      }
+      default:
+        lua_pop(L, 2);
+        return 0;
+    }
+    if (!lua_isnil(L, -1)) lua_rawseti(to, -2, i);
+    lua_pop(L, 1);
+  }
+  lua_pop(L, 1);
+  return 1;
+}
+
+
+/*
+** Match chunks in the state of a worker (in protected mode), taking
+** the next one not taken until there are none: its records go to a
+** buffer of the worker, as in the loop of 'r_chunked'
+*/
+static int matchchunks (lua_State *L) {
+  Capture capture[INITCAPSIZE];
+  rWorker *wk = (rWorker *)lua_touserdata(L, 3);
+  rChunks *cs = wk->cs;
+  int ptop;
+  lua_settop(L, 3);
+  lua_pushnil(L);
+  ptop = lua_gettop(L);
+  lua_pushnil(L);  /* initialize subscache */
+  lua_pushlightuserdata(L, capture);  /* initialize caplistidx */
+  lua_pushvalue(L, 2);  /* initialize penvidx */
+  for (;;) {
+    rChunk *c;
+    int k;
+    pthread_mutex_lock(&cs->lock);
+    k = cs->next++;
+    pthread_mutex_unlock(&cs->lock);
+    if (k >= cs->m) break;
+    c = &cs->ch[k];
+    c->buf = NULL;
+    if (cs->encoding != ENCODE_BOOL) {
+      c->buf = r_newbuffer(L);
+      lua_rawseti(L, 1, k + 1);  /* (keep it while the state lives) */
+    }
+    c->count = 0;
+    c->end = matchrecords(L, cs->p, cs->s, c->start,
+                          (k + 1 < cs->m) ? cs->ch[k + 1].start : cs->e,
+                          cs->e, c->buf, cs->encoding, capture, ptop,
+                          &c->count, &c->abend);
+  }
+  return 0;
+}
+
+
+static void *workerthread (void *arg) {
+  rWorker *wk = (rWorker *)arg;
+  lua_State *L = wk->L;
+  lua_pushcfunction(L, matchchunks);
+  lua_pushvalue(L, 1);
+  lua_pushvalue(L, 2);
+  lua_pushlightuserdata(L, wk);
+  if (lua_pcall(L, 3, 0, 0) != 0) {
+    const char *msg = lua_tostring(L, -1);
+    snprintf(wk->error, sizeof(wk->error), "%s",
+             (msg != NULL) ? msg : "error in a chunk");
+  }
+  return NULL;
+}
+
+
+/*
+** Match the chunks 'ch' of the subject of 'p' (at 1) with 'nw' threads,
+** each with a Lua state of its own (this thread being one of them).
+** Returns 0, matching nothing, when 'p' cannot run that way: while it
+** is profiled (the counts are not shared), or when its ktable has
+** values that are not plain data.  The buffers of the chunks live in
+** the states of the workers, in the list returned in '*wks', until
+** 'endworkers'.
+*/
+static int startworkers (lua_State *L, Pattern *p, const char *s,
+                         const char *e, rChunk *ch, int m, int encoding,
+                         int nw, rChunks *cs, rWorker **wks) {
+  rWorker *wk;
+  int i;
+  *wks = NULL;
+  if (p->profile != NULL) return 0;
+  if (encoding == ENCODE_BOOL && !(p->jit != NULL && p->jit->aot))
+    gettwin(L, p);  /* built here, as it is built lazily */
+  wk = (rWorker *)lua_newuserdata(L, nw * sizeof(rWorker));
+  memset(wk, 0, nw * sizeof(rWorker));
+  lua_getfield(L, LUA_REGISTRYINDEX, MAXSTACKIDX);
+  for (i = 0; i < nw; i++) {
+    lua_State *w = wk[i].L = luaL_newstate();
+    wk[i].cs = cs;
+    if (w == NULL) break;
+    if (!lua_isnil(L, -1)) {  /* same limit for the backtrack stack */
+      lua_pushinteger(w, lua_tointeger(L, -1));
+      lua_setfield(w, LUA_REGISTRYINDEX, MAXSTACKIDX);
+    }
+    lua_newtable(w);  /* buffers */
+    if (!copyktable(L, 1, w)) break;
+  }
+  lua_pop(L, 1);
+  if (i < nw) {  /* could not make them all */
+    int nomem = (wk[i].L == NULL);
+    for (i = 0; i < nw && wk[i].L != NULL; i++) lua_close(wk[i].L);
+    lua_pop(L, 1);
+    if (nomem) luaL_error(L, "not enough memory");
+    return 0;
+  }
+  cs->p = p;  cs->s = s;  cs->e = e;
+  cs->ch = ch;  cs->m = m;
+  cs->encoding = encoding;  cs->next = 0;
+  pthread_mutex_init(&cs->lock, NULL);
+  for (i = 1; i < nw; i++)
+    wk[i].started = (pthread_create(&wk[i].thread, NULL, workerthread,
+                                    &wk[i]) == 0);
+  workerthread(&wk[0]);  /* (so the chunks get matched, at least here) */
+  for (i = 1; i < nw; i++)
+    if (wk[i].started) pthread_join(wk[i].thread, NULL);
+  pthread_mutex_destroy(&cs->lock);
+  *wks = wk;
+  return 1;
+}
+
+
+/*
+** Close the states of the 'nw' workers 'wk' (on top of the stack),
+** raising the first error one of them had
+*/
+static void endworkers (lua_State *L, rWorker *wk, int nw) {
+  int i;
+  const char *err = NULL;
+  for (i = 0; i < nw; i++) {
+    if (err == NULL && wk[i].error[0] != '\0') err = wk[i].error;
+    lua_close(wk[i].L);
+  }
+  if (err != NULL) {
+    lua_pushstring(L, err);  /* (before the workers go) */
+    lua_remove(L, -2);
+    lua_error(L);
+  }
+  lua_pop(L, 1);
+}
+
+
+/*
+** rosie: rchunked(p, input, boundary, n [, encoding [, threads]])
+** matches the
+** records of 'p' one after another from the start of the input, as
+** rrecords does, in the chunks that rspeculate gives.  Every chunk is
+** matched on its own, from its speculative start up to the next one;
+** then, in order, a chunk is kept when the records before it ended
+** exactly at its start, and is matched again from where they did end
+** when not (a boundary that was not between records).  So the outcome
+** is that of one rrecords over the whole input.  Returns the buffer
+** (nil for "bool"), the number of records, the position after the last
+** one, whether it halted, and the number of chunks matched again.
+**
+** The chunks do not depend on each other until they are stitched, so
+** they are matched by up to 'threads' threads (by default, one per
+** processor online), each with a Lua state, and so a backtrack stack
+** and capture buffers, of its own.  With one thread, or for a pattern
+** that cannot be matched outside its state (see 'startworkers'), they
+** are matched in turn in this state.
+*/
+static int r_chunked (lua_State *L) {
+  Capture capture[INITCAPSIZE];
+  Pattern *p, *b;
+  rChunk *ch;
+  rBuffer *buf;
+  const char **starts;
+  const char *s, *e, *pos;
+  size_t l;
+  rChunks cs;
+  rWorker *wk;
+  int n, m, k, encoding, bufidx, ptop, count = 0, abend = 0, redone = 0;
+  int nw, threaded, workers;
+  p = (getpatt(L, 1, NULL), getpattern(L, 1));
+  if (p->code == NULL) prepcompile(L, p, 1);
+  s = getsubject(L, 1, &l);
+  if (s == NULL) return 0;
+  e = s + l;
+  b = (getpatt(L, SUBJIDX+1, NULL), getpattern(L, SUBJIDX+1));
+  n = (int)luaL_checkinteger(L, SUBJIDX+2);
+  luaL_argcheck(L, n >= 1 && n <= R_MAXCHUNKS, SUBJIDX+2,
+                "invalid number of chunks");
+  encoding = luaL_optinteger(L, SUBJIDX+3, ENCODE_BYTE);
+  checklength(L, l, encoding);
+  nw = (int)luaL_optinteger(L, SUBJIDX+4, onlinecpus());
+  luaL_argcheck(L, nw >= 1, SUBJIDX+4, "invalid number of threads");
+  lua_settop(L, SUBJIDX+4);
+  starts = (const char **)lua_newuserdata(L, n * sizeof(const char *));
+  m = speculate(L, b, SUBJIDX+1, s, e, n, starts);
+  buf = outbuffer(L, encoding, "chunked");
+  bufidx = lua_gettop(L);
+  ch = (rChunk *)lua_newuserdata(L, m * sizeof(rChunk));
+  for (k = 0; k < m; k++)
+    ch[k].start = starts[k];
+  if (nw > m) nw = m;
+  if (nw > R_MAXTHREADS) nw = R_MAXTHREADS;
+  threaded = (nw > 1 && startworkers(L, p, s, e, ch, m, encoding, nw,
+                                     &cs, &wk));
+  if (!threaded) {
+    lua_createtable(L, m, 0);  /* keeps the buffers of the other chunks */
+    for (k = 0; k < m; k++) {
+      ch[k].buf = buf;  /* the first chunk goes straight to the output */
+      if (k > 0 && buf != NULL) {
+        ch[k].buf = r_newbuffer(L);
+        lua_rawseti(L, -2, k);
+      }
+    }
+  }
+  workers = lua_gettop(L);
+  lua_pushvalue(L, bufidx);
+  ptop = lua_gettop(L);
+  lua_pushnil(L);  /* initialize subscache */
+  lua_pushlightuserdata(L, capture);  /* initialize caplistidx */
+  lua_getuservalue(L, 1);  /* initialize penvidx */
+  for (k = 0; !threaded && k < m; k++) {  /* the speculative part */
+    const char *stop = (k + 1 < m) ? starts[k + 1] : e;
+    ch[k].count = 0;
+    ch[k].end = matchrecords(L, p, s, ch[k].start, stop, e, ch[k].buf,
+                             encoding, capture, ptop, &ch[k].count,
+                             &ch[k].abend);
+  }
+  if (threaded) {  /* raise the error of a worker, if any */
+    for (k = 0; k < nw && wk[k].error[0] == '\0'; k++) ;
+    if (k < nw) {
+      lua_settop(L, workers);
+      endworkers(L, wk, nw);
+    }
+  }
+  pos = s;
+  for (k = 0; k < m; k++) {  /* validate and stitch, in order */
+    const char *stop = (k + 1 < m) ? starts[k + 1] : e;
+    if (pos == ch[k].start) {
+      if ((k > 0 || threaded) && buf != NULL)
+        r_addlstring(L, buf, ch[k].buf->data, ch[k].buf->n);
+      count += ch[k].count;
+      pos = ch[k].end;
+      abend = ch[k].abend;
+    }
+    else if (pos < stop) {  /* a record went past the start of the chunk */
+      redone++;
+      pos = matchrecords(L, p, s, pos, stop, e, buf, encoding, capture,
+                         ptop, &count, &abend);
+    }
+    if (abend || pos < stop) break;  /* the records end in this chunk */
+  }
+  if (threaded) {
+    lua_settop(L, workers);
+    endworkers(L, wk, nw);
+  }
+  lua_pushvalue(L, bufidx);  /* the buffer (or nil) */
+  lua_pushinteger(L, count);
+  lua_pushinteger(L, (lua_Integer)(pos - s) + 1);
+  lua_pushboolean(L, abend);
+  lua_pushinteger(L, redone);
+  return 5;
+}
+
+/* }====================================================== */
+
+
+/*
+** {======================================================
+** rosie: pattern sets
+** =======================================================
+*/
+
+#define ROSIE_PATTSET "ROSIE_PATTSET"
+
+/*
+** A set of patterns matched together.  'cand[first[c]..first[c+1])'
+** lists, in priority order, the patterns that can match a subject
+** starting with byte 'c'; 'first[UCHAR_MAX + 1]' begins those that can
+** match at the end of the subject.  The patterns themselves are in
+** the uservalue of the set, so they live as long as it does.
+*/
+typedef struct rSet {
+  int n;  /* number of patterns */
+  int min;  /* shortest subject any of them can match */
+  int first[UCHAR_MAX + 3];
+  Pattern **patt;  /* the patterns, by id - 1 */
+  int *cand;
+} rSet;
+
+
+/*
+** rosie: rset(list) makes a set of the patterns in 'list'; their
+** positions in the list are their ids, and earlier ones have priority
+*/
+static int r_newset (lua_State *L) {
+  rSet *set;
+  Charset *cs;
+  byte *atend;
+  int i, c, n, total = 0;
+  luaL_checktype(L, 1, LUA_TTABLE);
+  n = (int)lua_rawlen(L, 1);
+  luaL_argcheck(L, n > 0, 1, "empty pattern set");
+  cs = (Charset *)lua_newuserdata(L, n * (sizeof(Charset) + 1));
+  atend = (byte *)(cs + n);
+  lua_createtable(L, n, 0);  /* patterns */
+  set = (rSet *)lua_newuserdata(L, sizeof(rSet) + n * sizeof(Pattern *));
+  set->n = n;
+  set->min = INT_MAX;
+  set->patt = (Pattern **)(set + 1);
+  for (i = 0; i < n; i++) {
+    Pattern *p;
+    lua_rawgeti(L, 1, i + 1);
+    getpatt(L, lua_gettop(L), NULL);  /* convert it to a pattern, if needed */
+    p = getpattern(L, -1);
+    if (p->code == NULL) prepcompile(L, p, lua_gettop(L));
+    atend[i] = (r_firstset(p->tree, &cs[i]) != 0);
+    if (atend[i]) loopset(j, cs[i].cs[j] = 0xFF);  /* can start anywhere */
+    for (c = 0; c <= UCHAR_MAX; c++) total += (testchar(cs[i].cs, c) != 0);
+    if (p->filter.min < set->min) set->min = p->filter.min;
+    set->patt[i] = p;
+    lua_rawseti(L, -3, i + 1);
+  }
+  /* room for the candidates at the end of the subject, too */
+  set->cand = (int *)lua_newuserdata(L, (total + n) * sizeof(int));
+  lua_rawseti(L, -3, 0);
+  total = 0;
+  for (c = 0; c <= UCHAR_MAX + 1; c++) {
+    set->first[c] = total;
+    for (i = 0; i < n; i++)
+      if (c > UCHAR_MAX ? atend[i] : testchar(cs[i].cs, c))
+        set->cand[total++] = i;
+  }
+  set->first[UCHAR_MAX + 2] = total;
+  lua_pushvalue(L, -2);
+  lua_setuservalue(L, -2);
+  luaL_newmetatable(L, ROSIE_PATTSET);
+  lua_setmetatable(L, -2);
+  return 1;
+}
+
+
+/*
+** Match pattern 'i' of a set without captures (using its twin, when it
+** has one) at 's'; on a match, '*abend' tells whether it halted.
+*/
+static const char *setcandidate (lua_State *L, rSet *set, int i, int penv,
+                                 const char *o, const char *s,
+                                 const char *e, Capture *capture, int ptop,
+                                 int *abend) {
+  Pattern *p = set->patt[i];
+  rTwin *t = (p->jit != NULL && p->jit->aot) ? NULL : gettwin(L, p);
+  Pattern *q = (t != NULL) ? &t->p : p;
+  const char *r;
+  if (r_filterrejects(&p->filter, s, e)) return NULL;
+  lua_settop(L, ptop);
+  lua_pushnil(L);  /* initialize subscache */
+  lua_pushlightuserdata(L, capture);  /* initialize caplistidx */
+  lua_rawgeti(L, penv, i + 1);
+  lua_getuservalue(L, -1);  /* initialize penvidx */
+  lua_remove(L, -2);
+  r = runmatch(L, q, o, s, e, q->code, capture, ptop);
+  if (r != NULL)
+    *abend = halted((Capture *)lua_touserdata(L, caplistidx(ptop)));
+  return r;
+}
+
+
+/*
+** rosie: rsetmatch(set, input [, start [, encoding [, all]]]) matches
+** the patterns of a set at the start position, trying only those that
+** can start with the byte there.  Returns the id of the first pattern
+** (in priority order) that matches, or with 'all' the list of the ids
+** of all that match; then that first one's match as rmatch returns
+** it: encoded captures (or true for the "bool" encoding), leftover
+** and abend.  With no match, returns false, false, the length of the
+** input, and false.
+*/
+static int r_setmatch (lua_State *L) {
+  Capture capture[INITCAPSIZE];
+  rSet *set = (rSet *)luaL_checkudata(L, 1, ROSIE_PATTSET);
+  const char *s, *r, *rwin = NULL;
+  size_t l, i;
+  int encoding, all, penv, ptop, k, last, win = -1, abend = 0, ab;
+  s = getsubject(L, 1, &l);
+  if (s == NULL) return 0;
+  i = initposition(L, l, SUBJIDX+1);
+  encoding = luaL_optinteger(L, SUBJIDX+2, ENCODE_BYTE);
+  checklength(L, l, encoding);
+  all = lua_toboolean(L, SUBJIDX+3);
+  lua_settop(L, SUBJIDX+3);
+  lua_getuservalue(L, 1);
+  penv = lua_gettop(L);
+  if (all) lua_newtable(L);  /* ids */
+  ptop = lua_gettop(L);
+  if ((int)(l - i) >= set->min) {
+    int c = (i < l) ? (byte)s[i] : UCHAR_MAX + 1;
+    last = set->first[c + 1];
+    for (k = set->first[c]; k < last; k++) {
+      int id = set->cand[k];
+      r = setcandidate(L, set, id, penv, s, s + i, s + l, capture, ptop,
+                       &ab);
+      if (r == NULL) continue;
+      if (win < 0) {
+        win = id;  rwin = r;  abend = ab;
+      }
+      if (!all) break;
+      lua_pushinteger(L, id + 1);
+      lua_rawseti(L, ptop, (lua_Integer)lua_rawlen(L, ptop) + 1);
+    }
+  }
+  lua_settop(L, ptop);
+  if (!all) {
+    if (win < 0) lua_pushboolean(L, 0);
+    else lua_pushinteger(L, win + 1);
+  }
+  if (win < 0) {
+    lua_pushboolean(L, 0);
+    lua_pushinteger(L, l);
+    lua_pushboolean(L, 0);
+    return 4;
+  }
+  if (encoding == ENCODE_BOOL) {
+    lua_pushboolean(L, 1);
+    lua_pushinteger(L, l - (rwin - s));
+    lua_pushboolean(L, abend);
+    return 4;
+  }
+  /* run the winner for its captures */
+  ptop = lua_gettop(L);
+  lua_pushnil(L);  /* initialize subscache */
+  lua_pushlightuserdata(L, capture);  /* initialize caplistidx */
+  lua_rawgeti(L, penv, win + 1);
+  lua_getuservalue(L, -1);  /* initialize penvidx */
+  lua_remove(L, -2);
+  r = runmatch(L, set->patt[win], s, s + i, s + l, set->patt[win]->code,
+               capture, ptop);
+  assert(r == rwin);
+  r_getcaptures(L, s, r, ptop, encoding, l);
+  lua_pushvalue(L, ptop);  /* the id(s) go first */
+  lua_insert(L, -4);
+  return 4;
+}
+
+/* }====================================================== */
+
+
+/* rosie: like rmatch, but the match may start anywhere (see do_r_match) */
+int r_search_lua (lua_State *L);
+int r_search_lua (lua_State *L) {
+  return do_r_match(L, 1, 1);
+}
+
+int r_search_C (lua_State *L) {
+  return do_r_match(L, 0, 1);
 }
 
 /*
@@ -1343,7 +3264,22 @@ static int lp_type (lua_State *L) {
 
 int lp_gc (lua_State *L) {
   Pattern *p = getpattern(L, 1);
+  if (p->code != NULL) r_dfafreecode(p->code, p->codesize);  /* rosie */
   realloccode(L, p, 0);  /* delete code block */
+  r_jitfree(p->jit);  /* rosie */
+  p->jit = NULL;
+  freetwin(L, p);  /* rosie */
+  freesearch(L, p);  /* rosie */
+  r_freecache(L, p->cache);  /* rosie */
+  p->cache = NULL;
+  r_freeprofile(L, p->profile);  /* rosie */
+  p->profile = NULL;
+  if (p->tree != p->node && p->tree != NULL) {  /* rosie: a node's tree? */
+    void *ud;
+    lua_Alloc f = lua_getallocf(L, &ud);
+    f(ud, p->tree, p->treesize * sizeof(TTree), 0);
+    p->tree = NULL;
+  }
   return 0;
 }
 
@@ -1384,6 +3320,7 @@ static int lp_locale (lua_State *L) {
 static struct luaL_Reg pattreg[] = {
   {"ptree", lp_printtree},
   {"pcode", lp_printcode},
+  {"panalyses", lp_analyses},  /* rosie */
   {"match", lp_match},
   {"B", lp_behind},
   {"V", lp_V},
@@ -1410,12 +3347,32 @@ static struct luaL_Reg pattreg[] = {
   {"psize", r_pattern_size},
   {"rcap", r_capture},
   {"rconstcap", r_constcapture},
+  {"rpred", r_predicate_capture},
+  {"registerpredicate", r_lua_registerpredicate},
+  {"predicates", r_lua_predicates},
   {"rmatch", r_match_lua},
+  {"rsearch", r_search_lua},
+  {"rcache", r_cache},
+  {"rprofile", r_profile},
+  {"rlayout", r_layout},
+  {"rorder", r_order},
+  {"rfindall", r_findall},
+  {"rmatchlines", r_matchlines},
+  {"rspeculate", r_speculate},
+  {"rrecords", r_records},
+  {"rchunked", r_chunked},
+  {"rsubst", r_subst},
+  {"rset", r_newset},
+  {"rsetmatch", r_setmatch},
+  {"jit", r_jit},
+  {"aotsource", r_aot_source},
+  {"aot", r_aot},
   {"newbuffer", r_lua_newbuffer},
   {"getdata", r_lua_getdata},
   {"writedata", r_lua_writedata},
   {"add", r_lua_add},
   {"decode", r_lua_decode},
+  {"decodeall", r_lua_decodeall},
   {NULL, NULL}
 };
 
@@ -1437,6 +3394,12 @@ int luaopen_lpeg (lua_State *L) {
   luaL_newmetatable(L, PATTERN_T);
   lua_pushnumber(L, MAXBACK);  /* initialize maximum backtracking */
   lua_setfield(L, LUA_REGISTRYINDEX, MAXSTACKIDX);
+  lua_newtable(L);  /* rosie: nodes, with weak values */
+  lua_newtable(L);
+  lua_pushliteral(L, "v");
+  lua_setfield(L, -2, "__mode");
+  lua_setmetatable(L, -2);
+  lua_setfield(L, LUA_REGISTRYINDEX, R_NODES);
   luaL_setfuncs(L, metareg, 0);
   luaL_newlib(L, pattreg);
   lua_pushvalue(L, -1);
@@ -26,6 +26,7 @@ typedef enum TTag {
   TCapture,  /* regular capture */
   TRunTime,  /* run-time capture */
   THalt,			/* rosie */
+  TPredicate,			/* rosie: native predicate 'u.n' on sib1 */
 } TTag;
 
 /* number of siblings for each tree */
@@ -42,7 +43,8 @@ extern const byte numsiblings[];
 */
 typedef struct TTree {
   byte tag;
-  byte cap;  /* kind of capture (if it is a capture) */
+  unsigned short cap;  /* kind of capture (if it is a capture) */
+                       /* rosie: or rule number (if it is a rule) */
   capidx_t key;  /* key in ktable for Lua data (0 if no key) */
   union {
     int ps;  /* occasional second sibling */
@@ -51,17 +53,59 @@ typedef struct TTree {
 } TTree;
 
 
+/* rosie: longest literal kept by a prefilter */
+#define R_LITMAX	32
+
+/*
+** rosie: a quick test for subjects a pattern cannot match.  Every
+** match consumes at least 'min' bytes (and at most 'max' when 'max' is
+** not negative); these bytes start with the 'prelen' bytes of 'pre'
+** and contain the 'len' bytes of 'lit'.  See r_prefilter in lpcode.c.
+*/
+typedef struct rFilter {
+  int min, max;
+  int prelen, len;  /* 0 when there is no such literal */
+  char pre[R_LITMAX];
+  char lit[R_LITMAX];
+} rFilter;
+
+
 /*
 ** A complete pattern has its tree plus, if already compiled,
 ** its corresponding code
+** rosie: a pattern made by a combinator is a node, with only its root
+** in 'node' until its tree is made elsewhere (see "Pattern nodes" in
+** lptree.c); other patterns have their tree in 'node'
 */
 typedef struct Pattern {
   union Instruction *code;
   int codesize;
-  TTree tree[1];
+  struct rJit *jit;  /* rosie: native code, when requested (see rjit.h) */
+  struct rTwin *twin;  /* rosie: the same code without captures */
+  struct rSearch *search;  /* rosie: how 'rsearch' finds candidates */
+  struct rCache *cache;  /* rosie: results of rmatch, when asked for */
+  struct rProfile *profile;  /* rosie: counts, while profiling (see rprof.h) */
+  rFilter filter;  /* rosie: set when compiled */
+  TTree *tree;  /* rosie: 'node', a tree made for a node, or NULL */
+  int treesize;  /* rosie: in nodes, also for a node */
+  byte props;  /* rosie: what is known about the tree */
+  TTree node[1];
 } Pattern;
 
 
+/*
+** rosie: the capture-free twin of a pattern with captures.  It accepts
+** the same subjects and ends its matches at the same place, so it is
+** run first to reject subjects cheaply; only subjects that match are
+** run again with the captures.  'tries' and 'hits' count how often that
+** pays, and 'skips' samples the calls when it does not.
+*/
+typedef struct rTwin {
+  unsigned int tries, hits, skips;
+  Pattern p;  /* only its code and native code are used */
+} rTwin;
+
+
 /* number of siblings for each tree */
 extern const byte numsiblings[];
 
@@ -24,6 +24,7 @@
 
 #define PATTERN_T	"lpeg-pattern"
 #define MAXSTACKIDX	"lpeg-maxstack"
+#define R_NODES		"lpeg-nodes"	/* rosie: see "Pattern nodes" in lptree.c */
 
 
 /*
@@ -56,8 +57,14 @@
 
 
 /* maximum number of rules in a grammar */
+/* rosie: rule numbers are kept in the 'cap' of their TRule */
 #if !defined(MAXRULES)
-#define MAXRULES        1000
+#define MAXRULES        (USHRT_MAX + 1)
+#endif
+
+/* rosie: largest rule body (in tree nodes) that calls may inline */
+#if !defined(R_INLINESIZE)
+#define R_INLINESIZE    16
 #endif
 
 /* #define MAXCAPIDX USHRT_MAX */
@@ -123,15 +130,16 @@ typedef struct Charset {
 #define joinkindoff(k,o)	((k) | ((o) << 4))
 
 #define MAXOFF		0xF
-#define MAXAUX		0xFFFF	/* aux field of instruction is 'short' */
+#define MAXAUX		0xFF	/* aux field of instruction is a byte */
 
 
 /* maximum number of bytes to look behind */
-#define MAXBEHIND	0x7FFF	/* MAXAUX at most (stored in aux field of instruction) */
+#define MAXBEHIND	SHRT_MAX	/* rosie: stored in key field of instruction */
 
 
 /* maximum size (in elements) for a pattern */
-#define MAXPATTSIZE	(SHRT_MAX - 10)
+/* rosie: of its tree or code, as offsets in both are ints */
+#define MAXPATTSIZE	(INT_MAX / 2)
 
 
 /* size (in elements) for an instruction plus extra l bytes */
@@ -141,6 +149,9 @@ typedef struct Charset {
 /* size (in elements) for a ISet instruction */
 #define CHARSETINSTSIZE		instsize(CHARSETSIZE)
 
+/* rosie: size (in elements) for a IClasses instruction */
+#define CLASSINSTSIZE		instsize(UCHAR_MAX + 1)
+
 /* size (in elements) for a IFunc instruction */
 #define funcinstsize(p)		((p)->i.aux + 2)
 
@@ -14,6 +14,9 @@
 #include "lptypes.h"
 #include "lpvm.h"
 #include "lpprint.h"
+#include "rpred.h"
+#include "rdfa.h"
+#include "rprof.h"
 
 
 /* initial size for call/backtrack stack */
@@ -22,11 +25,21 @@
 #endif
 
 
-#define getoffset(p)	(((p) + 1)->offset)
-
 static const Instruction giveup = {{IGiveup, 0, 0}};
 
 
+/*
+** rosie: the bitmap of the charset of a set instruction, whichever
+** kind of entry of the pool it refers to
+*/
+void r_getcharset (const Instruction *p, byte *cs) {
+  int c;
+  memset(cs, 0, CHARSETSIZE);
+  for (c = 0; c <= UCHAR_MAX; c++)
+    if (inset(p, c)) cs[c >> 3] |= (byte)(1 << (c & 7));
+}
+
+
 /*
 ** {======================================================
 ** Virtual Machine
@@ -88,7 +101,8 @@ static Stack *doublestack (lua_State *L, Stack **stacklimit, int ptop) {
 ** is the result; 'curr' is current subject position; 'limit'
 ** is subject's size.
 */
-static int resdyncaptures (lua_State *L, int fr, int curr, int limit) {
+static ptrdiff_t resdyncaptures (lua_State *L, int fr, ptrdiff_t curr,
+                                 ptrdiff_t limit) {  /* rosie: was int */
   lua_Integer res;
   if (!lua_toboolean(L, fr)) {  /* false value? */
     lua_settop(L, fr - 1);  /* remove results */
@@ -142,6 +156,82 @@ static int removedyncap (lua_State *L, Capture *capture,
 
 
 
+/*
+** {======================================================
+** rosie: checkpoints (see lpvm.h)
+** =======================================================
+*/
+
+void r_resumeinit (rResume *rs) {
+  rs->n = 0;  rs->next = 0;  rs->prevlen = 0;  rs->resumed = 0;
+}
+
+
+/*
+** Save the state of the VM as a checkpoint, when there is room for it
+** and it does not depend on where the subject ends.  'maxs' is the
+** furthest position the match has looked at so far.
+*/
+static void savecheckpoint (rResume *rs, const char *o, const char *s,
+                            const char *e, const char *maxs,
+                            const Instruction *p, const Stack *base,
+                            const Stack *top, const Capture *capture,
+                            int captop) {
+  rCheckpoint *ck = &rs->ck[rs->n];
+  int stackat = 0, capat = 0, i;
+  size_t hw = ((maxs > s) ? maxs : s) - o + 1;
+  rs->next = (s - o) + R_CKSPACING;
+  if (rs->n > 0) {
+    stackat = (ck - 1)->stackat + (ck - 1)->nstack;
+    capat = (ck - 1)->capat + (ck - 1)->ncap;
+  }
+  if (rs->n == R_CKMAX || maxs >= e || s >= e || hw > R_CKPREFIX
+      || stackat + (top - base) > R_CKSTACK || capat + captop > R_CKCAPS)
+    return;
+  ck->p = p;  ck->s = s - o;  ck->hw = hw;
+  ck->stackat = stackat;  ck->nstack = top - base;
+  ck->capat = capat;  ck->ncap = captop;
+  for (i = 0; i < ck->nstack; i++) {
+    rSavedStack *ss = &rs->stack[stackat + i];
+    ss->s = (base[i].s == NULL) ? -1 : base[i].s - o;
+    ss->p = base[i].p;
+    ss->caplevel = base[i].caplevel;
+  }
+  for (i = 0; i < captop; i++) {
+    rSavedCap *sc = &rs->cap[capat + i];
+    sc->s = capture[i].s - o;
+    sc->idx = capture[i].idx;
+    sc->kind = capture[i].kind;
+    sc->siz = capture[i].siz;
+  }
+  if (hw > rs->prevlen) {  /* keep the bytes it depends on */
+    memcpy(rs->prev + rs->prevlen, o + rs->prevlen, hw - rs->prevlen);
+    rs->prevlen = hw;
+  }
+  rs->n++;
+}
+
+
+/*
+** Find the deepest checkpoint that holds for subject [s, e), which is
+** one whose bytes are the same in it; later ones are dropped.  Returns
+** its index, or -1.
+*/
+static int findcheckpoint (rResume *rs, const char *s, const char *e) {
+  size_t len = e - s, same = 0;
+  int k;
+  while (same < rs->prevlen && same < len && rs->prev[same] == s[same])
+    same++;
+  for (k = rs->n - 1; k >= 0 && rs->ck[k].hw > same; k--) ;
+  rs->n = k + 1;
+  rs->prevlen = (k >= 0) ? rs->ck[k].hw : 0;
+  rs->next = (k >= 0) ? rs->ck[k].s + R_CKSPACING : 0;
+  return k;
+}
+
+/* }====================================================== */
+
+
 /* 
   Mark reports: 98% of bytecodes executed in the Rosie syslog pattern are these (in order): 
     TestSet, Any, PartialCommit
@@ -149,11 +239,23 @@ static int removedyncap (lua_State *L, Capture *capture,
   range test is faster.  New lpeg opcode and compiler optimization?
 */
 
+/* rosie: where it is cheap to resume, take a checkpoint now and then */
+#define checkpoint() \
+  { if (rs != NULL && (size_t)(s - o) >= rs->next && ndyncap == 0) \
+      savecheckpoint(rs, o, s, e, maxs, p, getstackbase(L, ptop), \
+                     stack, capture, captop); }
+
+
 /*
-** Opcode interpreter
+** Opcode interpreter.  rosie: with 'rs', it resumes from a checkpoint
+** when it can, and takes new ones; with 'count', it counts the runs of
+** each instruction.  'match', 'r_resumematch' and 'r_profilematch' each
+** get a copy of it, so that plain matches pay nothing for that.
 */
-const char *match (lua_State *L, const char *o, const char *s, const char *e,
-                   Instruction *op, Capture *capture, int ptop) {
+static inline __attribute__ ((always_inline))
+const char *runvm (lua_State *L, const char *o, const char *s, const char *e,
+                   Instruction *op, Capture *capture, int ptop, rResume *rs,
+                   uint64_t *count) {
   Stack stackbase[INITBACK];
   Stack *stacklimit = stackbase + INITBACK;
   Stack *stack = stackbase;  /* point to first empty slot in stack */
@@ -161,8 +263,41 @@ const char *match (lua_State *L, const char *o, const char *s, const char *e,
   int captop = 0;  /* point to first empty slot in captures */
   int ndyncap = 0;  /* number of dynamic captures (in Lua stack) */
   const Instruction *p = op;  /* current instruction */
+  const char *maxs = s;  /* rosie: furthest position looked at (with 'rs') */
   stack->p = &giveup; stack->s = s; stack->caplevel = 0; stack++;
   lua_pushlightuserdata(L, stackbase);
+  if (rs != NULL) {  /* rosie: resume from a checkpoint? */
+    int k = findcheckpoint(rs, s, e);
+    if (k >= 0) {
+      const rCheckpoint *ck = &rs->ck[k];
+      const rSavedStack *ss = &rs->stack[ck->stackat];
+      const rSavedCap *sc = &rs->cap[ck->capat];
+      int i;
+      while (stacklimit - getstackbase(L, ptop) < ck->nstack)
+        doublestack(L, &stacklimit, ptop);
+      stack = getstackbase(L, ptop);
+      for (i = 0; i < ck->nstack; i++, stack++) {
+        stack->s = (ss[i].s < 0) ? NULL : o + ss[i].s;
+        stack->p = ss[i].p;
+        stack->caplevel = ss[i].caplevel;
+      }
+      while (capsize <= ck->ncap) {
+        capture = doublecap(L, capture, capsize, ptop);
+        capsize *= 2;
+      }
+      for (i = 0; i < ck->ncap; i++) {
+        capture[i].s = o + sc[i].s;
+        capture[i].idx = sc[i].idx;
+        capture[i].kind = sc[i].kind;
+        capture[i].siz = sc[i].siz;
+      }
+      captop = ck->ncap;
+      p = ck->p;
+      s = o + ck->s;
+      maxs = o + ck->hw - 1;
+      rs->resumed += ck->s;
+    }
+  }
   for (;;) {
 #if defined(DEBUG)
       printf("s: |%s| stck:%d, dyncaps:%d, caps:%d  ",
@@ -172,6 +307,7 @@ const char *match (lua_State *L, const char *o, const char *s, const char *e,
       fflush();
 #endif
     assert(stackidx(ptop) + ndyncap == lua_gettop(L) && ndyncap <= captop);
+    if (count != NULL && p != &giveup) count[p - op]++;
     switch ((Opcode)p->i.code) {
       case IEnd: {
         assert(stack == getstackbase(L, ptop) + 1);
@@ -195,7 +331,7 @@ const char *match (lua_State *L, const char *o, const char *s, const char *e,
         continue;
       }
       case ITestAny: {
-        if (s < e) p += 2;
+        if (s < e) p += 1 + longjump(p);
         else p += getoffset(p);
         continue;
       }
@@ -205,33 +341,34 @@ const char *match (lua_State *L, const char *o, const char *s, const char *e,
         continue;
       }
       case ITestChar: {
-        if (s < e && ((byte)*s == p->i.aux)) p += 2;
+        if (s < e && ((byte)*s == p->i.aux)) p += 1 + longjump(p);
         else p += getoffset(p);
         continue;
       }
       case ISet: {
-        if (s < e && testchar((p+1)->buff, (int)((byte)*s)))
-          { p += CHARSETINSTSIZE; s++; }
+        if (s < e && insetat(p, 1, (int)((byte)*s)))
+          { p += 2; s++; }
         else goto fail;
         continue;
       }
       case ITestSet: {
-        if (s < e && testchar((p + 2)->buff, (int)((byte)*s)))
-          p += 1 + CHARSETINSTSIZE;
+        if (s < e && inset(p, (int)((byte)*s)))
+          p += 2 + longjump(p);
         else p += getoffset(p);
         continue;
       }
       case IBehind: {
-        int n = p->i.aux;
+        int n = p->i.key;
+        if (rs != NULL && s > maxs) maxs = s;  /* rosie */
         if (n > s - o) goto fail;
         s -= n; p++;
         continue;
       }
       case ISpan: {
         for (; s < e; s++) {
-          if (!testchar((p+1)->buff, (int)((byte)*s))) break;
+          if (!insetat(p, 1, (int)((byte)*s))) break;
         }
-        p += CHARSETINSTSIZE;
+        p += 2;
         continue;
       }
       case IJmp: {
@@ -239,20 +376,22 @@ const char *match (lua_State *L, const char *o, const char *s, const char *e,
         continue;
       }
       case IChoice: {
+        checkpoint();  /* rosie */
         if (stack == stacklimit)
           stack = doublestack(L, &stacklimit, ptop);
         stack->p = p + getoffset(p);
         stack->s = s;
         stack->caplevel = captop;
         stack++;
-        p += 2;
+        p += 1 + longjump(p);
         continue;
       }
       case ICall: {
+        checkpoint();  /* rosie */
         if (stack == stacklimit)
           stack = doublestack(L, &stacklimit, ptop);
         stack->s = NULL;
-        stack->p = p + 2;  /* save return address */
+        stack->p = p + 1 + longjump(p);  /* save return address */
         stack++;
         p += getoffset(p);
         continue;
@@ -264,6 +403,7 @@ const char *match (lua_State *L, const char *o, const char *s, const char *e,
         continue;
       }
       case IPartialCommit: {
+        checkpoint();  /* rosie */
         assert(stack > getstackbase(L, ptop) && (stack - 1)->s != NULL);
         (stack - 1)->s = s;
         (stack - 1)->caplevel = captop;
@@ -272,6 +412,7 @@ const char *match (lua_State *L, const char *o, const char *s, const char *e,
       }
       case IBackCommit: {
         assert(stack > getstackbase(L, ptop) && (stack - 1)->s != NULL);
+        if (rs != NULL && s > maxs) maxs = s;  /* rosie */
         s = (--stack)->s;
         captop = stack->caplevel;
         p += getoffset(p);
@@ -283,6 +424,7 @@ const char *match (lua_State *L, const char *o, const char *s, const char *e,
 	__attribute__ ((fallthrough));
       case IFail:
       fail: { /* pattern failed: try to backtrack */
+        if (rs != NULL && s > maxs) maxs = s;  /* rosie */
         do {  /* remove pending calls */
           assert(stack > getstackbase(L, ptop));
           s = (--stack)->s;
@@ -295,8 +437,10 @@ const char *match (lua_State *L, const char *o, const char *s, const char *e,
       }
       case ICloseRunTime: {
         CapState cs;
-        int rem, res, n;
+        int rem, n;
+        ptrdiff_t res;  /* rosie: subjects may be over 2GB */
         int fr = lua_gettop(L) + 1;  /* stack index of first result */
+        maxs = e;  /* rosie: it may look anywhere */
         cs.s = o; cs.L = L; cs.ocap = capture; cs.ptop = ptop;
         n = runtimecap(&cs, capture + captop, s, &rem);  /* call function */
         captop -= n;  /* remove nested captures */
@@ -335,6 +479,7 @@ const char *match (lua_State *L, const char *o, const char *s, const char *e,
         }
       }
       case IOpenCapture:
+        checkpoint();  /* rosie */
         capture[captop].siz = 0;  /* mark entry as open */
         capture[captop].s = s;
         goto pushcapture;
@@ -343,15 +488,43 @@ const char *match (lua_State *L, const char *o, const char *s, const char *e,
         capture[captop].s = s - getoff(p);
         /* goto pushcapture; */
       pushcapture: {
-        capture[captop].idx = p->i.key;
+        capture[captop].idx = getkey(p);
         capture[captop].kind = getkind(p);
         if (++captop >= capsize) {
           capture = doublecap(L, capture, captop, ptop);
           capsize = 2 * captop;
         }
-        p++;
+        p += 1 + widekey(p);  /* rosie */
+        continue;
+      }
+      case IPredicate: {			    /* rosie */
+        const char *start, *res;
+        maxs = e;  /* it may look anywhere */
+        if ((p + 2)->offset >= 0)  /* body has fixed length? */
+          start = s - (p + 2)->offset;
+        else {  /* body started at the position saved by its choice */
+          assert(stack > getstackbase(L, ptop) && (stack - 1)->s != NULL);
+          start = (--stack)->s;
+        }
+        res = r_predicatefn(p->i.aux)(o, start, s, e);
+        if (res == NULL) goto fail;
+        assert(s <= res && res <= e);
+        s = res;
+        p += getoffset(p);
         continue;
       }
+      case IDfa: {				    /* rosie */
+        const char *end;
+        if (rs != NULL) {  /* how far it looks is not known */
+          p += DFAINSTSIZE;
+          continue;
+        }
+        switch (r_dfarun(r_getdfa(p), s, e, &end)) {
+          case R_DFA_MATCH: s = end; p += getoffset(p); continue;
+          case R_DFA_FAIL: goto fail;
+          default: p += DFAINSTSIZE; continue;  /* run the region's code */
+        }
+      }
       case IHalt: {				    /* rosie */
 	/* FUTURE: Maybe unwind the stack, if there is any info there that we could use? */
         capture[captop].kind = Cfinal;
@@ -363,6 +536,32 @@ const char *match (lua_State *L, const char *o, const char *s, const char *e,
   }
 }
 
+
+const char *match (lua_State *L, const char *o, const char *s, const char *e,
+                   Instruction *op, Capture *capture, int ptop) {
+  return runvm(L, o, s, e, op, capture, ptop, NULL, NULL);
+}
+
+
+/*
+** rosie: match subject [s, e) from its start, resuming from the deepest
+** checkpoint in 'rs' that holds for it, and taking new checkpoints
+*/
+const char *r_resumematch (lua_State *L, const char *s, const char *e,
+                           Instruction *op, Capture *capture, int ptop,
+                           rResume *rs) {
+  return runvm(L, s, s, e, op, capture, ptop, rs, NULL);
+}
+
+
+/* rosie: match, counting the runs of each instruction in 'pf' */
+const char *r_profilematch (lua_State *L, const char *o, const char *s,
+                            const char *e, Instruction *op, Capture *capture,
+                            int ptop, struct rProfile *pf) {
+  pf->runs++;
+  return runvm(L, o, s, e, op, capture, ptop, NULL, pf->count);
+}
+
 /* }====================================================== */
 
 
@@ -17,13 +17,13 @@ typedef enum Opcode {
   ITestChar,  /* if char != aux, jump to 'offset' */
   ITestSet,  /* if char not in buff, jump to 'offset' */
   ISpan,  /* read a span of chars in buff */
-  IBehind,  /* walk back 'aux' characters (fail if not possible) */
+  IBehind,  /* walk back 'key' characters (fail if not possible) */
   IRet,  /* return from a rule */
   IEnd,  /* end of pattern */
   IChoice,  /* stack a choice; next fail will jump to 'offset' */
   IJmp,  /* jump to 'offset' */
   ICall,  /* call rule at 'offset' */
-  IOpenCall,  /* call rule number 'key' (must be closed to a ICall) */
+  IOpenCall,  /* call rule number 'offset' (must be closed to a ICall) */
   ICommit,  /* pop choice and jump to 'offset' */
   IPartialCommit,  /* update top choice to current position and jump */
   IBackCommit,  /* "fails" but jump to its own 'offset' */
@@ -34,7 +34,11 @@ typedef enum Opcode {
   IOpenCapture,  /* start a capture */
   ICloseCapture,
   ICloseRunTime,
-  IHalt				/* rosie */
+  IHalt,				/* rosie */
+  IPredicate,			/* rosie: call predicate 'aux'; jump to 'offset' */
+  IDfa,				/* rosie: run a DFA; on a match, jump to 'offset' */
+  ICharset,			/* rosie: a charset of the pool (never runs) */
+  IClasses			/* rosie: up to 8 charsets of the pool (never runs) */
 } Opcode;
 
 
@@ -42,17 +46,110 @@ typedef enum Opcode {
 typedef union Instruction {
   struct Inst {
     byte code;
-    short aux;			/* Rosie (was byte) */
-    short key;
+    byte aux;
+    short key;			/* rosie: or a short offset (see below) */
   } i;
   int offset;
   byte buff[1];
 } Instruction;
 
 
+/*
+** rosie: an instruction takes one word of 4 bytes, plus the words of
+** its operands, if any.  An instruction with a label keeps its offset
+** in 'key' when it fits there, and else (with 0 in 'key') in the word
+** after it.  Code is generated with every offset in a word of its own,
+** and 'r_recode' then moves into 'key' those that fit.  IPredicate,
+** IDfa, and IOpenCall always keep theirs in a word.
+*/
+#define longjump(p)	((p)->i.key == 0)
+#define getoffset(p)	(longjump(p) ? ((p) + 1)->offset : (int)(p)->i.key)
+
+
+/*
+** rosie: likewise, IFullCapture and IOpenCapture keep their key into
+** the ktable in 'key' when it fits there, and else (with -1 in 'key')
+** in the word after them
+*/
+#define widekey(p)	((p)->i.key < 0)
+#define getkey(p)	(widekey(p) ? ((p) + 1)->offset : (int)(p)->i.key)
+
+
+/*
+** rosie: the charsets of ISet, ITestSet, and ISpan are kept once each in
+** a pool at the end of the code, after its IEnd.  Slot 'r' of the
+** instruction (the word after it, or after the offset of an ITestSet
+** with a long one) has the offset from the instruction to its entry:
+** an ICharset followed by the bitmap of one charset, or an IClasses
+** followed by a table of 256 bytes with a bit for each of up to 8
+** charsets, which the instruction selects with the mask in its 'aux'
+** (0 for an ICharset).
+*/
+#define setslot(p)	((p)->i.code == ITestSet ? 1 + longjump(p) : 1)
+#define setentry(p,r)	((p) + ((p) + (r))->offset + 1)
+#define insetat(p,r,c) \
+	((p)->i.aux == 0 ? testchar(setentry(p,r)->buff, c) \
+	                 : (setentry(p,r)->buff[c] & (p)->i.aux))
+#define inset(p,c)	insetat(p, setslot(p), c)
+
+
+/*
+** rosie: checkpoints of the VM state, taken while matching one subject,
+** from which a match of a later subject that shares a prefix with it
+** can resume (see r_resumematch).  Positions are kept as offsets from
+** the start of the subject.
+*/
+#define R_CKMAX		32	/* checkpoints per subject */
+#define R_CKSPACING	4	/* least distance between two of them */
+#define R_CKSTACK	1024	/* room for saved backtrack entries */
+#define R_CKCAPS	1024	/* room for saved captures */
+#define R_CKPREFIX	4096	/* longest prefix a checkpoint can depend on */
+
+typedef struct rSavedStack {
+  ptrdiff_t s;  /* -1 for calls */
+  const Instruction *p;
+  int caplevel;
+} rSavedStack;
+
+typedef struct rSavedCap {
+  ptrdiff_t s;
+  capidx_t idx;
+  byte kind;
+  byte siz;
+} rSavedCap;
+
+typedef struct rCheckpoint {
+  const Instruction *p;  /* next instruction */
+  size_t s;  /* subject position */
+  size_t hw;  /* the state depends on this many bytes of the subject */
+  int stackat, nstack;  /* its entries in 'stack' */
+  int capat, ncap;  /* its entries in 'cap' */
+} rCheckpoint;
+
+typedef struct rResume {
+  int n;  /* number of valid checkpoints */
+  size_t next;  /* least position for the next checkpoint */
+  size_t prevlen;  /* bytes of the previous subject in 'prev' */
+  size_t resumed;  /* subject bytes skipped by resuming, in total */
+  rCheckpoint ck[R_CKMAX];
+  rSavedStack stack[R_CKSTACK];
+  rSavedCap cap[R_CKCAPS];
+  char prev[R_CKPREFIX];
+} rResume;
+
+
 void printpatt (Instruction *p, int n);
+void r_getcharset (const Instruction *p, byte *cs);
 const char *match (lua_State *L, const char *o, const char *s, const char *e,
                    Instruction *op, Capture *capture, int ptop);
+void r_resumeinit (rResume *rs);
+const char *r_resumematch (lua_State *L, const char *s, const char *e,
+                           Instruction *op, Capture *capture, int ptop,
+                           rResume *rs);
+struct rProfile;
+const char *r_profilematch (lua_State *L, const char *o, const char *s,
+                            const char *e, Instruction *op, Capture *capture,
+                            int ptop, struct rProfile *pf);
 
 
 #endif
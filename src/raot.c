@@ -0,0 +1,496 @@
+/*  -*- Mode: C/l; -*-                                                       */
+/*                                                                           */
+/*  raot.c   Ahead-of-time compilation of patterns to C                     */
+/*                                                                           */
+/*  © Copyright IBM Corporation 2017.                                        */
+/*  LICENSE: MIT License (https://opensource.org/licenses/mit-license.html)  */
+/*  AUTHOR: Jamie A. Jennings                                                */
+
+/*
+ * The generated C function has the same contract as the code made by
+ * the jit (rjit.c): it runs on a JitState, keeps the same backtrack
+ * stack and capture list as match() in lpvm.c, and so its captures
+ * are processed by the usual getcaptures/r_getcaptures.  Each
+ * instruction becomes a few lines of C with 'goto's between them.
+ * Backtrack entries hold label numbers, and a 'switch' at the end of
+ * the function maps them back to labels.
+ */
+
+#include <ctype.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "lua.h"
+#include "lauxlib.h"
+
+#include "lptypes.h"
+#include "lpcap.h"
+#include "lpcode.h"
+#include "lpvm.h"
+#include "rpred.h"
+#include "rjit.h"
+#include "raot.h"
+#include "rhash.h"
+
+
+/* how an instruction is reached, other than by falling into it */
+#define JUMPED	1		/* by a goto */
+#define RESUMED	2		/* from the backtrack stack */
+
+typedef struct AotState {
+  luaL_Buffer *b;
+  const char *name;
+  const Instruction *code;
+  int codesize;
+  byte *reached;		/* JUMPED/RESUMED flags, per instruction */
+  int *csid;			/* charset number, per set instruction */
+  int needfail, needresume;
+} AotState;
+
+
+/*
+** {======================================================
+** Fingerprint
+** =======================================================
+*/
+
+static uint64_t fnvint (uint64_t h, long v) {
+  return r_fnv(h, &v, sizeof(v));
+}
+
+
+/*
+** Fingerprint of the compiled code of a pattern and of its ktable
+** (at stack index 'ktable'), so that generated code is only ever
+** attached to a pattern that compiles to the same program
+*/
+uint64_t r_aotfingerprint (lua_State *L, int ktable,
+                           const Instruction *code, int codesize) {
+  uint64_t h = R_FNV_OFFSET;
+  int i, n;
+  for (i = 0; i < codesize; i += sizei(&code[i])) {
+    const Instruction *p = &code[i];
+    h = fnvint(h, p->i.code);
+    h = fnvint(h, p->i.aux);
+    h = fnvint(h, p->i.key);
+    switch ((Opcode)p->i.code) {
+      case ITestSet:  /* both the label and the charset reference */
+        h = fnvint(h, getoffset(p));
+        h = fnvint(h, (p + setslot(p))->offset);
+        break;
+      case IPredicate:  /* the label and the length of its body */
+        h = fnvint(h, getoffset(p));
+        h = fnvint(h, (p + 2)->offset);
+        break;
+      case ICharset:
+        h = r_fnv(h, (p + 1)->buff, CHARSETSIZE);
+        break;
+      case IClasses:
+        h = r_fnv(h, (p + 1)->buff, UCHAR_MAX + 1);
+        break;
+      case IDfa:  /* not the address of the DFA */
+        h = fnvint(h, getoffset(p));
+        break;
+      case IFullCapture: case IOpenCapture:  /* a wide key */
+        h = fnvint(h, getkey(p));
+        break;
+      default:
+        if (sizei(p) == 2) h = fnvint(h, getoffset(p));
+        break;
+    }
+  }
+  n = lua_istable(L, ktable) ? (int)lua_rawlen(L, ktable) : 0;
+  for (i = 1; i <= n; i++) {
+    lua_rawgeti(L, ktable, i);
+    h = fnvint(h, lua_type(L, -1));
+    if (lua_type(L, -1) == LUA_TSTRING) {
+      size_t len;
+      const char *s = lua_tolstring(L, -1, &len);
+      h = r_fnv(h, s, len);
+    }
+    lua_pop(L, 1);
+  }
+  return h;
+}
+
+/* }====================================================== */
+
+
+/*
+** {======================================================
+** Code generation
+** =======================================================
+*/
+
+static void addf (AotState *as, const char *fmt, ...) {
+  char buff[256];
+  va_list argp;
+  int n;
+  va_start(argp, fmt);
+  n = vsnprintf(buff, sizeof(buff), fmt, argp);
+  va_end(argp);
+  if (n < 0) luaL_error(as->b->L, "cannot format generated code");
+  if ((size_t)n < sizeof(buff))
+    luaL_addlstring(as->b, buff, n);
+  else {  /* too long (a long name): format it again, in a userdata */
+    lua_State *L = as->b->L;
+    char *big = (char *)lua_newuserdata(L, n + 1);
+    va_start(argp, fmt);
+    vsnprintf(big, n + 1, fmt, argp);
+    va_end(argp);
+    lua_pushlstring(L, big, n);
+    lua_remove(L, -2);
+    luaL_addvalue(as->b);
+  }
+}
+
+
+/* Note how each instruction is reached; return 0 if some instruction
+   cannot be compiled */
+static int scan (AotState *as) {
+  const Instruction *code = as->code;
+  int i;
+  for (i = 0; i < as->codesize; i += sizei(&code[i])) {
+    const Instruction *p = &code[i];
+    switch ((Opcode)p->i.code) {
+      case IAny: case IChar: case ISet: case IBehind: case IFailTwice:
+      case IFail:
+        as->needfail = 1;
+        break;
+      case ITestAny: case ITestChar: case ITestSet: case IJmp:
+      case ICommit: case IPartialCommit: case IBackCommit:
+        as->reached[i + getoffset(p)] |= JUMPED;
+        break;
+      case IChoice:
+        as->reached[i + getoffset(p)] |= RESUMED;
+        break;
+      case ICall:
+        as->reached[i + getoffset(p)] |= JUMPED;
+        as->reached[i + sizei(p)] |= RESUMED;
+        break;
+      case IRet:
+        as->needresume = 1;
+        break;
+      case IPredicate:
+        as->needfail = 1;
+        as->reached[i + getoffset(p)] |= JUMPED;
+        break;
+      case ISpan: case IEnd: case IHalt: case IFullCapture:
+      case IOpenCapture: case ICloseCapture: case IDfa:
+      case ICharset: case IClasses:
+        break;
+      default:  /* IOpenCall, IGiveup, ICloseRunTime */
+        return 0;
+    }
+  }
+  return 1;
+}
+
+
+/*
+** Each entry of the pool of charsets (see lpvm.h) that some set
+** instruction tests with it becomes an array named by its position;
+** 'csid' has, for a set instruction, the position of its entry, or -1
+** when its charset is tested as a range, and for an entry, whether it
+** is used.
+*/
+static void emitcharsets (AotState *as) {
+  const Instruction *code = as->code;
+  int i, j, n, lo, hi;
+  memset(as->csid, 0, as->codesize * sizeof(int));
+  for (i = 0; i < as->codesize; i += sizei(&code[i])) {
+    const Instruction *p = &code[i];
+    byte cs[CHARSETSIZE];
+    switch ((Opcode)p->i.code) {
+      case ISet: case ISpan: case ITestSet: break;
+      default: continue;
+    }
+    r_getcharset(p, cs);
+    if (r_charsetrange(cs, &lo, &hi))
+      as->csid[i] = -1;  /* tested as a range */
+    else {
+      as->csid[i] = (int)(setentry(p, setslot(p)) - 1 - code);
+      as->csid[as->csid[i]] = 1;
+    }
+  }
+  for (i = 0; i < as->codesize; i += sizei(&code[i])) {
+    const Instruction *p = &code[i];
+    switch ((Opcode)p->i.code) {
+      case ICharset: n = CHARSETSIZE; break;
+      case IClasses: n = UCHAR_MAX + 1; break;
+      default: continue;
+    }
+    if (!as->csid[i]) continue;
+    addf(as, "static const byte %s_cs%d[%d] = {", as->name, i, n);
+    for (j = 0; j < n; j++)
+      addf(as, "%s0x%02x%s", (j % 8 == 0) ? "\n  " : " ", (p + 1)->buff[j],
+           (j < n - 1) ? "," : "");
+    luaL_addstring(as->b, "\n};\n\n");
+  }
+}
+
+
+/* C expression that is true when the byte at 's' is in the set */
+static void settest (AotState *as, int i) {
+  const Instruction *p = &as->code[i];
+  int lo, hi;
+  if (as->csid[i] < 0) {
+    byte cs[CHARSETSIZE];
+    r_getcharset(p, cs);
+    r_charsetrange(cs, &lo, &hi);
+    addf(as, "R_INRANGE(*s, %d, %d)", lo, hi - lo);
+  }
+  else if (p->i.aux == 0)
+    addf(as, "R_TESTCHAR(%s_cs%d, *s)", as->name, as->csid[i]);
+  else
+    addf(as, "R_INCLASS(%s_cs%d, *s, %d)", as->name, as->csid[i], p->i.aux);
+}
+
+
+static void codeinstruction (AotState *as, int i) {
+  const Instruction *p = &as->code[i];
+  switch ((Opcode)p->i.code) {
+    case IAny:
+      luaL_addstring(as->b, "  if (s >= e) goto fail;\n  s++;\n");
+      break;
+    case IChar:
+      addf(as, "  if (s >= e || (byte)*s != %d) goto fail;\n  s++;\n",
+           p->i.aux);
+      break;
+    case ISet:
+      luaL_addstring(as->b, "  if (s >= e || !");
+      settest(as, i);
+      luaL_addstring(as->b, ") goto fail;\n  s++;\n");
+      break;
+    case ITestAny:
+      addf(as, "  if (s >= e) goto L%d;\n", i + getoffset(p));
+      break;
+    case ITestChar:
+      addf(as, "  if (s >= e || (byte)*s != %d) goto L%d;\n",
+           p->i.aux, i + getoffset(p));
+      break;
+    case ITestSet:
+      luaL_addstring(as->b, "  if (s >= e || !");
+      settest(as, i);
+      addf(as, ") goto L%d;\n", i + getoffset(p));
+      break;
+    case ISpan:
+      luaL_addstring(as->b, "  while (s < e && ");
+      settest(as, i);
+      luaL_addstring(as->b, ") s++;\n");
+      break;
+    case ICharset: case IClasses:  /* the pool, after IEnd */
+      break;
+    case IBehind:
+      addf(as, "  if (%d > s - o) goto fail;\n  s -= %d;\n",
+           p->i.key, p->i.key);
+      break;
+    case IRet:
+      luaL_addstring(as->b, "  next = (--stack)->p.label;\n  goto resume;\n");
+      break;
+    case IEnd:
+      luaL_addstring(as->b, "  cap->kind = Cclose;\n  cap->s = NULL;\n"
+                            "  js->captop = cap;\n  return s;\n");
+      break;
+    case IHalt:
+      luaL_addstring(as->b, "  cap->kind = Cfinal;\n  cap->s = s;\n"
+                            "  js->captop = cap;\n  return s;\n");
+      break;
+    case IChoice:
+      addf(as, "  R_PUSH(s, %d);\n", i + getoffset(p) + 1);
+      break;
+    case IJmp:
+      addf(as, "  goto L%d;\n", i + getoffset(p));
+      break;
+    case ICall:
+      addf(as, "  R_PUSH(NULL, %d);\n  goto L%d;\n", i + sizei(p) + 1,
+           i + getoffset(p));
+      break;
+    case ICommit:
+      addf(as, "  stack--;\n  goto L%d;\n", i + getoffset(p));
+      break;
+    case IPartialCommit:
+      addf(as, "  (stack - 1)->s = s;\n  (stack - 1)->cap = cap;\n"
+               "  goto L%d;\n", i + getoffset(p));
+      break;
+    case IBackCommit:
+      addf(as, "  s = (--stack)->s;\n  cap = stack->cap;\n  goto L%d;\n",
+           i + getoffset(p));
+      break;
+    case IFailTwice:
+      luaL_addstring(as->b, "  stack--;\n  goto fail;\n");
+      break;
+    case IFail:
+      luaL_addstring(as->b, "  goto fail;\n");
+      break;
+    case IFullCapture:
+      addf(as, "  R_CAPTURE(s - %d, %d, %d, %d);\n",
+           getoff(p), getkey(p), getkind(p), getoff(p) + 1);
+      break;
+    case IOpenCapture:
+      addf(as, "  R_CAPTURE(s, %d, %d, 0);\n", getkey(p), getkind(p));
+      break;
+    case ICloseCapture:
+      /* if possible, turn the open capture into a full capture */
+      luaL_addstring(as->b,
+        "  if ((cap - 1)->siz == 0 && s - (cap - 1)->s < UCHAR_MAX)\n"
+        "    (cap - 1)->siz = (byte)(s - (cap - 1)->s + 1);\n  else ");
+      addf(as, "R_CAPTURE(s, %d, %d, 1);\n", p->i.key, getkind(p));
+      break;
+    case IPredicate:
+      luaL_addstring(as->b, "  {\n    const char *start = ");
+      if ((p + 2)->offset >= 0)  /* body has fixed length? */
+        addf(as, "s - %d;\n", (p + 2)->offset);
+      else  /* body started at the position saved by its choice */
+        luaL_addstring(as->b, "(--stack)->s;\n");
+      addf(as, "    const char *res = js->predicates[%d].fn(o, start, s, e);"
+               "  /* %s */\n", p->i.aux, r_predicates[p->i.aux].name);
+      addf(as, "    if (res == NULL) goto fail;\n    s = res;\n  }\n"
+               "  goto L%d;\n", i + getoffset(p));
+      break;
+    case IDfa:  /* DFAs are built at run time; the code after it suffices */
+      luaL_addstring(as->b, "  /* dfa region */\n");
+      break;
+    default: assert(0);
+  }
+}
+
+
+static void codefunction (AotState *as) {
+  const Instruction *code = as->code;
+  int i;
+  addf(as, "static const char *%s_match (JitState *js, const char *s) {\n",
+       as->name);
+  luaL_addstring(as->b,
+    "  const char *const o = js->o;\n"
+    "  const char *const e = js->e;\n"
+    "  JitStack *stack = js->stackbase + 1;  /* entry 0 gives up */\n"
+    "  Capture *cap = js->captop;\n");
+  if (as->needfail || as->needresume)
+    luaL_addstring(as->b, "  int next;\n");
+  luaL_addstring(as->b, "  (void)o; (void)e;\n");
+  for (i = 0; i < as->codesize; i += sizei(&code[i])) {
+    if (as->reached[i])
+      addf(as, " L%d:\n", i);
+    codeinstruction(as, i);
+  }
+  if (as->needfail)
+    luaL_addstring(as->b,
+      " fail:\n"
+      "  do {  /* remove pending calls */\n"
+      "    s = (--stack)->s;\n"
+      "  } while (s == NULL);\n"
+      "  cap = stack->cap;\n"
+      "  next = stack->p.label;\n");
+  if (as->needfail || as->needresume) {
+    if (as->needresume) luaL_addstring(as->b, " resume:\n");
+    luaL_addstring(as->b, "  switch (next) {\n");
+    for (i = 0; i < as->codesize; i += sizei(&code[i]))
+      if (as->reached[i] & RESUMED)
+        addf(as, "    case %d: goto L%d;\n", i + 1, i);
+    luaL_addstring(as->b,
+      "    default: break;  /* 0: give up */\n"
+      "  }\n"
+      "  js->captop = cap;\n"
+      "  return NULL;\n");
+  }
+  luaL_addstring(as->b, "}\n\n");
+}
+
+
+static void codedescriptor (AotState *as, uint64_t fingerprint) {
+  const Instruction *code = as->code;
+  int i, npred = 0;
+  for (i = 0; i < as->codesize; i += sizei(&code[i]))
+    if (code[i].i.code == IPredicate && code[i].i.aux >= npred)
+      npred = code[i].i.aux + 1;
+  if (npred > 0) {
+    int id;
+    addf(as, "static const char *const %s_predicates[%d] = {", as->name, npred);
+    for (id = 0; id < npred; id++) {
+      int used = 0;
+      for (i = 0; i < as->codesize; i += sizei(&code[i]))
+        if (code[i].i.code == IPredicate && code[i].i.aux == id) used = 1;
+      if (used) addf(as, "%s\"%s\"", id ? ", " : "", r_predicates[id].name);
+      else addf(as, "%sNULL", id ? ", " : "");
+    }
+    luaL_addstring(as->b, "};\n\n");
+  }
+  addf(as, "r_aotpattern %s = {\n  R_AOT_VERSION, %d, 0x%016llxULL,\n",
+       as->name, as->codesize, (unsigned long long)fingerprint);
+  if (npred > 0)
+    addf(as, "  %s_match, %s_predicates, %d\n};\n\n", as->name, as->name, npred);
+  else
+    addf(as, "  %s_match, NULL, 0\n};\n\n", as->name);
+  addf(as, "int %s_lua (lua_State *L);\n", as->name);
+  addf(as, "int %s_lua (lua_State *L) {\n"
+           "  lua_pushlightuserdata(L, &%s);\n"
+           "  return 1;\n"
+           "}\n", as->name, as->name);
+}
+
+
+static int isidentifier (const char *s) {
+  if (!(isalpha((byte)*s) || *s == '_')) return 0;
+  for (s++; *s; s++)
+    if (!(isalnum((byte)*s) || *s == '_')) return 0;
+  return 1;
+}
+
+
+/*
+** Push a string with the C source for 'code', as a function named
+** 'name'_match plus the r_aotpattern 'name' that describes it
+*/
+int r_aotsource (lua_State *L, const char *name, const Instruction *code,
+                 int codesize, uint64_t fingerprint) {
+  AotState as;
+  luaL_Buffer b;
+  if (!isidentifier(name))
+    return luaL_error(L, "'%s' is not a valid C identifier", name);
+  as.b = &b; as.name = name;
+  as.code = code; as.codesize = codesize;
+  as.needfail = as.needresume = 0;
+  /* work arrays live on the Lua stack, below the buffer */
+  as.reached = (byte *)lua_newuserdata(L, codesize);
+  memset(as.reached, 0, codesize);
+  as.csid = (int *)lua_newuserdata(L, codesize * sizeof(int));
+  if (!scan(&as))
+    return luaL_error(L, "pattern has run-time captures or open calls");
+  luaL_buffinit(L, &b);
+  addf(&as, "/* Generated by lpeg.aotsource(): %d instructions.  Do not edit. */\n\n"
+            "#include \"raot.h\"\n\n", codesize);
+  emitcharsets(&as);
+  codefunction(&as);
+  codedescriptor(&as, fingerprint);
+  luaL_pushresult(&b);
+  return 1;
+}
+
+/* }====================================================== */
+
+
+/*
+** Install generated code in 'jit'.  Returns NULL on success, else a
+** reason why 'aot' does not belong to the pattern
+*/
+const char *r_aotattach (rJit *jit, const r_aotpattern *aot,
+                         int codesize, uint64_t fingerprint) {
+  int i;
+  if (aot == NULL || aot->version != R_AOT_VERSION)
+    return "compiled for a different version of lpeg";
+  if (aot->codesize != codesize || aot->fingerprint != fingerprint)
+    return "compiled from a different pattern";
+  if (aot->npredicates > R_MAXPREDICATES)
+    return "unknown predicate";
+  for (i = 0; i < aot->npredicates; i++) {
+    const char *name = aot->predicates[i];
+    if (name && (!r_predicates[i].fn || strcmp(name, r_predicates[i].name)))
+      return "predicates are registered differently";
+  }
+  r_jitrelease(jit);
+  jit->fn = aot->fn;
+  jit->aot = 1;
+  return NULL;
+}
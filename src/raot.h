@@ -0,0 +1,74 @@
+/*  -*- Mode: C/l; -*-                                                       */
+/*                                                                           */
+/*  raot.h   Ahead-of-time compilation of patterns to C                     */
+/*                                                                           */
+/*  © Copyright IBM Corporation 2017.                                        */
+/*  LICENSE: MIT License (https://opensource.org/licenses/mit-license.html)  */
+/*  AUTHOR: Jamie A. Jennings                                                */
+
+/*
+ * lpeg.aotsource(p, name) returns C source for pattern 'p'.  That
+ * source includes this header, so compile it with the rosie-lpeg src
+ * directory and the Lua headers on the include path, e.g.
+ *
+ *   cc -O3 -fPIC -shared -I<lua> -I<rosie-lpeg>/src pats.c -o pats.so
+ *
+ * The generated file defines an r_aotpattern named 'name' and a Lua C
+ * function 'name_lua' that returns it as a lightuserdata.  To use it:
+ *
+ *   lpeg.aot(p, package.loadlib("./pats.so", "name_lua")())
+ *
+ * after which p:rmatch and p:match run the generated code.  The
+ * pattern given to lpeg.aot must compile to the same code, with the
+ * same ktable, as the one given to lpeg.aotsource; this is checked.
+ */
+
+#if !defined(raot_h)
+#define raot_h
+
+#include <limits.h>
+#include <stdint.h>
+
+#include "lua.h"
+
+#include "rjit.h"
+
+#define R_AOT_VERSION 2		/* bump when JitState, this file, or the code
+				   raot.c generates changes */
+
+typedef struct r_aotpattern {
+  int version;			/* R_AOT_VERSION */
+  int codesize;			/* number of instructions of the pattern */
+  uint64_t fingerprint;		/* of the code and ktable, see r_aotfingerprint */
+  r_jitfn fn;
+  const char *const *predicates;  /* names of the predicates used, by id */
+  int npredicates;
+} r_aotpattern;
+
+/* Used by the generated code */
+
+#define R_TESTCHAR(cs, c)	((cs)[(byte)(c) >> 3] & (1 << ((byte)(c) & 7)))
+#define R_INRANGE(c, lo, n)	((unsigned)((byte)(c) - (lo)) <= (n))
+#define R_INCLASS(tbl, c, m)	((tbl)[(byte)(c)] & (m))
+
+#define R_PUSH(str, lab) do {						\
+    if (stack == js->stacklimit) stack = js->growstack(js, stack);	\
+    stack->s = (str); stack->p.label = (lab); stack->cap = cap;	\
+    stack++;								\
+  } while (0)
+
+#define R_CAPTURE(str, k, kd, sz) do {					\
+    cap->s = (str); cap->idx = (k); cap->kind = (kd); cap->siz = (sz);	\
+    if (++cap >= js->caplimit) cap = js->growcap(js, cap, stack);	\
+  } while (0)
+
+/* Used by lptree.c */
+
+uint64_t r_aotfingerprint (lua_State *L, int ktable,
+                           const Instruction *code, int codesize);
+int r_aotsource (lua_State *L, const char *name, const Instruction *code,
+                 int codesize, uint64_t fingerprint);
+const char *r_aotattach (rJit *jit, const r_aotpattern *aot,
+                         int codesize, uint64_t fingerprint);
+
+#endif
@@ -6,6 +6,7 @@
 /*  LICENSE: MIT License (https://opensource.org/licenses/mit-license.html)  */
 /*  AUTHOR: Jamie A. Jennings                                                */
 
+#include <stdint.h>
 #include <string.h>
 #include <stdlib.h>
 
@@ -186,6 +187,16 @@ void r_addint (lua_State *L, rBuffer *buf, int i) {
   r_addlstring(L, buf, (const char *)str, 4);
 }
 
+/* rosie: overwrite the int that r_addint put at 'pos' */
+void r_setint (rBuffer *buf, size_t pos, int i) {
+  unsigned char *str = (unsigned char *)buf->data + pos;
+  unsigned int iun = (int) i;
+  str[3] = (iun >> 24) & 0xFF;
+  str[2] = (iun >> 16) & 0xFF;
+  str[1] = (iun >> 8) & 0xFF;
+  str[0] = iun & 0xFF;
+}
+
 int r_readint(const char **s) {
   const unsigned char *sun = (const unsigned char *) *s;
   int i = *sun | (*(sun+1)<<8) | (*(sun+2)<<16) | *(sun+3)<<24;
@@ -198,6 +209,29 @@ int r_peekint(const char **s) {
   return *sun | (*(sun+1)<<8) | (*(sun+2)<<16) | *(sun+3)<<24;
 }
 
+/* rosie: 64-bit ints for the byte64 encoding, little-endian as above */
+void r_addint64 (lua_State *L, rBuffer *buf, int64_t i) {
+  unsigned char str[8];
+  uint64_t iun = (uint64_t) i;
+  int k;
+  for (k = 0; k < 8; k++) str[k] = (iun >> (8 * k)) & 0xFF;
+  r_addlstring(L, buf, (const char *)str, 8);
+}
+
+int64_t r_peekint64(const char **s) {
+  const unsigned char *sun = (const unsigned char *) *s;
+  uint64_t iun = 0;
+  int k;
+  for (k = 7; k >= 0; k--) iun = (iun << 8) | sun[k];
+  return (int64_t) iun;
+}
+
+int64_t r_readint64(const char **s) {
+  int64_t i = r_peekint64(s);
+  (*s) += 8;
+  return i;
+}
+
 void r_addshort (lua_State *L, rBuffer *buf, short i) {
   char str[2];
   short iun = (short) i;
@@ -9,6 +9,8 @@
 #if !defined(rbuf_h)
 #define rbuf_h
 
+#include <stdint.h>
+
 #define ROSIE_BUFFER "ROSIE_BUFFER"
 #define R_BUFFERSIZE (8192 * sizeof(char))	  /* should experiment with different values */
 
@@ -49,8 +51,12 @@ rBuffer *r_newbuffer_wrap (lua_State *L, char *data, size_t len);
 char *r_prepbuffsize (lua_State *L, rBuffer *buf, size_t sz);
 void r_addlstring (lua_State *L, rBuffer *buf, const char *s, size_t l);
 void r_addint (lua_State *L, rBuffer *buf, int i);
+void r_setint (rBuffer *buf, size_t pos, int i);
 int r_readint(const char **s);
 int r_peekint(const char **s);
+void r_addint64 (lua_State *L, rBuffer *buf, int64_t i);
+int64_t r_readint64(const char **s);
+int64_t r_peekint64(const char **s);
 void r_addshort (lua_State *L, rBuffer *buf, short i);
 int r_readshort(const char **s);
      
@@ -0,0 +1,141 @@
+/*  -*- Mode: C/l; -*-                                                       */
+/*                                                                           */
+/*  rcache.c   Cache of match results for subjects that recur verbatim       */
+/*                                                                           */
+/*  © Copyright IBM Corporation 2017.                                        */
+/*  LICENSE: MIT License (https://opensource.org/licenses/mit-license.html)  */
+/*  AUTHOR: Jamie A. Jennings                                                */
+
+#include <string.h>
+
+#include "lua.h"
+#include "lauxlib.h"
+
+#include "rcache.h"
+#include "rhash.h"
+
+static size_t cachebytes (int size) {
+  return sizeof(rCache) + (size - 1) * sizeof(rCacheEntry)
+         + size * sizeof(int);
+}
+
+
+rCache *r_newcache (lua_State *L, int size) {
+  void *ud;
+  lua_Alloc f = lua_getallocf(L, &ud);
+  rCache *c = (rCache *)f(ud, NULL, 0, cachebytes(size));
+  int i;
+  if (c == NULL) luaL_error(L, "not enough memory");
+  c->size = size;
+  c->used = c->hand = 0;
+  c->hits = c->misses = 0;
+  c->bucket = (int *)&c->entry[size];
+  for (i = 0; i < size; i++) {
+    c->bucket[i] = -1;
+    c->entry[i].data = NULL;
+  }
+  return c;
+}
+
+
+void r_freecache (lua_State *L, rCache *c) {
+  void *ud;
+  lua_Alloc f = lua_getallocf(L, &ud);
+  int i;
+  if (c == NULL) return;
+  for (i = 0; i < c->used; i++)
+    f(ud, c->entry[i].data, c->entry[i].len + c->entry[i].outlen + 1, 0);
+  f(ud, c, cachebytes(c->size), 0);
+}
+
+
+/* FNV-1a of the subject, then of the rest of the key */
+uint64_t r_cachekey (const char *s, size_t len, size_t start, int encoding,
+                     int search) {
+  uint64_t h = r_fnv(R_FNV_OFFSET, s, len);
+  h = (h ^ start) * R_FNV_PRIME;
+  h = (h ^ (unsigned int)encoding) * R_FNV_PRIME;
+  return (h ^ (uint64_t)search) * R_FNV_PRIME;
+}
+
+
+static int samekey (const rCacheEntry *ce, uint64_t h, const char *s,
+                    size_t len, size_t start, int encoding, int search) {
+  return (ce->h == h && ce->len == len && ce->start == start
+          && ce->encoding == encoding && ce->search == search
+          && memcmp(ce->data, s, len) == 0);
+}
+
+
+/* the entry for a key, or NULL; counts hits and misses */
+rCacheEntry *r_cachefind (rCache *c, uint64_t h, const char *s, size_t len,
+                          size_t start, int encoding, int search) {
+  int i;
+  for (i = c->bucket[h % c->size]; i >= 0; i = c->entry[i].next) {
+    rCacheEntry *ce = &c->entry[i];
+    if (samekey(ce, h, s, len, start, encoding, search)) {
+      ce->ref = 1;
+      c->hits++;
+      return ce;
+    }
+  }
+  c->misses++;
+  return NULL;
+}
+
+
+/* CLOCK: the first entry not used lately, after clearing the others */
+static int victim (rCache *c) {
+  int i;
+  if (c->used < c->size) return c->used++;
+  while (c->entry[c->hand].ref) {
+    c->entry[c->hand].ref = 0;
+    c->hand = (c->hand + 1) % c->size;
+  }
+  i = c->hand;
+  c->hand = (c->hand + 1) % c->size;
+  return i;
+}
+
+
+static void unchain (rCache *c, int i) {
+  int *pi = &c->bucket[c->entry[i].h % c->size];
+  while (*pi != i) pi = &c->entry[*pi].next;
+  *pi = c->entry[i].next;
+}
+
+
+/*
+** Add an entry for a key (which must not be in the cache) with the
+** given output, replacing an old one when the cache is full.  The
+** caller fills in the other results.  Returns NULL when there is no
+** memory for it.  (The data of an entry has one more byte, so that it
+** is never empty.)
+*/
+rCacheEntry *r_cacheput (lua_State *L, rCache *c, uint64_t h,
+                         const char *s, size_t len, size_t start,
+                         int encoding, int search,
+                         const char *out, size_t outlen) {
+  void *ud;
+  lua_Alloc f = lua_getallocf(L, &ud);
+  char *data = (char *)f(ud, NULL, 0, len + outlen + 1);
+  rCacheEntry *ce;
+  int i;
+  if (data == NULL) return NULL;  /* not cached, then */
+  i = victim(c);
+  ce = &c->entry[i];
+  if (ce->data != NULL) {  /* replacing an entry? */
+    unchain(c, i);
+    f(ud, ce->data, ce->len + ce->outlen + 1, 0);
+  }
+  ce->data = data;
+  memcpy(ce->data, s, len);
+  if (outlen > 0) memcpy(ce->data + len, out, outlen);
+  ce->h = h;  ce->len = len;  ce->outlen = outlen;
+  ce->start = start;  ce->encoding = (short)encoding;
+  ce->search = (unsigned char)search;
+  ce->ref = 0;
+  ce->next = c->bucket[h % c->size];
+  c->bucket[h % c->size] = i;
+  return ce;
+}
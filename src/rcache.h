@@ -0,0 +1,65 @@
+/*  -*- Mode: C/l; -*-                                                       */
+/*                                                                           */
+/*  rcache.h   Cache of match results for subjects that recur verbatim       */
+/*                                                                           */
+/*  © Copyright IBM Corporation 2017.                                        */
+/*  LICENSE: MIT License (https://opensource.org/licenses/mit-license.html)  */
+/*  AUTHOR: Jamie A. Jennings                                                */
+
+/*
+ * A pattern may have a bounded cache of the results of rmatch and
+ * rsearch, for inputs that recur verbatim (health checks, repeated
+ * errors).  An entry is keyed by the whole subject, the start position,
+ * the encoding, and whether the call was a search; it holds the encoded
+ * output and the other results, so a hit copies the output into the
+ * output buffer without matching.  Entries are replaced in CLOCK order.
+ * Subjects longer than R_CACHEMAXLEN are not cached.
+ */
+
+#if !defined(rcache_h)
+#define rcache_h
+
+#include <stdint.h>
+
+#include "lua.h"
+
+#define R_CACHEMAXLEN	4096
+#define R_CACHEMAXSIZE	(1 << 20)  /* most entries in a cache */
+
+typedef struct rCacheEntry {
+  uint64_t h;
+  int next;  /* next entry in the same bucket, or -1 */
+  unsigned char ref;  /* recently used (CLOCK) */
+  unsigned char search;
+  short encoding;
+  size_t start;  /* start position given */
+  size_t len;  /* of the subject, which 'data' holds first */
+  size_t outlen;  /* of the output, which follows it */
+  char *data;
+  /* the results */
+  int matched, abend;
+  size_t leftover;
+  size_t matchstart;  /* for searches */
+} rCacheEntry;
+
+typedef struct rCache {
+  int size;  /* number of entries */
+  int used;  /* entries in use */
+  int hand;  /* next entry CLOCK looks at */
+  unsigned long hits, misses;
+  int *bucket;  /* first entry in each of 'size' buckets, or -1 */
+  rCacheEntry entry[1];
+} rCache;
+
+rCache *r_newcache (lua_State *L, int size);
+void r_freecache (lua_State *L, rCache *c);
+uint64_t r_cachekey (const char *s, size_t len, size_t start, int encoding,
+                     int search);
+rCacheEntry *r_cachefind (rCache *c, uint64_t h, const char *s, size_t len,
+                          size_t start, int encoding, int search);
+rCacheEntry *r_cacheput (lua_State *L, rCache *c, uint64_t h,
+                         const char *s, size_t len, size_t start,
+                         int encoding, int search,
+                         const char *out, size_t outlen);
+
+#endif
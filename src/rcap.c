@@ -148,7 +148,7 @@ int debug_Open(CapState *cs, rBuffer *buf, int count) {
 static void json_encode_pos(lua_State *L, size_t pos, rBuffer *buf) {
   char nb[MAXNUMBER2STR];
   size_t len;
-  len = r_inttostring(nb, (int) pos);
+  len = r_sizetostring(nb, pos);
   r_addlstring(L, buf, nb, len);
 }
 
@@ -218,7 +218,8 @@ int json_Open(CapState *cs, rBuffer *buf, int count) {
   r_addstring(cs->L, buf, START_LABEL);
   json_encode_pos(cs->L, s, buf);
   /* introduce subs array if needed */
-  if (!isclosecap(cs->cap+1)) r_addstring(cs->L, buf, COMPONENT_LABEL);
+  if (!isclosecap(cs->cap+1) && !isfinalcap(cs->cap+1))
+    r_addstring(cs->L, buf, COMPONENT_LABEL);
   return ROSIE_OK;
 }
 
@@ -230,12 +231,20 @@ int json_Open(CapState *cs, rBuffer *buf, int count) {
 /* The byte array encoding assumes that the input text length fits
    into 2^31, i.e. a signed int, and that the name length fits into
    2^15, i.e. a signed short.  It is the responsibility of rmatch to
-   ensure this. */
+   ensure this.  rosie: the byte64 encoding ('wide') lifts the limit
+   on the input length. */
 
-static void encode_pos(lua_State *L, size_t pos, int negate, rBuffer *buf) {
-  int intpos = (int) pos;
-  if (negate) intpos = - intpos;
-  r_addint(L, buf, intpos);
+static inline void encode_pos(lua_State *L, size_t pos, int negate,
+                              rBuffer *buf, int wide) {
+  if (wide) {
+    int64_t widepos = (int64_t) pos;
+    r_addint64(L, buf, negate ? - widepos : widepos);
+  }
+  else {
+    int intpos = (int) pos;
+    if (negate) intpos = - intpos;
+    r_addint(L, buf, intpos);
+  }
 }
 
 static void encode_string(lua_State *L, const char *str, size_t len,
@@ -256,35 +265,32 @@ static void encode_name(CapState *cs, rBuffer *buf, int offset) {
   lua_pop(cs->L, 1);				   /* pop name */
 }
 
-int byte_Fullcapture(CapState *cs, rBuffer *buf, int count) {
+static inline int byte_fullcapture(CapState *cs, rBuffer *buf, int wide) {
   size_t s, e;
   Capture *c = cs->cap;
-  UNUSED(count);
   if (! (isfullcap(c) || acceptable_capture(c->kind)) ) return ROSIE_FULLCAP_ERROR;
   s = c->s - cs->s + 1;		/* 1-based start position */
   e = s + c->siz - 1;
-  encode_pos(cs->L, s, 1, buf);	/* negative flag is set */
+  encode_pos(cs->L, s, 1, buf, wide);	/* negative flag is set */
   /* special case for constant captures: put the capture text into the buffer
    * before the pattern typename, and use a negative length to mark its presence
    */
   if (c->kind == Crosieconst) encode_name(cs, buf, 1);
   encode_name(cs, buf, 0);
-  encode_pos(cs->L, e, 0, buf);
+  encode_pos(cs->L, e, 0, buf, wide);
   return ROSIE_OK;
 }
 
-int byte_Close(CapState *cs, rBuffer *buf, int count, const char *start) {
+static inline int byte_close(CapState *cs, rBuffer *buf, int wide) {
   size_t e;
-  UNUSED(count); UNUSED(start);
   if (!isclosecap(cs->cap)) return ROSIE_CLOSE_ERROR;
   e = cs->cap->s - cs->s + 1;	/* 1-based end position */
-  encode_pos(cs->L, e, 0, buf);
+  encode_pos(cs->L, e, 0, buf, wide);
   return ROSIE_OK;
 }
 
-int byte_Open(CapState *cs, rBuffer *buf, int count) {
+static inline int byte_open(CapState *cs, rBuffer *buf, int wide) {
   size_t s;
-  UNUSED(count);
   if (isfullcap(cs->cap) || !acceptable_capture(cs->cap->kind)) {
        fprintf(stderr, "*** isfullcap-> %d, !acceptable_capture()->%d\n",
 	       isfullcap(cs->cap),
@@ -297,8 +303,38 @@ int byte_Open(CapState *cs, rBuffer *buf, int count) {
        return ROSIE_OPEN_ERROR;
   }
   s = cs->cap->s - cs->s + 1;	/* 1-based start position */
-  encode_pos(cs->L, s, 1, buf);
+  encode_pos(cs->L, s, 1, buf, wide);
   encode_name(cs, buf, 0);
   return ROSIE_OK;
 }
 
+int byte_Fullcapture(CapState *cs, rBuffer *buf, int count) {
+  UNUSED(count);
+  return byte_fullcapture(cs, buf, 0);
+}
+
+int byte_Close(CapState *cs, rBuffer *buf, int count, const char *start) {
+  UNUSED(count); UNUSED(start);
+  return byte_close(cs, buf, 0);
+}
+
+int byte_Open(CapState *cs, rBuffer *buf, int count) {
+  UNUSED(count);
+  return byte_open(cs, buf, 0);
+}
+
+int byte64_Fullcapture(CapState *cs, rBuffer *buf, int count) {
+  UNUSED(count);
+  return byte_fullcapture(cs, buf, 1);
+}
+
+int byte64_Close(CapState *cs, rBuffer *buf, int count, const char *start) {
+  UNUSED(count); UNUSED(start);
+  return byte_close(cs, buf, 1);
+}
+
+int byte64_Open(CapState *cs, rBuffer *buf, int count) {
+  UNUSED(count);
+  return byte_open(cs, buf, 1);
+}
+
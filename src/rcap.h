@@ -11,9 +11,21 @@
 #define rcap_h
 
 /* Signed 32-bit integers: from −2,147,483,648 to 2,147,483,647  */
-#define MAXNUMBER2STR 16
+/* rosie: room for positions, which are size_t (up to 20 digits) */
+#define MAXNUMBER2STR 24
 #define INT_FMT "%d"
+#define SIZE_FMT "%zu"
 #define r_inttostring(s, i) (snprintf((char *)(s), (MAXNUMBER2STR), (INT_FMT), (i)))
+#define r_sizetostring(s, i) (snprintf((char *)(s), (MAXNUMBER2STR), (SIZE_FMT), (i)))
+
+/*
+ * rosie: the byte64 encoding is the byte encoding with positions as
+ * 64-bit ints, so that subjects may be larger than 2GB.  A match in it
+ * starts with the int R_BYTE64_VERSION, which is positive, while a
+ * match in the byte encoding starts with a (negative) start marker;
+ * the decoder tells them apart by that.
+ */
+#define R_BYTE64_VERSION 2
 
 int debug_Fullcapture(CapState *cs, rBuffer *buf, int count);
 int debug_Close(CapState *cs, rBuffer *buf, int count, const char *start);
@@ -27,6 +39,10 @@ int byte_Fullcapture(CapState *cs, rBuffer *buf, int count);
 int byte_Close(CapState *cs, rBuffer *buf, int count, const char *start);
 int byte_Open(CapState *cs, rBuffer *buf, int count);
 
+int byte64_Fullcapture(CapState *cs, rBuffer *buf, int count);
+int byte64_Close(CapState *cs, rBuffer *buf, int count, const char *start);
+int byte64_Open(CapState *cs, rBuffer *buf, int count);
+
 /* Some JSON literals */
 #define TYPE_LABEL ("{\"type\":\"")
 #define START_LABEL (",\"s\":")
@@ -0,0 +1,638 @@
+/*  -*- Mode: C/l; -*-                                                       */
+/*                                                                           */
+/*  rdfa.c   Lazy DFAs for capture-free regular subpatterns                 */
+/*                                                                           */
+/*  © Copyright IBM Corporation 2017.                                        */
+/*  LICENSE: MIT License (https://opensource.org/licenses/mit-license.html)  */
+/*  AUTHOR: Jamie A. Jennings                                                */
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lptypes.h"
+#include "lpcode.h"
+#include "rdfa.h"
+
+/*
+ * A DFA state is the list, in priority order, of the ways the region
+ * could still end, as if the code were run by a backtracking machine
+ * that tried all alternatives at once:
+ *
+ *  - a thread is a program counter plus the stack of choices it has
+ *    open.  Each open choice is a group: the thread that was spawned
+ *    for its alternative (and everything that thread spawns) is a
+ *    member of the group, and dies when the choice is committed.
+ *  - a match is a thread that reached the end of the region.  Its
+ *    position is kept in a register, outside the state.
+ *  - a pending kill records that a lower-priority thread committed a
+ *    choice that a higher-priority thread also has open.  The commit
+ *    only counts if every entry above it fails, so the kill happens
+ *    when the entry reaches the top of the list.
+ *
+ * When the first entry is a match, that is the result; when the list
+ * is empty, the region fails.
+ */
+
+#define MAXENTRIES	48	/* entries in a state */
+#define MAXDEPTH	16	/* open choices of a thread */
+#define MAXGROUPS	64	/* groups alive in one step */
+#define MAXMARKS	8	/* matches in a state */
+#define MAXWORK		64	/* threads pending in one step */
+#define MAXGIVEUPS	16	/* after this many (and 1 in 8 runs), stop trying */
+
+#define EOS		256	/* the "character" at the end of the subject */
+#define NTRANS		(EOS + 1)
+
+#define EMATCH		(-1)	/* pc of a match */
+#define EKILL		(-2)	/* pc of a pending kill */
+#define NOW		(-1)	/* register for the current position */
+
+typedef uint64_t gmask;
+#define gbit(g)		((gmask)1 << (g))
+
+typedef struct Entry {
+  int pc;			/* next instruction, EMATCH, or EKILL */
+  int depth;			/* number of open choices */
+  int slot;			/* register of a match */
+  gmask member;			/* groups this entry is a member of */
+  gmask kill;			/* groups a pending kill will kill */
+  byte group[MAXDEPTH];		/* open choices */
+  int alt[MAXDEPTH];		/* their alternatives (for partial commits) */
+} Entry;
+
+typedef struct DTrans {
+  struct DState *to;		/* NULL when not computed yet */
+  signed char remap;		/* do the registers change? */
+  signed char map[MAXMARKS];	/* register of each match of 'to' */
+} DTrans;
+
+typedef struct DState {
+  struct DState *hnext;		/* in the hash table */
+  unsigned int hash;
+  int final;			/* R_DFA_MATCH, R_DFA_FAIL, or -1 */
+  int ngroups;			/* groups of the entries are 0 .. ngroups-1 */
+  int nmarks;			/* number of matches */
+  int nentries;
+  DTrans trans[NTRANS];
+  Entry entries[1];
+} DState;
+
+struct rDfa {
+  Instruction *code;		/* the region alone, ending with IEnd */
+  int ncode;
+  DState *start;
+  DState **table;		/* all states */
+  int tablesize;
+  int nstates;
+  size_t mem;			/* bytes used by the states */
+  unsigned long runs;
+  unsigned long giveups;
+  pthread_mutex_t lock;		/* held by the run using the cache */
+};
+
+/* target of transitions that need more than a state can hold */
+static DState toobig;
+
+
+/*
+** {======================================================
+** One step: all entries of a state, on one character
+** =======================================================
+*/
+
+typedef struct Step {
+  const Instruction *code;
+  int ncode;
+  int c;			/* current character, or EOS */
+  int ngroups;			/* next fresh group */
+  gmask killed;			/* groups committed in this step */
+  int overflow;			/* step needs more than a state can hold */
+  int nout;
+  Entry out[MAXENTRIES];	/* the next state, in priority order */
+} Step;
+
+typedef struct Work {
+  int n;
+  Entry e[MAXWORK];
+} Work;
+
+
+static int sameentry (const Entry *a, const Entry *b) {
+  int i;
+  if (a->pc != b->pc || a->depth != b->depth || a->slot != b->slot ||
+      a->member != b->member || a->kill != b->kill)
+    return 0;
+  for (i = 0; i < a->depth; i++)
+    if (a->group[i] != b->group[i] || a->alt[i] != b->alt[i]) return 0;
+  return 1;
+}
+
+
+/* Append 'e' to the next state, unless an entry above it is the same */
+static void addout (Step *st, const Entry *e) {
+  int i;
+  for (i = 0; i < st->nout; i++)
+    if (sameentry(&st->out[i], e)) return;
+  if (st->nout == MAXENTRIES) st->overflow = 1;
+  else st->out[st->nout++] = *e;
+}
+
+
+static void pushwork (Step *st, Work *w, const Entry *e) {
+  if (w->n == MAXWORK) st->overflow = 1;
+  else w->e[w->n++] = *e;
+}
+
+
+static int newgroup (Step *st) {
+  if (st->ngroups == MAXGROUPS) {
+    st->overflow = 1;
+    return 0;
+  }
+  return st->ngroups++;
+}
+
+
+/*
+** A commit of choice 'g' by a thread that is a member of 'member' must
+** wait if an entry above still has 'g' open, or if a pending kill above
+** may kill the thread: then the commit may never happen.
+*/
+static int mustwait (Step *st, int g, gmask member) {
+  int i, d;
+  for (i = 0; i < st->nout; i++) {
+    if (st->out[i].kill & member) return 1;
+    for (d = 0; d < st->out[i].depth; d++)
+      if (st->out[i].group[d] == g) return 1;
+  }
+  return 0;
+}
+
+
+/* A thread that is a member of 'member' commits choice 'g' */
+static void commit (Step *st, Work *w, int g, gmask member) {
+  if (mustwait(st, g, member)) {
+    Entry k;
+    memset(&k, 0, sizeof(k));
+    k.pc = EKILL;
+    k.member = member;
+    k.kill = gbit(g);
+    pushwork(st, w, &k);  /* below whatever the thread spawns from now */
+  }
+  else st->killed |= gbit(g);
+}
+
+
+/* Results of runthread */
+#define TDIES		0
+#define TCONSUMES	1
+#define TENDS		2
+
+/*
+** Run thread 't' on the current character until it consumes it,
+** fails, or reaches the end of the region.  Alternatives of the
+** choices it makes are pushed on 'w'.
+*/
+static int runthread (Step *st, Entry *t, Work *w) {
+  int c = st->c;
+  int n;
+  for (n = 0; n <= st->ncode && !st->overflow; n++) {
+    const Instruction *p = st->code + t->pc;
+    switch ((Opcode)p->i.code) {
+      case IAny:
+        if (c == EOS) return TDIES;
+        t->pc++;
+        return TCONSUMES;
+      case IChar:
+        if (c != p->i.aux) return TDIES;
+        t->pc++;
+        return TCONSUMES;
+      case ISet:
+        if (c == EOS || !insetat(p, 1, c)) return TDIES;
+        t->pc += 2;
+        return TCONSUMES;
+      case ISpan:
+        if (c != EOS && insetat(p, 1, c)) return TCONSUMES;
+        t->pc += 2;
+        break;
+      case ITestAny:
+        t->pc += (c != EOS) ? sizei(p) : getoffset(p);
+        break;
+      case ITestChar:
+        t->pc += (c == p->i.aux) ? sizei(p) : getoffset(p);
+        break;
+      case ITestSet:
+        t->pc += (c != EOS && inset(p, c)) ? sizei(p) : getoffset(p);
+        break;
+      case IJmp:
+        t->pc += getoffset(p);
+        break;
+      case IChoice: {
+        Entry a = *t;
+        int g = newgroup(st);
+        if (t->depth == MAXDEPTH) { st->overflow = 1; break; }
+        a.pc = t->pc + getoffset(p);
+        a.member |= gbit(g);
+        pushwork(st, w, &a);
+        t->group[t->depth] = (byte)g;
+        t->alt[t->depth] = a.pc;
+        t->depth++;
+        t->pc += sizei(p);
+        break;
+      }
+      case ICommit:
+        commit(st, w, t->group[--t->depth], t->member);
+        t->pc += getoffset(p);
+        break;
+      case IPartialCommit: {
+        Entry a = *t;
+        int top = t->depth - 1;
+        int g;
+        commit(st, w, t->group[top], t->member);
+        g = newgroup(st);
+        a.depth--;
+        a.pc = t->alt[top];
+        a.member |= gbit(g);
+        pushwork(st, w, &a);  /* above the pending kill, if any */
+        t->group[top] = (byte)g;
+        t->pc += getoffset(p);
+        break;
+      }
+      case IFail:
+        return TDIES;
+      case IEnd:
+        return TENDS;
+      default:  /* not generated for a region */
+        st->overflow = 1;
+        break;
+    }
+  }
+  st->overflow = 1;
+  return TDIES;
+}
+
+
+/* Step entry 'e' (and everything it spawns) */
+static void stepentry (Step *st, const Entry *e) {
+  Work w;
+  w.n = 0;
+  pushwork(st, &w, e);
+  while (w.n > 0 && !st->overflow) {
+    Entry t = w.e[--w.n];
+    if (t.member & st->killed) continue;
+    if (t.pc < 0) {  /* a match or a pending kill stays as it is */
+      addout(st, &t);
+      continue;
+    }
+    switch (runthread(st, &t, &w)) {
+      case TCONSUMES:
+        addout(st, &t);
+        break;
+      case TENDS:
+        t.pc = EMATCH;
+        t.depth = 0;
+        t.slot = NOW;
+        addout(st, &t);
+        break;
+      default: break;
+    }
+  }
+}
+
+
+/*
+** Reduce the next state to its canonical form: fire the pending kills
+** that reached the top, cut the list after a match that cannot be
+** killed, forget groups that no longer matter, and renumber groups
+** and registers in order of appearance.  Fills 'map' with the old
+** register of each match (or NOW); returns the number of matches, or
+** -1 if there are too many.
+*/
+static int canonical (Step *st, signed char *map, int *ngroups) {
+  Entry *out = st->out;
+  int n = st->nout;
+  int i, j, d, nmarks = 0, next = 0;
+  gmask open = 0, kills = 0, members = 0;
+  int newid[MAXGROUPS];
+  while (n > 0 && out[0].pc == EKILL) {
+    gmask kill = out[0].kill;
+    for (i = 1, j = 0; i < n; i++)
+      if (!(out[i].member & kill)) out[j++] = out[i];
+    n = j;
+  }
+  for (i = 0; i < n; i++) {
+    for (d = 0; d < out[i].depth; d++) open |= gbit(out[i].group[d]);
+    kills |= out[i].kill;
+  }
+  for (i = 0; i < n; i++) {
+    out[i].member &= open | kills;
+    members |= out[i].member;
+  }
+  for (i = 0, j = 0; i < n; i++) {  /* drop kills with nothing to kill */
+    out[i].kill &= members;
+    if (out[i].pc != EKILL || out[i].kill != 0) out[j++] = out[i];
+  }
+  n = j;
+  kills = 0;
+  for (i = 0; i < n; i++) kills |= out[i].kill;
+  for (i = 0; i < n; i++) {
+    out[i].member &= open | kills;
+    if (out[i].pc == EMATCH && (out[i].member == 0 || i == 0)) {
+      out[i].member = 0;
+      n = i + 1;  /* nothing below a certain match matters */
+    }
+  }
+  for (i = 0, j = 0; i < n; i++) {  /* remove duplicates */
+    int k;
+    for (k = 0; k < j; k++)
+      if (sameentry(&out[k], &out[i])) break;
+    if (k == j) out[j++] = out[i];
+  }
+  n = j;
+  for (i = 0; i < MAXGROUPS; i++) newid[i] = -1;
+  for (i = 0; i < n; i++) {
+    gmask m, old;
+    for (d = 0; d < out[i].depth; d++) {
+      if (newid[out[i].group[d]] < 0) newid[out[i].group[d]] = next++;
+      out[i].group[d] = (byte)newid[out[i].group[d]];
+    }
+    for (j = 0; j < 2; j++) {
+      old = (j == 0) ? out[i].kill : out[i].member;
+      for (m = 0, d = 0; d < MAXGROUPS; d++) {
+        if (old & gbit(d)) {
+          if (newid[d] < 0) newid[d] = next++;
+          m |= gbit(newid[d]);
+        }
+      }
+      if (j == 0) out[i].kill = m; else out[i].member = m;
+    }
+    if (out[i].pc == EMATCH) {
+      if (nmarks == MAXMARKS) return -1;
+      map[nmarks] = (signed char)out[i].slot;
+      out[i].slot = nmarks++;
+    }
+  }
+  st->nout = n;
+  *ngroups = next;
+  return nmarks;
+}
+
+/* }====================================================== */
+
+
+/*
+** {======================================================
+** State cache
+** =======================================================
+*/
+
+static unsigned int hashentries (const Entry *e, int n) {
+  unsigned int h = 2166136261u;
+  int i, d;
+#define mix(v)	(h = (h ^ (unsigned int)(v)) * 16777619u)
+  for (i = 0; i < n; i++) {
+    mix(e[i].pc); mix(e[i].depth); mix(e[i].slot);
+    mix(e[i].member); mix(e[i].member >> 32);
+    mix(e[i].kill); mix(e[i].kill >> 32);
+    for (d = 0; d < e[i].depth; d++) {
+      mix(e[i].group[d]); mix(e[i].alt[d]);
+    }
+  }
+#undef mix
+  return h;
+}
+
+
+static void flush (rDfa *d) {
+  int i;
+  for (i = 0; i < d->tablesize; i++) {
+    DState *ds = d->table[i];
+    while (ds != NULL) {
+      DState *next = ds->hnext;
+      free(ds);
+      ds = next;
+    }
+  }
+  free(d->table);
+  d->table = NULL;
+  d->tablesize = d->nstates = 0;
+  d->start = NULL;
+  d->mem = 0;
+}
+
+
+static int growtable (rDfa *d) {
+  int nsize = (d->tablesize == 0) ? 64 : 2 * d->tablesize;
+  DState **nt = (DState **)calloc(nsize, sizeof(DState *));
+  int i;
+  if (nt == NULL) return 0;
+  for (i = 0; i < d->tablesize; i++) {
+    DState *ds = d->table[i];
+    while (ds != NULL) {
+      DState *next = ds->hnext;
+      ds->hnext = nt[ds->hash & (nsize - 1)];
+      nt[ds->hash & (nsize - 1)] = ds;
+      ds = next;
+    }
+  }
+  free(d->table);
+  d->table = nt;
+  d->mem += (nsize - d->tablesize) * sizeof(DState *);
+  d->tablesize = nsize;
+  return 1;
+}
+
+
+/* Find or create the state with entries 'e' */
+static DState *intern (rDfa *d, const Entry *e, int n, int ngroups,
+                       int nmarks) {
+  unsigned int h = hashentries(e, n);
+  DState *ds;
+  size_t size;
+  int i;
+  if (d->tablesize > 0) {
+    for (ds = d->table[h & (d->tablesize - 1)]; ds != NULL; ds = ds->hnext) {
+      if (ds->hash == h && ds->nentries == n) {
+        for (i = 0; i < n; i++)
+          if (!sameentry(&ds->entries[i], &e[i])) break;
+        if (i == n) return ds;
+      }
+    }
+  }
+  if (d->nstates >= d->tablesize && !growtable(d))
+    return NULL;
+  size = offsetof(DState, entries) + (n > 0 ? n : 1) * sizeof(Entry);
+  ds = (DState *)calloc(1, size);
+  if (ds == NULL) return NULL;
+  ds->hash = h;
+  ds->ngroups = ngroups;
+  ds->nmarks = nmarks;
+  ds->nentries = n;
+  if (n > 0) memcpy(ds->entries, e, n * sizeof(Entry));
+  ds->final = (n == 0) ? R_DFA_FAIL
+              : (e[0].pc == EMATCH) ? R_DFA_MATCH : -1;
+  ds->hnext = d->table[h & (d->tablesize - 1)];
+  d->table[h & (d->tablesize - 1)] = ds;
+  d->nstates++;
+  d->mem += size;
+  return ds;
+}
+
+
+static DState *startstate (rDfa *d) {
+  Entry e;
+  memset(&e, 0, sizeof(e));  /* pc 0, nothing open */
+  return d->start = intern(d, &e, 1, 0, 0);
+}
+
+
+/* Compute the transition of state 'ds' on character 'c' */
+static DState *computetrans (rDfa *d, DState *ds, int c) {
+  Step st;
+  DTrans *t = &ds->trans[c];
+  int i, nmarks, ngroups;
+  st.code = d->code;
+  st.ncode = d->ncode;
+  st.c = c;
+  st.ngroups = ds->ngroups;
+  st.killed = 0;
+  st.overflow = 0;
+  st.nout = 0;
+  for (i = 0; i < ds->nentries && !st.overflow; i++)
+    if (!(ds->entries[i].member & st.killed))
+      stepentry(&st, &ds->entries[i]);
+  if (st.overflow || (nmarks = canonical(&st, t->map, &ngroups)) < 0)
+    return t->to = &toobig;
+  t->remap = 0;
+  for (i = 0; i < nmarks; i++)
+    if (t->map[i] != i) t->remap = 1;
+  return t->to = intern(d, st.out, st.nout, ngroups, nmarks);
+}
+
+/* }====================================================== */
+
+
+rDfa *r_dfanew (const Instruction *code, int ncode) {
+  rDfa *d = (rDfa *)calloc(1, sizeof(rDfa));
+  if (d == NULL) return NULL;
+  d->code = (Instruction *)malloc(ncode * sizeof(Instruction));
+  if (d->code == NULL) {
+    free(d);
+    return NULL;
+  }
+  memcpy(d->code, code, ncode * sizeof(Instruction));
+  d->ncode = ncode;
+  if (pthread_mutex_init(&d->lock, NULL) != 0) {
+    free(d->code);
+    free(d);
+    return NULL;
+  }
+  return d;
+}
+
+
+void r_dfafree (rDfa *d) {
+  if (d) {
+    flush(d);
+    pthread_mutex_destroy(&d->lock);
+    free(d->code);
+    free(d);
+  }
+}
+
+
+size_t r_dfasize (rDfa *d) {
+  size_t mem;
+  pthread_mutex_lock(&d->lock);
+  mem = d->mem;
+  pthread_mutex_unlock(&d->lock);
+  return sizeof(rDfa) + d->ncode * sizeof(Instruction) + mem;
+}
+
+
+static int giveup (rDfa *d, int flushcache) {
+  d->giveups++;
+  if (flushcache) flush(d);
+  return R_DFA_GIVEUP;
+}
+
+
+static int dfarun (rDfa *d, const char *s, const char *e, const char **end) {
+  const char *reg[MAXMARKS];
+  DState *ds = d->start;
+  d->runs++;
+  if (d->giveups >= MAXGIVEUPS && d->giveups > d->runs / 8)
+    return R_DFA_GIVEUP;  /* not worth it for this region */
+  if (ds == NULL && (ds = startstate(d)) == NULL)
+    return giveup(d, 1);
+  for (;;) {
+    int c;
+    DTrans *t;
+    DState *to;
+    if (ds->final >= 0) {
+      if (ds->final == R_DFA_MATCH) *end = reg[0];
+      return ds->final;
+    }
+    c = (s < e) ? (byte)*s : EOS;
+    t = &ds->trans[c];
+    if ((to = t->to) == NULL) {
+      to = computetrans(d, ds, c);
+      if (to == NULL || d->mem > R_DFACACHE)
+        return giveup(d, 1);  /* start over with an empty cache */
+    }
+    if (to == &toobig)
+      return giveup(d, 0);
+    if (t->remap) {
+      const char *nreg[MAXMARKS];
+      int i;
+      for (i = 0; i < to->nmarks; i++)
+        nreg[i] = (t->map[i] == NOW) ? s : reg[(int)t->map[i]];
+      memcpy(reg, nreg, to->nmarks * sizeof(const char *));
+    }
+    ds = to;
+    if (c == EOS) {
+      assert(ds->final >= 0);
+      continue;
+    }
+    s++;
+  }
+}
+
+
+/*
+** Match the region against [s, e).  On R_DFA_MATCH, '*end' is the end
+** of the match.  Only one run at a time uses the cache; another one,
+** in another thread, gives up at once, leaving the match to the
+** ordinary code.
+*/
+int r_dfarun (rDfa *d, const char *s, const char *e, const char **end) {
+  int res;
+  if (pthread_mutex_trylock(&d->lock) != 0)
+    return R_DFA_GIVEUP;
+  res = dfarun(d, s, e, end);
+  pthread_mutex_unlock(&d->lock);
+  return res;
+}
+
+
+rDfa *r_getdfa (const Instruction *p) {
+  rDfa *d;
+  memcpy(&d, p + 2, sizeof(d));
+  return d;
+}
+
+
+void r_setdfa (Instruction *p, rDfa *d) {
+  memcpy(p + 2, &d, sizeof(d));
+}
+
+
+/* Free the DFAs of the IDfa instructions in 'code' */
+void r_dfafreecode (Instruction *code, int codesize) {
+  int i;
+  for (i = 0; i < codesize; i += sizei(&code[i]))
+    if (code[i].i.code == IDfa) r_dfafree(r_getdfa(&code[i]));
+}
@@ -0,0 +1,69 @@
+/*  -*- Mode: C/l; -*-                                                       */
+/*                                                                           */
+/*  rdfa.h   Lazy DFAs for capture-free regular subpatterns                 */
+/*                                                                           */
+/*  © Copyright IBM Corporation 2017.                                        */
+/*  LICENSE: MIT License (https://opensource.org/licenses/mit-license.html)  */
+/*  AUTHOR: Jamie A. Jennings                                                */
+
+/*
+ * A subpattern built only from characters, sets, sequences, ordered
+ * choices and repetitions (no captures, calls, predicates or
+ * lookarounds) is compiled twice: once as ordinary code, and once as
+ * a stand-alone program from which a DFA is built lazily, one state
+ * and one transition at a time, as subjects are matched.  The code
+ * for such a region is
+ *
+ *     dfa L
+ *     <ordinary code for the region>
+ *   L:
+ *
+ * IDfa runs the DFA.  On a match it moves the subject to the end of
+ * the match and jumps to L; on a failure it fails.  When the DFA
+ * cannot decide (its state cache is full, or the region needs more
+ * threads than a state can hold) it gives up, and the ordinary code
+ * that follows does the work.  The result is the same either way:
+ * the DFA keeps the PEG semantics of ordered choice and greedy
+ * repetition, including the end of the match.
+ *
+ * The cache of states is the only part of compiled code that changes
+ * while it runs.  A lock keeps it to one run at a time, so a compiled
+ * pattern may be matched in several threads at once; a run that finds
+ * the cache in use gives up (with the same result, as above).
+ */
+
+#if !defined(rdfa_h)
+#define rdfa_h
+
+#include "lptypes.h"
+#include "lpvm.h"
+
+/* bytes of states cached by one DFA; when full, the cache is flushed */
+#if !defined(R_DFACACHE)
+#define R_DFACACHE	(1024 * 1024)
+#endif
+
+/* smallest region (in tree nodes) worth a DFA */
+#if !defined(R_DFAMINSIZE)
+#define R_DFAMINSIZE	6
+#endif
+
+/* results of r_dfarun */
+#define R_DFA_FAIL	0
+#define R_DFA_MATCH	1
+#define R_DFA_GIVEUP	2
+
+typedef struct rDfa rDfa;
+
+rDfa *r_dfanew (const Instruction *code, int ncode);
+void r_dfafree (rDfa *dfa);
+int r_dfarun (rDfa *dfa, const char *s, const char *e, const char **end);
+size_t r_dfasize (rDfa *dfa);
+
+/* The DFA of an IDfa instruction is kept in the slots after its offset */
+#define DFAINSTSIZE	(2 + (int)instsize(sizeof(rDfa *)) - 1)
+rDfa *r_getdfa (const Instruction *p);
+void r_setdfa (Instruction *p, rDfa *dfa);
+void r_dfafreecode (Instruction *code, int codesize);
+
+#endif
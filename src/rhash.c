@@ -0,0 +1,61 @@
+/*  -*- Mode: C/l; -*-                                                       */
+/*                                                                           */
+/*  rhash.c   Hash functions shared by the modules                          */
+/*                                                                           */
+/*  © Copyright IBM Corporation 2017.                                        */
+/*  LICENSE: MIT License (https://opensource.org/licenses/mit-license.html)  */
+/*  AUTHOR: Jamie A. Jennings                                                */
+
+#include "rhash.h"
+
+uint64_t r_fnv (uint64_t h, const void *data, size_t n) {
+  const unsigned char *s = (const unsigned char *)data;
+  while (n-- > 0)
+    h = (h ^ *s++) * R_FNV_PRIME;
+  return h;
+}
+
+
+/* little-endian word at 's', of 'n' (at most 8) bytes */
+static uint64_t getword (const char *s, size_t n) {
+  uint64_t w = 0;
+  while (n-- > 0)
+    w = (w << 8) | (unsigned char)s[n];
+  return w;
+}
+
+
+#define rotl(x,b)	(((x) << (b)) | ((x) >> (64 - (b))))
+
+#define sipround(v0,v1,v2,v3) {  \
+    v0 += v1; v1 = rotl(v1, 13); v1 ^= v0; v0 = rotl(v0, 32);  \
+    v2 += v3; v3 = rotl(v3, 16); v3 ^= v2;  \
+    v0 += v3; v3 = rotl(v3, 21); v3 ^= v0;  \
+    v2 += v1; v1 = rotl(v1, 17); v1 ^= v2; v2 = rotl(v2, 32); }
+
+/* SipHash-2-4 of the 'n' bytes at 'data', keyed by the 16 at 'key' */
+uint64_t r_siphash (const char *key, const char *data, size_t n) {
+  uint64_t k0 = getword(key, 8), k1 = getword(key + 8, 8);
+  uint64_t v0 = k0 ^ 0x736f6d6570736575ULL;
+  uint64_t v1 = k1 ^ 0x646f72616e646f6dULL;
+  uint64_t v2 = k0 ^ 0x6c7967656e657261ULL;
+  uint64_t v3 = k1 ^ 0x7465646279746573ULL;
+  uint64_t m;
+  size_t i;
+  for (i = 0; i + 8 <= n; i += 8) {
+    m = getword(data + i, 8);
+    v3 ^= m;
+    sipround(v0, v1, v2, v3);
+    sipround(v0, v1, v2, v3);
+    v0 ^= m;
+  }
+  m = getword(data + i, n - i) | ((uint64_t)(n & 0xFF) << 56);
+  v3 ^= m;
+  sipround(v0, v1, v2, v3);
+  sipround(v0, v1, v2, v3);
+  v0 ^= m;
+  v2 ^= 0xFF;
+  for (i = 0; i < 4; i++)
+    sipround(v0, v1, v2, v3);
+  return v0 ^ v1 ^ v2 ^ v3;
+}
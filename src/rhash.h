@@ -0,0 +1,33 @@
+/*  -*- Mode: C/l; -*-                                                       */
+/*                                                                           */
+/*  rhash.h   Hash functions shared by the modules                          */
+/*                                                                           */
+/*  © Copyright IBM Corporation 2017.                                        */
+/*  LICENSE: MIT License (https://opensource.org/licenses/mit-license.html)  */
+/*  AUTHOR: Jamie A. Jennings                                                */
+
+/*
+ * r_fnv is 64-bit FNV-1a, for hash tables: fast, but anyone can find
+ * inputs with the same hash.  Start with R_FNV_OFFSET, and continue a
+ * hash by passing the previous one as 'h'.
+ *
+ * r_siphash is SipHash-2-4, a pseudorandom function keyed by 16
+ * bytes: without the key, its output tells nothing of its input, even
+ * when the input is guessable (as is a phone number).
+ */
+
+#if !defined(rhash_h)
+#define rhash_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define R_FNV_OFFSET	14695981039346656037ULL
+#define R_FNV_PRIME	1099511628211ULL
+
+#define R_SIPKEYLEN	16
+
+uint64_t r_fnv (uint64_t h, const void *data, size_t n);
+uint64_t r_siphash (const char *key, const char *data, size_t n);
+
+#endif
@@ -0,0 +1,805 @@
+/*  -*- Mode: C/l; -*-                                                       */
+/*                                                                           */
+/*  rjit.c   Native x86-64 code for compiled patterns                       */
+/*                                                                           */
+/*  © Copyright IBM Corporation 2017.                                        */
+/*  LICENSE: MIT License (https://opensource.org/licenses/mit-license.html)  */
+/*  AUTHOR: Jamie A. Jennings                                                */
+
+/*
+ * The jit translates the instructions of a compiled pattern, one by
+ * one, into x86-64 code.  The translation mirrors the interpreter in
+ * lpvm.c exactly: the same backtrack stack discipline, the same
+ * capture list, and the same helpers to grow them.  What changes is
+ * that the subject position, the stack top and the capture top live
+ * in registers, charset tests are inlined, and every jump is a direct
+ * branch.
+ *
+ * Register use in the generated code:
+ *   rbx  current subject position ('s')
+ *   r12  end of subject ('e')
+ *   r13  first empty slot of the backtrack stack
+ *   r14  the JitState
+ *   r15  first empty slot of the capture list
+ *   rbp  end of the capture list (grow when r15 reaches it)
+ *
+ * Patterns that contain instructions we do not translate (run-time
+ * captures, which call back into Lua) are left to the interpreter.
+ *
+ * When the environment variable LPEG_PERFMAP is set (to anything but
+ * "" or "0"), installing native code appends a line to the perf map
+ * file /tmp/perf-<pid>.map so that 'perf' can symbolize it.  Nothing
+ * is written otherwise.
+ */
+
+#if defined(__x86_64__) && (defined(__linux__) || defined(__APPLE__))
+#define R_JIT 1
+#if !defined(_DEFAULT_SOURCE)
+#define _DEFAULT_SOURCE		/* for mmap flags */
+#endif
+#endif
+
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(R_JIT)
+#include <sys/mman.h>
+#include <unistd.h>
+#if !defined(MAP_ANONYMOUS)
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+#endif
+
+#include "lua.h"
+#include "lauxlib.h"
+
+#include "lptypes.h"
+#include "lpcap.h"
+#include "lpcode.h"
+#include "lpvm.h"
+#include "rpred.h"
+#include "rjit.h"
+#include "rdfa.h"
+
+
+/*
+** Double the size of the backtrack stack ('top' is its limit)
+*/
+static JitStack *jit_growstack (JitState *js, JitStack *top) {
+  lua_State *L = js->L;
+  int n = top - js->stackbase;  /* current stack size */
+  int max, newn;
+  JitStack *newstack;
+  lua_getfield(L, LUA_REGISTRYINDEX, MAXSTACKIDX);
+  max = lua_tointeger(L, -1);  /* maximum allowed size */
+  lua_pop(L, 1);
+  if (n >= max)  /* already at maximum size? */
+    luaL_error(L, "backtrack stack overflow (current limit is %d)", max);
+  newn = 2 * n;  /* new size */
+  if (newn > max) newn = max;
+  newstack = (JitStack *)lua_newuserdata(L, newn * sizeof(JitStack));
+  memcpy(newstack, js->stackbase, n * sizeof(JitStack));
+  lua_replace(L, stackidx(js->ptop));
+  js->stackbase = newstack;
+  js->stacklimit = newstack + newn;
+  return newstack + n;  /* return next position */
+}
+
+
+/*
+** Double the size of the capture list ('top' is its limit), and
+** rebase the capture levels saved in the backtrack stack
+*/
+static Capture *jit_growcap (JitState *js, Capture *top, JitStack *stacktop) {
+  lua_State *L = js->L;
+  int captop = top - js->capture;
+  Capture *newc;
+  JitStack *st;
+  if (captop >= INT_MAX/((int)sizeof(Capture) * 2))
+    luaL_error(L, "too many captures");
+  newc = (Capture *)lua_newuserdata(L, captop * 2 * sizeof(Capture));
+  memcpy(newc, js->capture, captop * sizeof(Capture));
+  lua_replace(L, caplistidx(js->ptop));
+  for (st = js->stackbase; st < stacktop; st++)
+    st->cap = newc + (st->cap - js->capture);
+  js->capture = newc;
+  js->caplimit = newc + 2 * captop;
+  return newc + captop;
+}
+
+
+/* Is the set a single range [lo, hi]? */
+int r_charsetrange (const byte *cs, int *lo, int *hi) {
+  int c, n = 0, prev = 0;
+  for (c = 0; c <= UCHAR_MAX; c++) {
+    int in = testchar(cs, c) != 0;
+    if (in && !prev) {
+      if (n++ > 0) return 0;
+      *lo = c;
+    }
+    if (in) *hi = c;
+    prev = in;
+  }
+  return (n == 1);
+}
+
+
+
+rJit *r_newjit (void) {
+  rJit *jit = (rJit *)malloc(sizeof(rJit));
+  if (jit) memset(jit, 0, sizeof(rJit));
+  return jit;
+}
+
+
+#if defined(R_JIT)
+
+/*
+** {======================================================
+** Assembler
+** =======================================================
+*/
+
+enum { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+       R8, R9, R10, R11, R12, R13, R14, R15 };
+
+#define RS	RBX		/* subject position */
+#define RE	R12		/* end of subject */
+#define RSTK	R13		/* backtrack stack top */
+#define RJS	R14		/* JitState */
+#define RCAP	R15		/* capture top */
+#define RCAPLIM	RBP		/* capture limit */
+
+/* condition codes */
+enum { CC_B = 2, CC_AE = 3, CC_E = 4, CC_NE = 5, CC_A = 7, CC_L = 0xC,
+       CC_GE = 0xD };
+
+#define jsfield(f)	((int)offsetof(JitState, f))
+#define stkfield(f)	((int)offsetof(JitStack, f))
+#define capfield(f)	((int)offsetof(Capture, f))
+#define STKSIZE		((int)sizeof(JitStack))
+#define CAPSIZE		((int)sizeof(Capture))
+
+typedef struct Fixup {
+  size_t pos;			/* position of a rel32 field */
+  int label;			/* target label, or -1 for data */
+  size_t dataoff;		/* target offset in data, when label is -1 */
+} Fixup;
+
+typedef struct Asm {
+  byte *code;
+  size_t ncode, codesize;
+  byte *data;			/* charset bitmaps */
+  size_t ndata, datasize;
+  long *label;			/* code position of each label, or -1 */
+  int nlabel, labelsize;
+  Fixup *fix;
+  int nfix, fixsize;
+  int error;			/* out of memory */
+} Asm;
+
+
+/* ensure room for 'n' more elements of size 'elem' in '*b' */
+static int asm_grow (Asm *a, void **b, size_t *size, size_t used,
+                     size_t n, size_t elem) {
+  if (used + n > *size) {
+    size_t newsize = (*size == 0) ? 64 : *size;
+    void *newb;
+    while (used + n > newsize) newsize *= 2;
+    newb = realloc(*b, newsize * elem);
+    if (newb == NULL) { a->error = 1; return 0; }
+    *b = newb; *size = newsize;
+  }
+  return 1;
+}
+
+static void emit (Asm *a, int b) {
+  if (asm_grow(a, (void **)&a->code, &a->codesize, a->ncode, 1, 1))
+    a->code[a->ncode++] = (byte)b;
+}
+
+static void emit32 (Asm *a, int32_t v) {
+  uint32_t u = (uint32_t)v;
+  int i;
+  for (i = 0; i < 4; i++) emit(a, (u >> (8 * i)) & 0xFF);
+}
+
+static void emit64 (Asm *a, uint64_t v) {
+  int i;
+  for (i = 0; i < 8; i++) emit(a, (int)((v >> (8 * i)) & 0xFF));
+}
+
+static int newlabel (Asm *a) {
+  size_t size = a->labelsize;
+  if (!asm_grow(a, (void **)&a->label, &size, a->nlabel, 1, sizeof(long)))
+    return 0;
+  a->labelsize = size;
+  a->label[a->nlabel] = -1;
+  return a->nlabel++;
+}
+
+static void setlabel (Asm *a, int l) {
+  if (l < a->nlabel) a->label[l] = a->ncode;
+}
+
+/* emit a rel32 field that refers to label 'l' (or to data at 'dataoff') */
+static void rel32 (Asm *a, int l, size_t dataoff) {
+  size_t size = a->fixsize;
+  if (!asm_grow(a, (void **)&a->fix, &size, a->nfix, 1, sizeof(Fixup)))
+    return;
+  a->fixsize = size;
+  a->fix[a->nfix].pos = a->ncode;
+  a->fix[a->nfix].label = l;
+  a->fix[a->nfix].dataoff = dataoff;
+  a->nfix++;
+  emit32(a, 0);
+}
+
+static void rex (Asm *a, int w, int reg, int base) {
+  int r = 0x40 | (w << 3) | ((reg >> 3) << 2) | (base >> 3);
+  if (r != 0x40) emit(a, r);
+}
+
+/* ModRM (and SIB) for the memory operand [base + disp] */
+static void modrm_mem (Asm *a, int reg, int base, int disp) {
+  int mod = ((disp == 0) && ((base & 7) != RBP)) ? 0
+            : (disp >= -128 && disp <= 127) ? 1 : 2;
+  emit(a, (mod << 6) | ((reg & 7) << 3) | (base & 7));
+  if ((base & 7) == RSP) emit(a, 0x24);
+  if (mod == 1) emit(a, disp & 0xFF);
+  else if (mod == 2) emit32(a, disp);
+}
+
+/* op reg, [base + disp] (or the reverse, per the opcode) */
+static void memop (Asm *a, int w, int op, int reg, int base, int disp) {
+  rex(a, w, reg, base);
+  if (op > 0xFF) emit(a, op >> 8);
+  emit(a, op & 0xFF);
+  modrm_mem(a, reg, base, disp);
+}
+
+/* op rm, reg (register to register) */
+static void regop (Asm *a, int w, int op, int reg, int rm) {
+  rex(a, w, reg, rm);
+  if (op > 0xFF) emit(a, op >> 8);
+  emit(a, op & 0xFF);
+  emit(a, 0xC0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+/* group-1 arithmetic with an immediate: add 0, or 1, and 4, sub 5, cmp 7 */
+static void alu_ri (Asm *a, int w, int ext, int reg, int32_t imm) {
+  rex(a, w, 0, reg);
+  if (imm >= -128 && imm <= 127) {
+    emit(a, 0x83); emit(a, 0xC0 | (ext << 3) | (reg & 7)); emit(a, imm & 0xFF);
+  }
+  else {
+    emit(a, 0x81); emit(a, 0xC0 | (ext << 3) | (reg & 7)); emit32(a, imm);
+  }
+}
+
+#define ADD 0
+#define SUB 5
+#define CMP 7
+
+#define load(a,dst,base,disp)	memop(a, 1, 0x8B, dst, base, disp)
+#define store(a,base,disp,src)	memop(a, 1, 0x89, src, base, disp)
+#define lea(a,dst,base,disp)	memop(a, 1, 0x8D, dst, base, disp)
+#define movzxb(a,dst,base,disp)	memop(a, 0, 0x0FB6, dst, base, disp)
+#define cmpmem(a,reg,base,disp)	memop(a, 1, 0x3B, reg, base, disp)
+#define submem(a,reg,base,disp)	memop(a, 1, 0x2B, reg, base, disp)
+#define movrr(a,dst,src)	regop(a, 1, 0x89, src, dst)
+#define cmprr(a,r1,r2)		regop(a, 1, 0x39, r2, r1)
+#define testrr(a,r1,r2)		regop(a, 1, 0x85, r2, r1)
+
+static void storeb_imm (Asm *a, int base, int disp, int imm) {
+  memop(a, 0, 0xC6, 0, base, disp); emit(a, imm & 0xFF);
+}
+
+static void storeq_imm (Asm *a, int base, int disp, int32_t imm) {
+  memop(a, 1, 0xC7, 0, base, disp); emit32(a, imm);
+}
+
+static void movimm (Asm *a, int reg, uint64_t imm) {
+  rex(a, 1, 0, reg); emit(a, 0xB8 + (reg & 7)); emit64(a, imm);
+}
+
+static void movaddr (Asm *a, int reg, const void *addr) {
+  uint64_t imm;
+  memcpy(&imm, &addr, sizeof(imm));
+  movimm(a, reg, imm);
+}
+
+static void leadata (Asm *a, int reg, size_t dataoff) {
+  rex(a, 1, reg, 0); emit(a, 0x8D); emit(a, ((reg & 7) << 3) | 5);
+  rel32(a, -1, dataoff);
+}
+
+static void leacode (Asm *a, int reg, int l) {
+  rex(a, 1, reg, 0); emit(a, 0x8D); emit(a, ((reg & 7) << 3) | 5);
+  rel32(a, l, 0);
+}
+
+static void jmp (Asm *a, int l) {
+  emit(a, 0xE9); rel32(a, l, 0);
+}
+
+static void jcc (Asm *a, int cc, int l) {
+  emit(a, 0x0F); emit(a, 0x80 | cc); rel32(a, l, 0);
+}
+
+static void jmpmem (Asm *a, int base, int disp) {
+  memop(a, 0, 0xFF, 4, base, disp);
+}
+
+static void callreg (Asm *a, int reg) {
+  rex(a, 0, 0, reg); emit(a, 0xFF); emit(a, 0xD0 | (reg & 7));
+}
+
+static void push (Asm *a, int reg) {
+  rex(a, 0, 0, reg); emit(a, 0x50 + (reg & 7));
+}
+
+static void pop (Asm *a, int reg) {
+  rex(a, 0, 0, reg); emit(a, 0x58 + (reg & 7));
+}
+
+/* add a 32-byte charset to the data area, sharing equal ones */
+static size_t adddata (Asm *a, const byte *cs) {
+  size_t i;
+  for (i = 0; i < a->ndata; i += CHARSETSIZE)
+    if (memcmp(a->data + i, cs, CHARSETSIZE) == 0) return i;
+  if (!asm_grow(a, (void **)&a->data, &a->datasize, a->ndata, CHARSETSIZE, 1))
+    return 0;
+  memcpy(a->data + a->ndata, cs, CHARSETSIZE);
+  a->ndata += CHARSETSIZE;
+  return i;
+}
+
+/* }====================================================== */
+
+
+/*
+** {======================================================
+** Code generation
+** =======================================================
+*/
+
+typedef struct JitCompState {
+  Asm a;
+  int lfail;			/* shared fail handler */
+  int lepilogue;		/* store capture top and return 'rax' */
+  int lgiveup;			/* bottom of the stack: return NULL */
+} JitCompState;
+
+
+/*
+** With the current byte in eax, jump to 'l' if it is not in the
+** charset of set instruction 'p' (as a bitmap, whatever its entry in
+** the pool of the code)
+*/
+static void settest (Asm *a, const Instruction *p, int l) {
+  byte cs[CHARSETSIZE];
+  int lo, hi;
+  r_getcharset(p, cs);
+  if (r_charsetrange(cs, &lo, &hi)) {
+    memop(a, 0, 0x8D, RCX, RAX, -lo);  /* lea ecx, [rax - lo] */
+    alu_ri(a, 0, CMP, RCX, hi - lo);
+    jcc(a, CC_A, l);
+  }
+  else {  /* bit test against the bitmap, 32 bits at a time */
+    leadata(a, RDX, adddata(a, cs));
+    regop(a, 0, 0x89, RAX, RCX);  /* mov ecx, eax */
+    rex(a, 0, 0, RCX); emit(a, 0xC1); emit(a, 0xE9); emit(a, 5);  /* shr ecx, 5 */
+    emit(a, 0x8B); emit(a, 0x0C); emit(a, 0x8A);  /* mov ecx, [rdx + rcx*4] */
+    regop(a, 0, 0x0FA3, RAX, RCX);  /* bt ecx, eax */
+    jcc(a, CC_AE, l);  /* carry clear: not in set */
+  }
+}
+
+
+/* Make room for one more backtrack entry */
+static void checkstack (Asm *a) {
+  int ok = newlabel(a);
+  cmpmem(a, RSTK, RJS, jsfield(stacklimit));
+  jcc(a, CC_B, ok);
+  movrr(a, RDI, RJS);
+  movrr(a, RSI, RSTK);
+  movaddr(a, RAX, (const void *)(uintptr_t)jit_growstack);
+  callreg(a, RAX);
+  movrr(a, RSTK, RAX);
+  setlabel(a, ok);
+}
+
+
+/* Advance the capture top, growing the capture list when needed */
+static void pushcapture (Asm *a) {
+  int ok = newlabel(a);
+  alu_ri(a, 1, ADD, RCAP, CAPSIZE);
+  cmprr(a, RCAP, RCAPLIM);
+  jcc(a, CC_B, ok);
+  movrr(a, RDI, RJS);
+  movrr(a, RSI, RCAP);
+  movrr(a, RDX, RSTK);
+  movaddr(a, RAX, (const void *)(uintptr_t)jit_growcap);
+  callreg(a, RAX);
+  movrr(a, RCAP, RAX);
+  load(a, RCAPLIM, RJS, jsfield(caplimit));
+  setlabel(a, ok);
+}
+
+
+/* Write the capture fields after 's' (idx, kind, siz) in one store */
+static void capinfo (Asm *a, const Instruction *p, int siz) {
+  Capture c;
+  uint64_t imm;
+  memset(&c, 0, sizeof(c));
+  c.idx = getkey(p);
+  c.kind = getkind(p);
+  c.siz = siz;
+  memcpy(&imm, (const char *)&c + capfield(idx), sizeof(imm));
+  movimm(a, RAX, imm);
+  store(a, RCAP, capfield(idx), RAX);
+}
+
+
+#define target	(i + getoffset(p))
+
+static int codeinstruction (JitCompState *jc, const Instruction *code, int i) {
+  Asm *a = &jc->a;
+  const Instruction *p = &code[i];
+  switch ((Opcode)p->i.code) {
+    case IAny:
+      cmprr(a, RS, RE);
+      jcc(a, CC_AE, jc->lfail);
+      alu_ri(a, 1, ADD, RS, 1);
+      break;
+    case IChar:
+      cmprr(a, RS, RE);
+      jcc(a, CC_AE, jc->lfail);
+      memop(a, 0, 0x80, CMP, RS, 0); emit(a, p->i.aux);  /* cmp byte [rbx] */
+      jcc(a, CC_NE, jc->lfail);
+      alu_ri(a, 1, ADD, RS, 1);
+      break;
+    case ISet:
+      cmprr(a, RS, RE);
+      jcc(a, CC_AE, jc->lfail);
+      movzxb(a, RAX, RS, 0);
+      settest(a, p, jc->lfail);
+      alu_ri(a, 1, ADD, RS, 1);
+      break;
+    case ITestAny:
+      cmprr(a, RS, RE);
+      jcc(a, CC_AE, target);
+      break;
+    case ITestChar:
+      cmprr(a, RS, RE);
+      jcc(a, CC_AE, target);
+      memop(a, 0, 0x80, CMP, RS, 0); emit(a, p->i.aux);
+      jcc(a, CC_NE, target);
+      break;
+    case ITestSet:
+      cmprr(a, RS, RE);
+      jcc(a, CC_AE, target);
+      movzxb(a, RAX, RS, 0);
+      settest(a, p, target);
+      break;
+    case ISpan: {
+      int loop = newlabel(a), done = newlabel(a);
+      setlabel(a, loop);
+      cmprr(a, RS, RE);
+      jcc(a, CC_AE, done);
+      movzxb(a, RAX, RS, 0);
+      settest(a, p, done);
+      alu_ri(a, 1, ADD, RS, 1);
+      jmp(a, loop);
+      setlabel(a, done);
+      break;
+    }
+    case IBehind:
+      movrr(a, RAX, RS);
+      submem(a, RAX, RJS, jsfield(o));
+      alu_ri(a, 1, CMP, RAX, p->i.key);
+      jcc(a, CC_L, jc->lfail);
+      alu_ri(a, 1, SUB, RS, p->i.key);
+      break;
+    case IRet:
+      alu_ri(a, 1, SUB, RSTK, STKSIZE);
+      jmpmem(a, RSTK, stkfield(p.addr));
+      break;
+    case IEnd:
+      storeq_imm(a, RCAP, capfield(s), 0);
+      storeb_imm(a, RCAP, capfield(kind), Cclose);
+      movrr(a, RAX, RS);
+      jmp(a, jc->lepilogue);
+      break;
+    case IHalt:
+      store(a, RCAP, capfield(s), RS);
+      storeb_imm(a, RCAP, capfield(kind), Cfinal);
+      movrr(a, RAX, RS);
+      jmp(a, jc->lepilogue);
+      break;
+    case IChoice:
+      checkstack(a);
+      store(a, RSTK, stkfield(s), RS);
+      leacode(a, RAX, target);
+      store(a, RSTK, stkfield(p.addr), RAX);
+      store(a, RSTK, stkfield(cap), RCAP);
+      alu_ri(a, 1, ADD, RSTK, STKSIZE);
+      break;
+    case IJmp:
+      jmp(a, target);
+      break;
+    case ICall:
+      checkstack(a);
+      storeq_imm(a, RSTK, stkfield(s), 0);
+      leacode(a, RAX, i + sizei(p));  /* return address */
+      store(a, RSTK, stkfield(p.addr), RAX);
+      store(a, RSTK, stkfield(cap), RCAP);
+      alu_ri(a, 1, ADD, RSTK, STKSIZE);
+      jmp(a, target);
+      break;
+    case ICommit:
+      alu_ri(a, 1, SUB, RSTK, STKSIZE);
+      jmp(a, target);
+      break;
+    case IPartialCommit:
+      store(a, RSTK, stkfield(s) - STKSIZE, RS);
+      store(a, RSTK, stkfield(cap) - STKSIZE, RCAP);
+      jmp(a, target);
+      break;
+    case IBackCommit:
+      alu_ri(a, 1, SUB, RSTK, STKSIZE);
+      load(a, RS, RSTK, stkfield(s));
+      load(a, RCAP, RSTK, stkfield(cap));
+      jmp(a, target);
+      break;
+    case IFailTwice:
+      alu_ri(a, 1, SUB, RSTK, STKSIZE);
+      jmp(a, jc->lfail);
+      break;
+    case IFail:
+      jmp(a, jc->lfail);
+      break;
+    case IFullCapture:
+      lea(a, RAX, RS, -getoff(p));
+      store(a, RCAP, capfield(s), RAX);
+      capinfo(a, p, getoff(p) + 1);
+      pushcapture(a);
+      break;
+    case IOpenCapture:
+      store(a, RCAP, capfield(s), RS);
+      capinfo(a, p, 0);
+      pushcapture(a);
+      break;
+    case ICloseCapture: {
+      /* if possible, turn the open capture into a full capture */
+      int lpush = newlabel(a), done = newlabel(a);
+      memop(a, 0, 0x80, CMP, RCAP, capfield(siz) - CAPSIZE); emit(a, 0);
+      jcc(a, CC_NE, lpush);
+      movrr(a, RCX, RS);
+      submem(a, RCX, RCAP, capfield(s) - CAPSIZE);
+      alu_ri(a, 1, CMP, RCX, UCHAR_MAX);
+      jcc(a, CC_GE, lpush);
+      alu_ri(a, 0, ADD, RCX, 1);
+      memop(a, 0, 0x88, RCX, RCAP, capfield(siz) - CAPSIZE);  /* mov [], cl */
+      jmp(a, done);
+      setlabel(a, lpush);
+      store(a, RCAP, capfield(s), RS);
+      capinfo(a, p, 1);
+      pushcapture(a);
+      setlabel(a, done);
+      break;
+    }
+    case IPredicate:
+      if ((p + 2)->offset >= 0)  /* body has fixed length? */
+        lea(a, RSI, RS, -(p + 2)->offset);
+      else {  /* body started at the position saved by its choice */
+        alu_ri(a, 1, SUB, RSTK, STKSIZE);
+        load(a, RSI, RSTK, stkfield(s));
+      }
+      load(a, RDI, RJS, jsfield(o));
+      movrr(a, RDX, RS);
+      movrr(a, RCX, RE);
+      movaddr(a, RAX, &r_predicates[p->i.aux].fn);
+      emit(a, 0xFF); emit(a, 0x10);  /* call [rax] */
+      testrr(a, RAX, RAX);
+      jcc(a, CC_E, jc->lfail);
+      movrr(a, RS, RAX);
+      jmp(a, target);
+      break;
+    case IDfa: {  /* r_dfarun(dfa, s, e, &end), 'end' in the alignment slot */
+      int lnomatch = newlabel(a);
+      movaddr(a, RDI, r_getdfa(p));
+      movrr(a, RSI, RS);
+      movrr(a, RDX, RE);
+      movrr(a, RCX, RSP);
+      movimm(a, RAX, (uint64_t)(uintptr_t)&r_dfarun);
+      callreg(a, RAX);
+      alu_ri(a, 0, CMP, RAX, R_DFA_MATCH);
+      jcc(a, CC_NE, lnomatch);
+      load(a, RS, RSP, 0);
+      jmp(a, target);
+      setlabel(a, lnomatch);
+      alu_ri(a, 0, CMP, RAX, R_DFA_FAIL);
+      jcc(a, CC_E, jc->lfail);
+      break;  /* gave up: run the region's code */
+    }
+    case ICharset: case IClasses:  /* the pool, after IEnd */
+      break;
+    default:  /* IOpenCall, IGiveup, ICloseRunTime */
+      return 0;
+  }
+  return 1;
+}
+
+#undef target
+
+
+static void prologue (Asm *a) {
+  push(a, RBX); push(a, RBP); push(a, R12);
+  push(a, R13); push(a, R14); push(a, R15);
+  alu_ri(a, 1, SUB, RSP, 8);  /* keep the C stack 16-byte aligned */
+  movrr(a, RJS, RDI);
+  movrr(a, RS, RSI);
+  load(a, RE, RJS, jsfield(e));
+  load(a, RSTK, RJS, jsfield(stackbase));
+  alu_ri(a, 1, ADD, RSTK, STKSIZE);  /* entry 0 is the 'giveup' entry */
+  load(a, RCAP, RJS, jsfield(captop));
+  load(a, RCAPLIM, RJS, jsfield(caplimit));
+}
+
+
+static void epilogue (JitCompState *jc) {
+  Asm *a = &jc->a;
+  int loop = newlabel(a);
+  /* fail: pop entries until a choice, restore its state, and resume */
+  setlabel(a, jc->lfail);
+  setlabel(a, loop);
+  alu_ri(a, 1, SUB, RSTK, STKSIZE);
+  load(a, RS, RSTK, stkfield(s));
+  testrr(a, RS, RS);
+  jcc(a, CC_E, loop);  /* remove pending calls */
+  load(a, RCAP, RSTK, stkfield(cap));
+  jmpmem(a, RSTK, stkfield(p.addr));
+  /* giveup */
+  setlabel(a, jc->lgiveup);
+  regop(a, 0, 0x31, RAX, RAX);  /* xor eax, eax */
+  setlabel(a, jc->lepilogue);
+  store(a, RJS, jsfield(captop), RCAP);
+  alu_ri(a, 1, ADD, RSP, 8);
+  pop(a, R15); pop(a, R14); pop(a, R13);
+  pop(a, R12); pop(a, RBP); pop(a, RBX);
+  emit(a, 0xC3);  /* ret */
+}
+
+
+static void writeperfmap (void *mem, size_t size, const Instruction *code) {
+  char fname[64];
+  FILE *f;
+  const char *on = getenv("LPEG_PERFMAP");
+  if (on == NULL || *on == '\0' || strcmp(on, "0") == 0)
+    return;  /* not asked for */
+  snprintf(fname, sizeof(fname), "/tmp/perf-%d.map", (int)getpid());
+  f = fopen(fname, "a");
+  if (f == NULL) return;
+  fprintf(f, "%lx %lx lpeg_pattern_%lx\n", (unsigned long)(uintptr_t)mem,
+          (unsigned long)size, (unsigned long)(uintptr_t)code);
+  fclose(f);
+}
+
+
+/* Translate 'code' and install the result in 'jit'.  Returns 0 (and
+   leaves jit->fn NULL) when the code cannot be translated. */
+static int jitcompile (rJit *jit, const Instruction *code, int codesize) {
+  JitCompState jc;
+  Asm *a = &jc.a;
+  int i, ok = 1;
+  size_t codebytes, size;
+  byte *mem = NULL;
+  if (offsetof(Capture, idx) + 8 != sizeof(Capture))
+    return 0;  /* capture layout not as expected */
+  memset(&jc, 0, sizeof(jc));
+  for (i = 0; i < codesize; i++) newlabel(a);  /* one label per slot */
+  jc.lfail = newlabel(a);
+  jc.lepilogue = newlabel(a);
+  jc.lgiveup = newlabel(a);
+  prologue(a);
+  for (i = 0; ok && i < codesize; i += sizei(&code[i])) {
+    setlabel(a, i);
+    ok = codeinstruction(&jc, code, i);
+  }
+  epilogue(&jc);
+  if (!ok || a->error) goto done;
+  codebytes = (a->ncode + 15) & ~(size_t)15;  /* data is 16-byte aligned */
+  size = codebytes + a->ndata;
+  mem = (byte *)mmap(NULL, size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mem == (byte *)MAP_FAILED) { ok = 0; goto done; }
+  memcpy(mem, a->code, a->ncode);
+  memset(mem + a->ncode, 0xCC, codebytes - a->ncode);  /* int3 padding */
+  if (a->ndata > 0) memcpy(mem + codebytes, a->data, a->ndata);
+  for (i = 0; i < a->nfix; i++) {
+    Fixup *f = &a->fix[i];
+    long dest = (f->label < 0) ? (long)(codebytes + f->dataoff)
+                               : a->label[f->label];
+    int32_t rel;
+    assert(dest >= 0);
+    rel = (int32_t)(dest - (long)(f->pos + 4));
+    memcpy(mem + f->pos, &rel, sizeof(rel));
+  }
+  if (mprotect(mem, size, PROT_READ | PROT_EXEC) != 0) {
+    munmap(mem, size);
+    ok = 0; goto done;
+  }
+  jit->mem = mem;
+  jit->size = size;
+  jit->fn = (r_jitfn)(uintptr_t)mem;
+  jit->giveup = mem + a->label[jc.lgiveup];
+  writeperfmap(mem, size, code);
+ done:
+  free(a->code); free(a->data); free(a->label); free(a->fix);
+  return ok && !a->error;
+}
+
+/* }====================================================== */
+
+#endif
+
+
+void r_jitrelease (rJit *jit) {
+#if defined(R_JIT)
+  if (jit->mem) munmap(jit->mem, jit->size);
+#endif
+  jit->mem = NULL; jit->size = 0;
+  jit->fn = NULL; jit->giveup = NULL;
+  jit->aot = 0;
+}
+
+
+void r_jitfree (rJit *jit) {
+  if (jit) {
+    r_jitrelease(jit);
+    free(jit);
+  }
+}
+
+
+/*
+** (Re)generate the native code for 'code'.  Returns 1 if the pattern
+** will run natively, 0 if it will be interpreted.
+*/
+int r_jitcode (rJit *jit, const Instruction *code, int codesize) {
+  r_jitrelease(jit);
+#if defined(R_JIT)
+  return jitcompile(jit, code, codesize);
+#else
+  (void)code; (void)codesize;
+  return 0;
+#endif
+}
+
+
+/*
+** Run the native code for a pattern.  Same contract as 'match'.
+*/
+const char *r_jitmatch (lua_State *L, rJit *jit, const char *o, const char *s,
+                        const char *e, Capture *capture, int ptop) {
+  JitStack stackbase[MAXBACK];
+  JitState js;
+  js.o = o; js.e = e;
+  js.stackbase = stackbase; js.stacklimit = stackbase + MAXBACK;
+  js.capture = capture; js.captop = capture;
+  js.caplimit = capture + INITCAPSIZE;
+  js.L = L; js.ptop = ptop;
+  js.growstack = jit_growstack; js.growcap = jit_growcap;
+  js.predicates = r_predicates;
+  stackbase[0].s = s; stackbase[0].cap = capture;
+  if (jit->aot) stackbase[0].p.label = 0;  /* label 0 gives up */
+  else stackbase[0].p.addr = jit->giveup;
+  lua_pushlightuserdata(L, stackbase);
+  return jit->fn(&js, s);
+}
@@ -0,0 +1,76 @@
+/*  -*- Mode: C/l; -*-                                                       */
+/*                                                                           */
+/*  rjit.h   Native x86-64 code for compiled patterns                       */
+/*                                                                           */
+/*  © Copyright IBM Corporation 2017.                                        */
+/*  LICENSE: MIT License (https://opensource.org/licenses/mit-license.html)  */
+/*  AUTHOR: Jamie A. Jennings                                                */
+
+#if !defined(rjit_h)
+#define rjit_h
+
+#include "lua.h"
+
+#include "lpcap.h"
+#include "lpvm.h"
+
+#include "rpred.h"
+
+/* A backtrack entry.  Like 'Stack' in lpvm.c, but holding a native
+   continuation (a code address for the jit, a label number for code
+   generated by raot.c) and a capture pointer. */
+typedef struct JitStack {
+  const char *s;		/* saved position (or NULL for calls) */
+  union {
+    const void *addr;
+    int label;
+  } p;				/* where to continue */
+  Capture *cap;			/* capture top to restore */
+} JitStack;
+
+/* State shared by the native code and the C code around it */
+typedef struct JitState {
+  const char *o;		/* start of subject */
+  const char *e;		/* end of subject */
+  JitStack *stackbase;
+  JitStack *stacklimit;
+  Capture *capture;
+  Capture *captop;		/* capture top when the match ends */
+  Capture *caplimit;
+  lua_State *L;
+  int ptop;
+  /* for code that is not linked against this library */
+  JitStack *(*growstack)(struct JitState *js, JitStack *top);
+  Capture *(*growcap)(struct JitState *js, Capture *top, JitStack *stacktop);
+  r_predicate_entry *predicates;
+} JitState;
+
+typedef const char *(*r_jitfn)(JitState *js, const char *s);
+
+/*
+ * Native code for one pattern.  A pattern that asked for the jit has
+ * an rJit even when its code could not be translated (e.g. it has
+ * run-time captures); then 'fn' is NULL and the interpreter is used.
+ * Code compiled ahead of time (see raot.h) has 'fn' but no 'mem'.
+ */
+typedef struct rJit {
+  void *mem;			/* mapped code + data */
+  size_t size;			/* size of the mapping */
+  r_jitfn fn;			/* entry point, or NULL */
+  const void *giveup;		/* address that makes 'fn' return NULL */
+  int aot;			/* is 'fn' ahead-of-time code? */
+} rJit;
+
+#define r_jitted(jit) ((jit) != NULL && (jit)->fn != NULL)
+
+rJit *r_newjit (void);
+void r_jitfree (rJit *jit);
+void r_jitrelease (rJit *jit);
+int r_jitcode (rJit *jit, const Instruction *code, int codesize);
+const char *r_jitmatch (lua_State *L, rJit *jit, const char *o, const char *s,
+			const char *e, Capture *capture, int ptop);
+
+/* Is the charset 'cs' a single range [lo, hi]? */
+int r_charsetrange (const byte *cs, int *lo, int *hi);
+
+#endif
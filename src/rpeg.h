@@ -29,16 +29,21 @@ typedef struct r_encoder_type {
 #define ENCODE_JSON 1
 #define ENCODE_LINE 2
 #define ENCODE_BYTE 3
+#define ENCODE_BOOL 4	/* match and end position only (no captures) */
+#define ENCODE_BYTE64 5	/* byte, with 64-bit positions (see rcap.h) */
 
 __attribute__((unused))
 static const r_encoder_t r_encoders[] = { 
      {"json",   ENCODE_JSON},
      {"line",   ENCODE_LINE},
      {"byte",   ENCODE_BYTE},
+     {"bool",   ENCODE_BOOL},
+     {"byte64", ENCODE_BYTE64},
      {"debug",  ENCODE_DEBUG},
      {NULL, 0}
 };
 
 int r_match_C (lua_State *L);
+int r_search_C (lua_State *L);
 
 #endif
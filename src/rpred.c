@@ -0,0 +1,141 @@
+/*  -*- Mode: C/l; -*-                                                       */
+/*                                                                           */
+/*  rpred.c   Native (C) match-time predicates                              */
+/*                                                                           */
+/*  © Copyright IBM Corporation 2017.                                        */
+/*  LICENSE: MIT License (https://opensource.org/licenses/mit-license.html)  */
+/*  AUTHOR: Jamie A. Jennings                                                */
+
+#include <string.h>
+
+#include "lua.h"
+#include "lauxlib.h"
+
+#include "rpred.h"
+
+#define UNUSED(x) (void)(x)
+
+/* ----------------------------------------------------------------------------- */
+/* Built-in predicates                                                           */
+/* ----------------------------------------------------------------------------- */
+
+/* Luhn checksum (credit card numbers, IMEI, etc.) over the digits in
+   [start, curr).  Spaces and dashes are allowed as separators. */
+static const char *luhn (const char *subject, const char *start,
+			 const char *curr, const char *end) {
+  int sum = 0, ndigits = 0;
+  const char *s;
+  UNUSED(subject); UNUSED(end);
+  for (s = curr - 1; s >= start; s--) {
+    int d = *s - '0';
+    if ((*s == ' ') || (*s == '-')) continue;
+    if ((d < 0) || (d > 9)) return NULL;
+    if (ndigits++ & 1) {
+      d *= 2;
+      if (d > 9) d -= 9;
+    }
+    sum += d;
+  }
+  return ((ndigits > 1) && (sum % 10 == 0)) ? curr : NULL;
+}
+
+/* Is [start, curr) a non-empty decimal number in the range [lo, hi]? */
+static const char *decimalrange (const char *start, const char *curr,
+				 long lo, long hi) {
+  long n = 0;
+  const char *s;
+  if ((start == curr) || (curr - start > 10)) return NULL;
+  for (s = start; s < curr; s++) {
+    if ((*s < '0') || (*s > '9')) return NULL;
+    n = n * 10 + (*s - '0');
+  }
+  return ((n >= lo) && (n <= hi)) ? curr : NULL;
+}
+
+#define rangepredicate(name, lo, hi)					\
+  static const char *name (const char *subject, const char *start,	\
+			   const char *curr, const char *end) {		\
+    UNUSED(subject); UNUSED(end);					\
+    return decimalrange(start, curr, (lo), (hi));			\
+  }
+
+rangepredicate(octet, 0, 255)
+rangepredicate(port, 0, 65535)
+rangepredicate(month, 1, 12)
+rangepredicate(day, 1, 31)
+rangepredicate(hour, 0, 23)
+rangepredicate(minute, 0, 59)
+rangepredicate(second, 0, 60)	/* allows for a leap second */
+
+r_predicate_entry r_predicates[R_MAXPREDICATES] = {
+  {"luhn", luhn},
+  {"octet", octet},
+  {"port", port},
+  {"month", month},
+  {"day", day},
+  {"hour", hour},
+  {"minute", minute},
+  {"second", second},
+};
+
+/* ----------------------------------------------------------------------------- */
+/* Registry                                                                      */
+/* ----------------------------------------------------------------------------- */
+
+int r_find_predicate (const char *name) {
+  int i;
+  for (i = 0; (i < R_MAXPREDICATES) && r_predicates[i].fn; i++)
+    if (strcmp(r_predicates[i].name, name) == 0) return i;
+  return -1;
+}
+
+/* N.B. The registry is process-wide and is not protected by a lock.
+   Plugins should register their predicates when they are loaded,
+   before any matching starts. */
+int r_register_predicate (const char *name, r_predicate fn) {
+  int i;
+  size_t len = strlen(name);
+  if ((len == 0) || (len >= R_PREDNAMELEN) || !fn) return -1;
+  i = r_find_predicate(name);
+  if (i < 0) {
+    for (i = 0; (i < R_MAXPREDICATES) && r_predicates[i].fn; i++) ;
+    if (i == R_MAXPREDICATES) return -1;
+    memcpy(r_predicates[i].name, name, len + 1);
+  }
+  r_predicates[i].fn = fn;
+  return i;
+}
+
+/* ----------------------------------------------------------------------------- */
+/* Lua interface                                                                 */
+/* ----------------------------------------------------------------------------- */
+
+/* registerpredicate(name, fn) where 'fn' is a lightuserdata pointing
+   to an r_predicate, e.g. a plugin module written in C does:
+     static r_predicate p = my_predicate;
+     lua_pushlightuserdata(L, &p);
+   and passes that value to lpeg.registerpredicate.  Returns the
+   predicate id. */
+int r_lua_registerpredicate (lua_State *L) {
+  const char *name = luaL_checkstring(L, 1);
+  r_predicate *fn;
+  int id;
+  luaL_checktype(L, 2, LUA_TLIGHTUSERDATA);
+  fn = (r_predicate *)lua_touserdata(L, 2);
+  luaL_argcheck(L, fn != NULL, 2, "NULL predicate");
+  id = r_register_predicate(name, *fn);
+  if (id < 0) return luaL_error(L, "cannot register predicate '%s'", name);
+  lua_pushinteger(L, id);
+  return 1;
+}
+
+/* Return a list of the names of all registered predicates */
+int r_lua_predicates (lua_State *L) {
+  int i;
+  lua_newtable(L);
+  for (i = 0; (i < R_MAXPREDICATES) && r_predicates[i].fn; i++) {
+    lua_pushstring(L, r_predicates[i].name);
+    lua_rawseti(L, -2, i + 1);
+  }
+  return 1;
+}
@@ -0,0 +1,46 @@
+/*  -*- Mode: C/l; -*-                                                       */
+/*                                                                           */
+/*  rpred.h   Native (C) match-time predicates                              */
+/*                                                                           */
+/*  © Copyright IBM Corporation 2017.                                        */
+/*  LICENSE: MIT License (https://opensource.org/licenses/mit-license.html)  */
+/*  AUTHOR: Jamie A. Jennings                                                */
+
+#if !defined(rpred_h)
+#define rpred_h
+
+#include "lua.h"
+
+/*
+ * A predicate is called by the IPredicate instruction after its body
+ * pattern has matched the text [start, curr) of the subject that
+ * begins at 'subject' and ends at 'end'.  It returns the new current
+ * position, which must be in [curr, end], or NULL to make the match
+ * fail.  Predicates must not keep pointers into the subject, and they
+ * are called without any access to the Lua state.
+ */
+typedef const char *(*r_predicate)(const char *subject, const char *start,
+				   const char *curr, const char *end);
+
+#define R_MAXPREDICATES 64	/* size of the predicate registry */
+#define R_PREDNAMELEN 32	/* max length of a predicate name, plus 1 */
+
+typedef struct r_predicate_entry {
+  char name[R_PREDNAMELEN];
+  r_predicate fn;
+} r_predicate_entry;
+
+extern r_predicate_entry r_predicates[R_MAXPREDICATES];
+
+#define r_predicatefn(id) (r_predicates[(id)].fn)
+
+/* Plugin API.  Registering an existing name replaces its function.
+   Returns the predicate id, or -1 when the name is invalid or the
+   registry is full. */
+int r_register_predicate (const char *name, r_predicate fn);
+int r_find_predicate (const char *name);
+
+int r_lua_registerpredicate (lua_State *L);
+int r_lua_predicates (lua_State *L);
+
+#endif
@@ -0,0 +1,178 @@
+/*  -*- Mode: C/l; -*-                                                       */
+/*                                                                           */
+/*  rprof.c   Execution profiles of patterns, and the code layout they guide */
+/*                                                                           */
+/*  © Copyright IBM Corporation 2017.                                        */
+/*  LICENSE: MIT License (https://opensource.org/licenses/mit-license.html)  */
+/*  AUTHOR: Jamie A. Jennings                                                */
+
+#include <string.h>
+
+#include "lua.h"
+#include "lauxlib.h"
+
+#include "lptypes.h"
+#include "lptree.h"
+#include "lpvm.h"
+#include "lpcode.h"
+#include "rprof.h"
+
+#define target(code,i)		((i) + getoffset(&(code)[i]))
+
+
+rProfile *r_newprofile (lua_State *L, int codesize, uint64_t fingerprint) {
+  void *ud;
+  lua_Alloc f = lua_getallocf(L, &ud);
+  rProfile *pf = (rProfile *)f(ud, NULL, 0, r_profilebytes(codesize));
+  if (pf == NULL) luaL_error(L, "not enough memory");
+  memset(pf, 0, r_profilebytes(codesize));
+  pf->fingerprint = fingerprint;
+  pf->codesize = codesize;
+  return pf;
+}
+
+
+void r_freeprofile (lua_State *L, rProfile *pf) {
+  void *ud;
+  lua_Alloc f = lua_getallocf(L, &ud);
+  if (pf != NULL) f(ud, pf, r_profilebytes(pf->codesize), 0);
+}
+
+
+static int haslabel (const Instruction *p) {
+  switch ((Opcode)p->i.code) {
+    case IChoice: case ICall: case IJmp: case ICommit: case IPartialCommit:
+    case IBackCommit: case ITestChar: case ITestSet: case ITestAny:
+    case IPredicate: case IDfa:
+      return 1;
+    default: return 0;
+  }
+}
+
+
+/* slot of the reference of 'p' to its charset (see lpvm.h), or 0 */
+static int setref (const Instruction *p) {
+  switch ((Opcode)p->i.code) {
+    case ISet: case ITestSet: case ISpan: return setslot(p);
+    default: return 0;
+  }
+}
+
+
+/* can the instruction after 'p' run next, without a jump? */
+static int fallsthrough (const Instruction *p) {
+  switch ((Opcode)p->i.code) {
+    case IJmp: case ICommit: case IPartialCommit: case IBackCommit:
+    case IRet: case IEnd: case IFail: case IFailTwice: case IGiveup:
+    case IHalt: case IPredicate:
+    case ICharset: case IClasses:  /* the pool never runs */
+      return 0;
+    default: return 1;
+  }
+}
+
+
+/*
+** A block starts at the beginning of the code, at each label, after
+** each instruction that does not fall through, and after each test,
+** whose two ways may be taken at very different rates.
+*/
+static int endsblock (const Instruction *p) {
+  switch ((Opcode)p->i.code) {
+    case ITestChar: case ITestSet: case ITestAny: case IDfa: return 1;
+    default: return !fallsthrough(p);
+  }
+}
+
+
+/*
+** Lay out the code of 'p' by the counts of 'pf' (see rprof.h).  Each
+** block is copied to its new place, with a jump added after one that
+** falls through to a block that is no longer next, and a jump dropped
+** when the block it goes to comes next; then every label is moved to
+** the new place of its target, and every reference to a charset to the
+** new place of its entry in the pool (which, never running, stays at
+** the end).  (Labels and references are first set to the old positions
+** of their targets, with every offset in a word of its own; the jumps
+** are shortened again at the end, see r_recode.)
+*/
+int r_relayout (lua_State *L, Pattern *p, const rProfile *pf) {
+  Instruction *code = p->code;
+  int n = p->codesize;
+  int *newpos = (int *)lua_newuserdata(L, 3 * (n + 1) * sizeof(int));
+  int *start = newpos + n + 1;  /* first instruction of each block */
+  int *order = start + n + 1;  /* blocks in their new order */
+  Instruction *nc;
+  int nb = 0, moved = 0;
+  int i, b, k, j, r, lasthot;
+  memset(newpos, 0, (n + 1) * sizeof(int));
+  newpos[0] = 1;  /* marks the start of a block, for now */
+  for (i = 0; i < n; i += sizei(&code[i])) {
+    if (haslabel(&code[i])) newpos[target(code, i)] = 1;
+    if (endsblock(&code[i])) newpos[i + sizei(&code[i])] = 1;
+  }
+  for (i = 0; i < n; i += sizei(&code[i]))
+    if (newpos[i]) start[nb++] = i;
+  start[nb] = n;
+  k = 0;
+  for (b = 0; b < nb; b++) {  /* hot blocks (the first always is) */
+    uint64_t c = pf->count[start[b]];
+    if (b == 0 || (c > 0 && c * R_COLDSHARE >= pf->runs))
+      order[k++] = b;
+  }
+  lasthot = order[k - 1];
+  for (b = 1; b < nb; b++) {  /* then cold ones */
+    uint64_t c = pf->count[start[b]];
+    if (c == 0 || c * R_COLDSHARE < pf->runs) {
+      if (b < lasthot) moved++;
+      order[k++] = b;
+    }
+  }
+  if (moved == 0) {  /* nothing to gain */
+    lua_pop(L, 1);
+    return 0;
+  }
+  nc = (Instruction *)lua_newuserdata(L,
+                                      (2 * n + 2 * nb) * sizeof(Instruction));
+  j = 0;
+  for (k = 0; k < nb; k++) {
+    int last = start[order[k]];
+    for (i = start[order[k]]; i < start[order[k] + 1]; i += sizei(&code[i]))
+      last = i;
+    for (i = start[order[k]]; i < start[order[k] + 1]; i += sizei(&code[i])) {
+      int size = sizei(&code[i]);
+      newpos[i] = j;
+      if (i == last && code[i].i.code == IJmp && k + 1 < nb
+          && target(code, i) == start[order[k + 1]])
+        break;  /* the block it jumps to comes next */
+      if (haslabel(&code[i]) && !longjump(&code[i])) {  /* short jump? */
+        nc[j] = code[i];  nc[j].i.key = 0;
+        memcpy(&nc[j + 2], &code[i + 1], (size - 1) * sizeof(Instruction));
+        size++;
+      }
+      else memcpy(&nc[j], &code[i], size * sizeof(Instruction));
+      if (haslabel(&code[i])) nc[j + 1].offset = target(code, i);
+      if ((r = setref(&code[i])) != 0)
+        nc[j + setref(&nc[j])].offset = i + code[i + r].offset;
+      j += size;
+    }
+    if (fallsthrough(&code[last]) && start[order[k] + 1] < n
+        && (k + 1 == nb || order[k + 1] != order[k] + 1)) {
+      nc[j].i.code = IJmp;  nc[j].i.aux = 0;  nc[j].i.key = 0;
+      nc[j + 1].offset = start[order[k] + 1];
+      j += 2;
+    }
+  }
+  newpos[n] = j;
+  for (i = 0; i < j; i += sizei(&nc[i])) {
+    if (haslabel(&nc[i]))
+      nc[i + 1].offset = newpos[nc[i + 1].offset] - i;
+    if ((r = setref(&nc[i])) != 0)
+      nc[i + r].offset = newpos[nc[i + r].offset] - i;
+  }
+  realloccode(L, p, j);
+  memcpy(p->code, nc, j * sizeof(Instruction));
+  lua_pop(L, 2);
+  r_recode(L, p, 1);
+  return moved;
+}
@@ -0,0 +1,61 @@
+/*  -*- Mode: C/l; -*-                                                       */
+/*                                                                           */
+/*  rprof.h   Execution profiles of patterns, and the code layout they guide */
+/*                                                                           */
+/*  © Copyright IBM Corporation 2017.                                        */
+/*  LICENSE: MIT License (https://opensource.org/licenses/mit-license.html)  */
+/*  AUTHOR: Jamie A. Jennings                                                */
+
+/*
+ * rprofile(p, true) starts counting how many times each instruction of
+ * the code of 'p' runs, in every match of 'p' from then on; while it
+ * counts, 'p' runs in the interpreter, without its twin or its cache.
+ * rprofile(p, false) stops counting.  rprofile(p) returns the profile
+ * collected so far as a string, or nil.  A profile holds the
+ * fingerprint of the code it was collected for (see r_aotfingerprint),
+ * so it can be saved with the source of a pattern and used again for
+ * the same code in the same build.
+ *
+ * rlayout(p [, profile]) moves the blocks of code that ran in fewer
+ * than 1 in R_COLDSHARE matches (by the given profile, or else the one
+ * being collected, which then ends) after all the others, keeping the
+ * order of each part.  The paths that run often are then contiguous,
+ * and each jump needed to reach a block that moved is on the rare path
+ * only.  Returns the number of blocks moved.
+ *
+ * rorder(p [, profile]) compiles 'p' again, with the alternatives of
+ * each choice that cannot match the empty string and have disjoint
+ * first sets tried in the order of how often their code ran, most often
+ * first; as at most one of them can match, their order cannot change a
+ * match.  The profile must be of the code 'p' compiles to (so rorder
+ * comes before rlayout).  Returns the number of choices reordered.
+ */
+
+#if !defined(rprof_h)
+#define rprof_h
+
+#include <stdint.h>
+
+#include "lua.h"
+
+#include "lptree.h"
+
+#if !defined(R_COLDSHARE)
+#define R_COLDSHARE	100
+#endif
+
+typedef struct rProfile {
+  uint64_t fingerprint;  /* of the code counted */
+  uint64_t runs;  /* matches counted */
+  int codesize;
+  uint64_t count[1];  /* runs of each instruction, by position */
+} rProfile;
+
+#define r_profilebytes(codesize) \
+  (sizeof(rProfile) + ((codesize) - 1) * sizeof(uint64_t))
+
+rProfile *r_newprofile (lua_State *L, int codesize, uint64_t fingerprint);
+void r_freeprofile (lua_State *L, rProfile *pf);
+int r_relayout (lua_State *L, Pattern *p, const rProfile *pf);
+
+#endif
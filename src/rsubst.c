@@ -0,0 +1,97 @@
+/*  -*- Mode: C/l; -*-                                                       */
+/*                                                                           */
+/*  rsubst.c   Substitution (redaction) of matches into an rBuffer          */
+/*                                                                           */
+/*  © Copyright IBM Corporation 2017.                                        */
+/*  LICENSE: MIT License (https://opensource.org/licenses/mit-license.html)  */
+/*  AUTHOR: Jamie A. Jennings                                                */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "lua.h"
+#include "lauxlib.h"
+
+#include "lptypes.h"
+#include "lpcap.h"
+#include "rbuf.h"
+#include "rhash.h"
+#include "rsubst.h"
+
+
+/*
+** Copy the input from '*pos' up to 's', then the replacement of the
+** text 's'..'e'; the input is then copied from 'e' on.
+*/
+void r_substspan (lua_State *L, rBuffer *out, const rSubst *sb,
+                  const char **pos, const char *s, const char *e) {
+  r_addlstring(L, out, *pos, s - *pos);
+  switch (sb->how) {
+    case R_SUBST_MASK: {
+      char *d = r_prepbuffsize(L, out, e - s);
+      memset(d, (sb->withlen > 0) ? sb->with[0] : '*', e - s);
+      addsize(out, e - s);
+      break;
+    }
+    case R_SUBST_HASH: {
+      static const char hex[] = "0123456789abcdef";
+      uint64_t h = r_siphash(sb->with, s, e - s);
+      char d[16];
+      int i;
+      for (i = 15; i >= 0; i--, h >>= 4) d[i] = hex[h & 0xF];
+      r_addlstring(L, out, d, sizeof(d));
+      break;
+    }
+    default:
+      r_addlstring(L, out, sb->with, sb->withlen);
+      break;
+  }
+  *pos = e;
+}
+
+
+static int isselected (const rSubst *sb, Capture *cap) {
+  return (captype(cap) == Crosiecap && (size_t)cap->idx < sb->nselected
+          && sb->selected[cap->idx]);
+}
+
+
+/*
+** Replace the text of the selected captures in the capture list of a
+** match.  A selected capture inside another one goes with it.  Returns
+** the number of replacements.
+*/
+int r_substcaptures (lua_State *L, rBuffer *out, const rSubst *sb,
+                     const char **pos, Capture *capture) {
+  Capture *cap;
+  const char *start = NULL;
+  int depth = 0;
+  int seldepth = -1;  /* depth of the selected capture being replaced */
+  int n = 0;
+  for (cap = capture; !isfinalcap(cap); cap++) {
+    if (isclosecap(cap)) {
+      if (cap->s == NULL) break;  /* closing entry put by IEnd */
+      if (--depth == seldepth) {
+        r_substspan(L, out, sb, pos, start, cap->s);
+        seldepth = -1;  n++;
+      }
+    }
+    else if (isfullcap(cap)) {
+      if (seldepth < 0 && isselected(sb, cap) && cap->siz > 1) {
+        r_substspan(L, out, sb, pos, cap->s, cap->s + cap->siz - 1);
+        n++;
+      }
+    }
+    else {
+      if (seldepth < 0 && isselected(sb, cap)) {
+        seldepth = depth;  start = cap->s;
+      }
+      depth++;
+    }
+  }
+  if (isfinalcap(cap) && seldepth >= 0) {  /* halted inside a selection? */
+    r_substspan(L, out, sb, pos, start, cap->s);
+    n++;
+  }
+  return n;
+}
@@ -0,0 +1,51 @@
+/*  -*- Mode: C/l; -*-                                                       */
+/*                                                                           */
+/*  rsubst.h   Substitution (redaction) of matches into an rBuffer          */
+/*                                                                           */
+/*  © Copyright IBM Corporation 2017.                                        */
+/*  LICENSE: MIT License (https://opensource.org/licenses/mit-license.html)  */
+/*  AUTHOR: Jamie A. Jennings                                                */
+
+/*
+ * rsubst(p, input, how [, with [, names [, out]]]) copies the input
+ * into an rBuffer, replacing each match of 'p' (found as rsearch finds
+ * it), or only the text of the named Rosie captures within each match.
+ * The replacement depends on 'how':
+ *
+ *   "replace"  the string 'with' (default "")
+ *   "mask"     one copy of the first byte of 'with' (default "*") for
+ *              each byte replaced, so that lengths are kept
+ *   "hash"     16 hex digits of the SipHash-2-4 of the text, keyed by
+ *              'with' (R_SIPKEYLEN bytes, required), so equal texts get
+ *              equal replacements, and the texts cannot be found from
+ *              them without the key
+ *
+ * 'out' is the buffer to append to; without it, the output buffer that
+ * rmatch uses is reset and used.  Returns the buffer and the number of
+ * replacements.  Empty matches replace nothing.
+ */
+
+#if !defined(rsubst_h)
+#define rsubst_h
+
+#include "lpcap.h"
+#include "rbuf.h"
+
+#define R_SUBST_REPLACE	0
+#define R_SUBST_MASK	1
+#define R_SUBST_HASH	2
+
+typedef struct rSubst {
+  int how;
+  const char *with;  /* (R_SIPKEYLEN bytes for R_SUBST_HASH) */
+  size_t withlen;
+  const byte *selected;  /* names to replace, by ktable index, or NULL */
+  size_t nselected;  /* size of 'selected' */
+} rSubst;
+
+void r_substspan (lua_State *L, rBuffer *out, const rSubst *sb,
+                  const char **pos, const char *s, const char *e);
+int r_substcaptures (lua_State *L, rBuffer *out, const rSubst *sb,
+                     const char **pos, Capture *capture);
+
+#endif